@@ -27,9 +27,18 @@ import shutil
 core = (
     "sd_spi_commands\.h",
     "sd_spi_info\.h",
-    "sd_spi(\.c|\.h)",
+    "sd_spi(\.c|\.h|\.hpp)",
+    "sd_spi_coro\.hpp",
+    "sd_spi_erase_planner(\.c|\.h)",
+    "sd_spi_log(\.c|\.h)",
+    "sd_spi_mirror(\.c|\.h)",
+    "sd_spi_mount(\.c|\.h)",
+    "sd_spi_ring(\.c|\.h)",
+    "sd_spi_store(\.c|\.h)",
+    "sd_spi_stripe(\.c|\.h)",
     "arduino_platform_dependencies\.cpp",
     "sd_spi_platform_dependencies\.h",
+    "sd_spi_platform_inline\.h",
 )
 
 unit_tests = (
@@ -44,6 +53,11 @@ card_info = (
     "card_info\.ino",
 )
 
+benchmarks = (
+    "sd_spi_benchmarks\.c",
+    "benchmarks\.ino",
+)
+
 source_dir = "./"
 default_dest_dir = "flatten"
 
@@ -90,6 +104,7 @@ while True:
                 os.makedirs(temp_dest_dir + "/core_files")
                 os.makedirs(temp_dest_dir + "/card_info")
                 os.makedirs(temp_dest_dir + "/unit_tests")
+                os.makedirs(temp_dest_dir + "/benchmarks")
         except OSError:
             print "Error creating directory."
             continue
@@ -100,3 +115,4 @@ while True:
 copy_files(core, temp_dest_dir + "/core_files")
 copy_files(core + card_info, temp_dest_dir + "/card_info")
 copy_files(core + unit_tests, temp_dest_dir + "/unit_tests")
+copy_files(core + benchmarks, temp_dest_dir + "/benchmarks")
@@ -0,0 +1,22 @@
+#include <SPI.h>
+#include "sd_spi_benchmarks.c"
+
+void
+setup(
+)
+{
+	Serial.begin(115200);
+
+	while (!Serial) {
+    	; // wait for serial port to connect. Needed for Leonardo only
+ 	}
+
+ 	runallbenchmarks_sd_spi();
+}
+
+void
+loop(
+)
+{
+
+}
@@ -0,0 +1,649 @@
+/******************************************************************************/
+/**
+@file		sd_spi_benchmarks.c
+@author     Wade Penson
+@date		June, 2015
+@brief      Benchmarks for the SD SPI Library.
+@details	The results are printed with printf(). When run with the emulator,
+			the times come from the emulator's timing model.
+@copyright  Copyright 2015 Wade Penson
+
+@license    Licensed under the Apache License, Version 2.0 (the "License");
+            you may not use this file except in compliance with the License.
+            You may obtain a copy of the License at
+
+              http://www.apache.org/licenses/LICENSE-2.0
+
+            Unless required by applicable law or agreed to in writing, software
+            distributed under the License is distributed on an "AS IS" BASIS,
+            WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+            implied. See the License for the specific language governing
+            permissions and limitations under the License.
+*/
+/******************************************************************************/
+
+#if defined(SD_SPI_THREAD_SAFE) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stdio.h>
+#include "sd_spi.h"
+#include "sd_spi_erase_planner.h"
+#include "sd_spi_log.h"
+#include "sd_spi_ring.h"
+#include "sd_spi_store.h"
+#include "sd_spi_stripe.h"
+#include "sd_spi_platform_dependencies.h"
+
+#define BENCHMARK_NUM_BLOCKS		512
+#define BENCHMARK_READ_NUM_BLOCKS	4
+/** The number of bytes in each record of the log benchmark. */
+#define BENCHMARK_RECORD_SIZE		32
+/** The number of pages of the store that is mounted. */
+#define BENCHMARK_STORE_NUM_BLOCKS	8192
+/** The number of keys in the range of the query benchmark. */
+#define BENCHMARK_QUERY_NUM_KEYS	100
+
+uint8_t chip_select_pins[SD_SPI_STRIPE_MAX_CARDS] = {4, 5, 6, 7};
+uint8_t benchmark_data[BENCHMARK_READ_NUM_BLOCKS * 512];
+
+#if defined(SD_SPI_THREAD_SAFE)
+#include <pthread.h>
+#include <time.h>
+
+/** The most reader threads that are run at once. */
+#define BENCHMARK_MAX_THREADS		4
+/** The number of blocks that each reader thread reads. */
+#define BENCHMARK_THREAD_NUM_BLOCKS	16384
+
+/** The card of each reader thread. */
+static sd_spi_card_t reader_cards[BENCHMARK_MAX_THREADS];
+#endif
+
+/**
+@brief	Prints the throughput of an operation.
+
+@param	name			The name of the operation.
+@param	num_blocks		The number of blocks that were transferred.
+@param	start_time		The value of sd_spi_millis() before the operation.
+*/
+static void
+print_throughput(
+	const char	*name,
+	uint32_t	num_blocks,
+	uint32_t	start_time
+)
+{
+	uint32_t elapsed_time = sd_spi_millis() - start_time;
+
+	if (elapsed_time == 0)
+	{
+		elapsed_time = 1;
+	}
+
+	printf("%s: %lu blocks in %lu ms (%lu KB/s)\n", name,
+		   (unsigned long) num_blocks, (unsigned long) elapsed_time,
+		   (unsigned long) (num_blocks * 512 / elapsed_time));
+}
+
+/**
+@brief	Prints the time that an operation took for each byte.
+@details	On boards that define F_CPU, the time is also given in cycles.
+
+@param	name			The name of the operation.
+@param	num_bytes		The number of bytes that were transferred.
+@param	start_time		The value of sd_spi_millis() before the operation.
+*/
+static void
+print_byte_time(
+	const char	*name,
+	uint32_t	num_bytes,
+	uint32_t	start_time
+)
+{
+	uint64_t elapsed_time = sd_spi_millis() - start_time;
+
+	printf("%s: %lu ns per byte", name,
+		   (unsigned long) (elapsed_time * 1000000 / num_bytes));
+#if defined(F_CPU)
+	printf(" (%lu cycles)",
+		   (unsigned long) (elapsed_time * (F_CPU / 1000) / num_bytes));
+#endif
+	printf("\n");
+}
+
+void
+benchmark_sd_spi_stripe(
+	void
+)
+{
+	sd_spi_card_t cards[SD_SPI_STRIPE_MAX_CARDS];
+	sd_spi_stripe_t stripe;
+	char name[40];
+	uint8_t num_cards;
+
+	for (num_cards = 1; num_cards <= SD_SPI_STRIPE_MAX_CARDS; num_cards *= 2)
+	{
+		if (sd_spi_stripe_init(&stripe, cards, chip_select_pins, num_cards, 1))
+		{
+			printf("Stripe with %d card(s) failed to initialize.\n", num_cards);
+			return;
+		}
+
+		uint32_t start_time = sd_spi_millis();
+		uint32_t i;
+
+		sd_spi_stripe_write_continuous_start(&stripe, 0, BENCHMARK_NUM_BLOCKS);
+
+		for (i = 0; i < BENCHMARK_NUM_BLOCKS; i++)
+		{
+			benchmark_data[0] = i;
+			sd_spi_stripe_write_blocks(&stripe, i, benchmark_data, 1);
+		}
+
+		sd_spi_stripe_write_continuous_stop(&stripe);
+
+		sprintf(name, "Stripe write, %d card(s)", num_cards);
+		print_throughput(name, BENCHMARK_NUM_BLOCKS, start_time);
+
+		start_time = sd_spi_millis();
+
+		for (i = 0; i < BENCHMARK_NUM_BLOCKS; i += BENCHMARK_READ_NUM_BLOCKS)
+		{
+			sd_spi_stripe_read_blocks(&stripe, i, benchmark_data,
+									  BENCHMARK_READ_NUM_BLOCKS);
+		}
+
+		sprintf(name, "Stripe read, %d card(s)", num_cards);
+		print_throughput(name, BENCHMARK_NUM_BLOCKS, start_time);
+	}
+
+	sd_spi_use_card(NULL);
+}
+
+/**
+@brief	Adds the bytes of a chunk to a checksum, as an export path would.
+*/
+static uint8_t
+checksum_callback(
+	void		*context,
+	uint32_t	block_address,
+	uint16_t	byte_offset,
+	uint8_t		*data,
+	uint16_t	number_of_bytes
+)
+{
+	uint32_t *checksum = (uint32_t *) context;
+	uint16_t i;
+
+	for (i = 0; i < number_of_bytes; i++)
+	{
+		*checksum += data[i];
+	}
+
+	return 0;
+}
+
+void
+benchmark_sd_spi_read_stream(
+	void
+)
+{
+	if (sd_spi_init(chip_select_pins[0]))
+	{
+		printf("Card failed to initialize.\n");
+		return;
+	}
+
+	uint32_t checksum = 0;
+	uint32_t start_time = sd_spi_millis();
+	uint32_t i;
+
+	/* Read each block into memory before going over it. */
+	sd_spi_read_continuous_start(0);
+
+	for (i = 0; i < BENCHMARK_NUM_BLOCKS; i++)
+	{
+		sd_spi_read_continuous(benchmark_data, 512, 0);
+		checksum_callback(&checksum, i, 0, benchmark_data, 512);
+
+		if (i + 1 < BENCHMARK_NUM_BLOCKS)
+		{
+			sd_spi_read_continuous_next();
+		}
+	}
+
+	sd_spi_read_continuous_stop();
+	print_throughput("Continuous read and checksum", BENCHMARK_NUM_BLOCKS,
+					 start_time);
+
+	start_time = sd_spi_millis();
+	sd_spi_read_stream(0, BENCHMARK_NUM_BLOCKS, checksum_callback, &checksum);
+	print_throughput("Stream read and checksum", BENCHMARK_NUM_BLOCKS,
+					 start_time);
+}
+
+void
+benchmark_sd_spi_erase_planner(
+	void
+)
+{
+	sd_spi_erase_geometry_t geometry;
+
+	if (sd_spi_init(chip_select_pins[0]) ||
+		sd_spi_read_erase_geometry(&geometry))
+	{
+		printf("Card failed to initialize.\n");
+		return;
+	}
+
+	/* A range which covers a unit and a few blocks on either side of it. */
+	uint32_t start_block_address = geometry.unit_blocks - 3;
+	uint32_t end_block_address = 2 * geometry.unit_blocks + 2;
+	uint32_t num_blocks = end_block_address - start_block_address + 1;
+	sd_spi_erase_plan_t plan;
+
+	uint32_t start_time = sd_spi_millis();
+	sd_spi_erase_blocks(start_block_address, end_block_address);
+	uint32_t naive_time = sd_spi_millis() - start_time;
+
+	start_time = sd_spi_millis();
+	sd_spi_erase_planned(&geometry, start_block_address, end_block_address,
+						 &plan);
+	uint32_t planned_time = sd_spi_millis() - start_time;
+
+	printf("Unaligned erase: %lu blocks in %lu ms (predicted %lu ms)\n",
+		   (unsigned long) num_blocks, (unsigned long) naive_time,
+		   (unsigned long) (plan.naive_predicted_us / 1000));
+	printf("Planned erase: %lu blocks in %lu ms (predicted %lu ms)\n",
+		   (unsigned long) num_blocks, (unsigned long) planned_time,
+		   (unsigned long) (plan.predicted_us / 1000));
+}
+
+void
+benchmark_sd_spi_transfer(
+	void
+)
+{
+	if (sd_spi_init(chip_select_pins[0]))
+	{
+		printf("Card failed to initialize.\n");
+		return;
+	}
+
+	/* Whole blocks go straight between memory and the bus, so the time is
+	   mostly the transfer loops and the card. Build with and without
+	   SD_SPI_PLATFORM_INLINE to compare them. */
+	uint32_t num_bytes = (uint32_t) BENCHMARK_NUM_BLOCKS * 512;
+	uint32_t start_time = sd_spi_millis();
+	uint32_t i;
+
+	for (i = 0; i < BENCHMARK_NUM_BLOCKS; i += BENCHMARK_READ_NUM_BLOCKS)
+	{
+		sd_spi_pread((uint64_t) i * 512, benchmark_data,
+					 sizeof(benchmark_data));
+	}
+
+	print_byte_time("Block read", num_bytes, start_time);
+
+	start_time = sd_spi_millis();
+
+	for (i = 0; i < BENCHMARK_NUM_BLOCKS; i += BENCHMARK_READ_NUM_BLOCKS)
+	{
+		sd_spi_pwrite((uint64_t) i * 512, benchmark_data,
+					  sizeof(benchmark_data));
+	}
+
+	print_byte_time("Block write", num_bytes, start_time);
+}
+
+void
+benchmark_sd_spi_log(
+	void
+)
+{
+	static sd_spi_card_t log_card;
+	static sd_spi_log_t log;
+	uint8_t record[BENCHMARK_RECORD_SIZE];
+	uint32_t num_records = (uint32_t) BENCHMARK_NUM_BLOCKS * 512 /
+						   BENCHMARK_RECORD_SIZE;
+	uint32_t i;
+
+	sd_spi_use_card(&log_card);
+
+	if (sd_spi_init(chip_select_pins[0]))
+	{
+		printf("Card failed to initialize.\n");
+		sd_spi_use_card(NULL);
+		return;
+	}
+
+	for (i = 0; i < BENCHMARK_RECORD_SIZE; i++)
+	{
+		record[i] = (uint8_t) i;
+	}
+
+	uint32_t start_time = sd_spi_millis();
+
+	/* The main loop drains after each record, as it would between samples. */
+	sd_spi_log_start(&log, &log_card, 0, BENCHMARK_NUM_BLOCKS);
+
+	for (i = 0; i < num_records; i++)
+	{
+		record[0] = (uint8_t) i;
+		sd_spi_log_push(&log, record, BENCHMARK_RECORD_SIZE);
+		sd_spi_log_drain(&log);
+	}
+
+	sd_spi_log_stop(&log);
+	print_throughput("Logged records", BENCHMARK_NUM_BLOCKS, start_time);
+	printf("Log high water: %u bytes, %lu overflows\n",
+		   (unsigned) log.high_water, (unsigned long) log.num_overflows);
+
+	sd_spi_use_card(NULL);
+}
+
+void
+benchmark_sd_spi_store_mount(
+	void
+)
+{
+	static sd_spi_card_t store_card;
+	static sd_spi_store_t store;
+	uint32_t i;
+
+	sd_spi_use_card(&store_card);
+
+	if (sd_spi_init(chip_select_pins[0]) ||
+		sd_spi_store_format(&store, &store_card, 0, BENCHMARK_STORE_NUM_BLOCKS))
+	{
+		printf("Store failed to be formatted.\n");
+		sd_spi_use_card(NULL);
+		return;
+	}
+
+	/* Each record takes a page, and the store is filled up to about two
+	   thirds. */
+	for (i = 0; i < BENCHMARK_STORE_NUM_BLOCKS / 3 * 2; i++)
+	{
+		sd_spi_store_append(&store, i, benchmark_data, 400);
+	}
+
+	sd_spi_store_flush(&store);
+
+	uint32_t num_blocks = store.next_block_address;
+	uint32_t start_time = sd_spi_millis();
+	sd_spi_store_mount(&store, &store_card, 0, BENCHMARK_STORE_NUM_BLOCKS);
+	uint32_t mount_time = sd_spi_millis() - start_time;
+
+	/* The way it was done before: read pages until one is not a page of the
+	   store. */
+	sd_spi_store_header_t header;
+	start_time = sd_spi_millis();
+
+	for (i = 0; sd_spi_store_read_header(&store, i, &header) == SD_ERR_OK; i++);
+
+	printf("Store mount of %lu pages: %lu ms (a scan takes %lu ms)\n",
+		   (unsigned long) num_blocks, (unsigned long) mount_time,
+		   (unsigned long) (sd_spi_millis() - start_time));
+
+	sd_spi_use_card(NULL);
+}
+
+/**
+@brief	Counts the records of a query.
+
+@param	context		The count.
+*/
+static int8_t
+count_record(
+	void		*context,
+	uint32_t	key,
+	const void	*data,
+	uint16_t	number_of_bytes
+)
+{
+	(void) key;
+	(void) data;
+	(void) number_of_bytes;
+
+	(*(uint32_t *) context)++;
+
+	return SD_ERR_OK;
+}
+
+void
+benchmark_sd_spi_store_query(
+	void
+)
+{
+	static sd_spi_card_t store_card;
+	static sd_spi_store_t store;
+	sd_spi_store_cursor_t cursor;
+	uint32_t num_keys = BENCHMARK_STORE_NUM_BLOCKS / 3 * 2;
+	uint32_t first_key = num_keys / 2;
+	uint32_t last_key = first_key + BENCHMARK_QUERY_NUM_KEYS - 1;
+	uint32_t num_records = 0;
+	uint32_t key;
+	uint16_t length;
+	uint32_t i;
+
+	sd_spi_use_card(&store_card);
+
+	if (sd_spi_init(chip_select_pins[0]) ||
+		sd_spi_store_format(&store, &store_card, 0, BENCHMARK_STORE_NUM_BLOCKS))
+	{
+		printf("Store failed to be formatted.\n");
+		sd_spi_use_card(NULL);
+		return;
+	}
+
+	/* Each record takes a page, as in the mount benchmark. */
+	for (i = 0; i < num_keys; i++)
+	{
+		sd_spi_store_append(&store, i, benchmark_data, 400);
+	}
+
+	sd_spi_store_flush(&store);
+
+	uint32_t start_time = sd_spi_millis();
+	sd_spi_store_query(&store, first_key, last_key, benchmark_data, 512,
+					   count_record, &num_records);
+	uint32_t query_time = sd_spi_millis() - start_time;
+
+	/* A seek and a read of each page on its own. */
+	start_time = sd_spi_millis();
+	sd_spi_store_seek(&store, &cursor, first_key);
+
+	while (sd_spi_store_read_next(&store, &cursor, &key, benchmark_data, 512,
+								  &length) == SD_ERR_OK && key < last_key);
+
+	uint32_t seek_time = sd_spi_millis() - start_time;
+
+	/* The way it was done before: a continuous read from the start until
+	   the range is passed. */
+	sd_spi_store_header_t header;
+	start_time = sd_spi_millis();
+	sd_spi_read_continuous_start(0);
+
+	for (i = 0; i < store.next_block_address; i++)
+	{
+		sd_spi_read_continuous(&header, sizeof(sd_spi_store_header_t), 0);
+
+		if (header.type == SD_SPI_STORE_PAGE_DATA &&
+			header.first_key > last_key)
+		{
+			break;
+		}
+
+		sd_spi_read_continuous_next();
+	}
+
+	sd_spi_read_continuous_stop();
+
+	printf("Store query of %lu records: %lu ms (seek and reads take %lu ms, "
+		   "a scan takes %lu ms)\n", (unsigned long) num_records,
+		   (unsigned long) query_time, (unsigned long) seek_time,
+		   (unsigned long) (sd_spi_millis() - start_time));
+
+	sd_spi_use_card(NULL);
+}
+
+void
+benchmark_sd_spi_ring(
+	void
+)
+{
+	static sd_spi_card_t ring_card;
+	static sd_spi_ring_t ring;
+	uint32_t num_writes = BENCHMARK_NUM_BLOCKS * 3;
+	uint32_t longest_time = 0;
+	uint32_t longest_wrap_time = 0;
+	uint32_t i;
+
+	sd_spi_use_card(&ring_card);
+
+	if (sd_spi_init(chip_select_pins[0]) ||
+		sd_spi_ring_format(&ring, &ring_card, 0, BENCHMARK_NUM_BLOCKS))
+	{
+		printf("Ring failed to be formatted.\n");
+		sd_spi_use_card(NULL);
+		return;
+	}
+
+	/* The ring is written around three times, one page at a time, and the
+	   writes that go back to the first page are timed on their own. */
+	uint32_t start_time = sd_spi_millis();
+
+	for (i = 0; i < num_writes; i++)
+	{
+		uint32_t num_wraps = ring.num_wraps;
+		uint32_t write_time = sd_spi_millis();
+		sd_spi_ring_write(&ring, benchmark_data,
+						  512 - sizeof(sd_spi_store_header_t));
+		write_time = sd_spi_millis() - write_time;
+
+		if (write_time > longest_time)
+		{
+			longest_time = write_time;
+		}
+
+		if (ring.num_wraps != num_wraps && write_time > longest_wrap_time)
+		{
+			longest_wrap_time = write_time;
+		}
+	}
+
+	sd_spi_ring_flush(&ring);
+	print_throughput("Ring writes", num_writes, start_time);
+	printf("Ring longest write: %lu ms (%lu ms at a wrap)\n",
+		   (unsigned long) longest_time, (unsigned long) longest_wrap_time);
+
+	sd_spi_use_card(NULL);
+}
+
+#if defined(SD_SPI_THREAD_SAFE)
+/**
+@brief	Reads blocks from the card of one reader thread.
+
+@param	context		The index of the card.
+*/
+static void *
+parallel_read_thread(
+	void *context
+)
+{
+	uint8_t i = (uint8_t) (uintptr_t) context;
+	uint8_t buffer[BENCHMARK_READ_NUM_BLOCKS * 512];
+	uint32_t block_address;
+
+	sd_spi_use_card(&reader_cards[i]);
+
+	for (block_address = 0; block_address < BENCHMARK_THREAD_NUM_BLOCKS;
+		 block_address += BENCHMARK_READ_NUM_BLOCKS)
+	{
+		sd_spi_pread((uint64_t) block_address * 512, buffer, sizeof(buffer));
+	}
+
+	return NULL;
+}
+
+void
+benchmark_sd_spi_parallel_reads(
+	void
+)
+{
+	uint8_t num_threads;
+	uint8_t i;
+
+	for (i = 0; i < BENCHMARK_MAX_THREADS; i++)
+	{
+		sd_spi_use_card(&reader_cards[i]);
+
+		if (sd_spi_init(chip_select_pins[i]))
+		{
+			printf("Card failed to initialize.\n");
+			sd_spi_use_card(NULL);
+			return;
+		}
+	}
+
+	sd_spi_use_card(NULL);
+
+	/* Each thread reads its own card, so the wall clock time is what is
+	   measured rather than the emulated time. */
+	for (num_threads = 1; num_threads <= BENCHMARK_MAX_THREADS;
+		 num_threads *= 2)
+	{
+		pthread_t threads[BENCHMARK_MAX_THREADS];
+		struct timespec start;
+		struct timespec end;
+
+		clock_gettime(CLOCK_MONOTONIC, &start);
+
+		for (i = 0; i < num_threads; i++)
+		{
+			pthread_create(&threads[i], NULL, parallel_read_thread,
+						   (void *) (uintptr_t) i);
+		}
+
+		for (i = 0; i < num_threads; i++)
+		{
+			pthread_join(threads[i], NULL);
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &end);
+
+		uint64_t elapsed_us = (uint64_t) (end.tv_sec - start.tv_sec) * 1000000 +
+							  (end.tv_nsec - start.tv_nsec) / 1000;
+
+		if (elapsed_us == 0)
+		{
+			elapsed_us = 1;
+		}
+
+		printf("Parallel reads with %u threads: %lu KB/s\n", num_threads,
+			   (unsigned long) ((uint64_t) num_threads *
+								BENCHMARK_THREAD_NUM_BLOCKS * 512 * 1000000 /
+								1024 / elapsed_us));
+	}
+}
+#endif
+
+void
+runallbenchmarks_sd_spi(
+	void
+)
+{
+	benchmark_sd_spi_stripe();
+	benchmark_sd_spi_read_stream();
+	benchmark_sd_spi_erase_planner();
+	benchmark_sd_spi_transfer();
+	benchmark_sd_spi_log();
+	benchmark_sd_spi_store_mount();
+	benchmark_sd_spi_store_query();
+	benchmark_sd_spi_ring();
+#if defined(SD_SPI_THREAD_SAFE)
+	benchmark_sd_spi_parallel_reads();
+#endif
+}
@@ -74,6 +74,7 @@ sd_spi_end_transaction(
 	SPI.endTransaction();
 }
 
+#if !defined(SD_SPI_PLATFORM_INLINE)
 void
 sd_spi_send_byte(
 	uint8_t b
@@ -88,4 +89,5 @@ sd_spi_receive_byte(
 )
 {
 	return SPI.transfer(0xFF);
-}
\ No newline at end of file
+}
+#endif
\ No newline at end of file
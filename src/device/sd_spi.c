@@ -23,10 +23,11 @@
 #include "sd_spi_platform_dependencies.h"
 #include "../sd_spi.h"
 
-uint8_t sd_spi_dirty_write = 0;
-
 /* An sd_spi_card_t structure for internal state. */
-static sd_spi_card_t card;
+static sd_spi_card_t default_card = { .is_chip_select_high = 1 };
+
+/* The card that the library is currently operating on. */
+static sd_spi_card_t *card = &default_card;
 
 /**
 @brief		Clears the buffer and sets the values to 0.
@@ -60,6 +61,64 @@ sd_spi_write_out_data(
 	uint16_t 	byte_offset
 );
 
+/**
+@brief		Stops a continuous write after a block failed to be written, finds
+			out how many blocks the card wrote without errors and drops the
+			blocks that were buffered.
+@details	The continuous write can be continued from the first page that was
+			not written with sd_spi_write_continuous_resume().
+
+@param		error	The error of the failed write.
+
+@return		The error that was given.
+*/
+static int8_t
+sd_spi_stop_failed_write(
+	int8_t	error
+);
+
+/**
+@brief		Stops a stream or a direct write of blocks after a block failed to
+			be written, the same as sd_spi_stop_failed_write().
+@details	These writes count 512 byte blocks instead of pages, so the first
+			block that was not written is left in continuous_block_address.
+
+@param		error	The error of the failed write.
+
+@return		The error that was given.
+*/
+static int8_t
+sd_spi_stop_failed_stream(
+	int8_t	error
+);
+
+/**
+@brief		Reads the status of the card after a write that is not part of a
+			continuous write, unless the status check of the card puts it off.
+
+@param		response	The error from the data response of the write.
+
+@return		The error of the write if there was one and otherwise the error
+			from the status of the card.
+*/
+static int8_t
+sd_spi_check_write_status(
+	int8_t	response
+);
+
+/**
+@brief		Reads the number of blocks that were written without errors by the
+			last write command (ACMD22).
+
+@param[out]	num_blocks	The number of well written blocks.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+static int8_t
+sd_spi_read_num_written_blocks(
+	uint32_t	*num_blocks
+);
+
 /**
 @brief		Performs the direct read from the card.
 
@@ -145,6 +204,331 @@ sd_spi_r2_error(
 	uint16_t r2_response
 );
 
+#if defined(SD_SPI_BUFFER) && SD_SPI_NUM_BUFFERS > 1
+/**
+@brief		Writes out the oldest block buffer that is waiting to be written
+			during a continuous write.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+static int8_t
+sd_spi_write_queued_buffer(
+	void
+);
+#endif
+
+#if defined(SD_SPI_BUFFER)
+/**
+@brief		Reads the buffered block in from the card while keeping the bytes
+			that were written to the buffer.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+static int8_t
+sd_spi_fetch_buffer(
+	void
+);
+#endif
+
+/**
+@brief		Reads whole blocks straight into memory with a multiple block read.
+
+@param		block_address	The address of the first block.
+@param[out]	data_buffer		A location in memory of num_blocks * 512 bytes.
+@param		num_blocks		The number of blocks to read.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+static int8_t
+sd_spi_read_blocks_direct(
+	uint32_t	block_address,
+	uint8_t		*data_buffer,
+	uint32_t	num_blocks
+);
+
+/**
+@brief		Writes whole blocks straight from memory with a multiple block
+			write.
+
+@param		block_address	The address of the first block.
+@param[in]	data			num_blocks * 512 bytes of data.
+@param		num_blocks		The number of blocks to write.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+static int8_t
+sd_spi_write_blocks_direct(
+	uint32_t	block_address,
+	uint8_t		*data,
+	uint32_t	num_blocks
+);
+
+/**
+@brief		Writes part of a page and keeps the rest of the data in the page.
+
+@param		page_address		The address of the page on the card.
+@param[in]	data				The data to write.
+@param		number_of_bytes		The number of bytes to write.
+@param		byte_offset			The byte offset of where to start writing in the
+								page.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+static int8_t
+sd_spi_write_partial_page(
+	uint32_t	page_address,
+	void		*data,
+	uint16_t	number_of_bytes,
+	uint16_t	byte_offset
+);
+
+/**
+@brief		Asks the callback of sd_spi_write_stream() for the next chunk of a
+			block.
+
+@param		callback		The callback of the stream.
+@param[in]	context			The context of the stream.
+@param		block_address	The address of the block the data goes to.
+@param		byte_offset		The offset of the data in the block.
+@param[out]	chunk			A location in memory of SD_SPI_STREAM_CHUNK_SIZE
+							bytes.
+
+@return		The number of bytes in chunk. 0 means the stream has ended.
+*/
+static uint16_t
+sd_spi_pull_stream_data(
+	sd_spi_write_stream_callback_t	callback,
+	void							*context,
+	uint32_t						block_address,
+	uint16_t						byte_offset,
+	uint8_t							*chunk
+);
+
+/**
+@brief		Reads the erased value of the card from an erased block if it is
+			not known yet.
+
+@param		block_address	The address of a block that holds the erased
+							value.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+static int8_t
+sd_spi_probe_erased_value(
+	uint32_t	block_address
+);
+
+/**
+@brief		A sd_spi_read_stream() callback which keeps the first byte of the
+			stream in context and then ends the stream.
+*/
+static uint8_t
+sd_spi_probe_erased_value_callback(
+	void		*context,
+	uint32_t	block_address,
+	uint16_t	byte_offset,
+	uint8_t		*data,
+	uint16_t	number_of_bytes
+);
+
+#if SD_SPI_MAX_ERASED_EXTENTS > 0
+/**
+@brief		Adds a range of blocks to the map of erased blocks.
+@details	Ranges that overlap or touch are merged. If the map is full, the
+			smallest range is forgotten.
+
+@param		start_block_address		The address of the first block.
+@param		num_blocks				The number of blocks.
+*/
+static void
+sd_spi_add_erased(
+	uint32_t	start_block_address,
+	uint32_t	num_blocks
+);
+
+/**
+@brief		Removes a range of blocks that is about to be written from the map
+			of erased blocks.
+
+@param		start_block_address		The address of the first block.
+@param		num_blocks				The number of blocks.
+*/
+static void
+sd_spi_remove_erased(
+	uint32_t	start_block_address,
+	uint32_t	num_blocks
+);
+
+/**
+@brief		Checks if a range of blocks is known to hold the erased value.
+
+@param		start_block_address		The address of the first block.
+@param		num_blocks				The number of blocks.
+
+@return		True if every block in the range is erased and false otherwise.
+*/
+static uint8_t
+sd_spi_is_erased(
+	uint32_t	start_block_address,
+	uint32_t	num_blocks
+);
+
+/**
+@brief		Hands erased blocks to the callback of sd_spi_read_stream()
+			without reading them from the card.
+
+@param		start_block_address		The address of the first block.
+@param		num_blocks				The number of blocks.
+@param		callback				The callback of the stream.
+@param[in]	context					The context of the stream.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+static int8_t
+sd_spi_read_stream_erased(
+	uint32_t						start_block_address,
+	uint32_t						num_blocks,
+	sd_spi_read_stream_callback_t	callback,
+	void							*context
+);
+#endif
+
+/**
+@brief		Starts erasing a sequence of blocks and deselects the card while it
+			is busy.
+
+@param 		start_block_address		The address of the first block.
+@param 		end_block_address		The address of the last block.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+static int8_t
+sd_spi_start_erase(
+	uint32_t	start_block_address,
+	uint32_t	end_block_address
+);
+
+/**
+@brief		Adds the blocks of a finished erase to the map of erased blocks and
+			fills in the buffer if its whole page was erased.
+@details	Nothing is recorded if the erased value of the card is not known.
+
+@param 		start_block_address		The address of the first block.
+@param 		end_block_address		The address of the last block.
+*/
+static void
+sd_spi_end_erase(
+	uint32_t	start_block_address,
+	uint32_t	end_block_address
+);
+
+#if SD_SPI_MAX_QUEUED_ERASES > 0
+/**
+@brief		Takes the oldest erase off the queue.
+
+@param[out]	range	The range of blocks of the erase.
+*/
+static void
+sd_spi_dequeue_erase(
+	sd_spi_block_range_t	*range
+);
+
+/**
+@brief		Waits for the erase in progress to finish.
+@details	The erase stays in the queue until sd_spi_record_queued_erase()
+			is called, since this can be called in the middle of another
+			operation where the erased value cannot be read from the card.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+static int8_t
+sd_spi_wait_for_queued_erase(
+	void
+);
+
+/**
+@brief		Records the blocks of the finished erase at the front of the queue
+			and takes it off the queue.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+static int8_t
+sd_spi_record_queued_erase(
+	void
+);
+
+/**
+@brief		Starts the queued erases one after the other and completes them.
+
+@param		is_waiting	True to wait for the card to finish each erase and
+						false to return while the card is busy.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+static int8_t
+sd_spi_run_erase_queue(
+	uint8_t	is_waiting
+);
+#endif
+
+/**
+@brief		Moves the data of a block over the bus, with DMA if the platform
+			has it and the transfer is long enough.
+
+@param[in]	tx					The bytes to send, or NULL to receive.
+@param[out]	rx					Where to put the bytes that are received.
+@param		number_of_bytes		The number of bytes.
+*/
+static void
+sd_spi_transfer_data(
+	const uint8_t	*tx,
+	uint8_t			*rx,
+	uint16_t		number_of_bytes
+);
+
+#if defined(SD_SPI_PLATFORM_DMA)
+/* Set by sd_spi_dma_done() when the DMA transfer in progress is done. It is
+   only volatile on AVR, where the callback runs in an interrupt and a byte
+   is read in one instruction, and where the compiler has no atomics. */
+#if defined(__AVR__) || !defined(__ATOMIC_ACQUIRE)
+static volatile uint8_t is_dma_done;
+#else
+static uint8_t is_dma_done;
+#endif
+
+/**
+@brief		Reads whether the DMA transfer in progress is done.
+@details	The bytes that the transfer received are not read before the flag
+			is seen to be set.
+
+@return		True if the transfer is done.
+*/
+static uint8_t
+sd_spi_load_dma_done(
+	void
+);
+
+/**
+@brief		Sets whether the DMA transfer in progress is done.
+@details	When it is set from another thread or core, the bytes that the
+			transfer received are done before the flag is seen.
+
+@param		value	The new value of the flag.
+*/
+static void
+sd_spi_store_dma_done(
+	uint8_t	value
+);
+
+/**
+@brief	The callback that is given to sd_spi_dma_transfer().
+*/
+static void
+sd_spi_dma_done(
+	void
+);
+#endif
+
 /**
 @brief	Asserts the chip select pin for the card.
 */
@@ -166,18 +550,47 @@ sd_spi_init(
 	uint8_t chip_select_pin
 )
 {
-	//sd_spi_dirty_write = 0;
-	card.spi_speed = 0;
-	card.card_type = SD_CARD_TYPE_UNKNOWN;
-	card.chip_select_pin = chip_select_pin;
-	card.is_chip_select_high = 1;
-	card.is_read_write_continuous = 0;
-	card.continuous_block_address = 0;
+	card->spi_speed = 0;
+	card->card_type = SD_CARD_TYPE_UNKNOWN;
+	card->chip_select_pin = chip_select_pin;
+	card->is_chip_select_high = 1;
+	card->is_read_write_continuous = 0;
+	card->is_write_continuous = 0;
+	card->continuous_block_address = 0;
+	card->continuous_start_block_address = 0;
+	card->num_well_written_blocks = 0;
+	card->page_size = 512;
+	card->erased_value = 0;
+	card->is_erased_value_known = 0;
+	card->status_check = SD_SPI_STATUS_CHECK_ALWAYS;
+	card->is_status_check_pending = 0;
+	card->num_status_checks_skipped = 0;
+	card->is_write_in_progress = 0;
+#if SD_SPI_MAX_ERASED_EXTENTS > 0
+	card->num_erased_extents = 0;
+	card->num_erased_blocks_read = 0;
+	card->num_pre_erases_skipped = 0;
+#endif
+#if SD_SPI_MAX_QUEUED_ERASES > 0
+	card->num_queued_erases = 0;
+	card->is_erase_in_progress = 0;
+	card->is_erase_done = 0;
+#endif
 
 #if defined(SD_SPI_BUFFER)
-	card.buffered_block_address = 0;
-	card.is_buffer_current = 0;
-	card.is_buffer_written = 1;
+	card->sd_spi_buffer = card->block_buffers[0];
+	card->buffered_block_address = 0;
+	card->is_buffer_current = 0;
+	card->is_buffer_written = 1;
+	card->written_start = 0;
+	card->written_end = 0;
+	card->is_flush_avoided = 0;
+	card->num_flushes_avoided = 0;
+	card->num_blocks_not_written = 0;
+#if SD_SPI_NUM_BUFFERS > 1
+	card->queued_buffer_index = 0;
+	card->num_queued_buffers = 0;
+#endif
 #endif
 
   	sd_spi_pin_mode(chip_select_pin, OUTPUT);
@@ -233,13 +646,13 @@ sd_spi_init(
       		return SD_ERR_SEND_IF_COND_WRONG_TEST_PATTERN;
     	}
 
-    	card.card_type = SD_CARD_TYPE_SD2;
+    	card->card_type = SD_CARD_TYPE_SD2;
   	}
 
   	init_start_time = sd_spi_millis();
 
   	/* Initialize card. */
-	if (card.card_type == SD_CARD_TYPE_SD2)
+	if (card->card_type == SD_CARD_TYPE_SD2)
 	{
 		while (spi_send_byte_app_command(SD_ACMD_SEND_OP_COND, 0x40000000) != 0)
 		{
@@ -259,7 +672,7 @@ sd_spi_init(
 
 		if ((sd_spi_receive_byte() & 0x40) != 0)
 		{
-			card.card_type = SD_CARD_TYPE_SDHC;
+			card->card_type = SD_CARD_TYPE_SDHC;
 		}
 
 		/* Discard rest of OCR. */
@@ -287,14 +700,14 @@ sd_spi_init(
 					}
 			  	}
 
-			  	card.card_type = SD_CARD_TYPE_MMC;
+			  	card->card_type = SD_CARD_TYPE_MMC;
 			  	break;
 			}
 		}
 
-		if (card.card_type != SD_CARD_TYPE_MMC)
+		if (card->card_type != SD_CARD_TYPE_MMC)
 		{
-			card.card_type = SD_CARD_TYPE_SD1;
+			card->card_type = SD_CARD_TYPE_SD1;
 		}
 	}
 
@@ -305,84 +718,226 @@ sd_spi_init(
     	return SD_ERR_SETTING_BLOCK_LENGTH;
     }
 
+#if defined(SD_SPI_BUFFER)
     for (i = 0; i < 512; i++)
     {
-    	card.sd_spi_buffer[i] = 0;
+    	card->sd_spi_buffer[i] = 0;
     }
+#endif
 
-	card.spi_speed = 1;
+	card->spi_speed = 1;
 	sd_spi_unselect_card();
 
-	return SD_ERR_OK;
-}
-
-int8_t
-sd_spi_write(
-	uint32_t 	block_address,
-	void	 	*data,
-	uint16_t 	number_of_bytes,
-	uint16_t 	byte_offset
-)
-{
-	/* Check to make sure that data is within page bounds. */
-	if (number_of_bytes + byte_offset > 512)
-	{
-		return SD_ERR_WRITE_OUTSIDE_OF_BLOCK;
-	}
-
-#if defined(SD_SPI_BUFFER)
-	/* Write a whole block out if it is 512 bytes, otherwise read block into
-	   buffer for partial writing. */
-	if (number_of_bytes == 512 && !card.is_read_write_continuous)
-	{
-		int8_t response = sd_spi_write_block(block_address, data);
-		sd_spi_unselect_card();
+	/* The SD status and SCR are kept for picking run lengths. MMC cards do
+	   not have them. */
+	memset(&card->sd_status, 0, sizeof(sd_spi_sd_status_t));
+	memset(&card->scr, 0, sizeof(sd_spi_scr_t));
 
-		return response;
-	}
-	else if (!card.is_read_write_continuous && (card.buffered_block_address !=
-			 block_address || !card.is_buffer_current))
+	if (card->card_type != SD_CARD_TYPE_MMC)
 	{
-		int8_t response;
-		if ((response = sd_spi_flush()))
+		if (sd_spi_read_sd_status_register(&card->sd_status))
 		{
-			return response;
+			memset(&card->sd_status, 0, sizeof(sd_spi_sd_status_t));
 		}
 
-		if (sd_spi_dirty_write)
-		{
-			card.buffered_block_address = block_address;
-		}
-		else
+		if (sd_spi_read_scr_register(&card->scr))
 		{
-			if ((response = sd_spi_read_in_data(block_address, card.sd_spi_buffer,
-												512, 0)))
-			{
-				return response;
-			}
+			memset(&card->scr, 0, sizeof(sd_spi_scr_t));
 		}
 	}
 
-	memcpy(card.sd_spi_buffer + byte_offset, data, number_of_bytes);
-	card.is_buffer_written = 0;
-
 	return SD_ERR_OK;
-#else
-	int8_t response = sd_spi_write_out_data(block_address, data,
-										 	number_of_bytes, byte_offset);
-
-	sd_spi_unselect_card();
-	return response;
-#endif
 }
-
 int8_t
-sd_spi_write_block(
-	uint32_t 	block_address,
-	void	 	*data
+sd_spi_set_page_size(
+	uint16_t page_size
 )
 {
-	int8_t response;
+	if (page_size == 0 || (page_size & 511) != 0 ||
+		page_size > SD_SPI_MAX_PAGE_SIZE)
+	{
+		return SD_ERR_ILLEGAL_PARAMETER;
+	}
+
+	if (card->is_read_write_continuous)
+	{
+		return SD_ERR_READ_WRITE_CONTINUOUS;
+	}
+
+#if defined(SD_SPI_BUFFER)
+	int8_t response;
+	if ((response = sd_spi_flush()))
+	{
+		return response;
+	}
+
+	/* The buffer holds a page of the old size. */
+	card->is_buffer_current = 0;
+#endif
+
+	card->page_size = page_size;
+
+	return SD_ERR_OK;
+}
+
+uint16_t
+sd_spi_page_size(
+	void
+)
+{
+	return card->page_size;
+}
+
+int8_t
+sd_spi_set_status_check(
+	uint8_t status_check
+)
+{
+	if (status_check > SD_SPI_STATUS_CHECK_ON_ERROR)
+	{
+		return SD_ERR_ILLEGAL_PARAMETER;
+	}
+
+	card->status_check = status_check;
+
+	return SD_ERR_OK;
+}
+
+
+int8_t
+sd_spi_write(
+	uint32_t 	block_address,
+	void	 	*data,
+	uint16_t 	number_of_bytes,
+	uint16_t 	byte_offset
+)
+{
+	/* Check to make sure that data is within page bounds. */
+	if (number_of_bytes + byte_offset > card->page_size)
+	{
+		return SD_ERR_WRITE_OUTSIDE_OF_BLOCK;
+	}
+
+#if defined(SD_SPI_BUFFER)
+	/* Nothing changes if the buffer already holds the data. */
+	if (!card->is_read_write_continuous &&
+		card->buffered_block_address == block_address &&
+		card->is_buffer_current &&
+		memcmp(card->sd_spi_buffer + byte_offset, data, number_of_bytes) == 0)
+	{
+		if (card->is_buffer_written)
+		{
+			card->is_flush_avoided = 1;
+		}
+
+		return SD_ERR_OK;
+	}
+
+	/* Write a whole page out if it is the size of a page, otherwise read page
+	   into buffer for partial writing. */
+	if (number_of_bytes == card->page_size && !card->is_read_write_continuous)
+	{
+		int8_t response = sd_spi_write_block(block_address, data);
+		sd_spi_unselect_card();
+
+		return response;
+	}
+	else if (!card->is_read_write_continuous)
+	{
+		int8_t response;
+
+		if (card->buffered_block_address != block_address ||
+			(card->is_buffer_written && !card->is_buffer_current))
+		{
+			if ((response = sd_spi_flush()))
+			{
+				return response;
+			}
+
+			/* The block is only read in from the card when the data written
+			   to it does not cover the whole block. */
+			card->buffered_block_address = block_address;
+			card->is_buffer_current = 0;
+		}
+
+		if (card->is_buffer_written)
+		{
+			card->written_start = byte_offset;
+			card->written_end = byte_offset;
+		}
+
+		/* The rest of the block is needed if the new data leaves a gap after
+		   the data already written. */
+		if (!card->is_buffer_current &&
+			(byte_offset > card->written_end ||
+			 byte_offset + number_of_bytes < card->written_start) &&
+			(response = sd_spi_fetch_buffer()))
+		{
+			return response;
+		}
+
+		if (byte_offset < card->written_start)
+		{
+			card->written_start = byte_offset;
+		}
+
+		if (byte_offset + number_of_bytes > card->written_end)
+		{
+			card->written_end = byte_offset + number_of_bytes;
+		}
+
+		if (card->written_start == 0 && card->written_end == card->page_size)
+		{
+			card->is_buffer_current = 1;
+		}
+	}
+
+	memcpy(card->sd_spi_buffer + byte_offset, data, number_of_bytes);
+	card->is_buffer_written = 0;
+
+	return SD_ERR_OK;
+#else
+	int8_t response = sd_spi_write_out_data(block_address, data,
+										 	number_of_bytes, byte_offset);
+
+	sd_spi_unselect_card();
+	return response;
+#endif
+}
+int8_t
+sd_spi_write_begin_fresh(
+	uint32_t 	block_address
+)
+{
+#if defined(SD_SPI_BUFFER)
+	if (card->is_read_write_continuous)
+	{
+		return SD_ERR_READ_WRITE_CONTINUOUS;
+	}
+
+	int8_t response;
+	if ((response = sd_spi_flush()))
+	{
+		return response;
+	}
+
+	sd_spi_clear_buffer();
+	card->buffered_block_address = block_address;
+	card->is_buffer_current = 1;
+	card->written_end = card->page_size;
+#endif
+
+	return SD_ERR_OK;
+}
+
+
+int8_t
+sd_spi_write_block(
+	uint32_t 	block_address,
+	void	 	*data
+)
+{
+	int8_t response;
 
 #if defined(SD_SPI_BUFFER)
 	if ((response = sd_spi_flush()))
@@ -391,17 +946,17 @@ sd_spi_write_block(
 	}
 #endif
 
-	response = sd_spi_write_out_data(block_address, data, 512, 0);
+	response = sd_spi_write_out_data(block_address, data, card->page_size, 0);
 
 #if defined(SD_SPI_BUFFER)
-	if (!card.is_read_write_continuous ||
-		block_address == card.continuous_block_address) // TODO: Does this logic make sense?
+	if (!card->is_read_write_continuous ||
+		block_address == card->continuous_block_address) // TODO: Does this logic make sense?
 	{
-			memcpy(card.sd_spi_buffer, data, 512);
+			memcpy(card->sd_spi_buffer, data, card->page_size);
 	}
 
-	card.is_buffer_written = 1;
-	card.buffered_block_address = block_address;
+	card->is_buffer_written = 1;
+	card->buffered_block_address = block_address;
 #endif
 
 	sd_spi_unselect_card();
@@ -414,30 +969,109 @@ sd_spi_flush(
 )
 {
 #if defined(SD_SPI_BUFFER)
-	if (card.is_buffer_written)
+	int8_t response;
+
+#if SD_SPI_NUM_BUFFERS > 1
+	/* Queued blocks come before the one in the buffer. */
+	while (card->num_queued_buffers > 0)
+	{
+		if ((response = sd_spi_write_queued_buffer()))
+		{
+			return response;
+		}
+	}
+#endif
+
+	if (card->is_buffer_written)
 	{
+		if (card->is_flush_avoided)
+		{
+			card->num_flushes_avoided++;
+			card->is_flush_avoided = 0;
+		}
+
 		return SD_ERR_OK;
 	}
 
-	int8_t response;
-	if ((response = sd_spi_write_out_data(card.buffered_block_address,
-										  card.sd_spi_buffer, 512, 0)))
+	/* A partially written block has to be completed with the data on the
+	   card. */
+	if (!card->is_read_write_continuous && !card->is_buffer_current &&
+		(response = sd_spi_fetch_buffer()))
 	{
 		return response;
 	}
 
-	if (!card.is_read_write_continuous)
+	/* Only the blocks of a page that hold changed bytes are written. */
+	uint16_t write_start = 0;
+	uint16_t write_end = card->page_size;
+
+	if (!card->is_read_write_continuous &&
+		card->written_end > card->written_start)
 	{
-		card.is_buffer_current = 1;
+		write_start = card->written_start & ~511;
+		write_end = (card->written_end + 511) & ~511;
 	}
-	
-	card.is_buffer_written = 1;
+
+	if (write_start != 0 || write_end != card->page_size)
+	{
+		/* The multiple block write must not flush the buffer again. */
+		card->is_buffer_written = 1;
+
+		if ((response = sd_spi_write_blocks_direct(
+				card->buffered_block_address * (card->page_size >> 9) +
+				(write_start >> 9), card->sd_spi_buffer + write_start,
+				(write_end - write_start) >> 9)))
+		{
+			card->is_buffer_written = 0;
+			return response;
+		}
+
+		card->num_blocks_not_written += (card->page_size -
+										 (write_end - write_start)) >> 9;
+	}
+	else if ((response = sd_spi_write_out_data(card->buffered_block_address,
+											   card->sd_spi_buffer,
+											   card->page_size, 0)))
+	{
+		return response;
+	}
+
+	if (!card->is_read_write_continuous)
+	{
+		card->is_buffer_current = 1;
+	}
+
+	card->written_start = 0;
+	card->written_end = 0;
+	card->is_flush_avoided = 0;
+	card->is_buffer_written = 1;
 	sd_spi_unselect_card();
 #endif
 
 	return SD_ERR_OK;
 }
 
+int8_t
+sd_spi_sync(
+	void
+)
+{
+	int8_t response;
+	if ((response = sd_spi_flush()))
+	{
+		return response;
+	}
+
+	if (!card->is_status_check_pending)
+	{
+		return SD_ERR_OK;
+	}
+
+	card->is_status_check_pending = 0;
+
+	return sd_spi_card_status();
+}
+
 int8_t
 sd_spi_write_continuous_start(
 	uint32_t start_block_address,
@@ -453,11 +1087,37 @@ sd_spi_write_continuous_start(
 #endif
 
 	/* Keep track of block address for error checking and buffering. */
-	card.continuous_block_address = start_block_address;
+	card->continuous_block_address = start_block_address;
+	card->continuous_start_block_address = start_block_address;
+
+	/* Pre-erase the pages that are left in the allocation unit. */
+	if (num_blocks_pre_erase == SD_SPI_PRE_ERASE_AU)
+	{
+		uint32_t au_blocks = sd_spi_au_blocks();
+
+		num_blocks_pre_erase = au_blocks == 0 ? 0 :
+							   (au_blocks - start_block_address *
+							    (card->page_size >> 9) % au_blocks) /
+							   (card->page_size >> 9);
+	}
+
+	/* The write goes over all of the blocks of each page. */
+	start_block_address *= card->page_size >> 9;
+	num_blocks_pre_erase *= card->page_size >> 9;
+
+#if SD_SPI_MAX_ERASED_EXTENTS > 0
+	/* Blocks that are known to be erased do not need to be pre-erased. */
+	if (num_blocks_pre_erase != 0 &&
+		sd_spi_is_erased(start_block_address, num_blocks_pre_erase))
+	{
+		num_blocks_pre_erase = 0;
+		card->num_pre_erases_skipped++;
+	}
+#endif
 
 	/* SD cards 2GB or less address by bytes so multiply by 512 to address
 	   by blocks. */
-	if (card.card_type != SD_CARD_TYPE_SDHC)
+	if (card->card_type != SD_CARD_TYPE_SDHC)
 	{
 		start_block_address <<= 9;
 	}
@@ -480,11 +1140,12 @@ sd_spi_write_continuous_start(
 		return SD_ERR_WRITE_FAILURE;
 	}
 
-	card.is_read_write_continuous = 1;
+	card->is_read_write_continuous = 1;
+	card->is_write_continuous = 1;
 
 #if defined(SD_SPI_BUFFER)
 	sd_spi_clear_buffer();
-	card.buffered_block_address = card.continuous_block_address;
+	card->buffered_block_address = card->continuous_block_address;
 #endif
 
 	sd_spi_unselect_card();
@@ -498,7 +1159,12 @@ sd_spi_write_continuous(
 	uint16_t 	byte_offset
 )
 {
-	return sd_spi_write(card.continuous_block_address, data, number_of_bytes,
+	if (!card->is_read_write_continuous)
+	{
+		return SD_ERR_READ_WRITE_CONTINUOUS;
+	}
+
+	return sd_spi_write(card->continuous_block_address, data, number_of_bytes,
 						byte_offset);
 }
 
@@ -507,31 +1173,134 @@ sd_spi_write_continuous_next(
 	void
 )
 {
-#if defined(SD_SPI_BUFFER)
-	int8_t response = sd_spi_flush();
+	if (!card->is_read_write_continuous)
+	{
+		return SD_ERR_READ_WRITE_CONTINUOUS;
+	}
+
+#if defined(SD_SPI_BUFFER) && SD_SPI_NUM_BUFFERS > 1
+	int8_t response;
+
+	if (!card->is_buffer_written)
+	{
+		/* Make room by writing out the oldest block if every other buffer is
+		   still waiting to be written. */
+		if (card->num_queued_buffers == SD_SPI_NUM_BUFFERS - 1 &&
+			(response = sd_spi_write_queued_buffer()))
+		{
+			return response;
+		}
+
+		card->num_queued_buffers++;
+		card->buffered_block_address++;
+		card->sd_spi_buffer = card->block_buffers[(card->queued_buffer_index +
+												   card->num_queued_buffers) %
+												  SD_SPI_NUM_BUFFERS];
+	}
+
 	sd_spi_clear_buffer();
 
-	return response;
+	return sd_spi_poll();
+#elif defined(SD_SPI_BUFFER)
+	int8_t response;
+
+	/* A failed write has already dropped the buffer. */
+	if ((response = sd_spi_flush()))
+	{
+		return response;
+	}
+
+	sd_spi_clear_buffer();
+
+	return SD_ERR_OK;
+#else
+	return SD_ERR_OK;
+#endif
+}
+
+int8_t
+sd_spi_poll(
+	void
+)
+{
+#if defined(SD_SPI_BUFFER) && SD_SPI_NUM_BUFFERS > 1
+	int8_t response;
+
+	while (card->num_queued_buffers > 0)
+	{
+		/* Leave the block queued if the card is still busy. */
+		sd_spi_select_card();
+
+		if (sd_spi_receive_byte() != 0xFF)
+		{
+			sd_spi_unselect_card();
+			return SD_ERR_OK;
+		}
+
+		if ((response = sd_spi_write_queued_buffer()))
+		{
+			return response;
+		}
+	}
+#endif
+
+#if SD_SPI_MAX_QUEUED_ERASES > 0
+	return sd_spi_run_erase_queue(0);
 #else
 	return SD_ERR_OK;
 #endif
 }
 
+uint8_t
+sd_spi_is_busy(
+	void
+)
+{
+	/* The card is sending data, which checking would throw out. */
+	if (card->is_read_write_continuous && !card->is_write_continuous)
+	{
+		return 0;
+	}
+
+	/* The card holds the data line low while it is busy. */
+	sd_spi_select_card();
+	uint8_t is_busy = sd_spi_receive_byte() != 0xFF;
+	sd_spi_unselect_card();
+
+	if (!is_busy)
+	{
+		card->is_write_in_progress = 0;
+	}
+
+	return is_busy;
+}
+
 int8_t
 sd_spi_write_continuous_stop(
 	void
 )
 {
+	int8_t response = SD_ERR_OK;
+
 #if defined(SD_SPI_BUFFER)
-	/* Flush buffer if it hasn't been written. */
-	int8_t response;
-	if ((response = sd_spi_flush()))
+	/* Flush buffer if it hasn't been written. If this fails, the block is
+	   dropped and the write is still stopped so that the card is not left in
+	   the middle of a multiple block write. */
+	response = sd_spi_flush();
+	card->is_buffer_written = 1;
+#if SD_SPI_NUM_BUFFERS > 1
+	card->num_queued_buffers = 0;
+#endif
+#endif
+
+	/* A failed write has already been stopped. */
+	if (!card->is_read_write_continuous)
 	{
 		return response;
 	}
-#endif
 
 	sd_spi_select_card();
+	card->is_read_write_continuous = 0;
 
 	/* Wait for card to complete the write. */
 	if (sd_spi_wait_if_busy(SD_WRITE_TIMEOUT))
@@ -543,8 +1312,6 @@ sd_spi_write_continuous_stop(
 	/* Token is sent to signal card to stop multiple block writing. */
   	sd_spi_send_byte(SD_TOKEN_MULTIPLE_WRITE_STOP_TRANSFER);
 
-	card.is_read_write_continuous = 0;
-
   	/* Wait for card to complete the write. */
 	if (sd_spi_wait_if_busy(SD_WRITE_TIMEOUT))
 	{
@@ -552,12 +1319,179 @@ sd_spi_write_continuous_stop(
 		return SD_ERR_WRITE_TIMEOUT;
 	}
 
-	return sd_spi_card_status();
+	/* The status also holds the errors of writes that did not read it. */
+	card->is_status_check_pending = 0;
+	int8_t status = sd_spi_card_status();
+
+	return response ? response : status;
 }
 
 int8_t
-sd_spi_read(
-	uint32_t 	block_address,
+sd_spi_write_continuous_resume(
+	uint32_t	*block_address
+)
+{
+	if (card->is_read_write_continuous)
+	{
+		return SD_ERR_READ_WRITE_CONTINUOUS;
+	}
+
+	if (block_address != NULL)
+	{
+		*block_address = card->continuous_block_address;
+	}
+
+	return sd_spi_write_continuous_start(card->continuous_block_address, 0);
+}
+
+int8_t
+sd_spi_write_stream(
+	uint32_t						start_block_address,
+	uint32_t						num_blocks,
+	sd_spi_write_stream_callback_t	callback,
+	void							*context
+)
+{
+	if (num_blocks == 0)
+	{
+		return SD_ERR_OK;
+	}
+
+#if defined(SD_SPI_BUFFER)
+	int8_t response;
+	if ((response = sd_spi_flush()))
+	{
+		return response;
+	}
+
+	/* The buffer has to be read in again if the stream writes over its
+	   page. */
+	uint32_t buffered_start = card->buffered_block_address *
+							  (card->page_size >> 9);
+
+	if (buffered_start < start_block_address + num_blocks &&
+		buffered_start + (card->page_size >> 9) > start_block_address)
+	{
+		card->is_buffer_current = 0;
+	}
+#endif
+
+#if SD_SPI_MAX_ERASED_EXTENTS > 0
+	sd_spi_remove_erased(start_block_address, num_blocks);
+#endif
+
+	uint32_t block_address = start_block_address;
+	uint32_t end_block_address = start_block_address + num_blocks;
+
+	/* SD cards 2GB or less address by bytes so multiply by 512 to address
+	   by blocks. */
+	if (card->card_type != SD_CARD_TYPE_SDHC)
+	{
+		start_block_address <<= 9;
+	}
+
+	/* Start multiple block write. */
+	if (sd_spi_send_byte_command(SD_CMD_WRITE_MULTIPLE_BLOCK, start_block_address))
+	{
+		sd_spi_unselect_card();
+		return SD_ERR_WRITE_FAILURE;
+	}
+
+	card->is_read_write_continuous = 1;
+	card->is_write_continuous = 1;
+	card->continuous_block_address = block_address;
+	card->continuous_start_block_address = block_address;
+
+	uint8_t chunk[SD_SPI_STREAM_CHUNK_SIZE];
+	uint8_t is_stream_ended = 0;
+
+	while (block_address < end_block_address && !is_stream_ended)
+	{
+		/* The first chunk is pulled before the block is started, so the
+		   stream can end on a block boundary. */
+		uint16_t number_of_bytes = sd_spi_pull_stream_data(callback, context,
+														   block_address, 0,
+														   chunk);
+
+		if (number_of_bytes == 0)
+		{
+			break;
+		}
+
+		/* Wait for card to complete the previous write. */
+		if (sd_spi_wait_if_busy(SD_WRITE_TIMEOUT))
+		{
+			return sd_spi_stop_failed_stream(SD_ERR_WRITE_TIMEOUT);
+		}
+
+		sd_spi_send_byte(SD_TOKEN_MULTIPLE_WRITE_START_BLOCK);
+
+		uint16_t i;
+
+		sd_spi_send_bytes(chunk, number_of_bytes);
+
+		uint16_t byte_offset = number_of_bytes;
+
+		while (byte_offset < 512)
+		{
+			if ((number_of_bytes = sd_spi_pull_stream_data(callback, context,
+														   block_address,
+														   byte_offset,
+														   chunk)) == 0)
+			{
+				is_stream_ended = 1;
+				break;
+			}
+
+			sd_spi_send_bytes(chunk, number_of_bytes);
+
+			byte_offset += number_of_bytes;
+		}
+
+		/* Pad data with 0. */
+		for (i = byte_offset; i < 512; i++)
+		{
+			sd_spi_send_byte(0);
+		}
+
+		/* Send dummy CRC. */
+		sd_spi_send_byte(0xFF);
+		sd_spi_send_byte(0xFF);
+
+		/* Check if write was successful. */
+		int8_t data_response;
+
+		switch (sd_spi_receive_byte() & 0x0F)
+		{
+			case SD_TOKEN_DATA_ACCEPTED:
+				data_response = SD_ERR_OK;
+				break;
+			case SD_TOKEN_DATA_REJECTED_CRC:
+				data_response = SD_ERR_WRITE_DATA_CRC_REJECTED;
+				break;
+			case SD_TOKEN_DATA_REJECTED_WRITE_ERR:
+				data_response = SD_ERR_WRITE_DATA_REJECTED;
+				break;
+			default:
+				data_response = SD_ERR_WRITE_FAILURE;
+				break;
+		}
+
+		if (data_response)
+		{
+			return sd_spi_stop_failed_stream(data_response);
+		}
+
+		block_address++;
+		card->continuous_block_address = block_address;
+	}
+
+	return sd_spi_write_continuous_stop();
+}
+
+int8_t
+sd_spi_read(
+	uint32_t 	block_address,
 	void	 	*data_buffer,
 	uint16_t 	number_of_bytes,
 	uint16_t 	byte_offset
@@ -572,23 +1506,23 @@ sd_spi_read(
 	}
 
 	/* Check to make sure that data is within page bounds. */
-	if (number_of_bytes + byte_offset > 512)
+	if (number_of_bytes + byte_offset > card->page_size)
 	{
     	return SD_ERR_READ_OUTSIDE_OF_BLOCK;
   	}
 
-	if (card.buffered_block_address != block_address ||
-		!card.is_buffer_current)
+	if (card->buffered_block_address != block_address ||
+		!card->is_buffer_current)
 	{
 		/* Read block into buffer. */
-		if ((response = sd_spi_read_in_data(block_address, card.sd_spi_buffer,
-											512, 0)))
+		if ((response = sd_spi_read_in_data(block_address, card->sd_spi_buffer,
+											card->page_size, 0)))
 		{
 			return response;
 		}
 	}
 
-	memcpy(data_buffer, card.sd_spi_buffer + byte_offset, number_of_bytes);
+	memcpy(data_buffer, card->sd_spi_buffer + byte_offset, number_of_bytes);
 
 	return SD_ERR_OK;
 #else
@@ -597,6 +1531,162 @@ sd_spi_read(
 #endif
 }
 
+int8_t
+sd_spi_pread(
+	uint64_t	byte_address,
+	void		*data_buffer,
+	size_t		number_of_bytes
+)
+{
+	if (card->is_read_write_continuous)
+	{
+		return SD_ERR_READ_WRITE_CONTINUOUS;
+	}
+
+	uint8_t *data = data_buffer;
+	uint16_t page_size = card->page_size;
+	uint32_t page_address = byte_address / page_size;
+	uint16_t byte_offset = byte_address % page_size;
+	int8_t response;
+
+	/* Partial page at the start. */
+	if (number_of_bytes > 0 && (byte_offset != 0 || number_of_bytes < page_size))
+	{
+		uint16_t head_bytes = page_size - byte_offset;
+
+		if (head_bytes > number_of_bytes)
+		{
+			head_bytes = number_of_bytes;
+		}
+
+		if ((response = sd_spi_read(page_address, data, head_bytes,
+									byte_offset)))
+		{
+			return response;
+		}
+
+		data += head_bytes;
+		number_of_bytes -= head_bytes;
+		page_address++;
+	}
+
+	/* Whole pages in the middle. */
+	if (number_of_bytes >= page_size)
+	{
+		uint32_t num_pages = number_of_bytes / page_size;
+
+#if defined(SD_SPI_BUFFER)
+		/* The card has to be up to date with the buffer. */
+		if ((response = sd_spi_flush()))
+		{
+			return response;
+		}
+#endif
+
+		if ((response = sd_spi_read_blocks_direct(page_address *
+												  (page_size >> 9), data,
+												  num_pages *
+												  (page_size >> 9))))
+		{
+			return response;
+		}
+
+		data += (size_t) num_pages * page_size;
+		number_of_bytes -= (size_t) num_pages * page_size;
+		page_address += num_pages;
+	}
+
+	/* Partial page at the end. */
+	if (number_of_bytes > 0)
+	{
+		return sd_spi_read(page_address, data, number_of_bytes, 0);
+	}
+
+	return SD_ERR_OK;
+}
+
+int8_t
+sd_spi_pwrite(
+	uint64_t	byte_address,
+	void		*data,
+	size_t		number_of_bytes
+)
+{
+	if (card->is_read_write_continuous)
+	{
+		return SD_ERR_READ_WRITE_CONTINUOUS;
+	}
+
+	uint8_t *source = data;
+	uint16_t page_size = card->page_size;
+	uint32_t page_address = byte_address / page_size;
+	uint16_t byte_offset = byte_address % page_size;
+	int8_t response;
+
+	/* Partial page at the start. */
+	if (number_of_bytes > 0 && (byte_offset != 0 || number_of_bytes < page_size))
+	{
+		uint16_t head_bytes = page_size - byte_offset;
+
+		if (head_bytes > number_of_bytes)
+		{
+			head_bytes = number_of_bytes;
+		}
+
+		if ((response = sd_spi_write_partial_page(page_address, source,
+												  head_bytes, byte_offset)))
+		{
+			return response;
+		}
+
+		source += head_bytes;
+		number_of_bytes -= head_bytes;
+		page_address++;
+	}
+
+	/* Whole pages in the middle. */
+	if (number_of_bytes >= page_size)
+	{
+		uint32_t num_pages = number_of_bytes / page_size;
+
+#if defined(SD_SPI_BUFFER)
+		/* Write out the buffer first so it cannot overwrite the new data
+		   later. */
+		if ((response = sd_spi_flush()))
+		{
+			return response;
+		}
+
+		if (card->buffered_block_address >= page_address &&
+			card->buffered_block_address < page_address + num_pages)
+		{
+			card->is_buffer_current = 0;
+		}
+#endif
+
+		if ((response = sd_spi_write_blocks_direct(page_address *
+												   (page_size >> 9), source,
+												   num_pages *
+												   (page_size >> 9))))
+		{
+			return response;
+		}
+
+		source += (size_t) num_pages * page_size;
+		number_of_bytes -= (size_t) num_pages * page_size;
+		page_address += num_pages;
+	}
+
+	/* Partial page at the end. */
+	if (number_of_bytes > 0)
+	{
+		return sd_spi_write_partial_page(page_address, source,
+										 number_of_bytes, 0);
+	}
+
+	return SD_ERR_OK;
+}
+
 int8_t
 sd_spi_read_continuous_start(
 	uint32_t start_block_address
@@ -611,11 +1701,14 @@ sd_spi_read_continuous_start(
 	}
 #endif
 
-	card.continuous_block_address = start_block_address;
+	card->continuous_block_address = start_block_address;
+
+	/* The read goes over all of the blocks of each page. */
+	start_block_address *= card->page_size >> 9;
 
 	/* SD cards 2GB or less address by bytes so multiply by 512 to address
 	   by blocks. */
-	if (card.card_type != SD_CARD_TYPE_SDHC)
+	if (card->card_type != SD_CARD_TYPE_SDHC)
 	{
 		start_block_address <<= 9;
 	}
@@ -627,18 +1720,20 @@ sd_spi_read_continuous_start(
 		return SD_ERR_READ_FAILURE;
 	}
 
-	card.is_read_write_continuous = 1;
+	card->is_read_write_continuous = 1;
+	card->is_write_continuous = 0;
 
 #if defined(SD_SPI_BUFFER)
-	if ((response = sd_spi_read_in_data(card.continuous_block_address,
-										card.sd_spi_buffer, 512, 0)))
+	if ((response = sd_spi_read_in_data(card->continuous_block_address,
+										card->sd_spi_buffer, card->page_size,
+										0)))
 	{
 		sd_spi_unselect_card();
 		return response;
 	}
 
-	card.continuous_block_address--;
-	card.buffered_block_address = card.continuous_block_address;
+	card->continuous_block_address--;
+	card->buffered_block_address = card->continuous_block_address;
 #endif
 
 	sd_spi_unselect_card();
@@ -653,10 +1748,10 @@ sd_spi_read_continuous(
 )
 {
 #if defined(SD_SPI_BUFFER)
-	return sd_spi_read(card.continuous_block_address, data_buffer,
+	return sd_spi_read(card->continuous_block_address, data_buffer,
 					   number_of_bytes, byte_offset);
 #else
-	return sd_spi_read_in_data(card.continuous_block_address, data_buffer,
+	return sd_spi_read_in_data(card->continuous_block_address, data_buffer,
 							   number_of_bytes, byte_offset);
 #endif
 }
@@ -667,8 +1762,8 @@ sd_spi_read_continuous_next(
 )
 {
 #if defined(SD_SPI_BUFFER)
-	return sd_spi_read_in_data(card.continuous_block_address,
-							   card.sd_spi_buffer, 512, 0);
+	return sd_spi_read_in_data(card->continuous_block_address,
+							   card->sd_spi_buffer, card->page_size, 0);
 #else
 	return SD_ERR_OK;
 #endif
@@ -708,95 +1803,253 @@ sd_spi_read_continuous_stop(
 		}
 	}
 
-	card.is_read_write_continuous = 0;
+	card->is_read_write_continuous = 0;
 	sd_spi_unselect_card();
 
 	return SD_ERR_OK;
 }
 
 int8_t
-sd_spi_erase_all(
-	void
+sd_spi_read_stream(
+	uint32_t						start_block_address,
+	uint32_t						num_blocks,
+	sd_spi_read_stream_callback_t	callback,
+	void							*context
 )
 {
-	return sd_spi_erase_blocks(0, sd_spi_card_size());
-}
+	if (num_blocks == 0)
+	{
+		return SD_ERR_OK;
+	}
 
-int8_t
-sd_spi_erase_blocks(
-	uint32_t start_block_address,
-	uint32_t end_block_address
-)
-{
 #if defined(SD_SPI_BUFFER)
 	int8_t response;
 	if ((response = sd_spi_flush()))
 	{
 		return response;
 	}
-	
-	if (card.buffered_block_address > start_block_address &&
-		card.buffered_block_address < end_block_address)
+#endif
+
+#if SD_SPI_MAX_ERASED_EXTENTS > 0
+	if (sd_spi_is_erased(start_block_address, num_blocks))
 	{
-		sd_spi_clear_buffer();
-		card.is_buffer_written = 1;
-		card.is_buffer_current = 1;
+		return sd_spi_read_stream_erased(start_block_address, num_blocks,
+										 callback, context);
 	}
 #endif
 
+	uint32_t block_address = start_block_address;
+	uint32_t end_block_address = start_block_address + num_blocks;
+
 	/* SD cards 2GB or less address by bytes so multiply by 512 to address
 	   by blocks. */
-	if (card.card_type != SD_CARD_TYPE_SDHC)
+	if (card->card_type != SD_CARD_TYPE_SDHC)
 	{
 		start_block_address <<= 9;
-		end_block_address <<= 9;
 	}
 
-	/* The start and end address of the blocks to be erased must be sent to the
-	   SD and then the erase command is called. */
-	if (sd_spi_send_byte_command(SD_CMD_ERASE_WR_BLK_START, start_block_address) ||
-		sd_spi_send_byte_command(SD_CMD_ERASE_WR_BLK_END, end_block_address) ||
-		sd_spi_send_byte_command(SD_CMD_ERASE, 0))
+	/* Start multiple block reading. */
+	if (sd_spi_send_byte_command(SD_CMD_READ_MULTIPLE_BLOCK, start_block_address))
 	{
 		sd_spi_unselect_card();
-		return SD_ERR_ERASE_FAILURE;
+		return SD_ERR_READ_FAILURE;
 	}
 
-	if (sd_spi_wait_if_busy(SD_ERASE_TIMEOUT))
+	card->is_read_write_continuous = 1;
+	card->is_write_continuous = 0;
+
+	uint8_t chunk[SD_SPI_STREAM_CHUNK_SIZE];
+	uint8_t is_stream_ended = 0;
+
+	while (block_address < end_block_address && !is_stream_ended)
 	{
-		sd_spi_unselect_card();
-		return SD_ERR_ERASE_TIMEOUT;
+		uint16_t timeout_start = sd_spi_millis();
+
+		/* Must wait for read token from card before reading. */
+		while (sd_spi_receive_byte() != SD_TOKEN_START_BLOCK)
+		{
+			if (((uint16_t) sd_spi_millis() - timeout_start) > SD_READ_TIMEOUT)
+			{
+				card->is_read_write_continuous = 0;
+				return sd_spi_card_status();
+			}
+		}
+
+		/* The chunks after the callback ends the stream are still clocked in
+		   so that the card finishes the block. */
+		uint16_t byte_offset;
+		for (byte_offset = 0; byte_offset < 512;
+			 byte_offset += SD_SPI_STREAM_CHUNK_SIZE)
+		{
+			uint16_t number_of_bytes = 512 - byte_offset;
+
+			if (number_of_bytes > SD_SPI_STREAM_CHUNK_SIZE)
+			{
+				number_of_bytes = SD_SPI_STREAM_CHUNK_SIZE;
+			}
+
+			sd_spi_receive_bytes(chunk, number_of_bytes);
+
+			if (!is_stream_ended &&
+				callback(context, block_address, byte_offset, chunk,
+						 number_of_bytes))
+			{
+				is_stream_ended = 1;
+			}
+		}
+
+		/* Throw out CRC. */
+		sd_spi_receive_byte();
+		sd_spi_receive_byte();
+
+		block_address++;
 	}
 
-	sd_spi_unselect_card();
-	return SD_ERR_OK;
+	return sd_spi_read_continuous_stop();
 }
 
-uint32_t
-sd_spi_card_size(
+int8_t
+sd_spi_erase_all(
 	void
 )
 {
-	if (sd_spi_send_byte_command(SD_CMD_SEND_CSD, 0))
+	return sd_spi_erase_blocks(0, sd_spi_card_size() - 1);
+}
+
+int8_t
+sd_spi_erase_blocks(
+	uint32_t start_block_address,
+	uint32_t end_block_address
+)
+{
+	int8_t response;
+	if ((response = sd_spi_start_erase(start_block_address, end_block_address)))
 	{
-		sd_spi_unselect_card();
-		return SD_ERR_READ_REGISTER;
+		return response;
 	}
 
-	uint16_t timeout_start = sd_spi_millis();
+	sd_spi_select_card();
 
-	while (sd_spi_receive_byte() != SD_TOKEN_START_BLOCK)
+	if (sd_spi_wait_if_busy(SD_ERASE_TIMEOUT))
 	{
-		if (((uint16_t) sd_spi_millis() - timeout_start) > SD_READ_TIMEOUT)
-		{
-			return sd_spi_card_status();
-	    }
+		sd_spi_unselect_card();
+		return SD_ERR_ERASE_TIMEOUT;
 	}
 
-	uint8_t c_size_high;
-	uint8_t c_size_mid;
-	uint8_t c_size_low;
-	uint32_t number_of_blocks;
+	sd_spi_unselect_card();
+
+	/* The erased blocks show the erased value of the card. */
+	if ((response = sd_spi_probe_erased_value(start_block_address)))
+	{
+		return response;
+	}
+
+	sd_spi_end_erase(start_block_address, end_block_address);
+
+	return SD_ERR_OK;
+}
+
+int8_t
+sd_spi_mark_erased(
+	uint32_t 	start_block_address,
+	uint32_t 	num_blocks
+)
+{
+#if SD_SPI_MAX_ERASED_EXTENTS > 0
+	if (num_blocks == 0)
+	{
+		return SD_ERR_OK;
+	}
+
+	int8_t response;
+	if ((response = sd_spi_probe_erased_value(start_block_address)))
+	{
+		return response;
+	}
+
+	sd_spi_add_erased(start_block_address, num_blocks);
+#endif
+
+	return SD_ERR_OK;
+}
+
+int8_t
+sd_spi_queue_erase(
+	uint32_t 	start_block_address,
+	uint32_t 	end_block_address
+)
+{
+#if SD_SPI_MAX_QUEUED_ERASES > 0
+	if (card->num_queued_erases == SD_SPI_MAX_QUEUED_ERASES)
+	{
+		return SD_ERR_ERASE_QUEUE_FULL;
+	}
+
+	sd_spi_block_range_t *range =
+		&card->queued_erases[card->num_queued_erases++];
+	range->start_block_address = start_block_address;
+	range->num_blocks = end_block_address - start_block_address + 1;
+
+	return SD_ERR_OK;
+#else
+	return sd_spi_erase_blocks(start_block_address, end_block_address);
+#endif
+}
+
+uint8_t
+sd_spi_pending_erases(
+	void
+)
+{
+#if SD_SPI_MAX_QUEUED_ERASES > 0
+	return card->num_queued_erases;
+#else
+	return 0;
+#endif
+}
+
+int8_t
+sd_spi_finish_erases(
+	void
+)
+{
+#if SD_SPI_MAX_QUEUED_ERASES > 0
+	if (card->num_queued_erases > 0 && card->is_read_write_continuous)
+	{
+		return SD_ERR_READ_WRITE_CONTINUOUS;
+	}
+
+	return sd_spi_run_erase_queue(1);
+#else
+	return SD_ERR_OK;
+#endif
+}
+
+uint32_t
+sd_spi_card_size(
+	void
+)
+{
+	if (sd_spi_send_byte_command(SD_CMD_SEND_CSD, 0))
+	{
+		sd_spi_unselect_card();
+		return SD_ERR_READ_REGISTER;
+	}
+
+	uint16_t timeout_start = sd_spi_millis();
+
+	while (sd_spi_receive_byte() != SD_TOKEN_START_BLOCK)
+	{
+		if (((uint16_t) sd_spi_millis() - timeout_start) > SD_READ_TIMEOUT)
+		{
+			return sd_spi_card_status();
+	    }
+	}
+
+	uint8_t c_size_high;
+	uint8_t c_size_mid;
+	uint8_t c_size_low;
+	uint32_t number_of_blocks;
 
 	uint8_t b = sd_spi_receive_byte();
 	uint8_t csd_structure = b >> 6;
@@ -857,6 +2110,27 @@ sd_spi_card_size(
 	return number_of_blocks;
 }
 
+uint32_t
+sd_spi_au_blocks(
+	void
+)
+{
+	/* AU sizes double from 16KB up to 4MB and then follow a table. */
+	static const uint8_t large_au_sizes[6] = {16, 24, 32, 48, 64, 128};
+	uint8_t au_size = card->sd_status.au_size;
+
+	if (au_size == 0)
+	{
+		return 0;
+	}
+	else if (au_size <= 9)
+	{
+		return (uint32_t) 32 << (au_size - 1);
+	}
+
+	return (uint32_t) large_au_sizes[au_size - 10] << 10;
+}
+
 int8_t
 sd_spi_read_cid_register(
 	sd_spi_cid_t *cid
@@ -1015,6 +2289,125 @@ sd_spi_read_csd_register(
 	return SD_ERR_OK;
 }
 
+int8_t
+sd_spi_read_sd_status_register(
+	sd_spi_sd_status_t *sd_status
+)
+{
+	if (spi_send_byte_app_command(SD_ACMD_STATUS, 0))
+	{
+		sd_spi_unselect_card();
+		return SD_ERR_READ_REGISTER;
+	}
+
+	/* The second byte of the R2 response. */
+	sd_spi_receive_byte();
+
+	uint16_t timeout_start = sd_spi_millis();
+
+	while (sd_spi_receive_byte() != SD_TOKEN_START_BLOCK)
+	{
+		if (((uint16_t) sd_spi_millis() - timeout_start) > SD_READ_TIMEOUT)
+		{
+			return sd_spi_card_status();
+	    }
+	}
+
+	/* See SD Specification for more information. */
+	uint8_t b = sd_spi_receive_byte();
+	sd_status->dat_bus_width = b >> 6;
+	sd_status->secured_mode = b >> 5;
+	sd_spi_receive_byte();
+	b = sd_spi_receive_byte();
+	sd_status->sd_card_type = (uint16_t) b << 8;
+	b = sd_spi_receive_byte();
+	sd_status->sd_card_type |= b;
+
+	sd_status->size_of_protected_area = 0;
+
+	uint8_t i;
+	for (i = 0; i < 4; i++)
+	{
+		sd_status->size_of_protected_area =
+			(sd_status->size_of_protected_area << 8) | sd_spi_receive_byte();
+	}
+
+	b = sd_spi_receive_byte();
+	sd_status->speed_class = b;
+	b = sd_spi_receive_byte();
+	sd_status->performance_move = b;
+	b = sd_spi_receive_byte();
+	sd_status->au_size = b >> 4;
+	b = sd_spi_receive_byte();
+	sd_status->erase_size = (uint16_t) b << 8;
+	b = sd_spi_receive_byte();
+	sd_status->erase_size |= b;
+	b = sd_spi_receive_byte();
+	sd_status->erase_timeout = b >> 2;
+	sd_status->erase_offset = b;
+	b = sd_spi_receive_byte();
+	sd_status->uhs_speed_grade = b >> 4;
+	sd_status->uhs_au_size = b;
+
+	/* Discard the reserved bytes and the CRC. */
+	for (i = 15; i < 64 + 2; i++)
+	{
+		sd_spi_receive_byte();
+	}
+
+	sd_spi_unselect_card();
+	return SD_ERR_OK;
+}
+
+int8_t
+sd_spi_read_scr_register(
+	sd_spi_scr_t *scr
+)
+{
+	if (spi_send_byte_app_command(SD_ACMD_SEND_SCR, 0))
+	{
+		sd_spi_unselect_card();
+		return SD_ERR_READ_REGISTER;
+	}
+
+	uint16_t timeout_start = sd_spi_millis();
+
+	while (sd_spi_receive_byte() != SD_TOKEN_START_BLOCK)
+	{
+		if (((uint16_t) sd_spi_millis() - timeout_start) > SD_READ_TIMEOUT)
+		{
+			return sd_spi_card_status();
+	    }
+	}
+
+	/* See SD Specification for more information. */
+	uint8_t b = sd_spi_receive_byte();
+	scr->scr_structure = b >> 4;
+	scr->sd_spec = b;
+	b = sd_spi_receive_byte();
+	scr->data_stat_after_erase = b >> 7;
+	scr->sd_security = b >> 4;
+	scr->sd_bus_widths = b;
+	b = sd_spi_receive_byte();
+	scr->sd_spec3 = b >> 7;
+	scr->ex_security = b >> 3;
+	scr->sd_spec4 = b >> 2;
+	scr->sd_specx = (b & 0x03) << 2;
+	b = sd_spi_receive_byte();
+	scr->sd_specx |= b >> 6;
+	scr->cmd_support = b;
+
+	/* Discard the reserved bytes and the CRC. */
+	uint8_t i;
+	for (i = 4; i < 8 + 2; i++)
+	{
+		sd_spi_receive_byte();
+	}
+
+	sd_spi_unselect_card();
+	return SD_ERR_OK;
+}
+
 int8_t
 sd_spi_card_status(
 	void
@@ -1032,7 +2425,7 @@ sd_spi_card_type(
 	void
 )
 {
-	return card.card_type;
+	return card->card_type;
 }
 
 uint32_t
@@ -1040,7 +2433,29 @@ sd_spi_current_buffered_block(
 		void
 )
 {
-	return card.buffered_block_address;
+	return card->buffered_block_address;
+}
+
+void
+sd_spi_use_card(
+	sd_spi_card_t *new_card
+)
+{
+	/* Release the bus before another card is addressed. */
+	if (!card->is_chip_select_high)
+	{
+		sd_spi_unselect_card();
+	}
+
+	card = (new_card == NULL) ? &default_card : new_card;
+}
+
+sd_spi_card_t *
+sd_spi_current_card(
+	void
+)
+{
+	return card;
 }
 
 static void
@@ -1050,12 +2465,14 @@ sd_spi_clear_buffer(
 {
 #if defined(SD_SPI_BUFFER)
 	uint16_t i;
-	for (i = 0; i < 512; i++) {
-		card.sd_spi_buffer[i] = 0;
+	for (i = 0; i < card->page_size; i++) {
+		card->sd_spi_buffer[i] = 0;
 	}
 
-	card.is_buffer_written = 0;
-	card.is_buffer_current = 0;
+	card->is_buffer_written = 0;
+	card->is_buffer_current = 0;
+	card->written_start = 0;
+	card->written_end = 0;
 #endif
 }
 
@@ -1067,86 +2484,147 @@ sd_spi_write_out_data(
 	uint16_t 	byte_offset
 )
 {
+	uint8_t blocks_per_page = card->page_size >> 9;
+
+#if SD_SPI_MAX_ERASED_EXTENTS > 0
+	sd_spi_remove_erased(block_address * blocks_per_page, blocks_per_page);
+#endif
+
 	sd_spi_select_card();
 
-	if (card.is_read_write_continuous)
+	if (!card->is_read_write_continuous)
 	{
-		/* Wait for card to complete the previous write. */
-	  	if (sd_spi_wait_if_busy(SD_WRITE_TIMEOUT))
-	  	{
-	  		sd_spi_unselect_card();
-	  		return SD_ERR_WRITE_TIMEOUT;
-	  	}
+		block_address *= blocks_per_page;
 
-		/* Send token for multiple block write. */
-	  	sd_spi_send_byte(SD_TOKEN_MULTIPLE_WRITE_START_BLOCK);
-	}
-	else
-	{
 		/* SD cards 2GB or less address by bytes so multiply by 512 to address
 	  	   by blocks. */
-		if (card.card_type != SD_CARD_TYPE_SDHC)
+		if (card->card_type != SD_CARD_TYPE_SDHC)
 		{
 			block_address <<= 9;
 		}
 
-		/* Send the command to start writing a single block. */
-		if (sd_spi_send_byte_command(SD_CMD_SET_WRITE_BLOCK, block_address))
+		if (blocks_per_page == 1)
 		{
-			sd_spi_unselect_card();
-			return SD_ERR_WRITE_FAILURE;
+			/* Send the command to start writing a single block. */
+			if (sd_spi_send_byte_command(SD_CMD_SET_WRITE_BLOCK, block_address))
+			{
+				sd_spi_unselect_card();
+				return SD_ERR_WRITE_FAILURE;
+			}
+		}
+		else
+		{
+			/* The blocks of a page are written with a multiple block write
+			   and are pre-erased together. */
+			if (spi_send_byte_app_command(SD_ACMD_SET_WR_BLK_ERASE_COUNT,
+										  blocks_per_page) ||
+				sd_spi_send_byte_command(SD_CMD_WRITE_MULTIPLE_BLOCK,
+										 block_address))
+			{
+				sd_spi_unselect_card();
+				return SD_ERR_WRITE_FAILURE;
+			}
 		}
-
-		/* Send token for single block write. */
-		sd_spi_send_byte(SD_TOKEN_START_BLOCK);
 	}
 
-	uint16_t i;
+	uint8_t is_multiple_block_write = card->is_read_write_continuous ||
+									  blocks_per_page > 1;
+	uint16_t data_end = byte_offset + number_of_bytes;
+	uint16_t block_start = 0;
+	int8_t response = SD_ERR_OK;
+	uint8_t block;
 
-	/* Pad data with 0. */
-	for (i = 0; i < byte_offset; i++)
+	for (block = 0; block < blocks_per_page && !response; block++)
 	{
-		sd_spi_send_byte(0);
-	}
+		if (is_multiple_block_write)
+		{
+			/* Wait for card to complete the previous write. */
+		  	if (sd_spi_wait_if_busy(SD_WRITE_TIMEOUT))
+		  	{
+		  		if (card->is_read_write_continuous)
+		  		{
+		  			return sd_spi_stop_failed_write(SD_ERR_WRITE_TIMEOUT);
+		  		}
+
+		  		sd_spi_unselect_card();
+		  		return SD_ERR_WRITE_TIMEOUT;
+		  	}
+
+			/* Send token for multiple block write. */
+		  	sd_spi_send_byte(SD_TOKEN_MULTIPLE_WRITE_START_BLOCK);
+		}
+		else
+		{
+			/* Send token for single block write. */
+			sd_spi_send_byte(SD_TOKEN_START_BLOCK);
+		}
 
-	/* Write block. */
-	for (i = byte_offset; i < byte_offset + number_of_bytes; i++)
-	{
-		sd_spi_send_byte(((uint8_t *) data)[i - byte_offset]);
-	}
+		uint16_t block_end = block_start + 512;
+		uint16_t i;
 
-	/* Pad data with 0. */
-	for (i = byte_offset + number_of_bytes; i < 512; i++)
-	{
-		sd_spi_send_byte(0);
-	}	
+		/* Pad data with 0. */
+		for (i = block_start; i < byte_offset && i < block_end; i++)
+		{
+			sd_spi_send_byte(0);
+		}
 
-	/* Send dummy CRC. */
-	sd_spi_send_byte(0xFF);
-	sd_spi_send_byte(0xFF);
+		/* Write block. */
+		uint16_t data_stop = data_end < block_end ? data_end : block_end;
 
-	/* Check if write was successful. */
-	switch (sd_spi_receive_byte() & 0x0F)
-	{
-		case SD_TOKEN_DATA_REJECTED_CRC:
-			return SD_ERR_WRITE_DATA_CRC_REJECTED;
-		case SD_TOKEN_DATA_REJECTED_WRITE_ERR:
-			return SD_ERR_WRITE_DATA_REJECTED;
-		case SD_TOKEN_DATA_ACCEPTED:
-			break;
-		default:
-			return SD_ERR_WRITE_FAILURE;
+		if (i < data_stop)
+		{
+			sd_spi_transfer_data((uint8_t *) data + (i - byte_offset), NULL,
+								 data_stop - i);
+			i = data_stop;
+		}
+
+		/* Pad data with 0. */
+		for (; i < block_end; i++)
+		{
+			sd_spi_send_byte(0);
+		}
+
+		/* Send dummy CRC. */
+		sd_spi_send_byte(0xFF);
+		sd_spi_send_byte(0xFF);
+
+		/* Check if write was successful. */
+		switch (sd_spi_receive_byte() & 0x0F)
+		{
+			case SD_TOKEN_DATA_REJECTED_CRC:
+				response = SD_ERR_WRITE_DATA_CRC_REJECTED;
+				break;
+			case SD_TOKEN_DATA_REJECTED_WRITE_ERR:
+				response = SD_ERR_WRITE_DATA_REJECTED;
+				break;
+			case SD_TOKEN_DATA_ACCEPTED:
+				break;
+			default:
+				response = SD_ERR_WRITE_FAILURE;
+				break;
+		}
+
+		block_start = block_end;
 	}
 
-	if (card.is_read_write_continuous)
+	if (card->is_read_write_continuous)
 	{
-		card.continuous_block_address++;
+		if (response)
+		{
+			return sd_spi_stop_failed_write(response);
+		}
+
+		card->continuous_block_address++;
 
 #if defined(SD_SPI_BUFFER)
-		card.buffered_block_address = card.continuous_block_address;
+		card->buffered_block_address = card->continuous_block_address;
 #endif
+
+		return SD_ERR_OK;
 	}
-	else {
+
+	if (blocks_per_page > 1)
+	{
 		/* Wait for card to complete the write. */
 	  	if (sd_spi_wait_if_busy(SD_WRITE_TIMEOUT))
 	  	{
@@ -1154,97 +2632,315 @@ sd_spi_write_out_data(
 	  		return SD_ERR_WRITE_TIMEOUT;
 	  	}
 
-	  	return sd_spi_card_status();
+		/* Token is sent to signal card to stop multiple block writing. */
+		sd_spi_send_byte(SD_TOKEN_MULTIPLE_WRITE_STOP_TRANSFER);
+	}
+	else if (response && card->status_check != SD_SPI_STATUS_CHECK_ON_ERROR)
+	{
+		return response;
 	}
 
-	return SD_ERR_OK;
+	/* When the status is not read right away, the card is left to finish
+	   the write with chip select high and the next command waits for it. */
+	if (!response && card->status_check != SD_SPI_STATUS_CHECK_ALWAYS)
+	{
+		card->is_write_in_progress = 1;
+		return sd_spi_check_write_status(response);
+	}
+
+	/* Wait for card to complete the write. */
+  	if (sd_spi_wait_if_busy(SD_WRITE_TIMEOUT))
+  	{
+  		sd_spi_unselect_card();
+  		return SD_ERR_WRITE_TIMEOUT;
+  	}
+
+	return sd_spi_check_write_status(response);
 }
 
 static int8_t
-sd_spi_read_in_data(
-	uint32_t 	block_address,
-	void	 	*data_buffer,
-	uint16_t 	number_of_bytes,
-	uint16_t 	byte_offset
+sd_spi_stop_failed_write(
+	int8_t	error
 )
 {
+	uint32_t num_blocks = 0;
+
 	sd_spi_select_card();
+	card->is_read_write_continuous = 0;
 
-	if (!card.is_read_write_continuous)
+	/* In SPI mode, a multiple block write is stopped with the stop token
+	   instead of CMD12. The status command clears the error on the card. */
+	if (!sd_spi_wait_if_busy(SD_WRITE_TIMEOUT))
 	{
-		/* SD cards 2GB or less address by bytes so multiply by 512 to address
-		   by blocks. */
-		if (card.card_type != SD_CARD_TYPE_SDHC)
+		sd_spi_send_byte(SD_TOKEN_MULTIPLE_WRITE_STOP_TRANSFER);
+
+		if (!sd_spi_wait_if_busy(SD_WRITE_TIMEOUT))
 		{
-			block_address <<= 9;
+			sd_spi_card_status();
+			sd_spi_read_num_written_blocks(&num_blocks);
 		}
+	}
 
-		/* Start single block reading. */
-	    if (sd_spi_send_byte_command(SD_CMD_READ_SINGLE_BLOCK, block_address))
-	    {
-	    	sd_spi_unselect_card();
-	    	return SD_ERR_READ_FAILURE;
-	    }
+	sd_spi_unselect_card();
+
+	/* A partly written page is written again when the write is resumed. */
+	card->num_well_written_blocks = num_blocks;
+	card->continuous_block_address = card->continuous_start_block_address +
+									 num_blocks / (card->page_size >> 9);
+
+#if defined(SD_SPI_BUFFER)
+#if SD_SPI_NUM_BUFFERS > 1
+	card->queued_buffer_index = 0;
+	card->num_queued_buffers = 0;
+	card->sd_spi_buffer = card->block_buffers[0];
+#endif
+	sd_spi_clear_buffer();
+	card->is_buffer_written = 1;
+	card->buffered_block_address = card->continuous_block_address;
+#endif
+
+	return error;
+}
+
+static int8_t
+sd_spi_stop_failed_stream(
+	int8_t	error
+)
+{
+	sd_spi_stop_failed_write(error);
+	card->continuous_block_address = card->continuous_start_block_address +
+									 card->num_well_written_blocks;
+
+	return error;
+}
+
+static int8_t
+sd_spi_read_num_written_blocks(
+	uint32_t	*num_blocks
+)
+{
+	if (spi_send_byte_app_command(SD_ACMD_SEND_NUM_WR_BLOCKS, 0))
+	{
+		sd_spi_unselect_card();
+		return SD_ERR_READ_REGISTER;
 	}
 
 	uint16_t timeout_start = sd_spi_millis();
 
-    /* Must wait for read token from card before reading. */
 	while (sd_spi_receive_byte() != SD_TOKEN_START_BLOCK)
 	{
 		if (((uint16_t) sd_spi_millis() - timeout_start) > SD_READ_TIMEOUT)
 		{
-	    	return sd_spi_card_status();
+			sd_spi_unselect_card();
+			return SD_ERR_READ_TIMEOUT;
 	    }
 	}
 
-	uint16_t i;
+	/* The count is sent most significant byte first. */
+	*num_blocks = 0;
 
-#if defined(SD_SPI_BUFFER)	/* Read block into sd_spi_buffer if it is defined. */
-	/* Read in the bytes to the buffer. */
-	for (i = 0; i < 512; i++)
+	uint8_t i;
+	for (i = 0; i < 4; i++)
 	{
-		card.sd_spi_buffer[i] = sd_spi_receive_byte();
+		*num_blocks = (*num_blocks << 8) | sd_spi_receive_byte();
 	}
 
-	/* Throw out CRC. */
+	/* Discard the CRC. */
 	sd_spi_receive_byte();
 	sd_spi_receive_byte();
 
-	if (card.is_read_write_continuous)
+	sd_spi_unselect_card();
+	return SD_ERR_OK;
+}
+
+static int8_t
+sd_spi_check_write_status(
+	int8_t	response
+)
+{
+	if (card->status_check == SD_SPI_STATUS_CHECK_ALWAYS ||
+		(card->status_check == SD_SPI_STATUS_CHECK_ON_ERROR && response))
 	{
-		card.continuous_block_address++;
-		card.buffered_block_address = card.continuous_block_address;
+		int8_t status = sd_spi_card_status();
+
+		return response ? response : status;
 	}
-	else
+
+	/* The errors stay in the status of the card until it is read. */
+	if (card->status_check == SD_SPI_STATUS_CHECK_AT_SYNC)
+	{
+		card->is_status_check_pending = 1;
+	}
+
+	card->num_status_checks_skipped++;
+	sd_spi_unselect_card();
+
+	return response;
+}
+
+static int8_t
+sd_spi_read_in_data(
+	uint32_t 	block_address,
+	void	 	*data_buffer,
+	uint16_t 	number_of_bytes,
+	uint16_t 	byte_offset
+)
+{
+	uint8_t blocks_per_page = card->page_size >> 9;
+
+#if SD_SPI_MAX_ERASED_EXTENTS > 0
+	/* Erased pages are filled in without reading them from the card. */
+	if (!card->is_read_write_continuous &&
+		sd_spi_is_erased(block_address * blocks_per_page, blocks_per_page))
+	{
+#if defined(SD_SPI_BUFFER)
+		/* Bytes that were written to the buffer are kept. */
+		memset(card->sd_spi_buffer, card->erased_value, card->written_start);
+		memset(card->sd_spi_buffer + card->written_end, card->erased_value,
+			   card->page_size - card->written_end);
+		card->buffered_block_address = block_address;
+		card->is_buffer_current = 1;
+#else
+		memset(data_buffer, card->erased_value, number_of_bytes);
+#endif
+		card->num_erased_blocks_read += blocks_per_page;
+
+		return SD_ERR_OK;
+	}
+#endif
+
+	sd_spi_select_card();
+
+	if (!card->is_read_write_continuous)
 	{
-		if (card.card_type != SD_CARD_TYPE_SDHC)
+		uint32_t card_address = block_address * blocks_per_page;
+
+		/* SD cards 2GB or less address by bytes so multiply by 512 to address
+		   by blocks. */
+		if (card->card_type != SD_CARD_TYPE_SDHC)
 		{
-			block_address >>= 9;
+			card_address <<= 9;
 		}
 
-		card.buffered_block_address = block_address;
+		/* Start single block reading or multiple block reading for the blocks
+		   of a page. */
+	    if (sd_spi_send_byte_command(blocks_per_page == 1 ?
+	    							 SD_CMD_READ_SINGLE_BLOCK :
+	    							 SD_CMD_READ_MULTIPLE_BLOCK, card_address))
+	    {
+	    	sd_spi_unselect_card();
+	    	return SD_ERR_READ_FAILURE;
+	    }
 	}
 
-	card.is_buffer_current = 1;
-#else
-    /* Throw out the bytes until the offset is reached. */
-	for (i = 0; i < byte_offset; i++)
+	uint16_t block_start = 0;
+	uint8_t block;
+
+	for (block = 0; block < blocks_per_page; block++)
 	{
+		uint16_t timeout_start = sd_spi_millis();
+
+	    /* Must wait for read token from card before reading. */
+		while (sd_spi_receive_byte() != SD_TOKEN_START_BLOCK)
+		{
+			if (((uint16_t) sd_spi_millis() - timeout_start) > SD_READ_TIMEOUT)
+			{
+		    	return sd_spi_card_status();
+		    }
+		}
+
+		uint16_t block_end = block_start + 512;
+
+#if defined(SD_SPI_BUFFER)	/* Read block into sd_spi_buffer if it is defined. */
+		/* Read in the bytes to the buffer. Bytes that were written to the
+		   buffer before the block was read in are kept. */
+		uint16_t i = block_start;
+		uint16_t kept_start = card->written_start;
+		uint16_t kept_end = card->written_end;
+
+		if (kept_start < i)
+		{
+			kept_start = i;
+		}
+
+		if (kept_end > block_end)
+		{
+			kept_end = block_end;
+		}
+
+		if (kept_start < kept_end)
+		{
+			sd_spi_receive_bytes(card->sd_spi_buffer + i, kept_start - i);
+			sd_spi_receive_bytes(NULL, kept_end - kept_start);
+			i = kept_end;
+		}
+
+		sd_spi_transfer_data(NULL, card->sd_spi_buffer + i, block_end - i);
+#else
+		uint16_t data_start = byte_offset;
+		uint16_t data_stop = byte_offset + number_of_bytes;
+
+		if (data_start < block_start)
+		{
+			data_start = block_start;
+		}
+
+		if (data_start > block_end)
+		{
+			data_start = block_end;
+		}
+
+		if (data_stop < data_start)
+		{
+			data_stop = data_start;
+		}
+
+		if (data_stop > block_end)
+		{
+			data_stop = block_end;
+		}
+
+	    /* Throw out the bytes until the offset is reached. */
+		sd_spi_receive_bytes(NULL, data_start - block_start);
+
+		/* Read in the bytes to the buffer. */
+		sd_spi_transfer_data(NULL,
+							 (uint8_t *) data_buffer +
+							 (data_start - byte_offset),
+							 data_stop - data_start);
+
+		/* Throw out any remaining bytes in the block. */
+		sd_spi_receive_bytes(NULL, block_end - data_stop);
+#endif
+
+		/* Throw out CRC. */
+		sd_spi_receive_byte();
 		sd_spi_receive_byte();
+
+		block_start = block_end;
 	}
 
-	/* Read in the bytes to the buffer. */
-	for (i = 0; i < number_of_bytes; i++)
+	if (!card->is_read_write_continuous && blocks_per_page > 1)
 	{
-		((uint8_t *) data_buffer)[i] = sd_spi_receive_byte();
+		int8_t response;
+		if ((response = sd_spi_read_continuous_stop()))
+		{
+			return response;
+		}
 	}
 
-	/* Throw out any remaining bytes in the page plus CRC. */
-    for (i = 0; number_of_bytes + byte_offset + i < 514; i++)
-    {
-    	sd_spi_receive_byte();
-    }
+#if defined(SD_SPI_BUFFER)
+	if (card->is_read_write_continuous)
+	{
+		card->continuous_block_address++;
+		card->buffered_block_address = card->continuous_block_address;
+	}
+	else
+	{
+		card->buffered_block_address = block_address;
+	}
+
+	card->is_buffer_current = 1;
 #endif
 
 	return SD_ERR_OK;
@@ -1256,7 +2952,24 @@ sd_spi_send_byte_command(
 	uint32_t 	argument
 )
 {
+#if SD_SPI_MAX_QUEUED_ERASES > 0
+	/* The card only takes commands again once a queued erase is done. */
+	if (card->is_erase_in_progress)
+	{
+		sd_spi_wait_for_queued_erase();
+	}
+#endif
+
 	sd_spi_select_card();
+
+	/* The card only takes commands again once a write that returned early is
+	   done. */
+	if (card->is_write_in_progress)
+	{
+		card->is_write_in_progress = 0;
+		sd_spi_wait_if_busy(SD_WRITE_TIMEOUT);
+	}
+
 	sd_spi_receive_byte();
 
 	/* Send command with transmission bit. */
@@ -1421,18 +3134,790 @@ sd_spi_r2_error(
 	return SD_ERR_OK;
 }
 
+#if defined(SD_SPI_BUFFER)
+static int8_t
+sd_spi_fetch_buffer(
+	void
+)
+{
+	/* The written bytes are skipped by sd_spi_read_in_data() and stay in the
+	   range of changed bytes. */
+	int8_t response = sd_spi_read_in_data(card->buffered_block_address,
+										  card->sd_spi_buffer, card->page_size,
+										  0);
+	sd_spi_unselect_card();
+
+	return response;
+}
+#endif
+
+static int8_t
+sd_spi_read_blocks_direct(
+	uint32_t	block_address,
+	uint8_t		*data_buffer,
+	uint32_t	num_blocks
+)
+{
+#if SD_SPI_MAX_ERASED_EXTENTS > 0
+	if (sd_spi_is_erased(block_address, num_blocks))
+	{
+		memset(data_buffer, card->erased_value, num_blocks << 9);
+		card->num_erased_blocks_read += num_blocks;
+
+		return SD_ERR_OK;
+	}
+#endif
+
+	/* SD cards 2GB or less address by bytes so multiply by 512 to address
+	   by blocks. */
+	if (card->card_type != SD_CARD_TYPE_SDHC)
+	{
+		block_address <<= 9;
+	}
+
+	/* Start multiple block reading. */
+	if (sd_spi_send_byte_command(SD_CMD_READ_MULTIPLE_BLOCK, block_address))
+	{
+		sd_spi_unselect_card();
+		return SD_ERR_READ_FAILURE;
+	}
+
+	card->is_read_write_continuous = 1;
+	card->is_write_continuous = 0;
+
+	uint32_t i;
+	for (i = 0; i < num_blocks; i++)
+	{
+		uint16_t timeout_start = sd_spi_millis();
+
+		/* Must wait for read token from card before reading. */
+		while (sd_spi_receive_byte() != SD_TOKEN_START_BLOCK)
+		{
+			if (((uint16_t) sd_spi_millis() - timeout_start) > SD_READ_TIMEOUT)
+			{
+				card->is_read_write_continuous = 0;
+				return sd_spi_card_status();
+			}
+		}
+
+		sd_spi_transfer_data(NULL, data_buffer, 512);
+		data_buffer += 512;
+
+		/* Throw out CRC. */
+		sd_spi_receive_byte();
+		sd_spi_receive_byte();
+	}
+
+	return sd_spi_read_continuous_stop();
+}
+
+static int8_t
+sd_spi_write_blocks_direct(
+	uint32_t	block_address,
+	uint8_t		*data,
+	uint32_t	num_blocks
+)
+{
+#if SD_SPI_MAX_ERASED_EXTENTS > 0
+	sd_spi_remove_erased(block_address, num_blocks);
+#endif
+
+	uint32_t start_block_address = block_address;
+
+	/* SD cards 2GB or less address by bytes so multiply by 512 to address
+	   by blocks. */
+	if (card->card_type != SD_CARD_TYPE_SDHC)
+	{
+		start_block_address <<= 9;
+	}
+
+	/* All of the blocks are known, so they are pre-erased. */
+	if (spi_send_byte_app_command(SD_ACMD_SET_WR_BLK_ERASE_COUNT, num_blocks))
+	{
+		sd_spi_unselect_card();
+		return SD_ERR_WRITE_PRE_ERASE;
+	}
+
+	/* Start multiple block write. */
+	if (sd_spi_send_byte_command(SD_CMD_WRITE_MULTIPLE_BLOCK, start_block_address))
+	{
+		sd_spi_unselect_card();
+		return SD_ERR_WRITE_FAILURE;
+	}
+
+	card->is_read_write_continuous = 1;
+	card->is_write_continuous = 1;
+	card->continuous_block_address = block_address;
+	card->continuous_start_block_address = block_address;
+
+	uint32_t i;
+	for (i = 0; i < num_blocks; i++)
+	{
+		/* Wait for card to complete the previous write. */
+		if (sd_spi_wait_if_busy(SD_WRITE_TIMEOUT))
+		{
+			return sd_spi_stop_failed_stream(SD_ERR_WRITE_TIMEOUT);
+		}
+
+		sd_spi_send_byte(SD_TOKEN_MULTIPLE_WRITE_START_BLOCK);
+
+		sd_spi_transfer_data(data, NULL, 512);
+		data += 512;
+
+		/* Send dummy CRC. */
+		sd_spi_send_byte(0xFF);
+		sd_spi_send_byte(0xFF);
+
+		/* Check if write was successful. */
+		int8_t data_response;
+
+		switch (sd_spi_receive_byte() & 0x0F)
+		{
+			case SD_TOKEN_DATA_ACCEPTED:
+				data_response = SD_ERR_OK;
+				break;
+			case SD_TOKEN_DATA_REJECTED_CRC:
+				data_response = SD_ERR_WRITE_DATA_CRC_REJECTED;
+				break;
+			case SD_TOKEN_DATA_REJECTED_WRITE_ERR:
+				data_response = SD_ERR_WRITE_DATA_REJECTED;
+				break;
+			default:
+				data_response = SD_ERR_WRITE_FAILURE;
+				break;
+		}
+
+		if (data_response)
+		{
+			return sd_spi_stop_failed_stream(data_response);
+		}
+
+		card->continuous_block_address++;
+	}
+
+	return sd_spi_write_continuous_stop();
+}
+
+static int8_t
+sd_spi_write_partial_page(
+	uint32_t	page_address,
+	void		*data,
+	uint16_t	number_of_bytes,
+	uint16_t	byte_offset
+)
+{
+#if defined(SD_SPI_BUFFER)
+	return sd_spi_write(page_address, data, number_of_bytes, byte_offset);
+#else
+	/* Without the buffer, only the blocks of the page that change are read,
+	   modified and written back. */
+	uint32_t block_address = page_address * (card->page_size >> 9) +
+							 (byte_offset >> 9);
+	uint8_t *source = data;
+	uint8_t block[512];
+	int8_t response;
+
+	byte_offset &= 511;
+
+	while (number_of_bytes > 0)
+	{
+		uint16_t block_bytes = 512 - byte_offset;
+
+		if (block_bytes > number_of_bytes)
+		{
+			block_bytes = number_of_bytes;
+		}
+
+		if ((response = sd_spi_read_blocks_direct(block_address, block, 1)))
+		{
+			return response;
+		}
+
+		memcpy(block + byte_offset, source, block_bytes);
+
+		if ((response = sd_spi_write_blocks_direct(block_address, block, 1)))
+		{
+			return response;
+		}
+
+		source += block_bytes;
+		number_of_bytes -= block_bytes;
+		byte_offset = 0;
+		block_address++;
+	}
+
+	return SD_ERR_OK;
+#endif
+}
+
+static uint16_t
+sd_spi_pull_stream_data(
+	sd_spi_write_stream_callback_t	callback,
+	void							*context,
+	uint32_t						block_address,
+	uint16_t						byte_offset,
+	uint8_t							*chunk
+)
+{
+	uint16_t max_bytes = 512 - byte_offset;
+
+	if (max_bytes > SD_SPI_STREAM_CHUNK_SIZE)
+	{
+		max_bytes = SD_SPI_STREAM_CHUNK_SIZE;
+	}
+
+	uint16_t number_of_bytes = callback(context, block_address, byte_offset,
+										chunk, max_bytes);
+
+	return number_of_bytes > max_bytes ? max_bytes : number_of_bytes;
+}
+
+static int8_t
+sd_spi_probe_erased_value(
+	uint32_t	block_address
+)
+{
+	if (card->is_erased_value_known)
+	{
+		return SD_ERR_OK;
+	}
+
+	uint8_t value;
+	int8_t response;
+	if ((response = sd_spi_read_stream(block_address, 1,
+									   sd_spi_probe_erased_value_callback,
+									   &value)))
+	{
+		return response;
+	}
+
+	card->erased_value = value;
+	card->is_erased_value_known = 1;
+
+	return SD_ERR_OK;
+}
+
+static uint8_t
+sd_spi_probe_erased_value_callback(
+	void		*context,
+	uint32_t	block_address,
+	uint16_t	byte_offset,
+	uint8_t		*data,
+	uint16_t	number_of_bytes
+)
+{
+	*(uint8_t *) context = data[0];
+
+	return 1;
+}
+
+#if SD_SPI_MAX_ERASED_EXTENTS > 0
+static void
+sd_spi_add_erased(
+	uint32_t	start_block_address,
+	uint32_t	num_blocks
+)
+{
+	uint32_t end_block_address = start_block_address + num_blocks;
+	uint8_t i = 0;
+
+	/* Merge the ranges that overlap or touch the new one into it. */
+	while (i < card->num_erased_extents)
+	{
+		sd_spi_block_range_t *extent = &card->erased_extents[i];
+		uint32_t extent_end = extent->start_block_address + extent->num_blocks;
+
+		if (extent->start_block_address > end_block_address ||
+			extent_end < start_block_address)
+		{
+			i++;
+			continue;
+		}
+
+		if (extent->start_block_address < start_block_address)
+		{
+			start_block_address = extent->start_block_address;
+		}
+
+		if (extent_end > end_block_address)
+		{
+			end_block_address = extent_end;
+		}
+
+		*extent = card->erased_extents[--card->num_erased_extents];
+	}
+
+	if (card->num_erased_extents == SD_SPI_MAX_ERASED_EXTENTS)
+	{
+		uint8_t smallest = 0;
+
+		for (i = 1; i < card->num_erased_extents; i++)
+		{
+			if (card->erased_extents[i].num_blocks <
+				card->erased_extents[smallest].num_blocks)
+			{
+				smallest = i;
+			}
+		}
+
+		if (card->erased_extents[smallest].num_blocks >=
+			end_block_address - start_block_address)
+		{
+			return;
+		}
+
+		card->erased_extents[smallest] =
+			card->erased_extents[--card->num_erased_extents];
+	}
+
+	sd_spi_block_range_t *extent =
+		&card->erased_extents[card->num_erased_extents++];
+	extent->start_block_address = start_block_address;
+	extent->num_blocks = end_block_address - start_block_address;
+}
+
+static void
+sd_spi_remove_erased(
+	uint32_t	start_block_address,
+	uint32_t	num_blocks
+)
+{
+	uint32_t end_block_address = start_block_address + num_blocks;
+	uint8_t i = 0;
+
+	while (i < card->num_erased_extents)
+	{
+		sd_spi_block_range_t *extent = &card->erased_extents[i];
+		uint32_t extent_start = extent->start_block_address;
+		uint32_t extent_end = extent_start + extent->num_blocks;
+
+		if (extent_start >= end_block_address ||
+			extent_end <= start_block_address)
+		{
+			i++;
+		}
+		else if (extent_start < start_block_address &&
+				 extent_end > end_block_address)
+		{
+			/* The written blocks split the range in two. If there is no room
+			   for both parts, the larger one is kept. */
+			if (card->num_erased_extents < SD_SPI_MAX_ERASED_EXTENTS)
+			{
+				sd_spi_block_range_t *tail =
+					&card->erased_extents[card->num_erased_extents++];
+				tail->start_block_address = end_block_address;
+				tail->num_blocks = extent_end - end_block_address;
+				extent->num_blocks = start_block_address - extent_start;
+			}
+			else if (extent_end - end_block_address >
+					 start_block_address - extent_start)
+			{
+				extent->start_block_address = end_block_address;
+				extent->num_blocks = extent_end - end_block_address;
+			}
+			else
+			{
+				extent->num_blocks = start_block_address - extent_start;
+			}
+
+			i++;
+		}
+		else if (extent_start < start_block_address)
+		{
+			extent->num_blocks = start_block_address - extent_start;
+			i++;
+		}
+		else if (extent_end > end_block_address)
+		{
+			extent->start_block_address = end_block_address;
+			extent->num_blocks = extent_end - end_block_address;
+			i++;
+		}
+		else
+		{
+			*extent = card->erased_extents[--card->num_erased_extents];
+		}
+	}
+}
+
+static uint8_t
+sd_spi_is_erased(
+	uint32_t	start_block_address,
+	uint32_t	num_blocks
+)
+{
+	uint8_t i;
+	for (i = 0; i < card->num_erased_extents; i++)
+	{
+		sd_spi_block_range_t *extent = &card->erased_extents[i];
+
+		if (start_block_address >= extent->start_block_address &&
+			start_block_address - extent->start_block_address + num_blocks <=
+			extent->num_blocks)
+		{
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int8_t
+sd_spi_read_stream_erased(
+	uint32_t						start_block_address,
+	uint32_t						num_blocks,
+	sd_spi_read_stream_callback_t	callback,
+	void							*context
+)
+{
+	uint8_t chunk[SD_SPI_STREAM_CHUNK_SIZE];
+	uint32_t block_address;
+
+	for (block_address = start_block_address;
+		 block_address < start_block_address + num_blocks;
+		 block_address++)
+	{
+		card->num_erased_blocks_read++;
+
+		uint16_t byte_offset;
+		for (byte_offset = 0; byte_offset < 512;
+			 byte_offset += SD_SPI_STREAM_CHUNK_SIZE)
+		{
+			uint16_t number_of_bytes = 512 - byte_offset;
+
+			if (number_of_bytes > SD_SPI_STREAM_CHUNK_SIZE)
+			{
+				number_of_bytes = SD_SPI_STREAM_CHUNK_SIZE;
+			}
+
+			/* The callback may have changed the chunk. */
+			memset(chunk, card->erased_value, number_of_bytes);
+
+			if (callback(context, block_address, byte_offset, chunk,
+						 number_of_bytes))
+			{
+				return SD_ERR_OK;
+			}
+		}
+	}
+
+	return SD_ERR_OK;
+}
+#endif
+
+static int8_t
+sd_spi_start_erase(
+	uint32_t	start_block_address,
+	uint32_t	end_block_address
+)
+{
+#if defined(SD_SPI_BUFFER)
+	int8_t response;
+	if ((response = sd_spi_flush()))
+	{
+		return response;
+	}
+
+	/* The buffer has to be read in again if its page is erased. */
+	uint32_t buffered_start = card->buffered_block_address *
+							  (card->page_size >> 9);
+	uint32_t buffered_end = buffered_start + (card->page_size >> 9) - 1;
+
+	if (buffered_start <= end_block_address &&
+		buffered_end >= start_block_address)
+	{
+		card->is_buffer_current = 0;
+	}
+#endif
+
+	/* SD cards 2GB or less address by bytes so multiply by 512 to address
+	   by blocks. */
+	if (card->card_type != SD_CARD_TYPE_SDHC)
+	{
+		start_block_address <<= 9;
+		end_block_address <<= 9;
+	}
+
+	/* The start and end address of the blocks to be erased must be sent to the
+	   SD and then the erase command is called. */
+	if (sd_spi_send_byte_command(SD_CMD_ERASE_WR_BLK_START, start_block_address) ||
+		sd_spi_send_byte_command(SD_CMD_ERASE_WR_BLK_END, end_block_address) ||
+		sd_spi_send_byte_command(SD_CMD_ERASE, 0))
+	{
+		sd_spi_unselect_card();
+		return SD_ERR_ERASE_FAILURE;
+	}
+
+	/* The card keeps erasing while it is deselected. */
+	sd_spi_unselect_card();
+
+	return SD_ERR_OK;
+}
+
+static void
+sd_spi_end_erase(
+	uint32_t	start_block_address,
+	uint32_t	end_block_address
+)
+{
+	if (!card->is_erased_value_known)
+	{
+		return;
+	}
+
+#if SD_SPI_MAX_ERASED_EXTENTS > 0
+	sd_spi_add_erased(start_block_address,
+					  end_block_address - start_block_address + 1);
+#endif
+
+#if defined(SD_SPI_BUFFER)
+	/* A clean buffer whose whole page was erased is filled in with the erased
+	   value instead of being read in again. */
+	uint32_t buffered_start = card->buffered_block_address *
+							  (card->page_size >> 9);
+	uint32_t buffered_end = buffered_start + (card->page_size >> 9) - 1;
+
+	if (card->is_buffer_written && buffered_start >= start_block_address &&
+		buffered_end <= end_block_address)
+	{
+		memset(card->sd_spi_buffer, card->erased_value, card->page_size);
+		card->is_buffer_current = 1;
+	}
+#endif
+}
+
+#if SD_SPI_MAX_QUEUED_ERASES > 0
+static void
+sd_spi_dequeue_erase(
+	sd_spi_block_range_t	*range
+)
+{
+	*range = card->queued_erases[0];
+	card->num_queued_erases--;
+	memmove(card->queued_erases, card->queued_erases + 1,
+			card->num_queued_erases * sizeof(sd_spi_block_range_t));
+}
+
+static int8_t
+sd_spi_wait_for_queued_erase(
+	void
+)
+{
+	card->is_erase_in_progress = 0;
+
+	sd_spi_select_card();
+
+	if (sd_spi_wait_if_busy(SD_ERASE_TIMEOUT))
+	{
+		/* The erase is dropped since the card did not finish it. */
+		sd_spi_block_range_t range;
+		sd_spi_dequeue_erase(&range);
+		sd_spi_unselect_card();
+		return SD_ERR_ERASE_TIMEOUT;
+	}
+
+	sd_spi_unselect_card();
+
+	card->is_erase_done = 1;
+
+	return SD_ERR_OK;
+}
+
+static int8_t
+sd_spi_record_queued_erase(
+	void
+)
+{
+	sd_spi_block_range_t range;
+	sd_spi_dequeue_erase(&range);
+	card->is_erase_done = 0;
+
+	int8_t response;
+	if ((response = sd_spi_probe_erased_value(range.start_block_address)))
+	{
+		return response;
+	}
+
+	sd_spi_end_erase(range.start_block_address,
+					 range.start_block_address + range.num_blocks - 1);
+
+	return SD_ERR_OK;
+}
+
+static int8_t
+sd_spi_run_erase_queue(
+	uint8_t	is_waiting
+)
+{
+	int8_t response;
+
+	while (card->num_queued_erases > 0 && !card->is_read_write_continuous)
+	{
+		if (card->is_erase_in_progress)
+		{
+			/* Leave the erase in progress if the card is still busy. */
+			if (!is_waiting)
+			{
+				sd_spi_select_card();
+				uint8_t is_busy = sd_spi_receive_byte() != 0xFF;
+				sd_spi_unselect_card();
+
+				if (is_busy)
+				{
+					return SD_ERR_OK;
+				}
+			}
+
+			if ((response = sd_spi_wait_for_queued_erase()))
+			{
+				return response;
+			}
+		}
+
+		if (card->is_erase_done)
+		{
+			if ((response = sd_spi_record_queued_erase()))
+			{
+				return response;
+			}
+
+			continue;
+		}
+
+		sd_spi_block_range_t *range = &card->queued_erases[0];
+
+		if ((response = sd_spi_start_erase(range->start_block_address,
+										   range->start_block_address +
+										   range->num_blocks - 1)))
+		{
+			/* The erase is dropped so that it does not hold up the ones behind
+			   it. */
+			sd_spi_block_range_t failed_range;
+			sd_spi_dequeue_erase(&failed_range);
+
+			return response;
+		}
+
+		card->is_erase_in_progress = 1;
+	}
+
+	return SD_ERR_OK;
+}
+#endif
+
+#if defined(SD_SPI_BUFFER) && SD_SPI_NUM_BUFFERS > 1
+static int8_t
+sd_spi_write_queued_buffer(
+	void
+)
+{
+	int8_t response = sd_spi_write_out_data(card->continuous_block_address,
+											card->block_buffers[
+												card->queued_buffer_index],
+											card->page_size, 0);
+	sd_spi_unselect_card();
+
+	/* A failed write stopped the continuous write and emptied the queue. */
+	if (!card->is_read_write_continuous)
+	{
+		return response;
+	}
+
+	card->queued_buffer_index = (card->queued_buffer_index + 1) %
+								SD_SPI_NUM_BUFFERS;
+	card->num_queued_buffers--;
+
+	/* The buffer in use holds the block after the queued ones. */
+	card->buffered_block_address = card->continuous_block_address +
+								   card->num_queued_buffers;
+
+	return response;
+}
+#endif
+
+static void
+sd_spi_transfer_data(
+	const uint8_t	*tx,
+	uint8_t			*rx,
+	uint16_t		number_of_bytes
+)
+{
+#if defined(SD_SPI_PLATFORM_DMA)
+	if (number_of_bytes >= SD_SPI_DMA_MIN_BYTES)
+	{
+		sd_spi_store_dma_done(0);
+
+		if (sd_spi_dma_transfer(tx, rx, number_of_bytes, sd_spi_dma_done))
+		{
+			while (!sd_spi_load_dma_done());
+			return;
+		}
+	}
+#endif
+
+	if (tx != NULL)
+	{
+		sd_spi_send_bytes(tx, number_of_bytes);
+	}
+	else
+	{
+		sd_spi_receive_bytes(rx, number_of_bytes);
+	}
+}
+
+#if defined(SD_SPI_PLATFORM_DMA)
+static void
+sd_spi_dma_done(
+	void
+)
+{
+	sd_spi_store_dma_done(1);
+}
+
+static uint8_t
+sd_spi_load_dma_done(
+	void
+)
+{
+#if !defined(__AVR__) && defined(__ATOMIC_ACQUIRE)
+	return __atomic_load_n(&is_dma_done, __ATOMIC_ACQUIRE);
+#else
+	uint8_t value = is_dma_done;
+
+#if defined(__GNUC__)
+	/* The received bytes must not be read before the flag. */
+	__asm__ __volatile__ ("" ::: "memory");
+#endif
+
+	return value;
+#endif
+}
+
+static void
+sd_spi_store_dma_done(
+	uint8_t	value
+)
+{
+#if !defined(__AVR__) && defined(__ATOMIC_RELEASE)
+	__atomic_store_n(&is_dma_done, value, __ATOMIC_RELEASE);
+#else
+	is_dma_done = value;
+#endif
+}
+#endif
+
 static void
 sd_spi_select_card(
 	void
 )
 {
-	sd_spi_digital_write(card.chip_select_pin, LOW);
+	sd_spi_digital_write(card->chip_select_pin, LOW);
 
-	if (card.is_chip_select_high)
+	if (card->is_chip_select_high)
 	{
-    	card.is_chip_select_high = 0;
+    	card->is_chip_select_high = 0;
 
-    	if (card.spi_speed == 0)
+    	if (card->spi_speed == 0)
     	{
     		sd_spi_begin_transaction(250000);
     		
@@ -1452,11 +3937,11 @@ sd_spi_unselect_card(
 	sd_spi_receive_byte();
 
 	/* Host has to wait 8 clock cycles after a command. */
-	sd_spi_digital_write(card.chip_select_pin, HIGH);
+	sd_spi_digital_write(card->chip_select_pin, HIGH);
 
-	if (!card.is_chip_select_high)
+	if (!card->is_chip_select_high)
 	{
-    	card.is_chip_select_high = 1;
+    	card->is_chip_select_high = 1;
     	sd_spi_end_transaction();
 	}
 }
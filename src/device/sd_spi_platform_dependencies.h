@@ -28,6 +28,23 @@ extern "C" {
 #endif
 
 #include <stdint.h>
+#include <stddef.h>
+
+/* Define to use the SPI transfers of sd_spi_platform_inline.h, which talk to
+   the SPI registers and are inlined into the transfer loops of the library,
+   instead of sd_spi_send_byte() and sd_spi_receive_byte() from the platform
+   source file. */
+/* #define SD_SPI_PLATFORM_INLINE */
+
+/* Define to move the data of blocks with sd_spi_dma_transfer(), which the
+   platform has to provide. sd_spi_platform_dma.c provides it on Linux with a
+   worker thread. */
+/* #define SD_SPI_PLATFORM_DMA */
+
+#if !defined(SD_SPI_DMA_MIN_BYTES)
+/** Transfers shorter than this are not worth setting up DMA for. */
+#define SD_SPI_DMA_MIN_BYTES	512
+#endif
 
 #if !defined(INPUT)
 #define INPUT	0
@@ -77,6 +94,9 @@ sd_spi_end_transaction(
 	void
 );
 
+#if defined(SD_SPI_PLATFORM_INLINE)
+#include "sd_spi_platform_inline.h"
+#else
 void
 sd_spi_send_byte(
 	uint8_t b
@@ -87,6 +107,83 @@ sd_spi_receive_byte(
 	void
 );
 
+/**
+@brief	Sends a sequence of bytes.
+
+@param	data				The bytes to send.
+@param	number_of_bytes		The number of bytes.
+*/
+static inline void
+sd_spi_send_bytes(
+	const uint8_t	*data,
+	uint16_t		number_of_bytes
+)
+{
+	uint16_t i;
+	for (i = 0; i < number_of_bytes; i++)
+	{
+		sd_spi_send_byte(data[i]);
+	}
+}
+
+/**
+@brief	Receives a sequence of bytes.
+
+@param	data				Where to put the bytes, or NULL to throw them out.
+@param	number_of_bytes		The number of bytes.
+*/
+static inline void
+sd_spi_receive_bytes(
+	uint8_t		*data,
+	uint16_t	number_of_bytes
+)
+{
+	uint16_t i;
+
+	if (data == NULL)
+	{
+		for (i = 0; i < number_of_bytes; i++)
+		{
+			sd_spi_receive_byte();
+		}
+
+		return;
+	}
+
+	for (i = 0; i < number_of_bytes; i++)
+	{
+		data[i] = sd_spi_receive_byte();
+	}
+}
+#endif
+
+#if defined(SD_SPI_PLATFORM_DMA)
+/** Called by the platform when a DMA transfer is done. It may be called from
+	an interrupt or from another thread. */
+typedef void (*sd_spi_dma_callback_t)(void);
+
+/**
+@brief		Starts a transfer that is done in the background.
+@details	The library does not touch the bus until done_callback is called.
+
+@param[in]	tx					The bytes to send, or NULL to send 0xFF.
+@param[out]	rx					Where to put the bytes that are received, or
+								NULL to throw them out.
+@param		number_of_bytes		The number of bytes.
+@param		done_callback		Called once all of the bytes have been moved.
+
+@return		1 if the transfer was started, or 0 if it cannot be done with DMA,
+			in which case the library sends the bytes itself.
+*/
+uint8_t
+sd_spi_dma_transfer(
+	const uint8_t			*tx,
+	uint8_t					*rx,
+	uint16_t				number_of_bytes,
+	sd_spi_dma_callback_t	done_callback
+);
+#endif
+
 #if defined(__cplusplus)
 }
 #endif
@@ -0,0 +1,145 @@
+/******************************************************************************/
+/**
+@file		sd_spi_platform_dma.c
+@author     Wade Penson
+@date		June, 2015
+@brief      DMA hooks for Linux that are backed by a worker thread.
+@details	The worker moves the bytes with sd_spi_send_byte() and
+			sd_spi_receive_byte() of the platform, so a host build runs the same
+			asynchronous transfers as a board with SPI DMA. It is only built
+			when SD_SPI_PLATFORM_DMA is defined.
+@copyright  Copyright 2015 Wade Penson
+
+@license    Licensed under the Apache License, Version 2.0 (the "License");
+            you may not use this file except in compliance with the License.
+            You may obtain a copy of the License at
+
+              http://www.apache.org/licenses/LICENSE-2.0
+
+            Unless required by applicable law or agreed to in writing, software
+            distributed under the License is distributed on an "AS IS" BASIS,
+            WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+            implied. See the License for the specific language governing
+            permissions and limitations under the License.
+*/
+/******************************************************************************/
+
+#include "sd_spi_platform_dependencies.h"
+
+#if defined(SD_SPI_PLATFORM_DMA) && defined(__linux__)
+#include <pthread.h>
+
+/* The transfer that the worker is given. */
+static const uint8_t			*dma_tx;
+static uint8_t					*dma_rx;
+static uint16_t					dma_number_of_bytes;
+static sd_spi_dma_callback_t	dma_done_callback;
+static uint8_t					is_dma_pending = 0;
+
+static pthread_mutex_t	dma_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	dma_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t	dma_once = PTHREAD_ONCE_INIT;
+static uint8_t			is_worker_running = 0;
+
+/**
+@brief	Waits for transfers and does them.
+*/
+static void *
+sd_spi_dma_worker(
+	void *arg
+);
+
+/**
+@brief	Starts the worker thread.
+*/
+static void
+sd_spi_dma_start_worker(
+	void
+);
+
+uint8_t
+sd_spi_dma_transfer(
+	const uint8_t			*tx,
+	uint8_t					*rx,
+	uint16_t				number_of_bytes,
+	sd_spi_dma_callback_t	done_callback
+)
+{
+	pthread_once(&dma_once, sd_spi_dma_start_worker);
+
+	if (!is_worker_running)
+	{
+		return 0;
+	}
+
+	pthread_mutex_lock(&dma_mutex);
+	dma_tx = tx;
+	dma_rx = rx;
+	dma_number_of_bytes = number_of_bytes;
+	dma_done_callback = done_callback;
+	is_dma_pending = 1;
+	pthread_cond_signal(&dma_cond);
+	pthread_mutex_unlock(&dma_mutex);
+
+	return 1;
+}
+
+static void *
+sd_spi_dma_worker(
+	void *arg
+)
+{
+	(void) arg;
+
+	while (1)
+	{
+		pthread_mutex_lock(&dma_mutex);
+
+		while (!is_dma_pending)
+		{
+			pthread_cond_wait(&dma_cond, &dma_mutex);
+		}
+
+		is_dma_pending = 0;
+		pthread_mutex_unlock(&dma_mutex);
+
+		uint16_t i;
+		for (i = 0; i < dma_number_of_bytes; i++)
+		{
+			if (dma_tx != NULL)
+			{
+				sd_spi_send_byte(dma_tx[i]);
+			}
+			else if (dma_rx != NULL)
+			{
+				dma_rx[i] = sd_spi_receive_byte();
+			}
+			else
+			{
+				sd_spi_receive_byte();
+			}
+		}
+
+		/* The received bytes have to be visible before the library sees that
+		   the transfer is done. */
+		__sync_synchronize();
+		dma_done_callback();
+	}
+
+	return NULL;
+}
+
+static void
+sd_spi_dma_start_worker(
+	void
+)
+{
+	pthread_t thread;
+
+	if (pthread_create(&thread, NULL, sd_spi_dma_worker, NULL) == 0)
+	{
+		pthread_detach(thread);
+		is_worker_running = 1;
+	}
+}
+#endif
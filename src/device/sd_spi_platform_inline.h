@@ -0,0 +1,207 @@
+/******************************************************************************/
+/**
+@file		sd_spi_platform_inline.h
+@author     Wade Penson
+@date		June, 2015
+@brief      SPI transfers that use the SPI registers directly so that they are
+			inlined into the transfer loops of the library.
+@details	It is included by sd_spi_platform_dependencies.h when
+			SD_SPI_PLATFORM_INLINE is defined. The SPI bus is still set up by
+			sd_spi_begin() and sd_spi_begin_transaction() in the platform
+			source file. The sequence transfers start the next byte while the
+			last one is stored or the next one is fetched from memory, so the
+			bus does not sit idle between bytes.
+
+@copyright  Copyright 2015 Wade Penson
+
+@license    Licensed under the Apache License, Version 2.0 (the "License");
+            you may not use this file except in compliance with the License.
+            You may obtain a copy of the License at
+
+              http://www.apache.org/licenses/LICENSE-2.0
+
+            Unless required by applicable law or agreed to in writing, software
+            distributed under the License is distributed on an "AS IS" BASIS,
+            WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+            implied. See the License for the specific language governing
+            permissions and limitations under the License.
+*/
+/******************************************************************************/
+
+#if !defined(SD_SPI_PLATFORM_INLINE_H_)
+#define SD_SPI_PLATFORM_INLINE_H_
+
+#include <stdint.h>
+#include <stddef.h>
+
+#if defined(__AVR__)
+#include <avr/io.h>
+
+/** Waits until the byte in SPDR has been shifted out and in. */
+#define SD_SPI_AVR_WAIT()	while (!(SPSR & (1 << SPIF)))
+
+static inline void
+sd_spi_send_byte(
+	uint8_t b
+)
+{
+	SPDR = b;
+	SD_SPI_AVR_WAIT();
+}
+
+static inline uint8_t
+sd_spi_receive_byte(
+	void
+)
+{
+	SPDR = 0xFF;
+	SD_SPI_AVR_WAIT();
+
+	return SPDR;
+}
+
+static inline void
+sd_spi_send_bytes(
+	const uint8_t	*data,
+	uint16_t		number_of_bytes
+)
+{
+	if (number_of_bytes == 0)
+	{
+		return;
+	}
+
+	SPDR = data[0];
+
+	uint16_t i;
+	for (i = 1; i < number_of_bytes; i++)
+	{
+		/* The next byte is loaded while the last one is shifted out. */
+		uint8_t b = data[i];
+		SD_SPI_AVR_WAIT();
+		SPDR = b;
+	}
+
+	SD_SPI_AVR_WAIT();
+}
+
+static inline void
+sd_spi_receive_bytes(
+	uint8_t		*data,
+	uint16_t	number_of_bytes
+)
+{
+	if (number_of_bytes == 0)
+	{
+		return;
+	}
+
+	SPDR = 0xFF;
+
+	uint16_t i;
+
+	if (data == NULL)
+	{
+		for (i = 1; i < number_of_bytes; i++)
+		{
+			SD_SPI_AVR_WAIT();
+			SPDR = 0xFF;
+		}
+
+		SD_SPI_AVR_WAIT();
+		return;
+	}
+
+	for (i = 0; i + 1 < number_of_bytes; i++)
+	{
+		SD_SPI_AVR_WAIT();
+		uint8_t b = SPDR;
+
+		/* The next byte is started before the last one is stored. */
+		SPDR = 0xFF;
+		data[i] = b;
+	}
+
+	SD_SPI_AVR_WAIT();
+	data[i] = SPDR;
+}
+
+#elif defined(__SAM3X8E__)
+#include <Arduino.h>
+
+/** The peripheral select of the channel that sd_spi_begin_transaction()
+	sets up (the one of the default SS pin). */
+#define SD_SPI_SAM_PCS	SPI_PCS(BOARD_PIN_TO_SPI_CHANNEL(BOARD_SPI_DEFAULT_SS))
+
+static inline uint8_t
+sd_spi_sam_transfer(
+	uint8_t b
+)
+{
+	while (!(SPI0->SPI_SR & SPI_SR_TDRE));
+	SPI0->SPI_TDR = b | SD_SPI_SAM_PCS;
+
+	while (!(SPI0->SPI_SR & SPI_SR_RDRF));
+	return SPI0->SPI_RDR;
+}
+
+static inline void
+sd_spi_send_byte(
+	uint8_t b
+)
+{
+	sd_spi_sam_transfer(b);
+}
+
+static inline uint8_t
+sd_spi_receive_byte(
+	void
+)
+{
+	return sd_spi_sam_transfer(0xFF);
+}
+
+static inline void
+sd_spi_send_bytes(
+	const uint8_t	*data,
+	uint16_t		number_of_bytes
+)
+{
+	/* The transmit register takes the next byte while the last one is
+	   shifted out. The bytes that are clocked in are not needed. */
+	uint16_t i;
+	for (i = 0; i < number_of_bytes; i++)
+	{
+		while (!(SPI0->SPI_SR & SPI_SR_TDRE));
+		SPI0->SPI_TDR = data[i] | SD_SPI_SAM_PCS;
+	}
+
+	while (!(SPI0->SPI_SR & SPI_SR_TXEMPTY));
+	(void) SPI0->SPI_RDR;
+}
+
+static inline void
+sd_spi_receive_bytes(
+	uint8_t		*data,
+	uint16_t	number_of_bytes
+)
+{
+	/* Each byte is read before the next one is started since a second byte
+	   would overrun the receive register if the loop was interrupted. */
+	uint16_t i;
+	for (i = 0; i < number_of_bytes; i++)
+	{
+		uint8_t b = sd_spi_sam_transfer(0xFF);
+
+		if (data != NULL)
+		{
+			data[i] = b;
+		}
+	}
+}
+
+#else
+#error "SD_SPI_PLATFORM_INLINE only supports AVR and SAM3X."
+#endif
+
+#endif /* SD_SPI_PLATFORM_INLINE_H_ */
@@ -20,20 +20,124 @@
 */
 /******************************************************************************/
 
+#if !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#if defined(SD_SPI_THREAD_SAFE)
+/* The library functions are defined as *_unlocked and wrapped at the end of
+   the file by versions that hold the lock of the card. Calls from inside the
+   library go straight to the unlocked versions since the lock is held. */
+#define sd_spi_init						sd_spi_init_unlocked
+#define sd_spi_set_page_size			sd_spi_set_page_size_unlocked
+#define sd_spi_set_status_check			sd_spi_set_status_check_unlocked
+#define sd_spi_write					sd_spi_write_unlocked
+#define sd_spi_write_begin_fresh		sd_spi_write_begin_fresh_unlocked
+#define sd_spi_write_block				sd_spi_write_block_unlocked
+#define sd_spi_flush					sd_spi_flush_unlocked
+#define sd_spi_sync						sd_spi_sync_unlocked
+#define sd_spi_write_continuous_start	sd_spi_write_continuous_start_unlocked
+#define sd_spi_write_continuous			sd_spi_write_continuous_unlocked
+#define sd_spi_write_continuous_next	sd_spi_write_continuous_next_unlocked
+#define sd_spi_poll						sd_spi_poll_unlocked
+#define sd_spi_is_busy					sd_spi_is_busy_unlocked
+#define sd_spi_write_continuous_stop	sd_spi_write_continuous_stop_unlocked
+#define sd_spi_write_continuous_resume	sd_spi_write_continuous_resume_unlocked
+#define sd_spi_write_stream				sd_spi_write_stream_unlocked
+#define sd_spi_read						sd_spi_read_unlocked
+#define sd_spi_pread					sd_spi_pread_unlocked
+#define sd_spi_pwrite					sd_spi_pwrite_unlocked
+#define sd_spi_read_continuous_start	sd_spi_read_continuous_start_unlocked
+#define sd_spi_read_continuous			sd_spi_read_continuous_unlocked
+#define sd_spi_read_continuous_next		sd_spi_read_continuous_next_unlocked
+#define sd_spi_read_continuous_stop		sd_spi_read_continuous_stop_unlocked
+#define sd_spi_read_stream				sd_spi_read_stream_unlocked
+#define sd_spi_erase_all				sd_spi_erase_all_unlocked
+#define sd_spi_erase_blocks				sd_spi_erase_blocks_unlocked
+#define sd_spi_mark_erased				sd_spi_mark_erased_unlocked
+#define sd_spi_queue_erase				sd_spi_queue_erase_unlocked
+#define sd_spi_finish_erases			sd_spi_finish_erases_unlocked
+#define sd_spi_read_cid_register		sd_spi_read_cid_register_unlocked
+#define sd_spi_read_csd_register		sd_spi_read_csd_register_unlocked
+#define sd_spi_read_sd_status_register	sd_spi_read_sd_status_register_unlocked
+#define sd_spi_read_scr_register		sd_spi_read_scr_register_unlocked
+#define sd_spi_card_status				sd_spi_card_status_unlocked
+#define sd_spi_use_card					sd_spi_use_card_unlocked
+#endif
+
+#include "../device/sd_spi_platform_dependencies.h"
 #include "../sd_spi.h"
 #include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#if defined(SD_SPI_THREAD_SAFE)
+#include <pthread.h>
+
+/** Each thread has its own card in use. */
+#define SD_SPI_THREAD_LOCAL	__thread
+
+/** Adds to one of the counters without a lock. */
+#define SD_SPI_COUNT(counter, n)	\
+	__atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+#else
+#define SD_SPI_THREAD_LOCAL
+#define SD_SPI_COUNT(counter, n)	((counter) += (n))
+#endif
 
 #define SD_NUMBER_OF_BLOCKS (1 << 16)
 
-/** Pointer for the file used to emulate the card. */
-FILE *fp;
+/**
+@defgroup sd_spi_emulator_timing	Emulator Timing Model
+@brief		Approximate costs used to advance the emulated clock so that the
+			performance of different access patterns can be compared without a
+			card. Bus times assume a 25MHz SPI clock.
+@{
+*/
+#define SD_EMULATOR_BYTE_TIME_NS				320
+#define SD_EMULATOR_COMMAND_BYTES				8
+#define SD_EMULATOR_READ_ACCESS_US				100
+#define SD_EMULATOR_WRITE_BUSY_US				1500
+#define SD_EMULATOR_CONTINUOUS_WRITE_BUSY_US	400
+#define SD_EMULATOR_PRE_ERASED_WRITE_BUSY_US	250
+#define SD_EMULATOR_ERASE_BUSY_US				10000
+#define SD_EMULATOR_AU_BLOCKS					2048
+#define SD_EMULATOR_ERASE_AU_US					5000
+#define SD_EMULATOR_ERASE_KEPT_BLOCK_US			250
+
+/** @} End of group sd_spi_emulator_timing */
+
+/** Timing state kept for each emulated card (indexed by chip select pin). */
+typedef struct sd_spi_emulated_card {
+	/** Emulated time in ns at which the card stops being busy. */
+	uint64_t busy_until_ns;
+	/** Blocks left from the ACMD23 pre-erase count of the current write. */
+	uint32_t pre_erased_blocks;
+	/** Blocks written without errors by the current multiple block write,
+		which ACMD22 gives. */
+	uint32_t num_written_blocks;
+	/** The file that backs the card. It stays open once it is opened. */
+	int fd;
+	/** True once fd has been opened. */
+	uint8_t is_file_open;
+} sd_spi_emulated_card_t;
+
+/** Emulated time in ns since the program started. */
+static uint64_t emulated_time_ns = 0;
+
+static sd_spi_emulated_card_t emulated_cards[256];
 
-uint8_t 	sd_spi_dirty_write 	= 0;
 uint32_t	num_reads 			= 0;
 uint32_t	num_writes 			= 0;
 
-/* An sd_spi_card_t structure for internal state. */
-static sd_spi_card_t card;
+/* An sd_spi_card_t structure for internal state. It is shared by every
+   thread that has not called sd_spi_use_card(), so in a thread-safe build
+   only one thread may use it. */
+static sd_spi_card_t default_card = { .is_chip_select_high = 1 };
+
+/* The card that the library is currently operating on. */
+static SD_SPI_THREAD_LOCAL sd_spi_card_t *card = &default_card;
 
 /**
 @brief		Clears the buffer and sets the values to 0.
@@ -67,6 +171,51 @@ sd_spi_write_out_data(
 	uint16_t 	byte_offset
 );
 
+/**
+@brief		Stops a continuous write after a block failed to be written, finds
+			out how many blocks the card wrote without errors and drops the
+			blocks that were buffered.
+@details	The continuous write can be continued from the first page that was
+			not written with sd_spi_write_continuous_resume().
+
+@param		error	The error of the failed write.
+
+@return		The error that was given.
+*/
+static int8_t
+sd_spi_stop_failed_write(
+	int8_t	error
+);
+
+/**
+@brief		Stops a stream after a block failed to be written, the same as
+			sd_spi_stop_failed_write().
+@details	A stream counts 512 byte blocks instead of pages, so the first
+			block that was not written is left in continuous_block_address.
+
+@param		error	The error of the failed write.
+
+@return		The error that was given.
+*/
+static int8_t
+sd_spi_stop_failed_stream(
+	int8_t	error
+);
+
+/**
+@brief		Reads the status of the card after a write that is not part of a
+			continuous write, unless the status check of the card puts it off.
+
+@param		response	The error from the data response of the write.
+
+@return		The error of the write if there was one and otherwise the error
+			from the status of the card.
+*/
+static int8_t
+sd_spi_check_write_status(
+	int8_t	response
+);
+
 /**
 @brief		Performs the direct read from the card.
 
@@ -86,6 +235,372 @@ sd_spi_read_in_data(
 	uint16_t 	byte_offset
 );
 
+/**
+@brief		Gives the file that backs the current card. Each chip select pin
+			has its own file (data_<pin>.raw) so multiple cards can be emulated.
+			The file is opened the first time and then kept open.
+
+@return		The file descriptor or -1 on failure.
+*/
+static int
+sd_spi_card_file(
+	void
+);
+
+/**
+@brief		Reads bytes from the file that backs the current card. Bytes past
+			the end of the file are 0's.
+
+@param		byte_address		The address of the first byte on the card.
+@param[out]	data				Where to put the bytes.
+@param		number_of_bytes		The number of bytes to read.
+
+@return		0 on success and 1 on failure.
+*/
+static uint8_t
+sd_spi_read_card_file(
+	uint64_t	byte_address,
+	void		*data,
+	size_t		number_of_bytes
+);
+
+/**
+@brief		Writes bytes to the file that backs the current card.
+
+@param		byte_address		The address of the first byte on the card.
+@param[in]	data				The bytes to write.
+@param		number_of_bytes		The number of bytes to write.
+
+@return		0 on success and 1 on failure.
+*/
+static uint8_t
+sd_spi_write_card_file(
+	uint64_t	byte_address,
+	const void	*data,
+	size_t		number_of_bytes
+);
+
+/**
+@brief	Getter for the emulated clock.
+
+@return	The emulated time in ns.
+*/
+static uint64_t
+sd_spi_emulated_time(
+	void
+);
+
+/**
+@brief	Advances the emulated clock.
+
+@param	time_ns		The time in ns to add.
+*/
+static void
+sd_spi_advance_clock(
+	uint64_t time_ns
+);
+
+/**
+@brief	Advances the emulated clock to a time unless it is already past it.
+
+@param	time_ns		The time in ns.
+
+@return	The emulated time in ns after the call.
+*/
+static uint64_t
+sd_spi_advance_clock_to(
+	uint64_t time_ns
+);
+
+/**
+@brief	Advances the emulated clock by the time it takes to clock the given
+		number of bytes over the bus.
+
+@param	number_of_bytes		The number of bytes sent or received.
+*/
+static void
+sd_spi_emulate_transfer(
+	uint32_t number_of_bytes
+);
+
+/**
+@brief	Advances the emulated clock until the current card is no longer busy
+		and then marks it busy for the given amount of time.
+
+@param	busy_time_us	How long the card will be busy after this call.
+*/
+static void
+sd_spi_emulate_busy(
+	uint32_t busy_time_us
+);
+
+#if defined(SD_SPI_BUFFER) && SD_SPI_NUM_BUFFERS > 1
+/**
+@brief		Writes out the oldest block buffer that is waiting to be written
+			during a continuous write.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+static int8_t
+sd_spi_write_queued_buffer(
+	void
+);
+#endif
+
+#if defined(SD_SPI_BUFFER)
+/**
+@brief		Reads the buffered block in from the card while keeping the bytes
+			that were written to the buffer.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+static int8_t
+sd_spi_fetch_buffer(
+	void
+);
+#endif
+
+/**
+@brief		Reads whole blocks straight into memory with a multiple block read.
+
+@param		block_address	The address of the first block.
+@param[out]	data_buffer		A location in memory of num_blocks * 512 bytes.
+@param		num_blocks		The number of blocks to read.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+static int8_t
+sd_spi_read_blocks_direct(
+	uint32_t	block_address,
+	uint8_t		*data_buffer,
+	uint32_t	num_blocks
+);
+
+/**
+@brief		Writes whole blocks straight from memory with a multiple block
+			write.
+
+@param		block_address	The address of the first block.
+@param[in]	data			num_blocks * 512 bytes of data.
+@param		num_blocks		The number of blocks to write.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+static int8_t
+sd_spi_write_blocks_direct(
+	uint32_t	block_address,
+	uint8_t		*data,
+	uint32_t	num_blocks
+);
+
+/**
+@brief		Writes part of a page and keeps the rest of the data in the page.
+
+@param		page_address		The address of the page on the card.
+@param[in]	data				The data to write.
+@param		number_of_bytes		The number of bytes to write.
+@param		byte_offset			The byte offset of where to start writing in the
+								page.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+static int8_t
+sd_spi_write_partial_page(
+	uint32_t	page_address,
+	void		*data,
+	uint16_t	number_of_bytes,
+	uint16_t	byte_offset
+);
+
+/**
+@brief		Asks the callback of sd_spi_write_stream() for the next chunk of a
+			block.
+
+@param		callback		The callback of the stream.
+@param[in]	context			The context of the stream.
+@param		block_address	The address of the block the data goes to.
+@param		byte_offset		The offset of the data in the block.
+@param[out]	chunk			A location in memory of SD_SPI_STREAM_CHUNK_SIZE
+							bytes.
+
+@return		The number of bytes in chunk. 0 means the stream has ended.
+*/
+static uint16_t
+sd_spi_pull_stream_data(
+	sd_spi_write_stream_callback_t	callback,
+	void							*context,
+	uint32_t						block_address,
+	uint16_t						byte_offset,
+	uint8_t							*chunk
+);
+
+/**
+@brief		Reads the erased value of the card from an erased block if it is
+			not known yet.
+
+@param		block_address	The address of a block that holds the erased
+							value.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+static int8_t
+sd_spi_probe_erased_value(
+	uint32_t	block_address
+);
+
+/**
+@brief		A sd_spi_read_stream() callback which keeps the first byte of the
+			stream in context and then ends the stream.
+*/
+static uint8_t
+sd_spi_probe_erased_value_callback(
+	void		*context,
+	uint32_t	block_address,
+	uint16_t	byte_offset,
+	uint8_t		*data,
+	uint16_t	number_of_bytes
+);
+
+#if SD_SPI_MAX_ERASED_EXTENTS > 0
+/**
+@brief		Adds a range of blocks to the map of erased blocks.
+@details	Ranges that overlap or touch are merged. If the map is full, the
+			smallest range is forgotten.
+
+@param		start_block_address		The address of the first block.
+@param		num_blocks				The number of blocks.
+*/
+static void
+sd_spi_add_erased(
+	uint32_t	start_block_address,
+	uint32_t	num_blocks
+);
+
+/**
+@brief		Removes a range of blocks that is about to be written from the map
+			of erased blocks.
+
+@param		start_block_address		The address of the first block.
+@param		num_blocks				The number of blocks.
+*/
+static void
+sd_spi_remove_erased(
+	uint32_t	start_block_address,
+	uint32_t	num_blocks
+);
+
+/**
+@brief		Checks if a range of blocks is known to hold the erased value.
+
+@param		start_block_address		The address of the first block.
+@param		num_blocks				The number of blocks.
+
+@return		True if every block in the range is erased and false otherwise.
+*/
+static uint8_t
+sd_spi_is_erased(
+	uint32_t	start_block_address,
+	uint32_t	num_blocks
+);
+
+/**
+@brief		Hands erased blocks to the callback of sd_spi_read_stream()
+			without reading them from the card.
+
+@param		start_block_address		The address of the first block.
+@param		num_blocks				The number of blocks.
+@param		callback				The callback of the stream.
+@param[in]	context					The context of the stream.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+static int8_t
+sd_spi_read_stream_erased(
+	uint32_t						start_block_address,
+	uint32_t						num_blocks,
+	sd_spi_read_stream_callback_t	callback,
+	void							*context
+);
+#endif
+
+/**
+@brief		Starts erasing a sequence of blocks and deselects the card while it
+			is busy.
+
+@param 		start_block_address		The address of the first block.
+@param 		end_block_address		The address of the last block.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+static int8_t
+sd_spi_start_erase(
+	uint32_t	start_block_address,
+	uint32_t	end_block_address
+);
+
+/**
+@brief		Adds the blocks of a finished erase to the map of erased blocks and
+			fills in the buffer if its whole page was erased.
+@details	Nothing is recorded if the erased value of the card is not known.
+
+@param 		start_block_address		The address of the first block.
+@param 		end_block_address		The address of the last block.
+*/
+static void
+sd_spi_end_erase(
+	uint32_t	start_block_address,
+	uint32_t	end_block_address
+);
+
+#if SD_SPI_MAX_QUEUED_ERASES > 0
+/**
+@brief		Takes the oldest erase off the queue.
+
+@param[out]	range	The range of blocks of the erase.
+*/
+static void
+sd_spi_dequeue_erase(
+	sd_spi_block_range_t	*range
+);
+
+/**
+@brief		Waits for the erase in progress to finish.
+@details	The erase stays in the queue until sd_spi_record_queued_erase()
+			is called, since this can be called in the middle of another
+			operation where the erased value cannot be read from the card.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+static int8_t
+sd_spi_wait_for_queued_erase(
+	void
+);
+
+/**
+@brief		Records the blocks of the finished erase at the front of the queue
+			and takes it off the queue.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+static int8_t
+sd_spi_record_queued_erase(
+	void
+);
+
+/**
+@brief		Starts the queued erases one after the other and completes them.
+
+@param		is_waiting	True to wait for the card to finish each erase and
+						false to return while the card is busy.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+static int8_t
+sd_spi_run_erase_queue(
+	uint8_t	is_waiting
+);
+#endif
+
 /**
 @brief	Asserts the chip select pin for the card.
 */
@@ -109,124 +624,241 @@ sd_spi_init(
 {
 	sd_spi_select_card();
 
-	card.spi_speed = 1;
-	card.card_type = 3;
-	card.chip_select_pin = chip_select_pin;
-	card.is_chip_select_high = 1;
-	card.is_read_write_continuous = 0;
-	card.continuous_block_address = 0;
+	card->spi_speed = 1;
+	card->card_type = 3;
+	card->chip_select_pin = chip_select_pin;
+	card->is_chip_select_high = 1;
+	card->is_read_write_continuous = 0;
+	card->is_write_continuous = 0;
+	card->continuous_block_address = 0;
+	card->continuous_start_block_address = 0;
+	card->num_well_written_blocks = 0;
+	card->page_size = 512;
+	/* The emulator erases blocks to 0's. */
+	card->erased_value = 0;
+	card->is_erased_value_known = 1;
+	card->status_check = SD_SPI_STATUS_CHECK_ALWAYS;
+	card->is_status_check_pending = 0;
+	card->num_status_checks_skipped = 0;
+	card->is_write_in_progress = 0;
+#if SD_SPI_MAX_ERASED_EXTENTS > 0
+	card->num_erased_extents = 0;
+	card->num_erased_blocks_read = 0;
+	card->num_pre_erases_skipped = 0;
+#endif
+#if SD_SPI_MAX_QUEUED_ERASES > 0
+	card->num_queued_erases = 0;
+	card->is_erase_in_progress = 0;
+	card->is_erase_done = 0;
+#endif
 
-#if defined(BUFFER)
-	card.buffered_block_address = 0;
-	card.is_buffer_current = 0;
-	card.is_buffer_written = 1;
+#if defined(SD_SPI_BUFFER)
+	card->sd_spi_buffer = card->block_buffers[0];
+	card->buffered_block_address = 0;
+	card->is_buffer_current = 0;
+	card->is_buffer_written = 1;
+	card->written_start = 0;
+	card->written_end = 0;
+	card->is_flush_avoided = 0;
+	card->num_flushes_avoided = 0;
+	card->num_blocks_not_written = 0;
+#if SD_SPI_NUM_BUFFERS > 1
+	card->queued_buffer_index = 0;
+	card->num_queued_buffers = 0;
+#endif
 #endif
 
-	if ((fp = fopen("data.raw", "rb+")) == NULL)
-	{
-		if ((fp = fopen("data.raw", "wb+")) == NULL)
-		{
-			return SD_ERR_INIT_TIMEOUT;
-		}
-	}
+	int fd;
+	off_t size;
+	off_t card_bytes = (off_t) sd_spi_card_size() << 9;
 
-	if (fseek(fp, 0, SEEK_END) != 0)
+	if ((fd = sd_spi_card_file()) == -1 ||
+		(size = lseek(fd, 0, SEEK_END)) == -1)
 	{
 		return SD_ERR_INIT_TIMEOUT;
 	}
 
-	int32_t size;
-
-	if ((size = ftell(fp)) == -1)
+	/* A new card is filled with 0's. */
+	if (size < card_bytes && ftruncate(fd, card_bytes) != 0)
 	{
 		return SD_ERR_INIT_TIMEOUT;
 	}
 
-	if (size < (sd_spi_card_size() << 9))
-	{
-		rewind(fp);
+#if defined(SD_SPI_BUFFER)
+	uint16_t i;
+	for (i = 0; i < 512; i++)
+    {
+    	card->sd_spi_buffer[i] = 0;
+    }
+#endif
+
+	sd_spi_unselect_card();
+	/* The SD status and SCR are kept for picking run lengths. MMC cards do
+	   not have them. */
+	memset(&card->sd_status, 0, sizeof(sd_spi_sd_status_t));
+	memset(&card->scr, 0, sizeof(sd_spi_scr_t));
 
-		uint64_t current_byte;
-		char val = 0;
-		
-		for (current_byte = 0;
-			 current_byte < (sd_spi_card_size() << 9);
-			 current_byte++)
+	if (card->card_type != SD_CARD_TYPE_MMC)
+	{
+		if (sd_spi_read_sd_status_register(&card->sd_status))
 		{
-			fwrite(&val, 1, 1, fp);
+			memset(&card->sd_status, 0, sizeof(sd_spi_sd_status_t));
 		}
 
-		if (fflush(fp) != 0)
+		if (sd_spi_read_scr_register(&card->scr))
 		{
-			return SD_ERR_INIT_TIMEOUT;
+			memset(&card->scr, 0, sizeof(sd_spi_scr_t));
 		}
 	}
 
-	if (fclose(fp) != 0)
-	{
-		return SD_ERR_INIT_TIMEOUT;
-	}
-
-	uint16_t i;
-	for (i = 0; i < 512; i++)
-    {
-    	card.sd_spi_buffer[i] = 0;
-    }
-
-	sd_spi_unselect_card();
 	return SD_ERR_OK;
 }
-
 int8_t
-sd_spi_write(
-	uint32_t 	block_address,
-	void	 	*data,
-	uint16_t 	number_of_bytes,
-	uint16_t 	byte_offset
+sd_spi_set_page_size(
+	uint16_t page_size
+)
+{
+	if (page_size == 0 || (page_size & 511) != 0 ||
+		page_size > SD_SPI_MAX_PAGE_SIZE)
+	{
+		return SD_ERR_ILLEGAL_PARAMETER;
+	}
+
+	if (card->is_read_write_continuous)
+	{
+		return SD_ERR_READ_WRITE_CONTINUOUS;
+	}
+
+#if defined(SD_SPI_BUFFER)
+	int8_t response;
+	if ((response = sd_spi_flush()))
+	{
+		return response;
+	}
+
+	/* The buffer holds a page of the old size. */
+	card->is_buffer_current = 0;
+#endif
+
+	card->page_size = page_size;
+
+	return SD_ERR_OK;
+}
+
+uint16_t
+sd_spi_page_size(
+	void
+)
+{
+	return card->page_size;
+}
+
+int8_t
+sd_spi_set_status_check(
+	uint8_t status_check
+)
+{
+	if (status_check > SD_SPI_STATUS_CHECK_ON_ERROR)
+	{
+		return SD_ERR_ILLEGAL_PARAMETER;
+	}
+
+	card->status_check = status_check;
+
+	return SD_ERR_OK;
+}
+
+
+int8_t
+sd_spi_write(
+	uint32_t 	block_address,
+	void	 	*data,
+	uint16_t 	number_of_bytes,
+	uint16_t 	byte_offset
 )
 {
 	/* Check to make sure that data is within page bounds. */
-	if (number_of_bytes + byte_offset > 512)
+	if (number_of_bytes + byte_offset > card->page_size)
 	{
 		return SD_ERR_WRITE_OUTSIDE_OF_BLOCK;
 	}
 
 #if defined(SD_SPI_BUFFER)
-	/* Write a whole block out if it is 512 bytes, otherwise read block into
-	   buffer for partial writing. */
-	if (number_of_bytes == 512 && !card.is_read_write_continuous)
+	/* Nothing changes if the buffer already holds the data. */
+	if (!card->is_read_write_continuous &&
+		card->buffered_block_address == block_address &&
+		card->is_buffer_current &&
+		memcmp(card->sd_spi_buffer + byte_offset, data, number_of_bytes) == 0)
+	{
+		if (card->is_buffer_written)
+		{
+			card->is_flush_avoided = 1;
+		}
+
+		return SD_ERR_OK;
+	}
+
+	/* Write a whole page out if it is the size of a page, otherwise read page
+	   into buffer for partial writing. */
+	if (number_of_bytes == card->page_size && !card->is_read_write_continuous)
 	{
 		int8_t response = sd_spi_write_block(block_address, data);
 		sd_spi_unselect_card();
 
 		return response;
 	}
-	else if (!card.is_read_write_continuous && (card.buffered_block_address !=
-			 block_address || !card.is_buffer_current))
+	else if (!card->is_read_write_continuous)
 	{
 		int8_t response;
 
-		if ((response = sd_spi_flush()))
+		if (card->buffered_block_address != block_address ||
+			(card->is_buffer_written && !card->is_buffer_current))
+		{
+			if ((response = sd_spi_flush()))
+			{
+				return response;
+			}
+
+			/* The block is only read in from the card when the data written
+			   to it does not cover the whole block. */
+			card->buffered_block_address = block_address;
+			card->is_buffer_current = 0;
+		}
+
+		if (card->is_buffer_written)
+		{
+			card->written_start = byte_offset;
+			card->written_end = byte_offset;
+		}
+
+		/* The rest of the block is needed if the new data leaves a gap after
+		   the data already written. */
+		if (!card->is_buffer_current &&
+			(byte_offset > card->written_end ||
+			 byte_offset + number_of_bytes < card->written_start) &&
+			(response = sd_spi_fetch_buffer()))
 		{
 			return response;
 		}
 
-		if (sd_spi_dirty_write)
+		if (byte_offset < card->written_start)
 		{
-			card.buffered_block_address = block_address;
+			card->written_start = byte_offset;
 		}
-		else
+
+		if (byte_offset + number_of_bytes > card->written_end)
 		{
-			if ((response = sd_spi_read_in_data(block_address, card.sd_spi_buffer,
-												512, 0)))
-			{
-				return response;
-			}
+			card->written_end = byte_offset + number_of_bytes;
+		}
+
+		if (card->written_start == 0 && card->written_end == card->page_size)
+		{
+			card->is_buffer_current = 1;
 		}
 	}
 
-	memcpy(card.sd_spi_buffer + byte_offset, data, number_of_bytes);
-	card.is_buffer_written = 0;
+	memcpy(card->sd_spi_buffer + byte_offset, data, number_of_bytes);
+	card->is_buffer_written = 0;
 
 	return SD_ERR_OK;
 #else
@@ -237,6 +869,32 @@ sd_spi_write(
 	return response;
 #endif
 }
+int8_t
+sd_spi_write_begin_fresh(
+	uint32_t 	block_address
+)
+{
+#if defined(SD_SPI_BUFFER)
+	if (card->is_read_write_continuous)
+	{
+		return SD_ERR_READ_WRITE_CONTINUOUS;
+	}
+
+	int8_t response;
+	if ((response = sd_spi_flush()))
+	{
+		return response;
+	}
+
+	sd_spi_clear_buffer();
+	card->buffered_block_address = block_address;
+	card->is_buffer_current = 1;
+	card->written_end = card->page_size;
+#endif
+
+	return SD_ERR_OK;
+}
+
 
 int8_t
 sd_spi_write_block(
@@ -253,16 +911,16 @@ sd_spi_write_block(
 	}
 #endif
 
-	response = sd_spi_write_out_data(block_address, data, 512, 0);
+	response = sd_spi_write_out_data(block_address, data, card->page_size, 0);
 
 #if defined(SD_SPI_BUFFER)
-	if (!card.is_read_write_continuous || block_address == card.continuous_block_address) // TODO: Does this logic make sense?
+	if (!card->is_read_write_continuous || block_address == card->continuous_block_address) // TODO: Does this logic make sense?
 	{
-		memcpy(card.sd_spi_buffer, data, 512);
+		memcpy(card->sd_spi_buffer, data, card->page_size);
 	}
 
-	card.is_buffer_written = 1;
-	card.buffered_block_address = block_address;
+	card->is_buffer_written = 1;
+	card->buffered_block_address = block_address;
 #endif
 
 	sd_spi_unselect_card();
@@ -275,30 +933,109 @@ sd_spi_flush(
 )
 {
 #if defined(SD_SPI_BUFFER)
-	if (card.is_buffer_written)
+	int8_t response;
+
+#if SD_SPI_NUM_BUFFERS > 1
+	/* Queued blocks come before the one in the buffer. */
+	while (card->num_queued_buffers > 0)
+	{
+		if ((response = sd_spi_write_queued_buffer()))
+		{
+			return response;
+		}
+	}
+#endif
+
+	if (card->is_buffer_written)
 	{
+		if (card->is_flush_avoided)
+		{
+			card->num_flushes_avoided++;
+			card->is_flush_avoided = 0;
+		}
+
 		return SD_ERR_OK;
 	}
 
-	int8_t response;
-	if ((response = sd_spi_write_out_data(card.buffered_block_address,
-										  card.sd_spi_buffer, 512, 0)))
+	/* A partially written block has to be completed with the data on the
+	   card. */
+	if (!card->is_read_write_continuous && !card->is_buffer_current &&
+		(response = sd_spi_fetch_buffer()))
 	{
 		return response;
 	}
 
-	if (!card.is_read_write_continuous)
+	/* Only the blocks of a page that hold changed bytes are written. */
+	uint16_t write_start = 0;
+	uint16_t write_end = card->page_size;
+
+	if (!card->is_read_write_continuous &&
+		card->written_end > card->written_start)
 	{
-		card.is_buffer_current = 1;
+		write_start = card->written_start & ~511;
+		write_end = (card->written_end + 511) & ~511;
 	}
-	
-	card.is_buffer_written = 1;
+
+	if (write_start != 0 || write_end != card->page_size)
+	{
+		/* The multiple block write must not flush the buffer again. */
+		card->is_buffer_written = 1;
+
+		if ((response = sd_spi_write_blocks_direct(
+				card->buffered_block_address * (card->page_size >> 9) +
+				(write_start >> 9), card->sd_spi_buffer + write_start,
+				(write_end - write_start) >> 9)))
+		{
+			card->is_buffer_written = 0;
+			return response;
+		}
+
+		card->num_blocks_not_written += (card->page_size -
+										 (write_end - write_start)) >> 9;
+	}
+	else if ((response = sd_spi_write_out_data(card->buffered_block_address,
+											   card->sd_spi_buffer,
+											   card->page_size, 0)))
+	{
+		return response;
+	}
+
+	if (!card->is_read_write_continuous)
+	{
+		card->is_buffer_current = 1;
+	}
+
+	card->written_start = 0;
+	card->written_end = 0;
+	card->is_flush_avoided = 0;
+	card->is_buffer_written = 1;
 	sd_spi_unselect_card();
 #endif
 
 	return SD_ERR_OK;
 }
 
+int8_t
+sd_spi_sync(
+	void
+)
+{
+	int8_t response;
+	if ((response = sd_spi_flush()))
+	{
+		return response;
+	}
+
+	if (!card->is_status_check_pending)
+	{
+		return SD_ERR_OK;
+	}
+
+	card->is_status_check_pending = 0;
+
+	return sd_spi_card_status();
+}
+
 int8_t
 sd_spi_write_continuous_start(
 	uint32_t start_block_address,
@@ -314,12 +1051,59 @@ sd_spi_write_continuous_start(
 #endif
 
 	/* Keep track of block address for error checking and buffering. */
-	card.continuous_block_address = start_block_address;
-	card.is_read_write_continuous = 1;
+	card->continuous_block_address = start_block_address;
+	card->continuous_start_block_address = start_block_address;
+
+	/* Pre-erase the pages that are left in the allocation unit. */
+	if (num_blocks_pre_erase == SD_SPI_PRE_ERASE_AU)
+	{
+		uint32_t au_blocks = sd_spi_au_blocks();
+
+		num_blocks_pre_erase = au_blocks == 0 ? 0 :
+							   (au_blocks - start_block_address *
+							    (card->page_size >> 9) % au_blocks) /
+							   (card->page_size >> 9);
+	}
+
+	/* The card rejects a write that starts past its end. */
+	if (start_block_address * (card->page_size >> 9) >= sd_spi_card_size())
+	{
+		sd_spi_emulate_transfer(SD_EMULATOR_COMMAND_BYTES);
+		sd_spi_unselect_card();
+		return SD_ERR_WRITE_FAILURE;
+	}
+
+	card->is_read_write_continuous = 1;
+	card->is_write_continuous = 1;
+
+	num_blocks_pre_erase *= card->page_size >> 9;
+	uint8_t is_pre_erase_sent = num_blocks_pre_erase != 0;
+
+#if SD_SPI_MAX_ERASED_EXTENTS > 0
+	/* Blocks that are known to be erased do not need to be pre-erased, and
+	   are written as fast as pre-erased blocks. */
+	if (is_pre_erase_sent &&
+		sd_spi_is_erased(start_block_address * (card->page_size >> 9),
+						 num_blocks_pre_erase))
+	{
+		is_pre_erase_sent = 0;
+		card->num_pre_erases_skipped++;
+	}
+#endif
+
+	if (is_pre_erase_sent)
+	{
+		sd_spi_emulate_transfer(2 * SD_EMULATOR_COMMAND_BYTES);
+	}
+
+	emulated_cards[card->chip_select_pin].pre_erased_blocks =
+		num_blocks_pre_erase;
+	emulated_cards[card->chip_select_pin].num_written_blocks = 0;
+	sd_spi_emulate_transfer(SD_EMULATOR_COMMAND_BYTES);
 
 #if defined(SD_SPI_BUFFER)
 	sd_spi_clear_buffer();
-	card.buffered_block_address = card.continuous_block_address;
+	card->buffered_block_address = card->continuous_block_address;
 #endif
 
 	sd_spi_unselect_card();
@@ -333,7 +1117,12 @@ sd_spi_write_continuous(
 	uint16_t 	byte_offset
 )
 {
-	return sd_spi_write(card.continuous_block_address, data,
+	if (!card->is_read_write_continuous)
+	{
+		return SD_ERR_READ_WRITE_CONTINUOUS;
+	}
+
+	return sd_spi_write(card->continuous_block_address, data,
 						number_of_bytes, byte_offset);
 }
 
@@ -342,106 +1131,527 @@ sd_spi_write_continuous_next(
 	void
 )
 {
-#if defined(SD_SPI_BUFFER)
-	int8_t response = sd_spi_flush();
+	if (!card->is_read_write_continuous)
+	{
+		return SD_ERR_READ_WRITE_CONTINUOUS;
+	}
+
+#if defined(SD_SPI_BUFFER) && SD_SPI_NUM_BUFFERS > 1
+	int8_t response;
+
+	if (!card->is_buffer_written)
+	{
+		/* Make room by writing out the oldest block if every other buffer is
+		   still waiting to be written. */
+		if (card->num_queued_buffers == SD_SPI_NUM_BUFFERS - 1 &&
+			(response = sd_spi_write_queued_buffer()))
+		{
+			return response;
+		}
+
+		card->num_queued_buffers++;
+		card->buffered_block_address++;
+		card->sd_spi_buffer = card->block_buffers[(card->queued_buffer_index +
+												   card->num_queued_buffers) %
+												  SD_SPI_NUM_BUFFERS];
+	}
+
 	sd_spi_clear_buffer();
 
-	return response;
+	return sd_spi_poll();
+#elif defined(SD_SPI_BUFFER)
+	int8_t response;
+
+	/* A failed write has already dropped the buffer. */
+	if ((response = sd_spi_flush()))
+	{
+		return response;
+	}
+
+	sd_spi_clear_buffer();
+
+	return SD_ERR_OK;
 #else
 	return SD_ERR_OK;
 #endif
 }
 
 int8_t
-sd_spi_write_continuous_stop(
+sd_spi_poll(
 	void
 )
 {
-#if defined(SD_SPI_BUFFER)
-	/* Flush buffer if it hasn't been written. */
+#if defined(SD_SPI_BUFFER) && SD_SPI_NUM_BUFFERS > 1
 	int8_t response;
-	if ((response = sd_spi_flush()))
+
+	while (card->num_queued_buffers > 0)
 	{
-		return response;
+		/* Leave the block queued if the card is still busy. */
+		if (emulated_cards[card->chip_select_pin].busy_until_ns >
+			sd_spi_emulated_time())
+		{
+			return SD_ERR_OK;
+		}
+
+		if ((response = sd_spi_write_queued_buffer()))
+		{
+			return response;
+		}
 	}
 #endif
 
-	sd_spi_select_card();
-	card.is_read_write_continuous = 0;
+#if SD_SPI_MAX_QUEUED_ERASES > 0
+	return sd_spi_run_erase_queue(0);
+#else
+	return SD_ERR_OK;
+#endif
+}
 
-	return sd_spi_card_status();
+uint8_t
+sd_spi_is_busy(
+	void
+)
+{
+	if (card->is_read_write_continuous && !card->is_write_continuous)
+	{
+		return 0;
+	}
+
+	/* Checking clocks a byte, which is what moves the emulated clock along
+	   while the caller waits. */
+	sd_spi_emulate_transfer(1);
+
+	return emulated_cards[card->chip_select_pin].busy_until_ns >
+		   sd_spi_emulated_time();
 }
 
 int8_t
-sd_spi_read(
-	uint32_t 	block_address,
-	void	 	*data_buffer,
-	uint16_t 	number_of_bytes,
-	uint16_t 	byte_offset
+sd_spi_write_continuous_stop(
+	void
 )
 {
+	int8_t response = SD_ERR_OK;
+
 #if defined(SD_SPI_BUFFER)
-	int8_t response;
+	/* Flush buffer if it hasn't been written. If this fails, the block is
+	   dropped and the write is still stopped. */
+	response = sd_spi_flush();
+	card->is_buffer_written = 1;
+#if SD_SPI_NUM_BUFFERS > 1
+	card->num_queued_buffers = 0;
+#endif
+#endif
 
-	if ((response = sd_spi_flush()))
+	/* A failed write has already been stopped. */
+	if (!card->is_read_write_continuous)
 	{
 		return response;
 	}
 
-	/* Check to make sure that data is within page bounds. */
-	if (number_of_bytes + byte_offset > 512)
-	{
-    	return SD_ERR_READ_OUTSIDE_OF_BLOCK;
-  	}
+	sd_spi_select_card();
+	card->is_read_write_continuous = 0;
+
+	/* Stop token followed by the busy period of the final write. */
+	sd_spi_emulate_busy(0);
+	sd_spi_emulate_transfer(1);
+	sd_spi_emulate_busy(SD_EMULATOR_CONTINUOUS_WRITE_BUSY_US);
+	sd_spi_emulate_busy(0);
+
+	/* The status also holds the errors of writes that did not read it. */
+	card->is_status_check_pending = 0;
+	int8_t status = sd_spi_card_status();
+
+	return response ? response : status;
+}
 
-	if (card.buffered_block_address != block_address ||
-		!card.is_buffer_current)
+int8_t
+sd_spi_write_continuous_resume(
+	uint32_t	*block_address
+)
+{
+	if (card->is_read_write_continuous)
 	{
-		/* Read block into buffer. */
-		if ((response = sd_spi_read_in_data(block_address, card.sd_spi_buffer,
-											512, 0)))
-		{
-			return response;
-		}
+		return SD_ERR_READ_WRITE_CONTINUOUS;
 	}
 
-	memcpy(data_buffer, card.sd_spi_buffer + byte_offset, number_of_bytes);
+	if (block_address != NULL)
+	{
+		*block_address = card->continuous_block_address;
+	}
 
-	return SD_ERR_OK;
-#else
-	return sd_spi_read_in_data(block_address, data_buffer, number_of_bytes,
-						   	   byte_offset);
-#endif
+	return sd_spi_write_continuous_start(card->continuous_block_address, 0);
 }
 
 int8_t
-sd_spi_read_continuous_start(
-	uint32_t 	start_block_address
+sd_spi_write_stream(
+	uint32_t						start_block_address,
+	uint32_t						num_blocks,
+	sd_spi_write_stream_callback_t	callback,
+	void							*context
 )
 {
+	if (num_blocks == 0)
+	{
+		return SD_ERR_OK;
+	}
+
 #if defined(SD_SPI_BUFFER)
 	int8_t response;
 	if ((response = sd_spi_flush()))
 	{
 		return response;
 	}
-#endif
 
-	card.continuous_block_address = start_block_address;
-	card.is_read_write_continuous = 1;
+	/* The buffer has to be read in again if the stream writes over its
+	   page. */
+	uint32_t buffered_start = card->buffered_block_address *
+							  (card->page_size >> 9);
 
-#if defined(SD_SPI_BUFFER)
-	if ((response = sd_spi_read_in_data(card.continuous_block_address,
-										card.sd_spi_buffer, 512, 0)))
+	if (buffered_start < start_block_address + num_blocks &&
+		buffered_start + (card->page_size >> 9) > start_block_address)
 	{
-		sd_spi_unselect_card();
-		return response;
+		card->is_buffer_current = 0;
 	}
 #endif
 
-	sd_spi_unselect_card();
-	return SD_ERR_OK;
-}
+#if SD_SPI_MAX_ERASED_EXTENTS > 0
+	sd_spi_remove_erased(start_block_address, num_blocks);
+#endif
+
+	sd_spi_select_card();
+
+	card->is_read_write_continuous = 1;
+	card->is_write_continuous = 1;
+	card->continuous_block_address = start_block_address;
+	card->continuous_start_block_address = start_block_address;
+	emulated_cards[card->chip_select_pin].pre_erased_blocks = 0;
+	emulated_cards[card->chip_select_pin].num_written_blocks = 0;
+	sd_spi_emulate_transfer(SD_EMULATOR_COMMAND_BYTES);
+
+	uint8_t chunk[SD_SPI_STREAM_CHUNK_SIZE];
+	uint8_t is_stream_ended = 0;
+	uint8_t is_file_error = 0;
+	uint32_t block_address = start_block_address;
+
+	while (block_address < start_block_address + num_blocks && !is_stream_ended)
+	{
+		uint64_t byte_address = (uint64_t) block_address << 9;
+
+		/* The card takes in a block past its end and then rejects it. */
+		uint8_t is_rejected = block_address >= sd_spi_card_size();
+
+		/* The first chunk is pulled before the block is started, so the
+		   stream can end on a block boundary. */
+		uint16_t number_of_bytes = sd_spi_pull_stream_data(callback, context,
+														   block_address, 0,
+														   chunk);
+
+		if (number_of_bytes == 0)
+		{
+			break;
+		}
+
+		/* The card must finish the previous block before taking the next
+		   one. */
+		sd_spi_emulate_busy(0);
+
+		if (!is_rejected)
+		{
+			is_file_error |= sd_spi_write_card_file(byte_address, chunk,
+													number_of_bytes);
+		}
+
+		uint16_t byte_offset = number_of_bytes;
+
+		while (byte_offset < 512)
+		{
+			if ((number_of_bytes = sd_spi_pull_stream_data(callback, context,
+														   block_address,
+														   byte_offset,
+														   chunk)) == 0)
+			{
+				is_stream_ended = 1;
+				break;
+			}
+
+			if (!is_rejected)
+			{
+				is_file_error |= sd_spi_write_card_file(
+					byte_address + byte_offset, chunk, number_of_bytes);
+			}
+
+			byte_offset += number_of_bytes;
+		}
+
+		/* Pad data with 0. */
+		memset(chunk, 0, sizeof(chunk));
+
+		while (byte_offset < 512 && !is_rejected)
+		{
+			uint16_t number_of_bytes = 512 - byte_offset;
+
+			if (number_of_bytes > SD_SPI_STREAM_CHUNK_SIZE)
+			{
+				number_of_bytes = SD_SPI_STREAM_CHUNK_SIZE;
+			}
+
+			is_file_error |= sd_spi_write_card_file(byte_address + byte_offset,
+													chunk, number_of_bytes);
+			byte_offset += number_of_bytes;
+		}
+
+		sd_spi_emulate_transfer(515);
+
+		if (is_rejected)
+		{
+			return sd_spi_stop_failed_stream(SD_ERR_WRITE_DATA_REJECTED);
+		}
+
+		sd_spi_emulate_busy(SD_EMULATOR_CONTINUOUS_WRITE_BUSY_US);
+
+		emulated_cards[card->chip_select_pin].num_written_blocks++;
+		block_address++;
+		card->continuous_block_address = block_address;
+		SD_SPI_COUNT(num_writes, 1);
+	}
+
+	if (is_file_error)
+	{
+		sd_spi_write_continuous_stop();
+		return SD_ERR_WRITE_FAILURE;
+	}
+
+	return sd_spi_write_continuous_stop();
+}
+
+int8_t
+sd_spi_read(
+	uint32_t 	block_address,
+	void	 	*data_buffer,
+	uint16_t 	number_of_bytes,
+	uint16_t 	byte_offset
+)
+{
+#if defined(SD_SPI_BUFFER)
+	int8_t response;
+
+	if ((response = sd_spi_flush()))
+	{
+		return response;
+	}
+
+	/* Check to make sure that data is within page bounds. */
+	if (number_of_bytes + byte_offset > card->page_size)
+	{
+    	return SD_ERR_READ_OUTSIDE_OF_BLOCK;
+  	}
+
+	if (card->buffered_block_address != block_address ||
+		!card->is_buffer_current)
+	{
+		/* Read block into buffer. */
+		if ((response = sd_spi_read_in_data(block_address, card->sd_spi_buffer,
+											card->page_size, 0)))
+		{
+			return response;
+		}
+	}
+
+	memcpy(data_buffer, card->sd_spi_buffer + byte_offset, number_of_bytes);
+
+	return SD_ERR_OK;
+#else
+	return sd_spi_read_in_data(block_address, data_buffer, number_of_bytes,
+						   	   byte_offset);
+#endif
+}
+
+int8_t
+sd_spi_pread(
+	uint64_t	byte_address,
+	void		*data_buffer,
+	size_t		number_of_bytes
+)
+{
+	if (card->is_read_write_continuous)
+	{
+		return SD_ERR_READ_WRITE_CONTINUOUS;
+	}
+
+	uint8_t *data = data_buffer;
+	uint16_t page_size = card->page_size;
+	uint32_t page_address = byte_address / page_size;
+	uint16_t byte_offset = byte_address % page_size;
+	int8_t response;
+
+	/* Partial page at the start. */
+	if (number_of_bytes > 0 && (byte_offset != 0 || number_of_bytes < page_size))
+	{
+		uint16_t head_bytes = page_size - byte_offset;
+
+		if (head_bytes > number_of_bytes)
+		{
+			head_bytes = number_of_bytes;
+		}
+
+		if ((response = sd_spi_read(page_address, data, head_bytes,
+									byte_offset)))
+		{
+			return response;
+		}
+
+		data += head_bytes;
+		number_of_bytes -= head_bytes;
+		page_address++;
+	}
+
+	/* Whole pages in the middle. */
+	if (number_of_bytes >= page_size)
+	{
+		uint32_t num_pages = number_of_bytes / page_size;
+
+#if defined(SD_SPI_BUFFER)
+		/* The card has to be up to date with the buffer. */
+		if ((response = sd_spi_flush()))
+		{
+			return response;
+		}
+#endif
+
+		if ((response = sd_spi_read_blocks_direct(page_address *
+												  (page_size >> 9), data,
+												  num_pages *
+												  (page_size >> 9))))
+		{
+			return response;
+		}
+
+		data += (size_t) num_pages * page_size;
+		number_of_bytes -= (size_t) num_pages * page_size;
+		page_address += num_pages;
+	}
+
+	/* Partial page at the end. */
+	if (number_of_bytes > 0)
+	{
+		return sd_spi_read(page_address, data, number_of_bytes, 0);
+	}
+
+	return SD_ERR_OK;
+}
+
+int8_t
+sd_spi_pwrite(
+	uint64_t	byte_address,
+	void		*data,
+	size_t		number_of_bytes
+)
+{
+	if (card->is_read_write_continuous)
+	{
+		return SD_ERR_READ_WRITE_CONTINUOUS;
+	}
+
+	uint8_t *source = data;
+	uint16_t page_size = card->page_size;
+	uint32_t page_address = byte_address / page_size;
+	uint16_t byte_offset = byte_address % page_size;
+	int8_t response;
+
+	/* Partial page at the start. */
+	if (number_of_bytes > 0 && (byte_offset != 0 || number_of_bytes < page_size))
+	{
+		uint16_t head_bytes = page_size - byte_offset;
+
+		if (head_bytes > number_of_bytes)
+		{
+			head_bytes = number_of_bytes;
+		}
+
+		if ((response = sd_spi_write_partial_page(page_address, source,
+												  head_bytes, byte_offset)))
+		{
+			return response;
+		}
+
+		source += head_bytes;
+		number_of_bytes -= head_bytes;
+		page_address++;
+	}
+
+	/* Whole pages in the middle. */
+	if (number_of_bytes >= page_size)
+	{
+		uint32_t num_pages = number_of_bytes / page_size;
+
+#if defined(SD_SPI_BUFFER)
+		/* Write out the buffer first so it cannot overwrite the new data
+		   later. */
+		if ((response = sd_spi_flush()))
+		{
+			return response;
+		}
+
+		if (card->buffered_block_address >= page_address &&
+			card->buffered_block_address < page_address + num_pages)
+		{
+			card->is_buffer_current = 0;
+		}
+#endif
+
+		if ((response = sd_spi_write_blocks_direct(page_address *
+												   (page_size >> 9), source,
+												   num_pages *
+												   (page_size >> 9))))
+		{
+			return response;
+		}
+
+		source += (size_t) num_pages * page_size;
+		number_of_bytes -= (size_t) num_pages * page_size;
+		page_address += num_pages;
+	}
+
+	/* Partial page at the end. */
+	if (number_of_bytes > 0)
+	{
+		return sd_spi_write_partial_page(page_address, source,
+										 number_of_bytes, 0);
+	}
+
+	return SD_ERR_OK;
+}
+
+int8_t
+sd_spi_read_continuous_start(
+	uint32_t 	start_block_address
+)
+{
+#if defined(SD_SPI_BUFFER)
+	int8_t response;
+	if ((response = sd_spi_flush()))
+	{
+		return response;
+	}
+#endif
+
+	card->continuous_block_address = start_block_address;
+	card->is_read_write_continuous = 1;
+	card->is_write_continuous = 0;
+
+#if defined(SD_SPI_BUFFER)
+	if ((response = sd_spi_read_in_data(card->continuous_block_address,
+										card->sd_spi_buffer, card->page_size,
+										0)))
+	{
+		sd_spi_unselect_card();
+		return response;
+	}
+#endif
+
+	sd_spi_unselect_card();
+	return SD_ERR_OK;
+}
 
 int8_t
 sd_spi_read_continuous(
@@ -451,10 +1661,10 @@ sd_spi_read_continuous(
 )
 {
 #if defined(SD_SPI_BUFFER)
-	return sd_spi_read(card.buffered_block_address, data_buffer,
+	return sd_spi_read(card->buffered_block_address, data_buffer,
 					   number_of_bytes, byte_offset);
 #else
-	return sd_spi_read_in_data(card.continuous_block_address, data_buffer,
+	return sd_spi_read_in_data(card->continuous_block_address, data_buffer,
 							   number_of_bytes, byte_offset);
 #endif
 }
@@ -465,8 +1675,8 @@ sd_spi_read_continuous_next(
 )
 {
 #if defined(SD_SPI_BUFFER)
-	return sd_spi_read_in_data(card.continuous_block_address,
-							   card.sd_spi_buffer, 512, 0);
+	return sd_spi_read_in_data(card->continuous_block_address,
+							   card->sd_spi_buffer, card->page_size, 0);
 #else
 	return SD_ERR_OK;
 #endif
@@ -478,358 +1688,2141 @@ sd_spi_read_continuous_stop(
 )
 {
 	sd_spi_select_card();
-	card.is_read_write_continuous = 0;
+	card->is_read_write_continuous = 0;
 	sd_spi_unselect_card();
 
 	return SD_ERR_OK;
 }
 
 int8_t
-sd_spi_erase_all(
-	void
+sd_spi_read_stream(
+	uint32_t						start_block_address,
+	uint32_t						num_blocks,
+	sd_spi_read_stream_callback_t	callback,
+	void							*context
 )
 {
-	return sd_spi_erase_blocks(0, sd_spi_card_size());
-}
+	if (num_blocks == 0)
+	{
+		return SD_ERR_OK;
+	}
 
-int8_t
-sd_spi_erase_blocks(
-	uint32_t start_block_address,
-	uint32_t end_block_address
-)
-{
 #if defined(SD_SPI_BUFFER)
 	int8_t response;
 	if ((response = sd_spi_flush()))
 	{
 		return response;
 	}
+#endif
 
-	if (card.buffered_block_address > start_block_address &&
-		card.buffered_block_address < end_block_address)
+#if SD_SPI_MAX_ERASED_EXTENTS > 0
+	if (sd_spi_is_erased(start_block_address, num_blocks))
 	{
-		sd_spi_clear_buffer();
-		card.is_buffer_written = 1;
-		card.is_buffer_current = 1;
+		return sd_spi_read_stream_erased(start_block_address, num_blocks,
+										 callback, context);
 	}
 #endif
 
-	if ((fp = fopen("data.raw", "rb+")) == NULL)
+	sd_spi_select_card();
+	sd_spi_emulate_busy(0);
+	sd_spi_emulate_transfer(SD_EMULATOR_COMMAND_BYTES);
+
+	uint8_t chunk[SD_SPI_STREAM_CHUNK_SIZE];
+	uint8_t is_stream_ended = 0;
+	uint32_t block_address = start_block_address;
+
+	while (block_address < start_block_address + num_blocks && !is_stream_ended)
 	{
-		return SD_ERR_ERASE_FAILURE;
+		/* Access time and the start token. */
+		sd_spi_advance_clock((uint64_t) SD_EMULATOR_READ_ACCESS_US * 1000);
+		sd_spi_emulate_transfer(1);
+
+		uint16_t byte_offset;
+		for (byte_offset = 0; byte_offset < 512;
+			 byte_offset += SD_SPI_STREAM_CHUNK_SIZE)
+		{
+			uint16_t number_of_bytes = 512 - byte_offset;
+
+			if (number_of_bytes > SD_SPI_STREAM_CHUNK_SIZE)
+			{
+				number_of_bytes = SD_SPI_STREAM_CHUNK_SIZE;
+			}
+
+			if (sd_spi_read_card_file(((uint64_t) block_address << 9) +
+									  byte_offset, chunk, number_of_bytes))
+			{
+				return SD_ERR_READ_FAILURE;
+			}
+
+			sd_spi_emulate_transfer(number_of_bytes);
+
+			if (!is_stream_ended &&
+				callback(context, block_address, byte_offset, chunk,
+						 number_of_bytes))
+			{
+				is_stream_ended = 1;
+			}
+		}
+
+		/* CRC. */
+		sd_spi_emulate_transfer(2);
+
+		block_address++;
+		SD_SPI_COUNT(num_reads, 1);
 	}
 
-	if (fseek(fp, start_block_address << 9, SEEK_SET) != 0)
+	/* Stop command. */
+	sd_spi_emulate_transfer(SD_EMULATOR_COMMAND_BYTES);
+
+	sd_spi_unselect_card();
+	return SD_ERR_OK;
+}
+
+int8_t
+sd_spi_erase_all(
+	void
+)
+{
+	return sd_spi_erase_blocks(0, sd_spi_card_size() - 1);
+}
+
+int8_t
+sd_spi_erase_blocks(
+	uint32_t start_block_address,
+	uint32_t end_block_address
+)
+{
+	int8_t response;
+	if ((response = sd_spi_start_erase(start_block_address, end_block_address)))
 	{
-		return SD_ERR_ERASE_FAILURE;
+		return response;
 	}
 
-	char val = 0;
-	uint64_t current_byte;
-	for (current_byte = (start_block_address << 9);
-		 current_byte < end_block_address << 9;
-		 current_byte++)
+	sd_spi_emulate_busy(0);
+
+	/* The erased blocks show the erased value of the card. */
+	if ((response = sd_spi_probe_erased_value(start_block_address)))
 	{
-		fwrite(&val, 1, 1, fp);
+		return response;
 	}
 
-	if (fflush(fp) != 0)
+	sd_spi_end_erase(start_block_address, end_block_address);
+
+	return SD_ERR_OK;
+}
+
+int8_t
+sd_spi_mark_erased(
+	uint32_t 	start_block_address,
+	uint32_t 	num_blocks
+)
+{
+#if SD_SPI_MAX_ERASED_EXTENTS > 0
+	if (num_blocks == 0)
 	{
-		return SD_ERR_ERASE_FAILURE;
+		return SD_ERR_OK;
 	}
 
-	if (fclose(fp) != 0)
+	int8_t response;
+	if ((response = sd_spi_probe_erased_value(start_block_address)))
 	{
-		return SD_ERR_ERASE_FAILURE;
+		return response;
+	}
+
+	sd_spi_add_erased(start_block_address, num_blocks);
+#endif
+
+	return SD_ERR_OK;
+}
+
+int8_t
+sd_spi_queue_erase(
+	uint32_t 	start_block_address,
+	uint32_t 	end_block_address
+)
+{
+#if SD_SPI_MAX_QUEUED_ERASES > 0
+	if (card->num_queued_erases == SD_SPI_MAX_QUEUED_ERASES)
+	{
+		return SD_ERR_ERASE_QUEUE_FULL;
+	}
+
+	sd_spi_block_range_t *range =
+		&card->queued_erases[card->num_queued_erases++];
+	range->start_block_address = start_block_address;
+	range->num_blocks = end_block_address - start_block_address + 1;
+
+	return SD_ERR_OK;
+#else
+	return sd_spi_erase_blocks(start_block_address, end_block_address);
+#endif
+}
+
+uint8_t
+sd_spi_pending_erases(
+	void
+)
+{
+#if SD_SPI_MAX_QUEUED_ERASES > 0
+	return card->num_queued_erases;
+#else
+	return 0;
+#endif
+}
+
+int8_t
+sd_spi_finish_erases(
+	void
+)
+{
+#if SD_SPI_MAX_QUEUED_ERASES > 0
+	if (card->num_queued_erases > 0 && card->is_read_write_continuous)
+	{
+		return SD_ERR_READ_WRITE_CONTINUOUS;
+	}
+
+	return sd_spi_run_erase_queue(1);
+#else
+	return SD_ERR_OK;
+#endif
+}
+
+uint32_t
+sd_spi_card_size(
+	void
+)
+{
+	return SD_NUMBER_OF_BLOCKS;
+}
+
+uint32_t
+sd_spi_au_blocks(
+	void
+)
+{
+	/* AU sizes double from 16KB up to 4MB and then follow a table. */
+	static const uint8_t large_au_sizes[6] = {16, 24, 32, 48, 64, 128};
+	uint8_t au_size = card->sd_status.au_size;
+
+	if (au_size == 0)
+	{
+		return 0;
+	}
+	else if (au_size <= 9)
+	{
+		return (uint32_t) 32 << (au_size - 1);
+	}
+
+	return (uint32_t) large_au_sizes[au_size - 10] << 10;
+}
+
+int8_t
+sd_spi_read_cid_register(
+	sd_spi_cid_t *cid
+)
+{
+	cid->mid = 0x03;
+	memcpy(cid->oid, "SD", 2);
+	memcpy(cid->pnm, "SU02G", 5);
+
+	cid->prv_n = 0x8;
+	cid->prv_m = 0x0;
+
+	cid->psn_high = 0x07;
+	cid->psn_mid_high = 0xD0;
+	cid->psn_mid_low = 0xA2;
+	cid->psn_low = 0xA8;
+
+	cid->mdt_year = 0x0A;
+	cid->mdt_month = 0x7;
+	cid->crc = 0x7F;
+
+	sd_spi_unselect_card();
+	return SD_ERR_OK;
+}
+
+int8_t
+sd_spi_read_csd_register(
+	sd_spi_csd_t *csd
+)
+{
+	csd->csd_structure = 0x1;
+	csd->taac = 0x0E;
+	csd->nsac = 0x00;
+	csd->tran_speed = 0x032;
+	csd->ccc_high = 0xF;
+	csd->ccc_low = 0xFF;
+	csd->max_read_bl_len = 0x0A;
+	csd->read_bl_partial = 0x0;
+	csd->write_bl_misalign = 0x0;
+	csd->read_bl_misalign = 0x0;
+	csd->dsr_imp = 0x0;
+
+	csd->cvsi.v2.c_size_high = 0x00;
+	csd->cvsi.v2.c_size_mid = 0x01;
+	csd->cvsi.v2.c_size_low = 0xD8;
+
+	csd->erase_bl_en = 0x1;
+	csd->erase_sector_size = 0x7F;
+	csd->wp_grp_size = 0x00;
+	csd->wp_grp_enable = 0x0;
+	csd->r2w_factor = 0x2;
+	csd->write_bl_len = 0x9;
+	csd->write_bl_partial = 0x0;
+	csd->file_format_grp = 0x0;
+	csd->copy = 0x0;
+	csd->perm_write_protect = 0x0;
+	csd->tmp_write_protect = 0x0;
+	csd->file_format = 0x0;
+	csd->crc = 0x7F;
+
+	sd_spi_unselect_card();
+
+	return SD_ERR_OK;
+}
+
+int8_t
+sd_spi_read_sd_status_register(
+	sd_spi_sd_status_t *sd_status
+)
+{
+	/* The emulated card has 1MB allocation units, erases 200 of them in a
+	   second and writes at 2MB/s, which roughly matches the timing model. */
+	sd_status->dat_bus_width = 0x0;
+	sd_status->secured_mode = 0x0;
+	sd_status->sd_card_type = 0x0000;
+	sd_status->size_of_protected_area = 0x00000000;
+	sd_status->speed_class = 0x01;
+	sd_status->performance_move = 0x00;
+	sd_status->au_size = 0x7;
+	sd_status->erase_size = 200;
+	sd_status->erase_timeout = 0x01;
+	sd_status->erase_offset = 0x0;
+	sd_status->uhs_speed_grade = 0x0;
+	sd_status->uhs_au_size = 0x0;
+
+	/* Command, R2 response, token, data and CRC. */
+	sd_spi_emulate_busy(0);
+	sd_spi_emulate_transfer(2 * SD_EMULATOR_COMMAND_BYTES + 1 + 1 + 64 + 2);
+
+	sd_spi_unselect_card();
+	return SD_ERR_OK;
+}
+
+int8_t
+sd_spi_read_scr_register(
+	sd_spi_scr_t *scr
+)
+{
+	/* The emulated card follows version 3.00 of the specification, erases to
+	   0's and supports CMD23. */
+	scr->scr_structure = 0x0;
+	scr->sd_spec = 0x2;
+	scr->data_stat_after_erase = 0x0;
+	scr->sd_security = 0x0;
+	scr->sd_bus_widths = 0x5;
+	scr->sd_spec3 = 0x1;
+	scr->ex_security = 0x0;
+	scr->sd_spec4 = 0x0;
+	scr->sd_specx = 0x0;
+	scr->cmd_support = 0x2;
+
+	/* Command, R1 response, token, data and CRC. */
+	sd_spi_emulate_busy(0);
+	sd_spi_emulate_transfer(2 * SD_EMULATOR_COMMAND_BYTES + 1 + 8 + 2);
+
+	sd_spi_unselect_card();
+	return SD_ERR_OK;
+}
+
+int8_t
+sd_spi_card_status(
+	void
+)
+{
+	int8_t response = SD_ERR_OK;
+
+	/* The command waits for the card to finish what it is doing. */
+	sd_spi_emulate_busy(0);
+	sd_spi_emulate_transfer(SD_EMULATOR_COMMAND_BYTES + 1);
+	sd_spi_unselect_card();
+	
+	return response;
+}
+
+uint32_t
+sd_spi_current_buffered_block(
+	void
+)
+{
+	return card->buffered_block_address;
+}
+
+void
+sd_spi_use_card(
+	sd_spi_card_t *new_card
+)
+{
+	/* Release the bus before another card is addressed. */
+	if (!card->is_chip_select_high)
+	{
+		sd_spi_unselect_card();
+	}
+
+	card = (new_card == NULL) ? &default_card : new_card;
+}
+
+sd_spi_card_t *
+sd_spi_current_card(
+	void
+)
+{
+	return card;
+}
+
+/* For debugging purposes */
+int8_t
+print_page(
+	uint32_t 	block_address
+)
+{
+	uint8_t buffer[512];
+
+	if (sd_spi_read_card_file((uint64_t) block_address << 9, buffer, 512))
+	{
+		return SD_ERR_READ_FAILURE;
+	}
+
+	printf("Page %d, Byte: %d\n", block_address, block_address * 512);
+
+	uint16_t i;
+	for (i = 0; i < 512; i++)
+	{
+		if (i % 16 == 0)
+		{
+			printf("\n");
+		}
+
+		printf("%d\t", buffer[i]);
+	}
+
+	printf("\n\n");
+	return 0;
+}
+
+static void
+sd_spi_clear_buffer(
+	void
+)
+{
+#if defined(SD_SPI_BUFFER)
+	uint16_t i;
+	for (i = 0; i < card->page_size; i++) {
+		card->sd_spi_buffer[i] = 0;
+	}
+
+	card->is_buffer_written = 0;
+	card->is_buffer_current = 0;
+	card->written_start = 0;
+	card->written_end = 0;
+#endif
+}
+
+static int8_t
+sd_spi_write_out_data(
+	uint32_t	block_address,
+	void	 	*data,
+	uint16_t 	number_of_bytes,
+	uint16_t 	byte_offset
+)
+{
+	uint8_t blocks_per_page = card->page_size >> 9;
+
+#if SD_SPI_MAX_ERASED_EXTENTS > 0
+	sd_spi_remove_erased(block_address * blocks_per_page, blocks_per_page);
+#endif
+
+	sd_spi_select_card();
+
+	/* The card rejects blocks past its end. */
+	if ((block_address + 1) * blocks_per_page > sd_spi_card_size())
+	{
+		if (card->is_read_write_continuous)
+		{
+			sd_spi_emulate_busy(0);
+			sd_spi_emulate_transfer(515);
+			return sd_spi_stop_failed_write(SD_ERR_WRITE_DATA_REJECTED);
+		}
+
+		sd_spi_emulate_transfer(SD_EMULATOR_COMMAND_BYTES);
+		sd_spi_unselect_card();
+		return SD_ERR_WRITE_FAILURE;
+	}
+
+	uint8_t output_buffer[SD_SPI_MAX_PAGE_SIZE];
+	uint16_t i;
+
+	/* Pad data with 0. */
+	for (i = 0; i < byte_offset; i++)
+	{
+		output_buffer[i] = 0;
+	}
+
+	/* Write page. */
+	for (i = byte_offset; i < byte_offset + number_of_bytes; i++)
+	{
+		output_buffer[i] = (((uint8_t*) data)[i - byte_offset]);
+	}
+
+	/* Pad data with 0. */
+	for (i = byte_offset + number_of_bytes; i < card->page_size; i++)
+	{
+		output_buffer[i] = 0;
+	}
+
+	uint8_t block;
+
+	if (card->is_read_write_continuous)
+	{
+		card->continuous_block_address++;
+
+#if defined(SD_SPI_BUFFER)
+		card->buffered_block_address = card->continuous_block_address;
+#endif
+
+		/* The card must finish the previous block before taking the next
+		   one. Blocks that were pre-erased are programmed faster. */
+		for (block = 0; block < blocks_per_page; block++)
+		{
+			sd_spi_emulate_busy(0);
+			sd_spi_emulate_transfer(515);
+			emulated_cards[card->chip_select_pin].num_written_blocks++;
+
+			if (emulated_cards[card->chip_select_pin].pre_erased_blocks > 0)
+			{
+				emulated_cards[card->chip_select_pin].pre_erased_blocks--;
+				sd_spi_emulate_busy(SD_EMULATOR_PRE_ERASED_WRITE_BUSY_US);
+			}
+			else
+			{
+				sd_spi_emulate_busy(SD_EMULATOR_CONTINUOUS_WRITE_BUSY_US);
+			}
+		}
+	}
+	else if (blocks_per_page == 1)
+	{
+		/* Command and data. The card stays busy until a later command, such
+		   as the status check, waits for it. */
+		sd_spi_emulate_busy(0);
+		sd_spi_emulate_transfer(SD_EMULATOR_COMMAND_BYTES + 515);
+		sd_spi_emulate_busy(SD_EMULATOR_WRITE_BUSY_US);
+	}
+	else
+	{
+		/* Pre-erase and write commands, the pre-erased blocks and the stop
+		   token. */
+		sd_spi_emulate_busy(0);
+		sd_spi_emulate_transfer(3 * SD_EMULATOR_COMMAND_BYTES);
+
+		for (block = 0; block < blocks_per_page; block++)
+		{
+			sd_spi_emulate_busy(0);
+			sd_spi_emulate_transfer(515);
+			sd_spi_emulate_busy(SD_EMULATOR_PRE_ERASED_WRITE_BUSY_US);
+		}
+
+		sd_spi_emulate_transfer(1);
+	}
+
+	if (sd_spi_write_card_file((uint64_t) block_address * card->page_size,
+							   output_buffer, card->page_size))
+	{
+		return SD_ERR_WRITE_FAILURE;
+	}
+
+	SD_SPI_COUNT(num_writes, blocks_per_page);
+
+	if (card->is_read_write_continuous)
+	{
+		return SD_ERR_OK;
+	}
+
+	return sd_spi_check_write_status(SD_ERR_OK);
+}
+
+static int8_t
+sd_spi_stop_failed_write(
+	int8_t	error
+)
+{
+	card->is_read_write_continuous = 0;
+
+	/* The stop token, then the status command and ACMD22 with its data
+	   block. */
+	sd_spi_emulate_busy(0);
+	sd_spi_emulate_transfer(1);
+	sd_spi_emulate_busy(0);
+	sd_spi_emulate_transfer(3 * SD_EMULATOR_COMMAND_BYTES + 1 + 4 + 2);
+	sd_spi_unselect_card();
+
+	/* A partly written page is written again when the write is resumed. */
+	uint32_t num_blocks =
+		emulated_cards[card->chip_select_pin].num_written_blocks;
+	card->num_well_written_blocks = num_blocks;
+	card->continuous_block_address = card->continuous_start_block_address +
+									 num_blocks / (card->page_size >> 9);
+
+#if defined(SD_SPI_BUFFER)
+#if SD_SPI_NUM_BUFFERS > 1
+	card->queued_buffer_index = 0;
+	card->num_queued_buffers = 0;
+	card->sd_spi_buffer = card->block_buffers[0];
+#endif
+	sd_spi_clear_buffer();
+	card->is_buffer_written = 1;
+	card->buffered_block_address = card->continuous_block_address;
+#endif
+
+	return error;
+}
+
+static int8_t
+sd_spi_stop_failed_stream(
+	int8_t	error
+)
+{
+	sd_spi_stop_failed_write(error);
+	card->continuous_block_address = card->continuous_start_block_address +
+									 card->num_well_written_blocks;
+
+	return error;
+}
+
+static int8_t
+sd_spi_check_write_status(
+	int8_t	response
+)
+{
+	if (card->status_check == SD_SPI_STATUS_CHECK_ALWAYS ||
+		(card->status_check == SD_SPI_STATUS_CHECK_ON_ERROR && response))
+	{
+		int8_t status = sd_spi_card_status();
+
+		return response ? response : status;
+	}
+
+	/* The errors stay in the status of the card until it is read. */
+	if (card->status_check == SD_SPI_STATUS_CHECK_AT_SYNC)
+	{
+		card->is_status_check_pending = 1;
+	}
+
+	card->num_status_checks_skipped++;
+	sd_spi_unselect_card();
+
+	return response;
+}
+
+static int8_t
+sd_spi_read_in_data(
+	uint32_t 	block_address,
+	void	 	*data_buffer,
+	uint16_t 	number_of_bytes,
+	uint16_t 	byte_offset
+)
+{
+	uint8_t blocks_per_page = card->page_size >> 9;
+
+#if SD_SPI_MAX_ERASED_EXTENTS > 0
+	/* Erased pages are filled in without reading them from the card. */
+	if (!card->is_read_write_continuous &&
+		sd_spi_is_erased(block_address * blocks_per_page, blocks_per_page))
+	{
+#if defined(SD_SPI_BUFFER)
+		/* Bytes that were written to the buffer are kept. */
+		memset(card->sd_spi_buffer, card->erased_value, card->written_start);
+		memset(card->sd_spi_buffer + card->written_end, card->erased_value,
+			   card->page_size - card->written_end);
+		card->buffered_block_address = block_address;
+		card->is_buffer_current = 1;
+#else
+		memset(data_buffer, card->erased_value, number_of_bytes);
+#endif
+		card->num_erased_blocks_read += blocks_per_page;
+
+		return SD_ERR_OK;
+	}
+#endif
+
+	sd_spi_select_card();
+	sd_spi_emulate_busy(0);
+
+	if (!card->is_read_write_continuous)
+	{
+		sd_spi_emulate_transfer(SD_EMULATOR_COMMAND_BYTES);
+	}
+
+	uint8_t block;
+	for (block = 0; block < blocks_per_page; block++)
+	{
+		sd_spi_advance_clock((uint64_t) SD_EMULATOR_READ_ACCESS_US * 1000);
+		sd_spi_emulate_transfer(515);
+	}
+
+	/* The blocks of a page are read with a multiple block read that has to
+	   be stopped. */
+	if (!card->is_read_write_continuous && blocks_per_page > 1)
+	{
+		sd_spi_emulate_transfer(SD_EMULATOR_COMMAND_BYTES);
+	}
+
+#if defined(SD_SPI_BUFFER)	/* Read page into sd_spi_buffer if it is defined. */
+	/* Bytes that were written to the buffer before the block was read in are
+	   kept. */
+	uint8_t page[SD_SPI_MAX_PAGE_SIZE];
+
+	if (sd_spi_read_card_file((uint64_t) block_address * card->page_size,
+							  page, card->page_size))
+	{
+		return SD_ERR_READ_FAILURE;
+	}
+	memcpy(card->sd_spi_buffer, page, card->written_start);
+	memcpy(card->sd_spi_buffer + card->written_end, page + card->written_end,
+		   card->page_size - card->written_end);
+
+	if (card->is_read_write_continuous)
+	{
+		card->buffered_block_address = card->continuous_block_address;
+		card->continuous_block_address++;
+	}
+	else
+	{
+		card->buffered_block_address = block_address;
+	}
+
+	card->is_buffer_current = 1;
+#else
+	if (sd_spi_read_card_file((uint64_t) block_address * card->page_size +
+							  byte_offset, data_buffer, number_of_bytes))
+	{
+		return SD_ERR_READ_FAILURE;
+	}
+#endif
+
+	SD_SPI_COUNT(num_reads, blocks_per_page);
+	return SD_ERR_OK;
+}
+
+uint32_t
+sd_spi_millis(
+	void
+)
+{
+	return (uint32_t) (sd_spi_emulated_time() / 1000000);
+}
+
+static int
+sd_spi_card_file(
+	void
+)
+{
+	sd_spi_emulated_card_t *emulated_card =
+		&emulated_cards[card->chip_select_pin];
+
+	if (!emulated_card->is_file_open)
+	{
+		char file_name[16];
+		sprintf(file_name, "data_%u.raw", card->chip_select_pin);
+
+		if ((emulated_card->fd = open(file_name, O_RDWR | O_CREAT, 0644)) == -1)
+		{
+			return -1;
+		}
+
+		emulated_card->is_file_open = 1;
+	}
+
+	return emulated_card->fd;
+}
+
+static uint8_t
+sd_spi_read_card_file(
+	uint64_t	byte_address,
+	void		*data,
+	size_t		number_of_bytes
+)
+{
+	int fd = sd_spi_card_file();
+	uint8_t *bytes = (uint8_t *) data;
+
+	while (number_of_bytes > 0)
+	{
+		ssize_t num_read = fd == -1 ? -1 :
+						   pread(fd, bytes, number_of_bytes,
+								 (off_t) byte_address);
+
+		if (num_read == -1 && errno == EINTR)
+		{
+			continue;
+		}
+		else if (num_read == -1)
+		{
+			return 1;
+		}
+		else if (num_read == 0)
+		{
+			memset(bytes, 0, number_of_bytes);
+			break;
+		}
+
+		bytes += num_read;
+		byte_address += num_read;
+		number_of_bytes -= num_read;
+	}
+
+	return 0;
+}
+
+static uint8_t
+sd_spi_write_card_file(
+	uint64_t	byte_address,
+	const void	*data,
+	size_t		number_of_bytes
+)
+{
+	int fd = sd_spi_card_file();
+	const uint8_t *bytes = (const uint8_t *) data;
+
+	while (number_of_bytes > 0)
+	{
+		ssize_t num_written = fd == -1 ? -1 :
+							  pwrite(fd, bytes, number_of_bytes,
+									 (off_t) byte_address);
+
+		if (num_written == -1 && errno == EINTR)
+		{
+			continue;
+		}
+		else if (num_written == -1)
+		{
+			return 1;
+		}
+
+		bytes += num_written;
+		byte_address += num_written;
+		number_of_bytes -= num_written;
+	}
+
+	return 0;
+}
+
+static uint64_t
+sd_spi_emulated_time(
+	void
+)
+{
+#if defined(SD_SPI_THREAD_SAFE)
+	return __atomic_load_n(&emulated_time_ns, __ATOMIC_RELAXED);
+#else
+	return emulated_time_ns;
+#endif
+}
+
+static void
+sd_spi_advance_clock(
+	uint64_t time_ns
+)
+{
+#if defined(SD_SPI_THREAD_SAFE)
+	__atomic_fetch_add(&emulated_time_ns, time_ns, __ATOMIC_RELAXED);
+#else
+	emulated_time_ns += time_ns;
+#endif
+}
+
+static uint64_t
+sd_spi_advance_clock_to(
+	uint64_t time_ns
+)
+{
+#if defined(SD_SPI_THREAD_SAFE)
+	/* The clock is shared by the threads, so it only moves forward. */
+	uint64_t current_time_ns = __atomic_load_n(&emulated_time_ns,
+											   __ATOMIC_RELAXED);
+
+	while (current_time_ns < time_ns &&
+		   !__atomic_compare_exchange_n(&emulated_time_ns, &current_time_ns,
+										time_ns, 1, __ATOMIC_RELAXED,
+										__ATOMIC_RELAXED));
+
+	return current_time_ns < time_ns ? time_ns : current_time_ns;
+#else
+	if (emulated_time_ns < time_ns)
+	{
+		emulated_time_ns = time_ns;
+	}
+
+	return emulated_time_ns;
+#endif
+}
+
+static void
+sd_spi_emulate_transfer(
+	uint32_t number_of_bytes
+)
+{
+	sd_spi_advance_clock((uint64_t) number_of_bytes * SD_EMULATOR_BYTE_TIME_NS);
+}
+
+static void
+sd_spi_emulate_busy(
+	uint32_t busy_time_us
+)
+{
+#if SD_SPI_MAX_QUEUED_ERASES > 0
+	/* The card only takes commands again once a queued erase is done. */
+	if (card->is_erase_in_progress)
+	{
+		sd_spi_wait_for_queued_erase();
+	}
+#endif
+
+	sd_spi_emulated_card_t *emulated_card =
+		&emulated_cards[card->chip_select_pin];
+
+	emulated_card->busy_until_ns =
+		sd_spi_advance_clock_to(emulated_card->busy_until_ns) +
+		(uint64_t) busy_time_us * 1000;
+}
+
+#if defined(SD_SPI_BUFFER)
+static int8_t
+sd_spi_fetch_buffer(
+	void
+)
+{
+	/* The written bytes are skipped by sd_spi_read_in_data() and stay in the
+	   range of changed bytes. */
+	int8_t response = sd_spi_read_in_data(card->buffered_block_address,
+										  card->sd_spi_buffer, card->page_size,
+										  0);
+	sd_spi_unselect_card();
+
+	return response;
+}
+#endif
+
+static int8_t
+sd_spi_read_blocks_direct(
+	uint32_t	block_address,
+	uint8_t		*data_buffer,
+	uint32_t	num_blocks
+)
+{
+#if SD_SPI_MAX_ERASED_EXTENTS > 0
+	if (sd_spi_is_erased(block_address, num_blocks))
+	{
+		memset(data_buffer, card->erased_value, num_blocks << 9);
+		card->num_erased_blocks_read += num_blocks;
+
+		return SD_ERR_OK;
+	}
+#endif
+
+	sd_spi_select_card();
+
+	if (sd_spi_read_card_file((uint64_t) block_address << 9, data_buffer,
+							  (size_t) num_blocks << 9))
+	{
+		return SD_ERR_READ_FAILURE;
+	}
+
+	/* Read command, access time, token, data and CRC of each block and then
+	   the stop command. */
+	sd_spi_emulate_busy(0);
+	sd_spi_emulate_transfer(SD_EMULATOR_COMMAND_BYTES);
+
+	uint32_t i;
+	for (i = 0; i < num_blocks; i++)
+	{
+		sd_spi_advance_clock((uint64_t) SD_EMULATOR_READ_ACCESS_US * 1000);
+		sd_spi_emulate_transfer(515);
+	}
+
+	sd_spi_emulate_transfer(SD_EMULATOR_COMMAND_BYTES);
+	SD_SPI_COUNT(num_reads, num_blocks);
+
+	sd_spi_unselect_card();
+	return SD_ERR_OK;
+}
+
+static int8_t
+sd_spi_write_blocks_direct(
+	uint32_t	block_address,
+	uint8_t		*data,
+	uint32_t	num_blocks
+)
+{
+#if SD_SPI_MAX_ERASED_EXTENTS > 0
+	sd_spi_remove_erased(block_address, num_blocks);
+#endif
+
+	sd_spi_select_card();
+
+	/* The card rejects the first block past its end. */
+	uint32_t num_accepted_blocks = num_blocks;
+
+	if (block_address >= sd_spi_card_size())
+	{
+		num_accepted_blocks = 0;
+	}
+	else if (num_blocks > sd_spi_card_size() - block_address)
+	{
+		num_accepted_blocks = sd_spi_card_size() - block_address;
+	}
+
+	if (sd_spi_write_card_file((uint64_t) block_address << 9, data,
+							   (size_t) num_accepted_blocks << 9))
+	{
+		return SD_ERR_WRITE_FAILURE;
+	}
+
+	/* Pre-erase and write commands, then every block is programmed as a
+	   pre-erased block. The stop token waits for the last one. */
+	sd_spi_emulate_busy(0);
+	sd_spi_emulate_transfer(3 * SD_EMULATOR_COMMAND_BYTES);
+
+	uint32_t i;
+	for (i = 0; i < num_accepted_blocks; i++)
+	{
+		sd_spi_emulate_busy(0);
+		sd_spi_emulate_transfer(515);
+		sd_spi_emulate_busy(SD_EMULATOR_PRE_ERASED_WRITE_BUSY_US);
+	}
+
+	if (num_accepted_blocks < num_blocks)
+	{
+		sd_spi_emulate_busy(0);
+		sd_spi_emulate_transfer(515);
+		SD_SPI_COUNT(num_writes, num_accepted_blocks);
+
+		card->continuous_start_block_address = block_address;
+		emulated_cards[card->chip_select_pin].num_written_blocks =
+			num_accepted_blocks;
+
+		return sd_spi_stop_failed_stream(SD_ERR_WRITE_DATA_REJECTED);
+	}
+
+	sd_spi_emulate_transfer(1);
+	sd_spi_emulate_busy(0);
+	SD_SPI_COUNT(num_writes, num_blocks);
+
+	sd_spi_unselect_card();
+	return sd_spi_card_status();
+}
+
+static int8_t
+sd_spi_write_partial_page(
+	uint32_t	page_address,
+	void		*data,
+	uint16_t	number_of_bytes,
+	uint16_t	byte_offset
+)
+{
+#if defined(SD_SPI_BUFFER)
+	return sd_spi_write(page_address, data, number_of_bytes, byte_offset);
+#else
+	/* Without the buffer, only the blocks of the page that change are read,
+	   modified and written back. */
+	uint32_t block_address = page_address * (card->page_size >> 9) +
+							 (byte_offset >> 9);
+	uint8_t *source = data;
+	uint8_t block[512];
+	int8_t response;
+
+	byte_offset &= 511;
+
+	while (number_of_bytes > 0)
+	{
+		uint16_t block_bytes = 512 - byte_offset;
+
+		if (block_bytes > number_of_bytes)
+		{
+			block_bytes = number_of_bytes;
+		}
+
+		if ((response = sd_spi_read_blocks_direct(block_address, block, 1)))
+		{
+			return response;
+		}
+
+		memcpy(block + byte_offset, source, block_bytes);
+
+		if ((response = sd_spi_write_blocks_direct(block_address, block, 1)))
+		{
+			return response;
+		}
+
+		source += block_bytes;
+		number_of_bytes -= block_bytes;
+		byte_offset = 0;
+		block_address++;
+	}
+
+	return SD_ERR_OK;
+#endif
+}
+
+static uint16_t
+sd_spi_pull_stream_data(
+	sd_spi_write_stream_callback_t	callback,
+	void							*context,
+	uint32_t						block_address,
+	uint16_t						byte_offset,
+	uint8_t							*chunk
+)
+{
+	uint16_t max_bytes = 512 - byte_offset;
+
+	if (max_bytes > SD_SPI_STREAM_CHUNK_SIZE)
+	{
+		max_bytes = SD_SPI_STREAM_CHUNK_SIZE;
+	}
+
+	uint16_t number_of_bytes = callback(context, block_address, byte_offset,
+										chunk, max_bytes);
+
+	return number_of_bytes > max_bytes ? max_bytes : number_of_bytes;
+}
+
+static int8_t
+sd_spi_probe_erased_value(
+	uint32_t	block_address
+)
+{
+	if (card->is_erased_value_known)
+	{
+		return SD_ERR_OK;
+	}
+
+	uint8_t value;
+	int8_t response;
+	if ((response = sd_spi_read_stream(block_address, 1,
+									   sd_spi_probe_erased_value_callback,
+									   &value)))
+	{
+		return response;
+	}
+
+	card->erased_value = value;
+	card->is_erased_value_known = 1;
+
+	return SD_ERR_OK;
+}
+
+static uint8_t
+sd_spi_probe_erased_value_callback(
+	void		*context,
+	uint32_t	block_address,
+	uint16_t	byte_offset,
+	uint8_t		*data,
+	uint16_t	number_of_bytes
+)
+{
+	*(uint8_t *) context = data[0];
+
+	return 1;
+}
+
+#if SD_SPI_MAX_ERASED_EXTENTS > 0
+static void
+sd_spi_add_erased(
+	uint32_t	start_block_address,
+	uint32_t	num_blocks
+)
+{
+	uint32_t end_block_address = start_block_address + num_blocks;
+	uint8_t i = 0;
+
+	/* Merge the ranges that overlap or touch the new one into it. */
+	while (i < card->num_erased_extents)
+	{
+		sd_spi_block_range_t *extent = &card->erased_extents[i];
+		uint32_t extent_end = extent->start_block_address + extent->num_blocks;
+
+		if (extent->start_block_address > end_block_address ||
+			extent_end < start_block_address)
+		{
+			i++;
+			continue;
+		}
+
+		if (extent->start_block_address < start_block_address)
+		{
+			start_block_address = extent->start_block_address;
+		}
+
+		if (extent_end > end_block_address)
+		{
+			end_block_address = extent_end;
+		}
+
+		*extent = card->erased_extents[--card->num_erased_extents];
+	}
+
+	if (card->num_erased_extents == SD_SPI_MAX_ERASED_EXTENTS)
+	{
+		uint8_t smallest = 0;
+
+		for (i = 1; i < card->num_erased_extents; i++)
+		{
+			if (card->erased_extents[i].num_blocks <
+				card->erased_extents[smallest].num_blocks)
+			{
+				smallest = i;
+			}
+		}
+
+		if (card->erased_extents[smallest].num_blocks >=
+			end_block_address - start_block_address)
+		{
+			return;
+		}
+
+		card->erased_extents[smallest] =
+			card->erased_extents[--card->num_erased_extents];
+	}
+
+	sd_spi_block_range_t *extent =
+		&card->erased_extents[card->num_erased_extents++];
+	extent->start_block_address = start_block_address;
+	extent->num_blocks = end_block_address - start_block_address;
+}
+
+static void
+sd_spi_remove_erased(
+	uint32_t	start_block_address,
+	uint32_t	num_blocks
+)
+{
+	uint32_t end_block_address = start_block_address + num_blocks;
+	uint8_t i = 0;
+
+	while (i < card->num_erased_extents)
+	{
+		sd_spi_block_range_t *extent = &card->erased_extents[i];
+		uint32_t extent_start = extent->start_block_address;
+		uint32_t extent_end = extent_start + extent->num_blocks;
+
+		if (extent_start >= end_block_address ||
+			extent_end <= start_block_address)
+		{
+			i++;
+		}
+		else if (extent_start < start_block_address &&
+				 extent_end > end_block_address)
+		{
+			/* The written blocks split the range in two. If there is no room
+			   for both parts, the larger one is kept. */
+			if (card->num_erased_extents < SD_SPI_MAX_ERASED_EXTENTS)
+			{
+				sd_spi_block_range_t *tail =
+					&card->erased_extents[card->num_erased_extents++];
+				tail->start_block_address = end_block_address;
+				tail->num_blocks = extent_end - end_block_address;
+				extent->num_blocks = start_block_address - extent_start;
+			}
+			else if (extent_end - end_block_address >
+					 start_block_address - extent_start)
+			{
+				extent->start_block_address = end_block_address;
+				extent->num_blocks = extent_end - end_block_address;
+			}
+			else
+			{
+				extent->num_blocks = start_block_address - extent_start;
+			}
+
+			i++;
+		}
+		else if (extent_start < start_block_address)
+		{
+			extent->num_blocks = start_block_address - extent_start;
+			i++;
+		}
+		else if (extent_end > end_block_address)
+		{
+			extent->start_block_address = end_block_address;
+			extent->num_blocks = extent_end - end_block_address;
+			i++;
+		}
+		else
+		{
+			*extent = card->erased_extents[--card->num_erased_extents];
+		}
+	}
+}
+
+static uint8_t
+sd_spi_is_erased(
+	uint32_t	start_block_address,
+	uint32_t	num_blocks
+)
+{
+	uint8_t i;
+	for (i = 0; i < card->num_erased_extents; i++)
+	{
+		sd_spi_block_range_t *extent = &card->erased_extents[i];
+
+		if (start_block_address >= extent->start_block_address &&
+			start_block_address - extent->start_block_address + num_blocks <=
+			extent->num_blocks)
+		{
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int8_t
+sd_spi_read_stream_erased(
+	uint32_t						start_block_address,
+	uint32_t						num_blocks,
+	sd_spi_read_stream_callback_t	callback,
+	void							*context
+)
+{
+	uint8_t chunk[SD_SPI_STREAM_CHUNK_SIZE];
+	uint32_t block_address;
+
+	for (block_address = start_block_address;
+		 block_address < start_block_address + num_blocks;
+		 block_address++)
+	{
+		card->num_erased_blocks_read++;
+
+		uint16_t byte_offset;
+		for (byte_offset = 0; byte_offset < 512;
+			 byte_offset += SD_SPI_STREAM_CHUNK_SIZE)
+		{
+			uint16_t number_of_bytes = 512 - byte_offset;
+
+			if (number_of_bytes > SD_SPI_STREAM_CHUNK_SIZE)
+			{
+				number_of_bytes = SD_SPI_STREAM_CHUNK_SIZE;
+			}
+
+			/* The callback may have changed the chunk. */
+			memset(chunk, card->erased_value, number_of_bytes);
+
+			if (callback(context, block_address, byte_offset, chunk,
+						 number_of_bytes))
+			{
+				return SD_ERR_OK;
+			}
+		}
+	}
+
+	return SD_ERR_OK;
+}
+#endif
+
+static int8_t
+sd_spi_start_erase(
+	uint32_t	start_block_address,
+	uint32_t	end_block_address
+)
+{
+#if defined(SD_SPI_BUFFER)
+	int8_t response;
+	if ((response = sd_spi_flush()))
+	{
+		return response;
+	}
+
+	/* The buffer has to be read in again if its page is erased. */
+	uint32_t buffered_start = card->buffered_block_address *
+							  (card->page_size >> 9);
+	uint32_t buffered_end = buffered_start + (card->page_size >> 9) - 1;
+
+	if (buffered_start <= end_block_address &&
+		buffered_end >= start_block_address)
+	{
+		card->is_buffer_current = 0;
+	}
+#endif
+
+	static const uint8_t erased_block[512] = {0};
+	uint64_t block_address;
+
+	for (block_address = start_block_address;
+		 block_address <= end_block_address;
+		 block_address++)
+	{
+		if (sd_spi_write_card_file(block_address << 9, erased_block, 512))
+		{
+			return SD_ERR_ERASE_FAILURE;
+		}
+	}
+
+	/* Every allocation unit that is touched is erased. The blocks of a partly
+	   erased unit that are kept have to be moved first. */
+	uint32_t num_units = end_block_address / SD_EMULATOR_AU_BLOCKS -
+						 start_block_address / SD_EMULATOR_AU_BLOCKS + 1;
+	uint32_t num_kept_blocks = start_block_address % SD_EMULATOR_AU_BLOCKS +
+							   SD_EMULATOR_AU_BLOCKS - 1 -
+							   end_block_address % SD_EMULATOR_AU_BLOCKS;
+
+	sd_spi_emulate_transfer(3 * SD_EMULATOR_COMMAND_BYTES);
+	sd_spi_emulate_busy(SD_EMULATOR_ERASE_BUSY_US +
+						num_units * SD_EMULATOR_ERASE_AU_US +
+						num_kept_blocks * SD_EMULATOR_ERASE_KEPT_BLOCK_US);
+
+	/* The card keeps erasing while it is deselected. */
+	sd_spi_unselect_card();
+
+	return SD_ERR_OK;
+}
+
+static void
+sd_spi_end_erase(
+	uint32_t	start_block_address,
+	uint32_t	end_block_address
+)
+{
+	if (!card->is_erased_value_known)
+	{
+		return;
+	}
+
+#if SD_SPI_MAX_ERASED_EXTENTS > 0
+	sd_spi_add_erased(start_block_address,
+					  end_block_address - start_block_address + 1);
+#endif
+
+#if defined(SD_SPI_BUFFER)
+	/* A clean buffer whose whole page was erased is filled in with the erased
+	   value instead of being read in again. */
+	uint32_t buffered_start = card->buffered_block_address *
+							  (card->page_size >> 9);
+	uint32_t buffered_end = buffered_start + (card->page_size >> 9) - 1;
+
+	if (card->is_buffer_written && buffered_start >= start_block_address &&
+		buffered_end <= end_block_address)
+	{
+		memset(card->sd_spi_buffer, card->erased_value, card->page_size);
+		card->is_buffer_current = 1;
+	}
+#endif
+}
+
+#if SD_SPI_MAX_QUEUED_ERASES > 0
+static void
+sd_spi_dequeue_erase(
+	sd_spi_block_range_t	*range
+)
+{
+	*range = card->queued_erases[0];
+	card->num_queued_erases--;
+	memmove(card->queued_erases, card->queued_erases + 1,
+			card->num_queued_erases * sizeof(sd_spi_block_range_t));
+}
+
+static int8_t
+sd_spi_wait_for_queued_erase(
+	void
+)
+{
+	card->is_erase_in_progress = 0;
+
+	sd_spi_emulate_busy(0);
+
+	card->is_erase_done = 1;
+
+	return SD_ERR_OK;
+}
+
+static int8_t
+sd_spi_record_queued_erase(
+	void
+)
+{
+	sd_spi_block_range_t range;
+	sd_spi_dequeue_erase(&range);
+	card->is_erase_done = 0;
+
+	int8_t response;
+	if ((response = sd_spi_probe_erased_value(range.start_block_address)))
+	{
+		return response;
+	}
+
+	sd_spi_end_erase(range.start_block_address,
+					 range.start_block_address + range.num_blocks - 1);
+
+	return SD_ERR_OK;
+}
+
+static int8_t
+sd_spi_run_erase_queue(
+	uint8_t	is_waiting
+)
+{
+	int8_t response;
+
+	while (card->num_queued_erases > 0 && !card->is_read_write_continuous)
+	{
+		if (card->is_erase_in_progress)
+		{
+			/* Leave the erase in progress if the card is still busy. */
+			if (!is_waiting)
+			{
+				sd_spi_emulate_transfer(1);
+
+				if (emulated_cards[card->chip_select_pin].busy_until_ns >
+					sd_spi_emulated_time())
+				{
+					return SD_ERR_OK;
+				}
+			}
+
+			if ((response = sd_spi_wait_for_queued_erase()))
+			{
+				return response;
+			}
+		}
+
+		if (card->is_erase_done)
+		{
+			if ((response = sd_spi_record_queued_erase()))
+			{
+				return response;
+			}
+
+			continue;
+		}
+
+		sd_spi_block_range_t *range = &card->queued_erases[0];
+
+		if ((response = sd_spi_start_erase(range->start_block_address,
+										   range->start_block_address +
+										   range->num_blocks - 1)))
+		{
+			/* The erase is dropped so that it does not hold up the ones behind
+			   it. */
+			sd_spi_block_range_t failed_range;
+			sd_spi_dequeue_erase(&failed_range);
+
+			return response;
+		}
+
+		card->is_erase_in_progress = 1;
 	}
 
-	sd_spi_unselect_card();
 	return SD_ERR_OK;
 }
+#endif
+
+#if defined(SD_SPI_BUFFER) && SD_SPI_NUM_BUFFERS > 1
+static int8_t
+sd_spi_write_queued_buffer(
+	void
+)
+{
+	int8_t response = sd_spi_write_out_data(card->continuous_block_address,
+											card->block_buffers[
+												card->queued_buffer_index],
+											card->page_size, 0);
+	sd_spi_unselect_card();
+
+	/* A failed write stopped the continuous write and emptied the queue. */
+	if (!card->is_read_write_continuous)
+	{
+		return response;
+	}
+
+	card->queued_buffer_index = (card->queued_buffer_index + 1) %
+								SD_SPI_NUM_BUFFERS;
+	card->num_queued_buffers--;
+
+	/* The buffer in use holds the block after the queued ones. */
+	card->buffered_block_address = card->continuous_block_address +
+								   card->num_queued_buffers;
+
+	return response;
+}
+#endif
+
+static void
+sd_spi_select_card(
+	void
+)
+{
+#if defined(USE_HARDWARE_SPI)
+
+#else
+	if (card->is_chip_select_high)
+	{
+    	card->is_chip_select_high = 0;
+	}
+#endif
+}
+
+static void
+sd_spi_unselect_card(
+	void
+)
+{
+#if defined(USE_HARDWARE_SPI)
+
+#else
+	if (!card->is_chip_select_high)
+	{
+    	card->is_chip_select_high = 1;
+	}
+#endif
+}
+
+#if defined(SD_SPI_THREAD_SAFE)
+/* One lock for each emulated card (indexed by chip select pin). They are
+   recursive so that stream callbacks can call the library. */
+static pthread_mutex_t card_locks[256];
+static pthread_once_t card_locks_once = PTHREAD_ONCE_INIT;
+
+static void
+sd_spi_init_card_locks(
+	void
+)
+{
+	pthread_mutexattr_t attributes;
+	pthread_mutexattr_init(&attributes);
+	pthread_mutexattr_settype(&attributes, PTHREAD_MUTEX_RECURSIVE);
+
+	uint16_t i;
+	for (i = 0; i < 256; i++)
+	{
+		pthread_mutex_init(&card_locks[i], &attributes);
+	}
+
+	pthread_mutexattr_destroy(&attributes);
+}
+
+static void
+sd_spi_lock_card(
+	uint8_t chip_select_pin
+)
+{
+	pthread_once(&card_locks_once, sd_spi_init_card_locks);
+	pthread_mutex_lock(&card_locks[chip_select_pin]);
+}
+
+static uint8_t
+sd_spi_lock_current_card(
+	void
+)
+{
+	uint8_t chip_select_pin = card->chip_select_pin;
+	sd_spi_lock_card(chip_select_pin);
+
+	return chip_select_pin;
+}
+
+static void
+sd_spi_unlock_card(
+	uint8_t chip_select_pin
+)
+{
+	pthread_mutex_unlock(&card_locks[chip_select_pin]);
+}
+
+#undef sd_spi_init
+int8_t
+sd_spi_init(
+	uint8_t chip_select_pin
+)
+{
+	sd_spi_lock_card(chip_select_pin);
+	int8_t result = sd_spi_init_unlocked(chip_select_pin);
+	sd_spi_unlock_card(chip_select_pin);
+
+	return result;
+}
+
+#undef sd_spi_set_page_size
+int8_t
+sd_spi_set_page_size(
+	uint16_t page_size
+)
+{
+	uint8_t chip_select_pin = sd_spi_lock_current_card();
+	int8_t result = sd_spi_set_page_size_unlocked(page_size);
+	sd_spi_unlock_card(chip_select_pin);
+
+	return result;
+}
+
+#undef sd_spi_set_status_check
+int8_t
+sd_spi_set_status_check(
+	uint8_t status_check
+)
+{
+	uint8_t chip_select_pin = sd_spi_lock_current_card();
+	int8_t result = sd_spi_set_status_check_unlocked(status_check);
+	sd_spi_unlock_card(chip_select_pin);
+
+	return result;
+}
+
+#undef sd_spi_write
+int8_t
+sd_spi_write(
+	uint32_t 	block_address,
+	void	 	*data,
+	uint16_t 	number_of_bytes,
+	uint16_t 	byte_offset
+)
+{
+	uint8_t chip_select_pin = sd_spi_lock_current_card();
+	int8_t result = sd_spi_write_unlocked(block_address, data, number_of_bytes,
+										  byte_offset);
+	sd_spi_unlock_card(chip_select_pin);
+
+	return result;
+}
+
+#undef sd_spi_write_begin_fresh
+int8_t
+sd_spi_write_begin_fresh(
+	uint32_t 	block_address
+)
+{
+	uint8_t chip_select_pin = sd_spi_lock_current_card();
+	int8_t result = sd_spi_write_begin_fresh_unlocked(block_address);
+	sd_spi_unlock_card(chip_select_pin);
+
+	return result;
+}
+
+#undef sd_spi_write_block
+int8_t
+sd_spi_write_block(
+	uint32_t 	block_address,
+	void	 	*data
+)
+{
+	uint8_t chip_select_pin = sd_spi_lock_current_card();
+	int8_t result = sd_spi_write_block_unlocked(block_address, data);
+	sd_spi_unlock_card(chip_select_pin);
+
+	return result;
+}
+
+#undef sd_spi_flush
+int8_t
+sd_spi_flush(
+	void
+)
+{
+	uint8_t chip_select_pin = sd_spi_lock_current_card();
+	int8_t result = sd_spi_flush_unlocked();
+	sd_spi_unlock_card(chip_select_pin);
+
+	return result;
+}
+
+#undef sd_spi_sync
+int8_t
+sd_spi_sync(
+	void
+)
+{
+	uint8_t chip_select_pin = sd_spi_lock_current_card();
+	int8_t result = sd_spi_sync_unlocked();
+	sd_spi_unlock_card(chip_select_pin);
+
+	return result;
+}
+
+#undef sd_spi_write_continuous_start
+int8_t
+sd_spi_write_continuous_start(
+	uint32_t 	start_block_address,
+	uint32_t 	num_blocks_pre_erase
+)
+{
+	uint8_t chip_select_pin = sd_spi_lock_current_card();
+	int8_t result = sd_spi_write_continuous_start_unlocked(start_block_address,
+														   num_blocks_pre_erase);
+	sd_spi_unlock_card(chip_select_pin);
+
+	return result;
+}
+
+#undef sd_spi_write_continuous
+int8_t
+sd_spi_write_continuous(
+	void	 	*data,
+	uint16_t 	number_of_bytes,
+	uint16_t 	byte_offset
+)
+{
+	uint8_t chip_select_pin = sd_spi_lock_current_card();
+	int8_t result = sd_spi_write_continuous_unlocked(data, number_of_bytes,
+													 byte_offset);
+	sd_spi_unlock_card(chip_select_pin);
+
+	return result;
+}
 
-uint32_t
-sd_spi_card_size(
+#undef sd_spi_write_continuous_next
+int8_t
+sd_spi_write_continuous_next(
 	void
 )
 {
-	return SD_NUMBER_OF_BLOCKS;
+	uint8_t chip_select_pin = sd_spi_lock_current_card();
+	int8_t result = sd_spi_write_continuous_next_unlocked();
+	sd_spi_unlock_card(chip_select_pin);
+
+	return result;
 }
 
+#undef sd_spi_poll
 int8_t
-sd_spi_read_cid_register(
-	sd_spi_cid_t *cid
+sd_spi_poll(
+	void
 )
 {
-	cid->mid = 0x03;
-	memcpy(cid->oid, "SD", 2);
-	memcpy(cid->pnm, "SU02G", 5);
+	uint8_t chip_select_pin = sd_spi_lock_current_card();
+	int8_t result = sd_spi_poll_unlocked();
+	sd_spi_unlock_card(chip_select_pin);
 
-	cid->prv_n = 0x8;
-	cid->prv_m = 0x0;
-
-	cid->psn_high = 0x07;
-	cid->psn_mid_high = 0xD0;
-	cid->psn_mid_low = 0xA2;
-	cid->psn_low = 0xA8;
+	return result;
+}
 
-	cid->mdt_year = 0x0A;
-	cid->mdt_month = 0x7;
-	cid->crc = 0x7F;
+#undef sd_spi_is_busy
+uint8_t
+sd_spi_is_busy(
+	void
+)
+{
+	uint8_t chip_select_pin = sd_spi_lock_current_card();
+	uint8_t result = sd_spi_is_busy_unlocked();
+	sd_spi_unlock_card(chip_select_pin);
 
-	sd_spi_unselect_card();
-	return SD_ERR_OK;
+	return result;
 }
 
+#undef sd_spi_write_continuous_stop
 int8_t
-sd_spi_read_csd_register(
-	sd_spi_csd_t *csd
+sd_spi_write_continuous_stop(
+	void
 )
 {
-	csd->csd_structure = 0x1;
-	csd->taac = 0x0E;
-	csd->nsac = 0x00;
-	csd->tran_speed = 0x032;
-	csd->ccc_high = 0xF;
-	csd->ccc_low = 0xFF;
-	csd->max_read_bl_len = 0x0A;
-	csd->read_bl_partial = 0x0;
-	csd->write_bl_misalign = 0x0;
-	csd->read_bl_misalign = 0x0;
-	csd->dsr_imp = 0x0;
-
-	csd->cvsi.v2.c_size_high = 0x00;
-	csd->cvsi.v2.c_size_mid = 0x01;
-	csd->cvsi.v2.c_size_low = 0xD8;
+	uint8_t chip_select_pin = sd_spi_lock_current_card();
+	int8_t result = sd_spi_write_continuous_stop_unlocked();
+	sd_spi_unlock_card(chip_select_pin);
 
-	csd->erase_bl_en = 0x1;
-	csd->erase_sector_size = 0x7F;
-	csd->wp_grp_size = 0x00;
-	csd->wp_grp_enable = 0x0;
-	csd->r2w_factor = 0x2;
-	csd->write_bl_len = 0x9;
-	csd->write_bl_partial = 0x0;
-	csd->file_format_grp = 0x0;
-	csd->copy = 0x0;
-	csd->perm_write_protect = 0x0;
-	csd->tmp_write_protect = 0x0;
-	csd->file_format = 0x0;
-	csd->crc = 0x7F;
+	return result;
+}
 
-	sd_spi_unselect_card();
+#undef sd_spi_write_continuous_resume
+int8_t
+sd_spi_write_continuous_resume(
+	uint32_t	*block_address
+)
+{
+	uint8_t chip_select_pin = sd_spi_lock_current_card();
+	int8_t result = sd_spi_write_continuous_resume_unlocked(block_address);
+	sd_spi_unlock_card(chip_select_pin);
 
-	return SD_ERR_OK;
+	return result;
 }
 
+#undef sd_spi_write_stream
 int8_t
-sd_spi_card_status(
-	void
+sd_spi_write_stream(
+	uint32_t						start_block_address,
+	uint32_t						num_blocks,
+	sd_spi_write_stream_callback_t	callback,
+	void							*context
 )
 {
-	int8_t response = SD_ERR_OK;
+	uint8_t chip_select_pin = sd_spi_lock_current_card();
+	int8_t result = sd_spi_write_stream_unlocked(start_block_address,
+												 num_blocks, callback, context);
+	sd_spi_unlock_card(chip_select_pin);
 
-	sd_spi_unselect_card();
-	
-	return response;
+	return result;
 }
 
-uint32_t
-sd_spi_current_buffered_block(
-	void
+#undef sd_spi_read
+int8_t
+sd_spi_read(
+	uint32_t 	block_address,
+	void		*data_buffer,
+	uint16_t 	number_of_bytes,
+	uint16_t 	byte_offset
 )
 {
-	return card.buffered_block_address;
+	uint8_t chip_select_pin = sd_spi_lock_current_card();
+	int8_t result = sd_spi_read_unlocked(block_address, data_buffer,
+										 number_of_bytes, byte_offset);
+	sd_spi_unlock_card(chip_select_pin);
+
+	return result;
 }
 
-/* For debugging purposes */
+#undef sd_spi_pread
 int8_t
-print_page(
-	uint32_t 	block_address
+sd_spi_pread(
+	uint64_t	byte_address,
+	void		*data_buffer,
+	size_t		number_of_bytes
 )
 {
-	if ((fp = fopen("data.raw", "rb+")) == NULL)
-	{
-		return SD_ERR_READ_FAILURE;
-	}
+	uint8_t chip_select_pin = sd_spi_lock_current_card();
+	int8_t result = sd_spi_pread_unlocked(byte_address, data_buffer,
+										  number_of_bytes);
+	sd_spi_unlock_card(chip_select_pin);
 
-	uint8_t buffer[512];
+	return result;
+}
 
-	fseek(fp, block_address << 9, SEEK_SET);
-	fread(buffer, 512, 1, fp);
+#undef sd_spi_pwrite
+int8_t
+sd_spi_pwrite(
+	uint64_t	byte_address,
+	void		*data,
+	size_t		number_of_bytes
+)
+{
+	uint8_t chip_select_pin = sd_spi_lock_current_card();
+	int8_t result = sd_spi_pwrite_unlocked(byte_address, data, number_of_bytes);
+	sd_spi_unlock_card(chip_select_pin);
 
-	if (fclose(fp) != 0)
-	{
-		return SD_ERR_READ_FAILURE;
-	}
+	return result;
+}
 
-	printf("Page %d, Byte: %d\n", block_address, block_address * 512);
+#undef sd_spi_read_continuous_start
+int8_t
+sd_spi_read_continuous_start(
+	uint32_t start_block_address
+)
+{
+	uint8_t chip_select_pin = sd_spi_lock_current_card();
+	int8_t result = sd_spi_read_continuous_start_unlocked(start_block_address);
+	sd_spi_unlock_card(chip_select_pin);
 
-	uint16_t i;
-	for (i = 0; i < 512; i++)
-	{
-		if (i % 16 == 0)
-		{
-			printf("\n");
-		}
+	return result;
+}
 
-		printf("%d\t", buffer[i]);
-	}
+#undef sd_spi_read_continuous
+int8_t
+sd_spi_read_continuous(
+	void 		*data_buffer,
+	uint16_t 	number_of_bytes,
+	uint16_t 	byte_offset
+)
+{
+	uint8_t chip_select_pin = sd_spi_lock_current_card();
+	int8_t result = sd_spi_read_continuous_unlocked(data_buffer,
+													number_of_bytes,
+													byte_offset);
+	sd_spi_unlock_card(chip_select_pin);
 
-	printf("\n\n");
-	return 0;
+	return result;
 }
 
-static void
-sd_spi_clear_buffer(
+#undef sd_spi_read_continuous_next
+int8_t
+sd_spi_read_continuous_next(
 	void
 )
 {
-#if defined(SD_SPI_BUFFER)
-	uint16_t i;
-	for (i = 0; i < 512; i++) {
-		card.sd_spi_buffer[i] = 0;
-	}
+	uint8_t chip_select_pin = sd_spi_lock_current_card();
+	int8_t result = sd_spi_read_continuous_next_unlocked();
+	sd_spi_unlock_card(chip_select_pin);
 
-	card.is_buffer_written = 0;
-	card.is_buffer_current = 0;
-#endif
+	return result;
 }
 
-static int8_t
-sd_spi_write_out_data(
-	uint32_t	block_address,
-	void	 	*data,
-	uint16_t 	number_of_bytes,
-	uint16_t 	byte_offset
+#undef sd_spi_read_continuous_stop
+int8_t
+sd_spi_read_continuous_stop(
+	void
 )
 {
-	sd_spi_select_card();
+	uint8_t chip_select_pin = sd_spi_lock_current_card();
+	int8_t result = sd_spi_read_continuous_stop_unlocked();
+	sd_spi_unlock_card(chip_select_pin);
 
-	if ((fp = fopen("data.raw", "rb+")) == NULL)
-	{
-		return SD_ERR_WRITE_FAILURE;
-	}
+	return result;
+}
 
-	if (fseek(fp, block_address << 9, SEEK_SET) != 0)
-	{
-		return SD_ERR_WRITE_FAILURE;
-	}
+#undef sd_spi_read_stream
+int8_t
+sd_spi_read_stream(
+	uint32_t						start_block_address,
+	uint32_t						num_blocks,
+	sd_spi_read_stream_callback_t	callback,
+	void							*context
+)
+{
+	uint8_t chip_select_pin = sd_spi_lock_current_card();
+	int8_t result = sd_spi_read_stream_unlocked(start_block_address, num_blocks,
+												callback, context);
+	sd_spi_unlock_card(chip_select_pin);
 
-	uint8_t output_buffer[512];
-	uint16_t i;
+	return result;
+}
 
-	/* Pad data with 0. */
-	for (i = 0; i < byte_offset; i++)
-	{
-		output_buffer[i] = 0;
-	}
+#undef sd_spi_erase_all
+int8_t
+sd_spi_erase_all(
+	void
+)
+{
+	uint8_t chip_select_pin = sd_spi_lock_current_card();
+	int8_t result = sd_spi_erase_all_unlocked();
+	sd_spi_unlock_card(chip_select_pin);
 
-	/* Write block. */
-	for (i = byte_offset; i < byte_offset + number_of_bytes; i++)
-	{
-		output_buffer[i] = (((uint8_t*) data)[i - byte_offset]);
-	}
+	return result;
+}
 
-	/* Pad data with 0. */
-	for (i = byte_offset + number_of_bytes; i < 512; i++)
-	{
-		output_buffer[i] = 0;
-	}
+#undef sd_spi_erase_blocks
+int8_t
+sd_spi_erase_blocks(
+	uint32_t 	start_block_address,
+	uint32_t 	end_block_address
+)
+{
+	uint8_t chip_select_pin = sd_spi_lock_current_card();
+	int8_t result = sd_spi_erase_blocks_unlocked(start_block_address,
+												 end_block_address);
+	sd_spi_unlock_card(chip_select_pin);
 
-	if (card.is_read_write_continuous)
-	{
-		card.continuous_block_address++;
+	return result;
+}
 
-#if defined(SD_SPI_BUFFER)
-		card.buffered_block_address = card.continuous_block_address;
-#endif
-	}
+#undef sd_spi_mark_erased
+int8_t
+sd_spi_mark_erased(
+	uint32_t 	start_block_address,
+	uint32_t 	num_blocks
+)
+{
+	uint8_t chip_select_pin = sd_spi_lock_current_card();
+	int8_t result = sd_spi_mark_erased_unlocked(start_block_address,
+												num_blocks);
+	sd_spi_unlock_card(chip_select_pin);
 
-	fwrite(output_buffer, 512, 1, fp);
-	
-	if (fflush(fp) != 0)
-	{
-		return SD_ERR_WRITE_FAILURE;
-	}
+	return result;
+}
 
-	if (fclose(fp) != 0)
-	{
-		return SD_ERR_WRITE_FAILURE;
-	}
+#undef sd_spi_queue_erase
+int8_t
+sd_spi_queue_erase(
+	uint32_t 	start_block_address,
+	uint32_t 	end_block_address
+)
+{
+	uint8_t chip_select_pin = sd_spi_lock_current_card();
+	int8_t result = sd_spi_queue_erase_unlocked(start_block_address,
+												end_block_address);
+	sd_spi_unlock_card(chip_select_pin);
 
-	num_writes++;
-	return SD_ERR_OK;
+	return result;
 }
 
-static int8_t
-sd_spi_read_in_data(
-	uint32_t 	block_address,
-	void	 	*data_buffer,
-	uint16_t 	number_of_bytes,
-	uint16_t 	byte_offset
+#undef sd_spi_finish_erases
+int8_t
+sd_spi_finish_erases(
+	void
 )
 {
-	sd_spi_select_card();
+	uint8_t chip_select_pin = sd_spi_lock_current_card();
+	int8_t result = sd_spi_finish_erases_unlocked();
+	sd_spi_unlock_card(chip_select_pin);
 
-	if ((fp = fopen("data.raw", "rb+")) == NULL)
-	{
-		return SD_ERR_READ_FAILURE;
-	}
+	return result;
+}
 
-#if defined(SD_SPI_BUFFER)	/* Read block into sd_spi_buffer if it is defined. */
-	fseek(fp, block_address << 9, SEEK_SET);
-	fread(card.sd_spi_buffer, 512, 1, fp);
+#undef sd_spi_read_cid_register
+int8_t
+sd_spi_read_cid_register(
+	sd_spi_cid_t *cid
+)
+{
+	uint8_t chip_select_pin = sd_spi_lock_current_card();
+	int8_t result = sd_spi_read_cid_register_unlocked(cid);
+	sd_spi_unlock_card(chip_select_pin);
 
-	if (card.is_read_write_continuous)
-	{
-		card.buffered_block_address = card.continuous_block_address;
-		card.continuous_block_address++;
-	}
-	else
-	{
-		card.buffered_block_address = block_address;
-	}
+	return result;
+}
 
-	card.is_buffer_current = 1;
-#else
-	fseek(fp, (block_address << 9) + byte_offset, SEEK_SET);
-	fread(data_buffer, number_of_bytes, 1, fp);
-#endif
+#undef sd_spi_read_csd_register
+int8_t
+sd_spi_read_csd_register(
+	sd_spi_csd_t *csd
+)
+{
+	uint8_t chip_select_pin = sd_spi_lock_current_card();
+	int8_t result = sd_spi_read_csd_register_unlocked(csd);
+	sd_spi_unlock_card(chip_select_pin);
 
-	if (fclose(fp) != 0)
-	{
-		return SD_ERR_READ_FAILURE;
-	}
+	return result;
+}
 
-	num_reads++;
-	return SD_ERR_OK;
+#undef sd_spi_read_sd_status_register
+int8_t
+sd_spi_read_sd_status_register(
+	sd_spi_sd_status_t *sd_status
+)
+{
+	uint8_t chip_select_pin = sd_spi_lock_current_card();
+	int8_t result = sd_spi_read_sd_status_register_unlocked(sd_status);
+	sd_spi_unlock_card(chip_select_pin);
+
+	return result;
 }
 
-static void
-sd_spi_select_card(
-	void
+#undef sd_spi_read_scr_register
+int8_t
+sd_spi_read_scr_register(
+	sd_spi_scr_t *scr
 )
 {
-#if defined(USE_HARDWARE_SPI)
+	uint8_t chip_select_pin = sd_spi_lock_current_card();
+	int8_t result = sd_spi_read_scr_register_unlocked(scr);
+	sd_spi_unlock_card(chip_select_pin);
 
-#else
-	if (card.is_chip_select_high)
-	{
-    	card.is_chip_select_high = 0;
-	}
-#endif
+	return result;
 }
 
-static void
-sd_spi_unselect_card(
+#undef sd_spi_card_status
+int8_t
+sd_spi_card_status(
 	void
 )
 {
-#if defined(USE_HARDWARE_SPI)
+	uint8_t chip_select_pin = sd_spi_lock_current_card();
+	int8_t result = sd_spi_card_status_unlocked();
+	sd_spi_unlock_card(chip_select_pin);
 
-#else
-	if (!card.is_chip_select_high)
-	{
-    	card.is_chip_select_high = 1;
-	}
-#endif
+	return result;
+}
+
+#undef sd_spi_use_card
+void
+sd_spi_use_card(
+	sd_spi_card_t *new_card
+)
+{
+	uint8_t chip_select_pin = sd_spi_lock_current_card();
+	sd_spi_use_card_unlocked(new_card);
+	sd_spi_unlock_card(chip_select_pin);
 }
+#endif
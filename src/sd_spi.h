@@ -27,16 +27,8 @@
 @todo 		Use CMD6 during initialization to switch card to high speed mode if
 			it supports it. This will be helpful for the due since the SPI
 			speed can be up to 84MHz.
-@todo 		Allow setting CS high when card is in busy state for operations
-			instead of waiting. However, if an error is thrown for the
-			operation, the host will get that error on the next command it
-			sends.
 @todo 		Send_status should be sent after all busy signals
 			(look at ch 4.3.7).
-@todo 		Send stop_transmission if there was an error during
-			write continuous (and read continuous??).
-@todo 		Get the number of well written blocks for sequential writing just in
-			case if there was an error.
 @todo 		Card reads take up to 100ms and writes take up to 500ms. Make
 			timeouts reflect this.
 @todo 		Reduce the number of error codes.
@@ -58,10 +50,61 @@ extern "C" {
 /** Define to enable the block buffer. */
 #define SD_SPI_BUFFER
 
+/** The number of block buffers when buffering is enabled. With more than one,
+	sd_spi_write_continuous_next() queues the filled block and hands out an
+	empty buffer right away. The queued blocks are written by sd_spi_poll()
+	when the card is not busy, so the application can fill a block while the
+	card is still programming the previous one. */
+#if !defined(SD_SPI_NUM_BUFFERS)
+#define SD_SPI_NUM_BUFFERS 1
+#endif
+
+/** The number of bytes that sd_spi_read_stream() and sd_spi_write_stream()
+	pass to their callbacks at a time. It is also the amount of stack that a
+	stream uses for data. */
+#if !defined(SD_SPI_STREAM_CHUNK_SIZE)
+#define SD_SPI_STREAM_CHUNK_SIZE 32
+#endif
+
+/** The largest page size that can be set with sd_spi_set_page_size(). It is
+	the size of each block buffer, so it must be a multiple of 512 and at
+	most 32768. */
+#if !defined(SD_SPI_MAX_PAGE_SIZE)
+#define SD_SPI_MAX_PAGE_SIZE 512
+#endif
+
+/** The number of ranges of erased blocks that are remembered for each card.
+	Reads of blocks in these ranges are answered from memory with the erased
+	value of the card. Use 0 to disable the map. */
+#if !defined(SD_SPI_MAX_ERASED_EXTENTS)
+#define SD_SPI_MAX_ERASED_EXTENTS 4
+#endif
+
+/** The number of erases that can be waiting in the queue of each card (see
+	sd_spi_queue_erase()). Use 0 to disable the queue. */
+#if !defined(SD_SPI_MAX_QUEUED_ERASES)
+#define SD_SPI_MAX_QUEUED_ERASES 4
+#endif
+
+/** Pass as num_blocks_pre_erase to sd_spi_write_continuous_start() to
+	pre-erase the pages up to the end of the allocation unit that the write
+	starts in. Nothing is pre-erased if the card does not give its AU size. */
+#define SD_SPI_PRE_ERASE_AU	0xFFFFFFFF
+
+/** A range of consecutive blocks. */
+typedef struct sd_spi_block_range {
+	/** The address of the first block in the range. */
+	uint32_t	start_block_address;
+	/** The number of blocks in the range. */
+	uint32_t	num_blocks;
+} sd_spi_block_range_t;
+
 /** State variables used by the SD raw library. */
 typedef struct sd_spi_card {
-	/** Digital pin for setting CS high or low. */
-	uint8_t chip_select_pin: 			8;
+	/** Digital pin for setting CS high or low. It is not a bit-field, so the
+		thread-safe emulator can read it to find the lock of the card while
+		another thread changes the flags below under that lock. */
+	uint8_t chip_select_pin;
 	/** The speed of the SPI bus. Use 0 for 25KHz and 1 for 25MHz. */
 	uint8_t spi_speed: 					3;
 	/** Determines if the card is MMC, SD1, SD2, or SDHC/SDXC. */
@@ -75,16 +118,94 @@ typedef struct sd_spi_card {
 	/** If the card is being read or written to continually, this keeps track
 		of the block being read or written to. */
 	uint32_t continuous_block_address;
+	/** The page that the current or last continuous write started at, or the
+		block that the last stream started at. */
+	uint32_t continuous_start_block_address;
+	/** The number of blocks (512 bytes) that the card wrote without errors
+		before the last continuous write or stream failed. It is read from the card
+		with ACMD22. */
+	uint32_t num_well_written_blocks;
+	/** The number of bytes in a page (a multiple of 512). */
+	uint16_t page_size;
+	/** The value of every byte of an erased block (0x00 or 0xFF). It is read
+		from the card after the first erase. */
+	uint8_t erased_value;
+	/** True once erased_value has been read from the card. */
+	uint8_t is_erased_value_known:		1;
+	/** The SD status of the card, which is read when the card is
+		initialized. It is all 0's if the card does not have one. */
+	sd_spi_sd_status_t sd_status;
+	/** The SCR register of the card, which is read when the card is
+		initialized. It is all 0's if the card does not have one. */
+	sd_spi_scr_t scr;
+	/** When the status is read after a write. It is one of the
+		SD_SPI_STATUS_CHECK_* definitions. */
+	uint8_t status_check:				2;
+	/** True if a write has not had its status read yet. */
+	uint8_t is_status_check_pending:	1;
+	/** The number of writes that did not read the status right after. */
+	uint32_t num_status_checks_skipped;
+	/** True if a write returned while the card was still programming. The
+		next command waits for the card first. */
+	uint8_t is_write_in_progress:		1;
+
+#if SD_SPI_MAX_ERASED_EXTENTS > 0
+	/** Ranges of blocks that are known to hold the erased value. */
+	sd_spi_block_range_t erased_extents[SD_SPI_MAX_ERASED_EXTENTS];
+	/** The number of ranges in erased_extents. */
+	uint8_t num_erased_extents;
+	/** The number of blocks that were read from the erased ranges without
+		going to the card. */
+	uint32_t num_erased_blocks_read;
+	/** The number of continuous writes that did not pre-erase because their
+		blocks were known to be erased. */
+	uint32_t num_pre_erases_skipped;
+#endif
+
+#if SD_SPI_MAX_QUEUED_ERASES > 0
+	/** Erases that are done by sd_spi_poll(), oldest first. */
+	sd_spi_block_range_t queued_erases[SD_SPI_MAX_QUEUED_ERASES];
+	/** The number of ranges in queued_erases. */
+	uint8_t num_queued_erases;
+	/** True while the card is busy with the first erase in the queue. */
+	uint8_t is_erase_in_progress:		1;
+	/** True if the first erase in the queue is finished but its blocks have
+		not been added to the map of erased blocks yet. */
+	uint8_t is_erase_done:				1;
+#endif
 
 #if defined(SD_SPI_BUFFER)
-	/** Buffer for SD blocks. */
-	uint8_t sd_spi_buffer[512];
+	/** Storage for the block buffers. */
+	uint8_t block_buffers[SD_SPI_NUM_BUFFERS][SD_SPI_MAX_PAGE_SIZE];
+	/** Buffer for SD blocks. Points to the block buffer that is in use. */
+	uint8_t *sd_spi_buffer;
 	/** The address of the block currently being buffered. */
 	uint32_t buffered_block_address;
 	/** Keeps track of the consistency of the buffer for reading. */
 	uint8_t is_buffer_current:			1;
 	/** Keeps track if the buffer has been flushed or not. */
 	uint8_t is_buffer_written:			1;
+	/** True if a write stored the same bytes as the buffer already held since
+		the last flush. */
+	uint8_t is_flush_avoided:			1;
+	/** The start of the range of bytes in the buffer that are newer than the
+		data on the card. While a partially written block has not been read
+		in, these are the only bytes of the buffer that are valid. */
+	uint16_t written_start;
+	/** The end (exclusive) of the range of bytes that were written. */
+	uint16_t written_end;
+	/** The number of flushes that were not needed because the data written
+		to the buffer did not change it. */
+	uint32_t num_flushes_avoided;
+	/** The number of blocks of multiple block pages that were not written on
+		a flush because none of their bytes changed. */
+	uint32_t num_blocks_not_written;
+#if SD_SPI_NUM_BUFFERS > 1
+	/** Index of the oldest block buffer waiting to be written. */
+	uint8_t queued_buffer_index;
+	/** The number of block buffers waiting to be written. */
+	uint8_t num_queued_buffers;
+#endif
 #endif
 } sd_spi_card_t;
 
@@ -114,6 +235,22 @@ typedef struct sd_spi_card {
 
 /** @} End of group sd_spi_card_types */
 
+/**
+@defgroup sd_spi_status_checks	Status Checks
+@brief							When the status of the card is read with CMD13
+								after a write (see sd_spi_set_status_check()).
+@{
+*/
+/** The status is read after every write. */
+#define SD_SPI_STATUS_CHECK_ALWAYS		0
+/** The status is read once by the next sd_spi_sync(), which reports the
+	errors of all of the writes since the last check. */
+#define SD_SPI_STATUS_CHECK_AT_SYNC		1
+/** The status is only read when the card rejects the data of a write. */
+#define SD_SPI_STATUS_CHECK_ON_ERROR	2
+
+/** @} End of group sd_spi_status_checks */
+
 /**
 @defgroup sd_spi_error_codes	SD Error Codes
 @brief							Error codes for the SD library.
@@ -164,6 +301,11 @@ typedef struct sd_spi_card {
 
 #define SD_ERR_READ_REGISTER					36
 
+#define SD_ERR_ERASE_QUEUE_FULL					37
+
+#define SD_ERR_STORE_CORRUPT					38
+#define SD_ERR_STORE_END						39
+
 /** @} End of group sd_spi_error_codes */
 /* R1 token responses */
 #define SD_IN_IDLE_STATE						0x01
@@ -206,6 +348,60 @@ sd_spi_init(
 	uint8_t chip_select_pin
 );
 
+/**
+@brief		Sets the size of the logical pages of the card.
+@details	The page size is 512 after sd_spi_init(). With a larger page size,
+			the block addresses of sd_spi_read(), sd_spi_write(),
+			sd_spi_write_block(), the continuous reads and writes and the block
+			buffer all refer to pages, and every page is moved with a single
+			multiple block command. The stream functions, the erase functions
+			and sd_spi_card_size() keep using 512 byte blocks. The buffer is
+			flushed before the page size changes.
+
+@param		page_size	The number of bytes in a page. It must be a multiple of
+						512 and at most SD_SPI_MAX_PAGE_SIZE.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+int8_t
+sd_spi_set_page_size(
+	uint16_t page_size
+);
+
+/**
+@brief		Getter for the size of the logical pages of the card.
+
+@return		The number of bytes in a page.
+*/
+uint16_t
+sd_spi_page_size(
+	void
+);
+
+/**
+@brief		Sets when the status of the card is read after the single block
+			and page writes that do not belong to a continuous write.
+@details	The status check is SD_SPI_STATUS_CHECK_ALWAYS after sd_spi_init().
+			Reading the status takes a command with the card selected after
+			every write. With SD_SPI_STATUS_CHECK_AT_SYNC, the status is read
+			once by the next sd_spi_sync() or sd_spi_write_continuous_stop().
+			Errors that the card only gives in its status, such as a write
+			protection violation, are returned from there instead of from the
+			write. Errors in the data response of a write are still returned
+			right away by every policy. With the policies that do not read the
+			status after every write, a write that the card accepted returns
+			while the card is still programming it, and the next command waits
+			for the card (see sd_spi_is_busy()).
+
+@param		status_check	One of the SD_SPI_STATUS_CHECK_* definitions.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+int8_t
+sd_spi_set_status_check(
+	uint8_t status_check
+);
+
 /**
 @brief		Writes data to a block on the card.
 @details	If buffering is enabled, the card will read the block on the card
@@ -213,6 +409,9 @@ sd_spi_init(
 			the buffer. The data will be only written out to the card when a 
 			different block is written to, read is called, write is called, 
 			erase is called, or sd_spi_flush() is explicitly called.
+			When the buffer holds the block and the data is the same as what
+			is already in it, the buffer is not marked as changed so no write
+			to the card is needed (see num_flushes_avoided in sd_spi_card_t).
 			If buffering is not enabled, the card will write out the data and
 			pad the rest of the block with zeros if number_of_bytes is less
 			than 512.
@@ -234,6 +433,27 @@ sd_spi_write(
 	uint16_t 	byte_offset
 );
 
+/**
+@brief		Starts a new block in the buffer without reading it in from the
+			card.
+@details	Use this when the whole block is about to be rewritten with
+			sd_spi_write(). The old contents of the block are thrown away: the
+			buffer starts out with 0's and the block is written out on the next
+			flush even if nothing else is written to it. Without this hint, the
+			block is still not read in as long as the partial writes to it
+			touch each other and cover the whole block before it is flushed.
+			If buffering is not enabled, this does nothing since partial writes
+			never read in the block.
+
+@param		block_address	The address of the block on the card.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+int8_t
+sd_spi_write_begin_fresh(
+	uint32_t 	block_address
+);
+
 /**
 @brief		Writes a block of data to a block on the card.
 @details	When buffering is enabled, this is faster than using sd_spi_write
@@ -265,6 +485,19 @@ sd_spi_flush(
 	void
 );
 
+/**
+@brief		Flushes the buffer and reads the status of the card if a write did
+			not read it because of SD_SPI_STATUS_CHECK_AT_SYNC.
+@details	The status holds the errors of all of the writes since it was last
+			read.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+int8_t
+sd_spi_sync(
+	void
+);
+
 /**
 @brief		Notifies the card to prepare for sequential writing starting at the
 			specified block address.
@@ -275,6 +508,14 @@ sd_spi_flush(
 			the data and it will advance to the next block in the sequence 
 			automatically.
 
+			If a block fails to be written, the write is stopped with the stop
+			token, and the number of blocks the card wrote without errors is
+			read into num_well_written_blocks of the card. The blocks that were
+			buffered are dropped and later calls to sd_spi_write_continuous()
+			and sd_spi_write_continuous_next() return
+			SD_ERR_READ_WRITE_CONTINUOUS until the write is resumed with
+			sd_spi_write_continuous_resume().
+
 @param		start_block_address		The address of the first block in the
 									sequence.
 @param		num_blocks_pre_erase	(Optional) The number of block to pre-erase
@@ -330,10 +571,42 @@ sd_spi_write_continuous_next(
 	void
 );
 
+/**
+@brief		Writes out the blocks queued by sd_spi_write_continuous_next() for
+			as long as the card is ready to take them, and works through the
+			erases queued by sd_spi_queue_erase().
+@details	This never waits for the card to finish programming a block or
+			erasing, so it can be called from the main loop of the application.
+			Queued blocks are written when SD_SPI_NUM_BUFFERS is more than 1.
+			They are also written out when a free buffer is needed and by
+			sd_spi_flush() and sd_spi_write_continuous_stop(). Queued erases
+			are only started when no continuous read or write is in progress.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+int8_t
+sd_spi_poll(
+	void
+);
+
+/**
+@brief		Checks if the card is busy programming or erasing.
+@details	This never waits, so a scheduler can run other work while the card
+			is busy and only call into the library once the card is ready. A
+			card in the middle of a continuous read is never busy.
+
+@return		1 if the card is busy and 0 otherwise.
+*/
+uint8_t
+sd_spi_is_busy(
+	void
+);
+
 /**
 @brief		Notifies the card to stop sequential writing and flushes the buffer
 			to the card if buffering is enabled.
 @details	This may take some time since it waits for the card to complete the
+			write. Nothing is sent to the card if an error already stopped the
 			write.
 
 @return		An error code as defined by one of the SD_ERR_* definitions.
@@ -343,6 +616,75 @@ sd_spi_write_continuous_stop(
 	void
 );
 
+/**
+@brief		Starts a continuous write again after an error stopped it, from the
+			first page that the card did not write.
+@details	The page is worked out from the number of well written blocks that
+			the card gave. Pages from there on have to be written again.
+
+@param[out]	block_address	(Optional) The address of the page the write
+							continues from. Use NULL if it is not needed.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+			SD_ERR_READ_WRITE_CONTINUOUS is returned if a continuous read or
+			write is in progress.
+*/
+int8_t
+sd_spi_write_continuous_resume(
+	uint32_t	*block_address
+);
+
+/**
+@brief		Called by sd_spi_write_stream() when it needs more data for the
+			block that is being sent to the card.
+
+@param[in]	context			The context given to sd_spi_write_stream().
+@param		block_address	The address of the block the data goes to.
+@param		byte_offset		The offset of the data in the block.
+@param[out]	data			Where to put the data.
+@param		max_bytes		The most bytes that data can take.
+
+@return		The number of bytes put in data. Returning 0 ends the stream and
+			the rest of the current block is padded with 0's.
+*/
+typedef uint16_t (*sd_spi_write_stream_callback_t)(
+	void		*context,
+	uint32_t	block_address,
+	uint16_t	byte_offset,
+	uint8_t		*data,
+	uint16_t	max_bytes
+);
+
+/**
+@brief		Writes a sequence of blocks with data that is pulled from a
+			callback while the blocks are being sent to the card.
+@details	The blocks are written with a single multiple block write. The data
+			is asked for in chunks of at most SD_SPI_STREAM_CHUNK_SIZE bytes and
+			is never stored in the block buffer, so no 512 byte buffer is
+			needed. The callback may take as long as it needs to produce the
+			data. The stream ends after num_blocks blocks or when the callback
+			returns 0.
+
+			If a block fails to be written, the stream is stopped the same way
+			as a continuous write, and num_well_written_blocks of the card
+			holds the number of blocks from start_block_address that the card
+			wrote without errors.
+
+@param		start_block_address		The address of the first block.
+@param		num_blocks				The most blocks to write.
+@param		callback				The function that produces the data.
+@param[in]	context					Passed to the callback as is.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+int8_t
+sd_spi_write_stream(
+	uint32_t						start_block_address,
+	uint32_t						num_blocks,
+	sd_spi_write_stream_callback_t	callback,
+	void							*context
+);
+
 /**
 @brief		Reads data from a block on the card.
 @details	If buffering is enabled, this will write in the block to the buffer.
@@ -366,6 +708,49 @@ sd_spi_read(
 	uint16_t 	byte_offset
 );
 
+/**
+@brief		Reads data from any byte address on the card.
+@details	The data may span any number of blocks. The partial blocks at the
+			start and the end go through sd_spi_read(). The whole blocks in
+			between are read with a single multiple block read straight into
+			data_buffer without going through the block buffer.
+
+@param		byte_address		The address of the first byte on the card.
+@param[out]	data_buffer			A location in memory to write the data to.
+@param		number_of_bytes		The number of bytes to read.
+
+@return 	An error code as defined by one of the SD_ERR_* definitions.
+*/
+int8_t
+sd_spi_pread(
+	uint64_t	byte_address,
+	void		*data_buffer,
+	size_t		number_of_bytes
+);
+
+/**
+@brief		Writes data to any byte address on the card.
+@details	The data may span any number of blocks. The partial blocks at the
+			start and the end are read, modified and written back so the rest
+			of their data is kept. If buffering is enabled, this goes through
+			the block buffer and the last partial block stays in the buffer
+			until it is flushed. The whole blocks in between are written with
+			a single multiple block write straight from data without going
+			through the block buffer.
+
+@param		byte_address		The address of the first byte on the card.
+@param[in]	data				The data to write.
+@param		number_of_bytes		The number of bytes to write.
+
+@return 	An error code as defined by one of the SD_ERR_* definitions.
+*/
+int8_t
+sd_spi_pwrite(
+	uint64_t	byte_address,
+	void		*data,
+	size_t		number_of_bytes
+);
+
 /**
 @brief		Notifies the card to prepare for sequential reading starting at the
 			specified block address.
@@ -428,6 +813,50 @@ sd_spi_read_continuous_stop(
 	void
 );
 
+/**
+@brief		Called by sd_spi_read_stream() for each chunk of data as it is
+			received from the card.
+
+@param[in]	context			The context given to sd_spi_read_stream().
+@param		block_address	The address of the block the data belongs to.
+@param		byte_offset		The offset of the data in the block.
+@param[in]	data			The data. It is only valid during the call.
+@param		number_of_bytes	The number of bytes of data.
+
+@return		0 to continue the stream or anything else to end it early.
+*/
+typedef uint8_t (*sd_spi_read_stream_callback_t)(
+	void		*context,
+	uint32_t	block_address,
+	uint16_t	byte_offset,
+	uint8_t		*data,
+	uint16_t	number_of_bytes
+);
+
+/**
+@brief		Reads a sequence of blocks and hands the data to a callback in
+			chunks of SD_SPI_STREAM_CHUNK_SIZE bytes as it comes in.
+@details	The blocks are read with a single multiple block read. The data is
+			never stored in the block buffer, so the buffer keeps its contents
+			and no 512 byte buffer is needed. If the callback ends the stream
+			early, the rest of the current block is clocked in and thrown out
+			before the read is stopped.
+
+@param		start_block_address		The address of the first block.
+@param		num_blocks				The number of blocks to read.
+@param		callback				The function that receives the data.
+@param[in]	context					Passed to the callback as is.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+int8_t
+sd_spi_read_stream(
+	uint32_t						start_block_address,
+	uint32_t						num_blocks,
+	sd_spi_read_stream_callback_t	callback,
+	void							*context
+);
+
 /**
 @brief		Erases all the blocks on the card.
 @details	All of the bits will be set with the default value of 0 or 1
@@ -443,7 +872,9 @@ sd_spi_erase_all(
 /**
 @brief		Erases the given sequence of blocks on the card.
 @details	All of the bits will be set with the default value of 0 or 1
-			depending on the card.
+			depending on the card. The value is read back after the first
+			erase and kept in erased_value of the card state, and the blocks
+			are added to the map of erased blocks (see sd_spi_mark_erased()).
 
 @param 		start_block_address		The address of the first block in the
 									sequence.
@@ -458,6 +889,74 @@ sd_spi_erase_blocks(
 	uint32_t 	end_block_address
 );
 
+/**
+@brief		Records that a sequence of blocks holds the erased value, for
+			example on a card that was just formatted.
+@details	sd_spi_erase_blocks() records the blocks that it erases by itself.
+			Reads of the recorded blocks are answered from memory until they
+			are written to. If the erased value of the card is not known yet,
+			it is read from the first block. Marking blocks that do not hold
+			the erased value makes reads of them return the wrong data. This
+			does nothing if SD_SPI_MAX_ERASED_EXTENTS is 0.
+
+@param 		start_block_address		The address of the first block.
+@param 		num_blocks				The number of blocks.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+int8_t
+sd_spi_mark_erased(
+	uint32_t 	start_block_address,
+	uint32_t 	num_blocks
+);
+
+/**
+@brief		Queues a sequence of blocks to be erased in idle time.
+@details	The erase is started by sd_spi_poll() and the card is deselected
+			while it is busy erasing, so other cards on the bus can be used in
+			the meantime. Any command to the card waits for the erase to
+			finish. The next call to sd_spi_poll() adds the erased blocks to
+			the map of erased blocks, so continuous writes to them skip the
+			pre-erase. The blocks must not be written to until
+			sd_spi_pending_erases() shows that the erase is done. If
+			SD_SPI_MAX_QUEUED_ERASES is 0, the blocks are erased right away.
+
+@param 		start_block_address		The address of the first block in the
+									sequence.
+@param 		end_block_address		The address of the last block in the
+									sequence.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+			SD_ERR_ERASE_QUEUE_FULL if SD_SPI_MAX_QUEUED_ERASES erases are
+			already waiting.
+*/
+int8_t
+sd_spi_queue_erase(
+	uint32_t 	start_block_address,
+	uint32_t 	end_block_address
+);
+
+/**
+@brief		Gets the number of queued erases that are not done, including the
+			one in progress.
+
+@return		The number of erases.
+*/
+uint8_t
+sd_spi_pending_erases(
+	void
+);
+
+/**
+@brief		Does all of the queued erases and waits for them to finish.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+int8_t
+sd_spi_finish_erases(
+	void
+);
+
 /**
 @brief		Gets the number of blocks the card has. Blocks are 512 bytes.
 
@@ -468,6 +967,18 @@ sd_spi_card_size(
 	void
 );
 
+/**
+@brief		Gets the size of an allocation unit (AU) of the card.
+@details	The size comes from the SD status that is read when the card is
+			initialized.
+
+@return		The number of blocks in an AU, or 0 if the card does not give it.
+*/
+uint32_t
+sd_spi_au_blocks(
+	void
+);
+
 /**
 @brief		Gets the type of the card. 1 = SD1, 2 = SD2, 3 = SDHC, and 4 = MMC.
 
@@ -502,6 +1013,32 @@ sd_spi_read_csd_register(
 	sd_spi_csd_t *csd
 );
 
+/**
+@brief		Reads the SD status of the card with ACMD13.
+@details	Information is stored in the sd_spi_sd_status_t structure. The
+			details of the structure can be found in sd_spi_info.h. MMC and
+			SD1 cards may not support this.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+int8_t
+sd_spi_read_sd_status_register(
+	sd_spi_sd_status_t *sd_status
+);
+
+/**
+@brief		Reads the SD configuration register (SCR) of the card with ACMD51.
+@details	Information is stored in the sd_spi_scr_t structure. The details of
+			the structure can be found in sd_spi_info.h. MMC cards do not
+			support this.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+int8_t
+sd_spi_read_scr_register(
+	sd_spi_scr_t *scr
+);
+
 /**
 @brief		Returns the first error code (if any) found in the R2 response on
 			from the card.
@@ -523,6 +1060,39 @@ sd_spi_current_buffered_block(
 	void
 );
 
+/**
+@brief		Sets the card that the rest of the library functions operate on.
+@details	All state for a card is kept in an sd_spi_card_t. By default, an
+			internal one is used. To communicate with multiple cards on the same
+			SPI bus, declare an sd_spi_card_t for each card, pass it to this
+			function and then call sd_spi_init() with the chip select pin of
+			that card. Afterwards, calling this function switches between the
+			initialized cards. The card that was in use is deselected first.
+
+			In the thread-safe emulator build (SD_SPI_THREAD_SAFE), each
+			thread has its own card in use, but the internal card is shared
+			by every thread. Threads other than one must call this function
+			with their own sd_spi_card_t before sd_spi_init(). Threads that
+			use the same card must share the same sd_spi_card_t.
+
+@param[in]	new_card	The state of the card to use or NULL to go back to the
+						internal one.
+*/
+void
+sd_spi_use_card(
+	sd_spi_card_t *new_card
+);
+
+/**
+@brief		Getter for the card that is currently in use.
+
+@return		The state of the current card.
+*/
+sd_spi_card_t *
+sd_spi_current_card(
+	void
+);
+
 #if defined(__cplusplus)
 }
 #endif
@@ -0,0 +1,378 @@
+/******************************************************************************/
+/**
+@file		sd_spi.hpp
+@author     Wade Penson
+@date		June, 2015
+@brief      Header-only C++ front end for the SD SPI library.
+@details	Each sd_spi::card object holds the state of one card and makes it
+			the card in use (see sd_spi_use_card()) before every call, so
+			several cards on the same bus are plain objects. The page size is
+			a template parameter, which sets the page size of the card when it
+			is initialized and checks at compile time that the values which
+			are read and written as a whole fit in a page.
+
+			The class is a thin wrapper over the C functions and adds no code
+			paths of its own. The page size only sets the page size at run
+			time (see sd_spi_set_page_size()). Buffering is chosen when the C
+			library is built (SD_SPI_BUFFER, SD_SPI_NUM_BUFFERS), and the
+			byte or block addressing of the card is found when it is
+			initialized, so neither is a template parameter.
+
+@copyright  Copyright 2015 Wade Penson
+
+@license    Licensed under the Apache License, Version 2.0 (the "License");
+            you may not use this file except in compliance with the License.
+            You may obtain a copy of the License at
+
+              http://www.apache.org/licenses/LICENSE-2.0
+
+            Unless required by applicable law or agreed to in writing, software
+            distributed under the License is distributed on an "AS IS" BASIS,
+            WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+            implied. See the License for the specific language governing
+            permissions and limitations under the License.
+*/
+/******************************************************************************/
+
+#if !defined(SD_SPI_HPP_)
+#define SD_SPI_HPP_
+
+#include "sd_spi.h"
+
+namespace sd_spi {
+
+/**
+@brief		A card on the SPI bus.
+
+@tparam		PageSize	The number of bytes in a page. It must be a multiple of
+						512 and at most SD_SPI_MAX_PAGE_SIZE.
+*/
+template <uint16_t PageSize = 512>
+class card
+{
+	static_assert(PageSize != 0 && PageSize % 512 == 0 &&
+				  PageSize <= SD_SPI_MAX_PAGE_SIZE,
+				  "The page size must be a multiple of 512 and at most "
+				  "SD_SPI_MAX_PAGE_SIZE.");
+
+public:
+	/** The number of bytes in a page. */
+	static const uint16_t page_size = PageSize;
+
+	card(
+	) : state_()
+	{
+		state_.is_chip_select_high = 1;
+	}
+
+	/** The library goes back to its internal card if this one is in use. */
+	~card(
+	)
+	{
+		if (sd_spi_current_card() == &state_)
+		{
+			sd_spi_use_card(NULL);
+		}
+	}
+
+	/** The block buffers point into the state, so it cannot be copied. */
+	card(const card &) = delete;
+	card &operator=(const card &) = delete;
+
+	/**
+	@brief		Initializes the card (see sd_spi_init()) and sets its page
+				size.
+	*/
+	int8_t
+	init(
+		uint8_t chip_select_pin
+	)
+	{
+		use();
+
+		int8_t response;
+		if ((response = sd_spi_init(chip_select_pin)))
+		{
+			return response;
+		}
+
+		return PageSize == 512 ? SD_ERR_OK : sd_spi_set_page_size(PageSize);
+	}
+
+	/** Makes this the card that the C functions operate on. */
+	void
+	use(
+	)
+	{
+		if (sd_spi_current_card() != &state_)
+		{
+			sd_spi_use_card(&state_);
+		}
+	}
+
+	/** The state of the card, such as its counters. */
+	sd_spi_card_t &
+	state(
+	)
+	{
+		return state_;
+	}
+
+	int8_t
+	read(
+		uint32_t	block_address,
+		void		*data_buffer,
+		uint16_t	number_of_bytes,
+		uint16_t	byte_offset = 0
+	)
+	{
+		use();
+		return sd_spi_read(block_address, data_buffer, number_of_bytes,
+						   byte_offset);
+	}
+
+	/** Reads a value that is stored at byte_offset in a page. */
+	template <typename T>
+	int8_t
+	read(
+		uint32_t	block_address,
+		T			&value,
+		uint16_t	byte_offset = 0
+	)
+	{
+		static_assert(sizeof(T) <= PageSize, "The value must fit in a page.");
+		return read(block_address, &value, sizeof(T), byte_offset);
+	}
+
+	int8_t
+	write(
+		uint32_t	block_address,
+		const void	*data,
+		uint16_t	number_of_bytes,
+		uint16_t	byte_offset = 0
+	)
+	{
+		use();
+		return sd_spi_write(block_address, const_cast<void *>(data),
+							number_of_bytes, byte_offset);
+	}
+
+	/** Writes a value to byte_offset in a page. */
+	template <typename T>
+	int8_t
+	write(
+		uint32_t	block_address,
+		const T		&value,
+		uint16_t	byte_offset = 0
+	)
+	{
+		static_assert(sizeof(T) <= PageSize, "The value must fit in a page.");
+		return write(block_address, &value, sizeof(T), byte_offset);
+	}
+
+	int8_t
+	write_block(
+		uint32_t	block_address,
+		const void	*data
+	)
+	{
+		use();
+		return sd_spi_write_block(block_address, const_cast<void *>(data));
+	}
+
+	int8_t
+	pread(
+		uint64_t	byte_address,
+		void		*data_buffer,
+		size_t		number_of_bytes
+	)
+	{
+		use();
+		return sd_spi_pread(byte_address, data_buffer, number_of_bytes);
+	}
+
+	int8_t
+	pwrite(
+		uint64_t	byte_address,
+		const void	*data,
+		size_t		number_of_bytes
+	)
+	{
+		use();
+		return sd_spi_pwrite(byte_address, const_cast<void *>(data),
+							 number_of_bytes);
+	}
+
+	int8_t
+	flush(
+	)
+	{
+		use();
+		return sd_spi_flush();
+	}
+
+	int8_t
+	sync(
+	)
+	{
+		use();
+		return sd_spi_sync();
+	}
+
+	int8_t
+	poll(
+	)
+	{
+		use();
+		return sd_spi_poll();
+	}
+
+	int8_t
+	set_status_check(
+		uint8_t status_check
+	)
+	{
+		use();
+		return sd_spi_set_status_check(status_check);
+	}
+
+	int8_t
+	write_continuous_start(
+		uint32_t	start_block_address,
+		uint32_t	num_blocks_pre_erase = 0
+	)
+	{
+		use();
+		return sd_spi_write_continuous_start(start_block_address,
+											 num_blocks_pre_erase);
+	}
+
+	int8_t
+	write_continuous(
+		const void	*data,
+		uint16_t	number_of_bytes,
+		uint16_t	byte_offset = 0
+	)
+	{
+		use();
+		return sd_spi_write_continuous(const_cast<void *>(data),
+									   number_of_bytes, byte_offset);
+	}
+
+	int8_t
+	write_continuous_next(
+	)
+	{
+		use();
+		return sd_spi_write_continuous_next();
+	}
+
+	int8_t
+	write_continuous_stop(
+	)
+	{
+		use();
+		return sd_spi_write_continuous_stop();
+	}
+
+	int8_t
+	write_continuous_resume(
+		uint32_t *block_address = NULL
+	)
+	{
+		use();
+		return sd_spi_write_continuous_resume(block_address);
+	}
+
+	int8_t
+	read_continuous_start(
+		uint32_t start_block_address
+	)
+	{
+		use();
+		return sd_spi_read_continuous_start(start_block_address);
+	}
+
+	int8_t
+	read_continuous(
+		void		*data_buffer,
+		uint16_t	number_of_bytes,
+		uint16_t	byte_offset = 0
+	)
+	{
+		use();
+		return sd_spi_read_continuous(data_buffer, number_of_bytes,
+									  byte_offset);
+	}
+
+	int8_t
+	read_continuous_next(
+	)
+	{
+		use();
+		return sd_spi_read_continuous_next();
+	}
+
+	int8_t
+	read_continuous_stop(
+	)
+	{
+		use();
+		return sd_spi_read_continuous_stop();
+	}
+
+	int8_t
+	erase_blocks(
+		uint32_t	start_block_address,
+		uint32_t	end_block_address
+	)
+	{
+		use();
+		return sd_spi_erase_blocks(start_block_address, end_block_address);
+	}
+
+	int8_t
+	queue_erase(
+		uint32_t	start_block_address,
+		uint32_t	end_block_address
+	)
+	{
+		use();
+		return sd_spi_queue_erase(start_block_address, end_block_address);
+	}
+
+	int8_t
+	finish_erases(
+	)
+	{
+		use();
+		return sd_spi_finish_erases();
+	}
+
+	/** The number of 512 byte blocks on the card. */
+	uint32_t
+	size(
+	)
+	{
+		use();
+		return sd_spi_card_size();
+	}
+
+	uint8_t
+	type(
+	)
+	{
+		use();
+		return sd_spi_card_type();
+	}
+
+private:
+	sd_spi_card_t state_;
+};
+
+template <uint16_t PageSize>
+const uint16_t card<PageSize>::page_size;
+
+}
+
+#endif /* SD_SPI_HPP_ */
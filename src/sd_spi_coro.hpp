@@ -0,0 +1,504 @@
+/******************************************************************************/
+/**
+@file		sd_spi_coro.hpp
+@author     Wade Penson
+@date		June, 2015
+@brief      C++20 coroutines that wait for the card without blocking.
+@details	A sd_spi::task is a coroutine that gives an SD_ERR_* code with
+			co_return. Tasks are run by a sd_spi::scheduler, which resumes a
+			task that waits for a card once sd_spi_is_busy() says that the card
+			is ready, and calls sd_spi_poll() for the card in the meantime. A
+			sd_spi::async_card reads and writes pages one at a time and waits
+			for the card to be ready before each one, so other tasks run while
+			the card is programming:
+
+				sd_spi::scheduler tasks;
+				sd_spi::async_card<> card(tasks);
+
+				sd_spi::task
+				log_page(const void *data)
+				{
+					co_return co_await card.write_blocks(42, 1, data);
+				}
+
+			Set the status check of the card to SD_SPI_STATUS_CHECK_AT_SYNC
+			(see sd_spi_set_status_check()) so that writes return while the card
+			is still busy. The wait for the data of a read and the transfers
+			themselves still happen inside the library calls.
+
+@copyright  Copyright 2015 Wade Penson
+
+@license    Licensed under the Apache License, Version 2.0 (the "License");
+            you may not use this file except in compliance with the License.
+            You may obtain a copy of the License at
+
+              http://www.apache.org/licenses/LICENSE-2.0
+
+            Unless required by applicable law or agreed to in writing, software
+            distributed under the License is distributed on an "AS IS" BASIS,
+            WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+            implied. See the License for the specific language governing
+            permissions and limitations under the License.
+*/
+/******************************************************************************/
+
+#if !defined(SD_SPI_CORO_HPP_)
+#define SD_SPI_CORO_HPP_
+
+#if !defined(__cpp_impl_coroutine)
+#error "sd_spi_coro.hpp needs a compiler with C++20 coroutines."
+#endif
+
+#include <coroutine>
+#include <exception>
+#include "sd_spi.hpp"
+
+/** The number of tasks that can wait in a scheduler at a time. A task that
+	finds the scheduler full does not wait and calls into the library right
+	away instead. */
+#if !defined(SD_SPI_MAX_WAITING_TASKS)
+#define SD_SPI_MAX_WAITING_TASKS 8
+#endif
+
+namespace sd_spi {
+
+/**
+@brief		A coroutine that gives an SD_ERR_* code.
+@details	A task does not run until it is given to scheduler::spawn() or
+			awaited by another task. Awaiting a task gives its code.
+*/
+class task
+{
+public:
+	struct promise_type
+	{
+		int8_t					result = SD_ERR_OK;
+		/** The task that awaits this one, if any. */
+		std::coroutine_handle<>	continuation;
+
+		/** Goes back to the task that awaited this one when it is done. */
+		struct final_awaiter
+		{
+			bool
+			await_ready(
+			) noexcept
+			{
+				return false;
+			}
+
+			std::coroutine_handle<>
+			await_suspend(
+				std::coroutine_handle<promise_type> handle
+			) noexcept
+			{
+				std::coroutine_handle<> continuation =
+					handle.promise().continuation;
+
+				return continuation ? continuation : std::noop_coroutine();
+			}
+
+			void
+			await_resume(
+			) noexcept
+			{
+			}
+		};
+
+		task
+		get_return_object(
+		)
+		{
+			return task(
+				std::coroutine_handle<promise_type>::from_promise(*this));
+		}
+
+		std::suspend_always
+		initial_suspend(
+		) noexcept
+		{
+			return {};
+		}
+
+		final_awaiter
+		final_suspend(
+		) noexcept
+		{
+			return {};
+		}
+
+		void
+		return_value(
+			int8_t response
+		)
+		{
+			result = response;
+		}
+
+		void
+		unhandled_exception(
+		)
+		{
+			std::terminate();
+		}
+	};
+
+	task(
+		task &&other
+	) noexcept : handle_(other.handle_)
+	{
+		other.handle_ = nullptr;
+	}
+
+	~task(
+	)
+	{
+		if (handle_)
+		{
+			handle_.destroy();
+		}
+	}
+
+	task(const task &) = delete;
+	task &operator=(const task &) = delete;
+	task &operator=(task &&) = delete;
+
+	/** True once the task has returned. */
+	bool
+	done(
+	) const
+	{
+		return !handle_ || handle_.done();
+	}
+
+	/** The code that the task returned. */
+	int8_t
+	result(
+	) const
+	{
+		return handle_ ? handle_.promise().result : SD_ERR_OK;
+	}
+
+	std::coroutine_handle<promise_type>
+	handle(
+	) const
+	{
+		return handle_;
+	}
+
+	bool
+	await_ready(
+	) const
+	{
+		return done();
+	}
+
+	/** Runs the awaited task right away and comes back when it is done. */
+	std::coroutine_handle<>
+	await_suspend(
+		std::coroutine_handle<> awaiting
+	)
+	{
+		handle_.promise().continuation = awaiting;
+		return handle_;
+	}
+
+	int8_t
+	await_resume(
+	) const
+	{
+		return result();
+	}
+
+private:
+	explicit task(
+		std::coroutine_handle<promise_type> handle
+	) : handle_(handle)
+	{
+	}
+
+	std::coroutine_handle<promise_type> handle_;
+};
+
+/**
+@brief		Runs tasks on a single thread and resumes the ones that wait for a
+			card once the card is ready.
+*/
+class scheduler
+{
+	/** A suspended task and the card that it waits for (NULL if it only
+		gave way to the other tasks). */
+	struct waiter
+	{
+		std::coroutine_handle<>	handle;
+		sd_spi_card_t			*card;
+	};
+
+public:
+	/** Suspends a task until a card is ready. */
+	class ready_awaiter
+	{
+	public:
+		ready_awaiter(
+			scheduler		&tasks,
+			sd_spi_card_t	*card
+		) : tasks_(tasks), card_(card)
+		{
+		}
+
+		bool
+		await_ready(
+		)
+		{
+			if (card_ == NULL)
+			{
+				return false;
+			}
+
+			sd_spi_use_card(card_);
+			return !sd_spi_is_busy();
+		}
+
+		/** Does not suspend if the scheduler is full. */
+		bool
+		await_suspend(
+			std::coroutine_handle<> handle
+		)
+		{
+			return tasks_.add(handle, card_);
+		}
+
+		void
+		await_resume(
+		)
+		{
+			if (card_ != NULL)
+			{
+				sd_spi_use_card(card_);
+			}
+		}
+
+	private:
+		scheduler		&tasks_;
+		sd_spi_card_t	*card_;
+	};
+
+	scheduler(
+	) : num_waiters_(0)
+	{
+	}
+
+	scheduler(const scheduler &) = delete;
+	scheduler &operator=(const scheduler &) = delete;
+
+	/**
+	@brief		Starts a task on the next call to run_once().
+	@details	The task object has to outlive the task.
+
+	@return		False if the scheduler is full.
+	*/
+	bool
+	spawn(
+		task &t
+	)
+	{
+		return t.done() || add(t.handle(), NULL);
+	}
+
+	/**
+	@brief		Waits until a card is ready.
+	*/
+	ready_awaiter
+	ready(
+		sd_spi_card_t *card
+	)
+	{
+		return ready_awaiter(*this, card);
+	}
+
+	/**
+	@brief		Lets the other tasks run before the task goes on.
+	*/
+	ready_awaiter
+	yield(
+	)
+	{
+		return ready_awaiter(*this, NULL);
+	}
+
+	/**
+	@brief		Resumes every waiting task that can go on.
+	@details	The cards that tasks wait for are polled (see sd_spi_poll()).
+				Tasks that start waiting during this call are looked at on the
+				next call.
+
+	@return		True if any task is still waiting.
+	*/
+	bool
+	run_once(
+	)
+	{
+		uint8_t num_to_check = num_waiters_;
+		uint8_t i = 0;
+
+		while (i < num_to_check)
+		{
+			waiter next = waiters_[i];
+
+			if (next.card != NULL)
+			{
+				/* An error here comes back from the next call of the task. */
+				sd_spi_use_card(next.card);
+				sd_spi_poll();
+
+				if (sd_spi_is_busy())
+				{
+					i++;
+					continue;
+				}
+			}
+
+			uint8_t j;
+			for (j = i + 1; j < num_waiters_; j++)
+			{
+				waiters_[j - 1] = waiters_[j];
+			}
+
+			num_waiters_--;
+			num_to_check--;
+
+			next.handle.resume();
+		}
+
+		return num_waiters_ > 0;
+	}
+
+	/**
+	@brief		Runs the tasks until none of them is waiting.
+	*/
+	void
+	run(
+	)
+	{
+		while (run_once());
+	}
+
+private:
+	bool
+	add(
+		std::coroutine_handle<>	handle,
+		sd_spi_card_t			*card
+	)
+	{
+		if (num_waiters_ == SD_SPI_MAX_WAITING_TASKS)
+		{
+			return false;
+		}
+
+		waiters_[num_waiters_].handle = handle;
+		waiters_[num_waiters_].card = card;
+		num_waiters_++;
+
+		return true;
+	}
+
+	waiter	waiters_[SD_SPI_MAX_WAITING_TASKS];
+	uint8_t	num_waiters_;
+};
+
+/**
+@brief		A card whose page reads and writes are tasks.
+@details	The block addresses refer to pages, as in sd_spi_read().
+
+@tparam		PageSize	The number of bytes in a page (see card).
+*/
+template <uint16_t PageSize = 512>
+class async_card : public card<PageSize>
+{
+public:
+	explicit async_card(
+		scheduler &tasks
+	) : tasks_(tasks)
+	{
+	}
+
+	/** Waits until the card is not busy programming or erasing. */
+	scheduler::ready_awaiter
+	ready(
+	)
+	{
+		return tasks_.ready(&this->state());
+	}
+
+	/**
+	@brief		Reads a sequence of pages.
+
+	@param		block_address	The address of the first page.
+	@param		num_blocks		The number of pages.
+	@param[out]	data_buffer		Room for num_blocks * PageSize bytes.
+	*/
+	task
+	read_blocks(
+		uint32_t	block_address,
+		uint32_t	num_blocks,
+		void		*data_buffer
+	)
+	{
+		uint8_t *data = static_cast<uint8_t *>(data_buffer);
+		uint32_t i;
+
+		for (i = 0; i < num_blocks; i++)
+		{
+			co_await ready();
+
+			int8_t response;
+			if ((response = this->read(block_address + i,
+									   data + i * PageSize, PageSize)))
+			{
+				co_return response;
+			}
+		}
+
+		co_return SD_ERR_OK;
+	}
+
+	/**
+	@brief		Writes a sequence of pages and then reads the status of the
+				card (see sd_spi_sync()).
+
+	@param		block_address	The address of the first page.
+	@param		num_blocks		The number of pages.
+	@param[in]	data			num_blocks * PageSize bytes.
+	*/
+	task
+	write_blocks(
+		uint32_t	block_address,
+		uint32_t	num_blocks,
+		const void	*data
+	)
+	{
+		const uint8_t *bytes = static_cast<const uint8_t *>(data);
+		uint32_t i;
+
+		for (i = 0; i < num_blocks; i++)
+		{
+			co_await ready();
+
+			int8_t response;
+			if ((response = this->write_block(block_address + i,
+											  bytes + i * PageSize)))
+			{
+				co_return response;
+			}
+		}
+
+		co_await ready();
+		co_return this->sync();
+	}
+
+private:
+	scheduler &tasks_;
+};
+
+}
+
+#endif /* SD_SPI_CORO_HPP_ */
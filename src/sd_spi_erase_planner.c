@@ -0,0 +1,338 @@
+/******************************************************************************/
+/**
+@file		sd_spi_erase_planner.c
+@author     Wade Penson
+@date		June, 2015
+@brief      Erase planner implementation.
+@copyright  Copyright 2015 Wade Penson
+
+@license    Licensed under the Apache License, Version 2.0 (the "License");
+            you may not use this file except in compliance with the License.
+            You may obtain a copy of the License at
+
+              http://www.apache.org/licenses/LICENSE-2.0
+
+            Unless required by applicable law or agreed to in writing, software
+            distributed under the License is distributed on an "AS IS" BASIS,
+            WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+            implied. See the License for the specific language governing
+            permissions and limitations under the License.
+*/
+/******************************************************************************/
+
+#include "sd_spi_erase_planner.h"
+
+/**
+@brief		Converts the TAAC field of the CSD register to microseconds.
+
+@param		taac	The TAAC field.
+
+@return		The data access time in microseconds (at least 1).
+*/
+static uint32_t
+sd_spi_taac_to_us(
+	uint8_t	taac
+);
+
+/**
+@brief		Predicts the time of a single erase command.
+@details	Every unit that is touched is erased, and the blocks that are kept
+			in the units at either end have to be moved first.
+
+@param[in]	geometry				The erase geometry of the card.
+@param		start_block_address		The address of the first block.
+@param		num_blocks				The number of blocks.
+
+@return		The predicted time in microseconds.
+*/
+static uint64_t
+sd_spi_predict_erase(
+	sd_spi_erase_geometry_t	*geometry,
+	uint32_t				start_block_address,
+	uint32_t				num_blocks
+);
+
+/**
+@brief		A sd_spi_write_stream() callback which fills the blocks with the
+			value that context points to.
+*/
+static uint16_t
+sd_spi_erase_fill_callback(
+	void		*context,
+	uint32_t	block_address,
+	uint16_t	byte_offset,
+	uint8_t		*data,
+	uint16_t	max_bytes
+);
+
+int8_t
+sd_spi_read_erase_geometry(
+	sd_spi_erase_geometry_t	*geometry
+)
+{
+	sd_spi_csd_t csd;
+
+	int8_t response;
+	if ((response = sd_spi_read_csd_register(&csd)))
+	{
+		return response;
+	}
+
+	geometry->is_block_erasable = csd.erase_bl_en;
+	geometry->unit_blocks = csd.erase_sector_size + 1;
+	geometry->unit_erase_us = SD_SPI_DEFAULT_UNIT_ERASE_US;
+	geometry->erase_offset_us = 0;
+	geometry->block_write_us = sd_spi_taac_to_us(csd.taac) << csd.r2w_factor;
+
+	/* The SD status was read when the card was initialized. */
+	sd_spi_sd_status_t *sd_status = &sd_spi_current_card()->sd_status;
+
+	if (sd_spi_au_blocks() == 0)
+	{
+		return SD_ERR_OK;
+	}
+
+	geometry->unit_blocks = sd_spi_au_blocks();
+
+	if (sd_status->erase_size != 0)
+	{
+		geometry->unit_erase_us = sd_status->erase_timeout * 1000000UL /
+								  sd_status->erase_size;
+		geometry->erase_offset_us = sd_status->erase_offset * 1000000UL;
+	}
+
+	/* The speed class is the sequential write speed in MB/s. */
+	static const uint8_t class_speeds[5] = {0, 2, 4, 6, 10};
+
+	if (sd_status->speed_class >= 1 && sd_status->speed_class <= 4)
+	{
+		geometry->block_write_us = 512 / class_speeds[sd_status->speed_class];
+	}
+
+	return SD_ERR_OK;
+}
+
+void
+sd_spi_plan_erase(
+	sd_spi_erase_geometry_t	*geometry,
+	uint32_t				start_block_address,
+	uint32_t				end_block_address,
+	sd_spi_erase_plan_t		*plan
+)
+{
+	uint32_t unit_blocks = geometry->unit_blocks;
+	uint32_t num_blocks = end_block_address - start_block_address + 1;
+	uint32_t aligned_start = (start_block_address + unit_blocks - 1) /
+							 unit_blocks * unit_blocks;
+	uint32_t aligned_end = (end_block_address + 1) / unit_blocks * unit_blocks;
+	uint64_t naive_predicted_us = sd_spi_predict_erase(geometry,
+													   start_block_address,
+													   num_blocks);
+	uint64_t predicted_us = 0;
+
+	if (aligned_start < aligned_end)
+	{
+		plan->aligned.start_block_address = aligned_start;
+		plan->aligned.num_blocks = aligned_end - aligned_start;
+		plan->fragments[0].start_block_address = start_block_address;
+		plan->fragments[0].num_blocks = aligned_start - start_block_address;
+		plan->fragments[1].start_block_address = aligned_end;
+		plan->fragments[1].num_blocks = end_block_address + 1 - aligned_end;
+
+		predicted_us = sd_spi_predict_erase(geometry, aligned_start,
+											aligned_end - aligned_start);
+	}
+	else
+	{
+		/* No whole unit is covered, so the range is one fragment. */
+		plan->aligned.start_block_address = start_block_address;
+		plan->aligned.num_blocks = 0;
+		plan->fragments[0].start_block_address = start_block_address;
+		plan->fragments[0].num_blocks = num_blocks;
+		plan->fragments[1].start_block_address = end_block_address + 1;
+		plan->fragments[1].num_blocks = 0;
+	}
+
+	uint8_t i;
+	for (i = 0; i < 2; i++)
+	{
+		sd_spi_block_range_t *fragment = &plan->fragments[i];
+		plan->is_overwritten[i] = 0;
+
+		if (fragment->num_blocks == 0)
+		{
+			continue;
+		}
+
+		uint64_t overwrite_us = (uint64_t) fragment->num_blocks *
+								geometry->block_write_us;
+		uint64_t erase_us = sd_spi_predict_erase(geometry,
+												 fragment->start_block_address,
+												 fragment->num_blocks);
+
+		/* Cards that erase whole sectors would lose the rest of the sector,
+		   so their fragments are always overwritten. */
+		if (!geometry->is_block_erasable || overwrite_us < erase_us)
+		{
+			plan->is_overwritten[i] = 1;
+			predicted_us += overwrite_us;
+		}
+		else
+		{
+			predicted_us += erase_us;
+		}
+	}
+
+	/* Splitting the range only pays off if it beats a single erase. */
+	if (geometry->is_block_erasable && predicted_us >= naive_predicted_us)
+	{
+		plan->aligned.start_block_address = start_block_address;
+		plan->aligned.num_blocks = 0;
+		plan->fragments[0].start_block_address = start_block_address;
+		plan->fragments[0].num_blocks = num_blocks;
+		plan->fragments[1].start_block_address = end_block_address + 1;
+		plan->fragments[1].num_blocks = 0;
+		plan->is_overwritten[0] = 0;
+		plan->is_overwritten[1] = 0;
+		predicted_us = naive_predicted_us;
+	}
+
+	plan->predicted_us = predicted_us > UINT32_MAX ? UINT32_MAX :
+						 (uint32_t) predicted_us;
+	plan->naive_predicted_us = naive_predicted_us > UINT32_MAX ? UINT32_MAX :
+							   (uint32_t) naive_predicted_us;
+}
+
+int8_t
+sd_spi_erase_planned(
+	sd_spi_erase_geometry_t	*geometry,
+	uint32_t				start_block_address,
+	uint32_t				end_block_address,
+	sd_spi_erase_plan_t		*plan
+)
+{
+	sd_spi_erase_plan_t default_plan;
+
+	if (plan == NULL)
+	{
+		plan = &default_plan;
+	}
+
+	sd_spi_plan_erase(geometry, start_block_address, end_block_address, plan);
+
+	int8_t response;
+
+	/* The aligned erase comes first so that the erased value of the card is
+	   known before the fragments are overwritten. */
+	if (plan->aligned.num_blocks > 0 &&
+		(response = sd_spi_erase_blocks(plan->aligned.start_block_address,
+										plan->aligned.start_block_address +
+										plan->aligned.num_blocks - 1)))
+	{
+		return response;
+	}
+
+	sd_spi_card_t *card = sd_spi_current_card();
+	uint8_t i;
+
+	for (i = 0; i < 2; i++)
+	{
+		sd_spi_block_range_t *fragment = &plan->fragments[i];
+
+		if (fragment->num_blocks == 0)
+		{
+			continue;
+		}
+
+		if (!plan->is_overwritten[i] ||
+			(geometry->is_block_erasable && !card->is_erased_value_known))
+		{
+			if ((response = sd_spi_erase_blocks(fragment->start_block_address,
+												fragment->start_block_address +
+												fragment->num_blocks - 1)))
+			{
+				return response;
+			}
+
+			continue;
+		}
+
+		/* Until the erased value is known, the value that the SCR register
+		   gives is written. */
+		uint8_t erased_value = card->is_erased_value_known ?
+							   card->erased_value :
+							   (card->scr.data_stat_after_erase ? 0xFF : 0x00);
+
+		if ((response = sd_spi_write_stream(fragment->start_block_address,
+											fragment->num_blocks,
+											sd_spi_erase_fill_callback,
+											&erased_value)))
+		{
+			return response;
+		}
+
+		if (card->is_erased_value_known &&
+			(response = sd_spi_mark_erased(fragment->start_block_address,
+										   fragment->num_blocks)))
+		{
+			return response;
+		}
+	}
+
+	return SD_ERR_OK;
+}
+
+static uint32_t
+sd_spi_taac_to_us(
+	uint8_t	taac
+)
+{
+	/* Ten times the time value and a unit from 1ns to 10ms. */
+	static const uint8_t time_values[16] = {0, 10, 12, 13, 15, 20, 25, 30,
+											35, 40, 45, 50, 55, 60, 70, 80};
+	uint32_t time_ns = time_values[(taac >> 3) & 0x0F];
+	uint8_t i;
+
+	for (i = 0; i < (taac & 0x07); i++)
+	{
+		time_ns *= 10;
+	}
+
+	time_ns /= 10;
+
+	return time_ns < 1000 ? 1 : time_ns / 1000;
+}
+
+static uint64_t
+sd_spi_predict_erase(
+	sd_spi_erase_geometry_t	*geometry,
+	uint32_t				start_block_address,
+	uint32_t				num_blocks
+)
+{
+	uint32_t unit_blocks = geometry->unit_blocks;
+	uint32_t end_block_address = start_block_address + num_blocks - 1;
+	uint32_t num_units = end_block_address / unit_blocks -
+						 start_block_address / unit_blocks + 1;
+	uint32_t num_kept_blocks = start_block_address % unit_blocks +
+							   unit_blocks - 1 -
+							   end_block_address % unit_blocks;
+
+	return geometry->erase_offset_us +
+		   (uint64_t) num_units * geometry->unit_erase_us +
+		   (uint64_t) num_kept_blocks * geometry->block_write_us;
+}
+
+static uint16_t
+sd_spi_erase_fill_callback(
+	void		*context,
+	uint32_t	block_address,
+	uint16_t	byte_offset,
+	uint8_t		*data,
+	uint16_t	max_bytes
+)
+{
+	memset(data, *(uint8_t *) context, max_bytes);
+
+	return max_bytes;
+}
@@ -0,0 +1,146 @@
+/******************************************************************************/
+/**
+@file		sd_spi_erase_planner.h
+@author     Wade Penson
+@date		June, 2015
+@brief      Erase planner that aligns erases to the erase units of a card.
+@details	Cards erase whole allocation units (AUs) at a time. An erase that
+			starts or ends in the middle of an AU makes the card move the
+			blocks of the AU that are kept before the AU can be erased, which
+			can take much longer than the erase itself. The planner splits a
+			range into the aligned units, which are erased with a single erase
+			command, and the fragments at either end, which are either erased
+			or overwritten with the erased value, whichever is predicted to be
+			faster. The predictions come from the CSD register and the SD
+			status of the card.
+
+@copyright  Copyright 2015 Wade Penson
+
+@license    Licensed under the Apache License, Version 2.0 (the "License");
+            you may not use this file except in compliance with the License.
+            You may obtain a copy of the License at
+
+              http://www.apache.org/licenses/LICENSE-2.0
+
+            Unless required by applicable law or agreed to in writing, software
+            distributed under the License is distributed on an "AS IS" BASIS,
+            WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+            implied. See the License for the specific language governing
+            permissions and limitations under the License.
+*/
+/******************************************************************************/
+
+#if !defined(SD_SPI_ERASE_PLANNER_H_)
+#define SD_SPI_ERASE_PLANNER_H_
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#include "sd_spi.h"
+
+/** The time in microseconds to erase a unit when the card does not give an
+	erase timeout. */
+#define SD_SPI_DEFAULT_UNIT_ERASE_US	250000
+
+/** The erase geometry and timing of a card. */
+typedef struct sd_spi_erase_geometry {
+	/** The number of blocks that erases are aligned to. This is the AU size
+		if the card has an SD status and the erase sector size otherwise. */
+	uint32_t	unit_blocks;
+	/** The predicted time in microseconds to erase one unit. */
+	uint32_t	unit_erase_us;
+	/** The predicted time in microseconds that is added to every erase. */
+	uint32_t	erase_offset_us;
+	/** The predicted time in microseconds to write one block. */
+	uint32_t	block_write_us;
+	/** True if the card can erase single blocks (erase_bl_en in the CSD).
+		Otherwise, fragments are always overwritten. */
+	uint8_t		is_block_erasable;
+} sd_spi_erase_geometry_t;
+
+/** How a range of blocks is erased. */
+typedef struct sd_spi_erase_plan {
+	/** The whole units that are erased with one erase command. The range is
+		empty if the blocks do not cover a whole unit. */
+	sd_spi_block_range_t	aligned;
+	/** The blocks before and after the aligned units. */
+	sd_spi_block_range_t	fragments[2];
+	/** For each fragment, true if it is overwritten with the erased value
+		and false if it is erased. */
+	uint8_t					is_overwritten[2];
+	/** The predicted time of the plan in microseconds. */
+	uint32_t				predicted_us;
+	/** The predicted time in microseconds of erasing the whole range with a
+		single erase command. */
+	uint32_t				naive_predicted_us;
+} sd_spi_erase_plan_t;
+
+/**
+@brief		Reads the erase geometry of the card in use from its CSD register
+			and the SD status that was read when it was initialized.
+@details	Cards without an SD status are aligned to their erase sector size.
+
+@param[out]	geometry	The erase geometry of the card.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+int8_t
+sd_spi_read_erase_geometry(
+	sd_spi_erase_geometry_t	*geometry
+);
+
+/**
+@brief		Plans how to erase a sequence of blocks.
+@details	Nothing is sent to the card. If splitting the range is not
+			predicted to be faster, the plan erases the whole range as one
+			fragment.
+
+@param[in]	geometry				The erase geometry of the card.
+@param 		start_block_address		The address of the first block in the
+									sequence.
+@param 		end_block_address		The address of the last block in the
+									sequence.
+@param[out]	plan					The plan.
+*/
+void
+sd_spi_plan_erase(
+	sd_spi_erase_geometry_t	*geometry,
+	uint32_t				start_block_address,
+	uint32_t				end_block_address,
+	sd_spi_erase_plan_t		*plan
+);
+
+/**
+@brief		Erases a sequence of blocks on the card in use according to a
+			plan from sd_spi_plan_erase().
+@details	The aligned units are erased first, which makes the erased value of
+			the card known (see sd_spi_erase_blocks()). Until it is known,
+			fragments are erased instead of overwritten, except on cards that
+			cannot erase single blocks, where they are overwritten with the
+			erased value that the SCR register gives. Overwritten blocks are
+			added to the map of erased blocks.
+
+@param[in]	geometry				The erase geometry of the card.
+@param 		start_block_address		The address of the first block in the
+									sequence.
+@param 		end_block_address		The address of the last block in the
+									sequence.
+@param[out]	plan					(Optional) The plan that was followed.
+									Use NULL if it is not needed.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+int8_t
+sd_spi_erase_planned(
+	sd_spi_erase_geometry_t	*geometry,
+	uint32_t				start_block_address,
+	uint32_t				end_block_address,
+	sd_spi_erase_plan_t		*plan
+);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif /* SD_SPI_ERASE_PLANNER_H_ */
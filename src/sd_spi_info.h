@@ -4,7 +4,8 @@
 @author     Wade Penson
 @date		June, 2015
 @brief      Structures to store information from CID (Card Identification)
-			and CSD (Card Specific Data) registers for SD cards.
+			and CSD (Card Specific Data) registers and the SD status of SD
+			cards.
 @details	Information about the fields can be found in the simplified
 			physical SD specifications from the SD Association.
 @copyright  Copyright 2015 Wade Penson
@@ -30,6 +31,8 @@
 extern "C" {
 #endif
 
+#include <stdint.h>
+
 /**
 @brief CID register information
 */
@@ -194,6 +197,81 @@ typedef struct sd_spi_csd
 	unsigned int:								1;
 } sd_spi_csd_t;
 
+/**
+@brief		SD status information
+@details	The SD status is read with ACMD13. Only the fields up to the UHS
+			allocation unit size are kept. Further details about the fields
+			can be found in the SD specifications.
+*/
+typedef struct sd_spi_sd_status
+{
+	/** Size of the protected area. */
+	uint32_t		size_of_protected_area;
+	/** The type of the card. 0 is a regular read and write card. */
+	unsigned int	sd_card_type:		16;
+	/** The number of AUs that erase_timeout is given for. 0 if the erase
+		timeout is not supported. */
+	unsigned int	erase_size:			16;
+	/** The width of the data bus. */
+	unsigned int	dat_bus_width:		2;
+	/** Defines if the card is in the secured mode of operation. */
+	unsigned int	secured_mode:		1;
+	/* Bitfield padding */
+	unsigned int:						5;
+	/** Speed class of the card. 0, 1, 2, 3 and 4 are classes 0, 2, 4, 6
+		and 10. */
+	unsigned int	speed_class:		8;
+	/** Performance of moving data in MB/s. 0 means that it is the same as
+		sequential writing. */
+	unsigned int	performance_move:	8;
+	/** Size of an allocation unit (AU). 1 to 9 are 16KB to 4MB, doubling
+		each time. 10 to 15 are 8, 12, 16, 24, 32 and 64MB. */
+	unsigned int	au_size:			4;
+	/** UHS size of an allocation unit. */
+	unsigned int	uhs_au_size:		4;
+	/** Time in seconds to erase the number of AUs given by erase_size. */
+	unsigned int	erase_timeout:		6;
+	/** Time in seconds that is added to the erase time. */
+	unsigned int	erase_offset:		2;
+	/** UHS speed grade of the card. */
+	unsigned int	uhs_speed_grade:	4;
+	/* Bitfield padding */
+	unsigned int:						4;
+} sd_spi_sd_status_t;
+
+/**
+@brief		SD configuration register (SCR) information
+@details	The SCR is read with ACMD51. Further details about the fields can
+			be found in the SD specifications.
+*/
+typedef struct sd_spi_scr
+{
+	/** Version of the SCR structure. */
+	unsigned int	scr_structure:			4;
+	/** Version of the physical layer specification. */
+	unsigned int	sd_spec:				4;
+	/** The value of the bits of an erased block (0 or 1). */
+	unsigned int	data_stat_after_erase:	1;
+	/** The security version that the card supports. */
+	unsigned int	sd_security:			3;
+	/** The supported data bus widths. Bit 0 is 1 bit and bit 2 is 4 bits. */
+	unsigned int	sd_bus_widths:			4;
+	/** Set for version 3.00 or higher of the physical layer specification. */
+	unsigned int	sd_spec3:				1;
+	/** Extended security support. */
+	unsigned int	ex_security:			4;
+	/** Set for version 4.00 or higher of the physical layer specification. */
+	unsigned int	sd_spec4:				1;
+	/** Version 5.00 or higher of the physical layer specification. */
+	unsigned int	sd_specx:				4;
+	/** Supported commands. Bit 0 is speed class control (CMD20), bit 1 is
+		SET_BLOCK_COUNT (CMD23), bit 2 is extension registers (CMD48/49)
+		and bit 3 is multiple block extension registers (CMD58/59). */
+	unsigned int	cmd_support:			4;
+	/* Bitfield padding */
+	unsigned int:							6;
+} sd_spi_scr_t;
+
 #if defined(__cplusplus)
 }
 #endif
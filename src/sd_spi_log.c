@@ -0,0 +1,285 @@
+/******************************************************************************/
+/**
+@file		sd_spi_log.c
+@author     Wade Penson
+@date		June, 2015
+@brief      Logging pipeline implementation.
+@copyright  Copyright 2015 Wade Penson
+
+@license    Licensed under the Apache License, Version 2.0 (the "License");
+            you may not use this file except in compliance with the License.
+            You may obtain a copy of the License at
+
+              http://www.apache.org/licenses/LICENSE-2.0
+
+            Unless required by applicable law or agreed to in writing, software
+            distributed under the License is distributed on an "AS IS" BASIS,
+            WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+            implied. See the License for the specific language governing
+            permissions and limitations under the License.
+*/
+/******************************************************************************/
+
+#include "sd_spi_log.h"
+
+#if defined(__AVR__)
+#include <util/atomic.h>
+#endif
+
+/**
+@brief		Reads the index that the other side of the ring writes.
+@details	The bytes of the ring that the index covers are visible once the
+			index is. On AVR, interrupts are held off so the two bytes of the
+			index are read together.
+
+@param[in]	index	The head or tail of a log.
+
+@return		The value of the index.
+*/
+static uint16_t
+sd_spi_log_load_index(
+	volatile uint16_t	*index
+);
+
+/**
+@brief		Publishes the index of this side of the ring.
+@details	The bytes that were written to or read from the ring before are
+			done before the other side sees the new index.
+
+@param[out]	index	The head or tail of a log.
+@param		value	The new value of the index.
+*/
+static void
+sd_spi_log_store_index(
+	volatile uint16_t	*index,
+	uint16_t			value
+);
+
+int8_t
+sd_spi_log_start(
+	sd_spi_log_t	*log,
+	sd_spi_card_t	*card,
+	uint32_t		start_block_address,
+	uint32_t		num_blocks
+)
+{
+	if (num_blocks == 0)
+	{
+		return SD_ERR_ARGUMENT_OUT_OF_RANGE;
+	}
+
+	log->head = 0;
+	log->tail = 0;
+	log->high_water = 0;
+	log->num_overflows = 0;
+	log->num_bytes_dropped = 0;
+	log->card = card;
+	log->next_block_address = start_block_address;
+	log->end_block_address = start_block_address + num_blocks;
+	log->page_fill = 0;
+	log->num_bytes_logged = 0;
+	log->is_started = 0;
+
+	sd_spi_use_card(card);
+
+	int8_t response;
+	if ((response = sd_spi_write_continuous_start(start_block_address,
+												   num_blocks)))
+	{
+		return response;
+	}
+
+	log->is_started = 1;
+
+	return SD_ERR_OK;
+}
+
+uint8_t
+sd_spi_log_push(
+	sd_spi_log_t	*log,
+	const void		*data,
+	uint16_t		number_of_bytes
+)
+{
+	uint16_t head = log->head;
+	uint16_t used = head - sd_spi_log_load_index(&log->tail);
+
+	if (number_of_bytes > SD_SPI_LOG_RING_SIZE - used)
+	{
+		log->num_overflows++;
+		log->num_bytes_dropped += number_of_bytes;
+
+		return 0;
+	}
+
+	/* The bytes may wrap around the end of the ring. */
+	uint16_t offset = head & (SD_SPI_LOG_RING_SIZE - 1);
+	uint16_t first_part = SD_SPI_LOG_RING_SIZE - offset;
+
+	if (first_part > number_of_bytes)
+	{
+		first_part = number_of_bytes;
+	}
+
+	memcpy(&log->ring[offset], data, first_part);
+	memcpy(log->ring, (const uint8_t *) data + first_part,
+		   number_of_bytes - first_part);
+
+	used += number_of_bytes;
+
+	if (used > log->high_water)
+	{
+		log->high_water = used;
+	}
+
+	sd_spi_log_store_index(&log->head, head + number_of_bytes);
+
+	return 1;
+}
+
+int8_t
+sd_spi_log_drain(
+	sd_spi_log_t	*log
+)
+{
+	if (!log->is_started)
+	{
+		return SD_ERR_READ_WRITE_CONTINUOUS;
+	}
+
+	sd_spi_use_card(log->card);
+
+	int8_t response;
+	uint16_t page_size = log->card->page_size;
+	uint16_t head = sd_spi_log_load_index(&log->head);
+	uint16_t tail = log->tail;
+
+	while (head != tail)
+	{
+		if (log->next_block_address == log->end_block_address)
+		{
+			return SD_ERR_ARGUMENT_OUT_OF_RANGE;
+		}
+
+		/* Take the bytes up to the end of the ring or of the page, whichever
+		   comes first. */
+		uint16_t offset = tail & (SD_SPI_LOG_RING_SIZE - 1);
+		uint16_t number_of_bytes = head - tail;
+
+		if (number_of_bytes > SD_SPI_LOG_RING_SIZE - offset)
+		{
+			number_of_bytes = SD_SPI_LOG_RING_SIZE - offset;
+		}
+
+		if (number_of_bytes > page_size - log->page_fill)
+		{
+			number_of_bytes = page_size - log->page_fill;
+		}
+
+		if ((response = sd_spi_write_continuous(&log->ring[offset],
+												number_of_bytes,
+												log->page_fill)))
+		{
+			return response;
+		}
+
+		/* The bytes are in the block buffer, so the producer can reuse their
+		   room right away. */
+		tail += number_of_bytes;
+		sd_spi_log_store_index(&log->tail, tail);
+
+		log->page_fill += number_of_bytes;
+		log->num_bytes_logged += number_of_bytes;
+
+		if (log->page_fill == page_size)
+		{
+			if ((response = sd_spi_write_continuous_next()))
+			{
+				return response;
+			}
+
+			log->page_fill = 0;
+			log->next_block_address++;
+
+			/* Pick up the bytes that came in while the page was handed over. */
+			head = sd_spi_log_load_index(&log->head);
+		}
+	}
+
+	return sd_spi_poll();
+}
+
+int8_t
+sd_spi_log_stop(
+	sd_spi_log_t	*log
+)
+{
+	if (!log->is_started)
+	{
+		return SD_ERR_OK;
+	}
+
+	int8_t response = sd_spi_log_drain(log);
+	int8_t stop_response;
+
+	/* The page that is partly filled is flushed by the stop. */
+	sd_spi_use_card(log->card);
+	stop_response = sd_spi_write_continuous_stop();
+	log->is_started = 0;
+
+	if (log->page_fill > 0)
+	{
+		log->page_fill = 0;
+		log->next_block_address++;
+	}
+
+	return response ? response : stop_response;
+}
+
+uint16_t
+sd_spi_log_pending(
+	sd_spi_log_t	*log
+)
+{
+	return sd_spi_log_load_index(&log->head) -
+		   sd_spi_log_load_index(&log->tail);
+}
+
+static uint16_t
+sd_spi_log_load_index(
+	volatile uint16_t	*index
+)
+{
+#if defined(__AVR__)
+	uint16_t value;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		value = *index;
+	}
+
+	return value;
+#elif defined(__ATOMIC_ACQUIRE)
+	return __atomic_load_n(index, __ATOMIC_ACQUIRE);
+#else
+	return *index;
+#endif
+}
+
+static void
+sd_spi_log_store_index(
+	volatile uint16_t	*index,
+	uint16_t			value
+)
+{
+#if defined(__AVR__)
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE)
+	{
+		*index = value;
+	}
+#elif defined(__ATOMIC_RELEASE)
+	__atomic_store_n(index, value, __ATOMIC_RELEASE);
+#else
+	*index = value;
+#endif
+}
@@ -0,0 +1,177 @@
+/******************************************************************************/
+/**
+@file		sd_spi_log.h
+@author     Wade Penson
+@date		June, 2015
+@brief      Logging pipeline from an interrupt or other producer to a card.
+@details	The producer pushes bytes into a single-producer/single-consumer
+			ring without locks, so it can run in an interrupt handler while
+			the main loop is inside a library call. The main loop calls
+			sd_spi_log_drain(), which packs the bytes of the ring into pages
+			and hands them to a continuous write that was started with a
+			pre-erase. With SD_SPI_NUM_BUFFERS above 1, a full page is queued
+			and written by sd_spi_poll() while the next one fills, so the
+			drain does not wait for the card to program. The ring only has to
+			hold the bytes that arrive while the card is busy.
+
+@copyright  Copyright 2015 Wade Penson
+
+@license    Licensed under the Apache License, Version 2.0 (the "License");
+            you may not use this file except in compliance with the License.
+            You may obtain a copy of the License at
+
+              http://www.apache.org/licenses/LICENSE-2.0
+
+            Unless required by applicable law or agreed to in writing, software
+            distributed under the License is distributed on an "AS IS" BASIS,
+            WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+            implied. See the License for the specific language governing
+            permissions and limitations under the License.
+*/
+/******************************************************************************/
+
+#if !defined(SD_SPI_LOG_H_)
+#define SD_SPI_LOG_H_
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#include "sd_spi.h"
+
+/** The number of bytes in the ring of a log. It must be a power of two and at
+	most 32768. */
+#if !defined(SD_SPI_LOG_RING_SIZE)
+#define SD_SPI_LOG_RING_SIZE 1024
+#endif
+
+#if (SD_SPI_LOG_RING_SIZE & (SD_SPI_LOG_RING_SIZE - 1)) != 0 || \
+	SD_SPI_LOG_RING_SIZE > 32768
+#error "SD_SPI_LOG_RING_SIZE must be a power of two and at most 32768."
+#endif
+
+/** State variables used by the logging pipeline. */
+typedef struct sd_spi_log {
+	/** The bytes that have been pushed and not drained yet. */
+	uint8_t				ring[SD_SPI_LOG_RING_SIZE];
+	/** The number of bytes ever pushed (modulo 2^16). It is only written by
+		the producer. */
+	volatile uint16_t	head;
+	/** The number of bytes ever drained (modulo 2^16). It is only written by
+		the consumer. */
+	volatile uint16_t	tail;
+	/** The most bytes that were ever waiting in the ring. It is only written
+		by the producer. */
+	volatile uint16_t	high_water;
+	/** The number of pushes that were dropped because the ring was full. It
+		is only written by the producer. */
+	volatile uint32_t	num_overflows;
+	/** The number of bytes of the dropped pushes. It is only written by the
+		producer. */
+	volatile uint32_t	num_bytes_dropped;
+	/** The card that the log is written to. */
+	sd_spi_card_t		*card;
+	/** The page that the next full page is written to. */
+	uint32_t			next_block_address;
+	/** The page after the last one of the log. */
+	uint32_t			end_block_address;
+	/** The number of bytes in the page that is being filled. */
+	uint16_t			page_fill;
+	/** The number of bytes that have been drained to the card. */
+	uint32_t			num_bytes_logged;
+	/** True while the continuous write of the log is open. */
+	uint8_t				is_started;
+} sd_spi_log_t;
+
+/**
+@brief		Starts a log on a card.
+@details	The ring is emptied, the statistics are cleared and a continuous
+			write is started at start_block_address which pre-erases the
+			pages of the log. The card must already be initialized. Call
+			this before the producer pushes any bytes.
+
+@param[out]	log						The log to start.
+@param[in]	card					The state of the card to write to.
+@param		start_block_address		The first page of the log.
+@param		num_blocks				The number of pages the log may take.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+int8_t
+sd_spi_log_start(
+	sd_spi_log_t	*log,
+	sd_spi_card_t	*card,
+	uint32_t		start_block_address,
+	uint32_t		num_blocks
+);
+
+/**
+@brief		Adds bytes to the ring of a log.
+@details	This never calls into the library and never waits, so it can be
+			called from an interrupt handler. Only one producer may push to a
+			log. The bytes are stored as a whole or dropped as a whole, so a
+			record is never cut short.
+
+@param[in]	log					A started log.
+@param[in]	data				The bytes to add.
+@param		number_of_bytes		The number of bytes.
+
+@return		1 if the bytes were added and 0 if the ring did not have room.
+*/
+uint8_t
+sd_spi_log_push(
+	sd_spi_log_t	*log,
+	const void		*data,
+	uint16_t		number_of_bytes
+);
+
+/**
+@brief		Moves the bytes in the ring into pages on the card.
+@details	This is meant to be called repeatedly from the main loop. Every
+			page that fills up is passed to sd_spi_write_continuous_next(),
+			and sd_spi_poll() is called otherwise so queued pages keep going
+			out while the card is ready. The functions of the layer change the
+			card in use (see sd_spi_use_card()).
+
+@param[in]	log		A started log.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+			SD_ERR_ARGUMENT_OUT_OF_RANGE is returned once the pages of the log
+			are full. The bytes that did not fit stay in the ring.
+*/
+int8_t
+sd_spi_log_drain(
+	sd_spi_log_t	*log
+);
+
+/**
+@brief		Drains the ring and stops the continuous write of the log.
+@details	A page that is partly filled is written with the rest of it set to
+			zeros. The producer must stop pushing before this is called.
+
+@param[in]	log		A started log.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+int8_t
+sd_spi_log_stop(
+	sd_spi_log_t	*log
+);
+
+/**
+@brief		Gets the number of bytes waiting in the ring of a log.
+
+@param[in]	log		A started log.
+
+@return		The number of bytes that have not been drained yet.
+*/
+uint16_t
+sd_spi_log_pending(
+	sd_spi_log_t	*log
+);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif /* SD_SPI_LOG_H_ */
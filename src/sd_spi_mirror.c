@@ -0,0 +1,658 @@
+/******************************************************************************/
+/**
+@file		sd_spi_mirror.c
+@author     Wade Penson
+@date		June, 2015
+@brief      Mirroring (RAID-1) layer implementation.
+@copyright  Copyright 2015 Wade Penson
+
+@license    Licensed under the Apache License, Version 2.0 (the "License");
+            you may not use this file except in compliance with the License.
+            You may obtain a copy of the License at
+
+              http://www.apache.org/licenses/LICENSE-2.0
+
+            Unless required by applicable law or agreed to in writing, software
+            distributed under the License is distributed on an "AS IS" BASIS,
+            WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+            implied. See the License for the specific language governing
+            permissions and limitations under the License.
+*/
+/******************************************************************************/
+
+#include "sd_spi_mirror.h"
+
+/** The number of bytes compared at a time when verifying blocks. */
+#define SD_SPI_MIRROR_VERIFY_CHUNK	32
+
+/**
+@brief		Records a range of blocks as dirty for a card. Overlapping and
+			adjacent ranges are merged.
+
+@param[in]	mirror					An initialized mirror set.
+@param		card_index				The index of the card.
+@param		start_block_address		The first dirty block.
+@param		num_blocks				The number of dirty blocks.
+*/
+static void
+sd_spi_mirror_mark_dirty(
+	sd_spi_mirror_t	*mirror,
+	uint8_t			card_index,
+	uint32_t		start_block_address,
+	uint32_t		num_blocks
+);
+
+/**
+@brief		Checks if any block in a range is dirty for a card.
+
+@param[in]	mirror					An initialized mirror set.
+@param		card_index				The index of the card.
+@param		start_block_address		The first block of the range.
+@param		num_blocks				The number of blocks in the range.
+
+@return		1 if a block is dirty and 0 otherwise.
+*/
+static uint8_t
+sd_spi_mirror_is_dirty(
+	sd_spi_mirror_t	*mirror,
+	uint8_t			card_index,
+	uint32_t		start_block_address,
+	uint32_t		num_blocks
+);
+
+/**
+@brief		Reads blocks from a single card of the mirror set.
+
+@param[in]	mirror			An initialized mirror set.
+@param		card_index		The index of the card.
+@param		block_address	The first block to read.
+@param[out]	data_buffer		A location in memory of num_blocks * 512 bytes.
+@param		num_blocks		The number of blocks to read.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+static int8_t
+sd_spi_mirror_read_card(
+	sd_spi_mirror_t	*mirror,
+	uint8_t			card_index,
+	uint32_t		block_address,
+	void			*data_buffer,
+	uint32_t		num_blocks
+);
+
+int8_t
+sd_spi_mirror_init(
+	sd_spi_mirror_t	*mirror,
+	sd_spi_card_t	*cards,
+	uint8_t			*chip_select_pins,
+	uint8_t			num_cards
+)
+{
+	if (num_cards < 2 || num_cards > SD_SPI_MIRROR_MAX_CARDS)
+	{
+		return SD_ERR_ILLEGAL_PARAMETER;
+	}
+
+	mirror->num_cards = num_cards;
+	mirror->start_block_address = 0;
+	mirror->next_block_address = 0;
+	mirror->write_card_mask = 0;
+	mirror->is_write_continuous = 0;
+	mirror->next_read_card = 0;
+
+	uint8_t i;
+	for (i = 0; i < num_cards; i++)
+	{
+		mirror->cards[i] = &cards[i];
+		mirror->next_read_address[i] = 0;
+		mirror->num_dirty_ranges[i] = 0;
+		sd_spi_use_card(mirror->cards[i]);
+
+		int8_t response;
+		if ((response = sd_spi_init(chip_select_pins[i])))
+		{
+			return response;
+		}
+
+		uint32_t card_size = sd_spi_card_size();
+
+		if (i == 0 || card_size < mirror->num_blocks)
+		{
+			mirror->num_blocks = card_size;
+		}
+	}
+
+	return SD_ERR_OK;
+}
+
+int8_t
+sd_spi_mirror_write_blocks(
+	sd_spi_mirror_t	*mirror,
+	uint32_t		block_address,
+	void			*data,
+	uint32_t		num_blocks
+)
+{
+	if (block_address > mirror->num_blocks ||
+		num_blocks > mirror->num_blocks - block_address)
+	{
+		return SD_ERR_ARGUMENT_OUT_OF_RANGE;
+	}
+
+	int8_t response = SD_ERR_OK;
+	uint8_t i;
+
+	if (!mirror->is_write_continuous ||
+		mirror->next_block_address != block_address)
+	{
+		sd_spi_mirror_write_continuous_stop(mirror);
+
+		mirror->write_card_mask = 0;
+
+		for (i = 0; i < mirror->num_cards; i++)
+		{
+			sd_spi_use_card(mirror->cards[i]);
+
+			if ((response = sd_spi_write_continuous_start(block_address,
+														   num_blocks)) == 0)
+			{
+				mirror->write_card_mask |= 1 << i;
+			}
+		}
+
+		mirror->start_block_address = block_address;
+		mirror->next_block_address = block_address;
+		mirror->is_write_continuous = 1;
+	}
+
+	uint32_t current_block;
+	for (current_block = 0; current_block < num_blocks; current_block++)
+	{
+		/* Every card gets the block in turn. A card does not wait for its own
+		   write to finish, so the next card receives the block while the
+		   previous one is busy. */
+		for (i = 0; i < mirror->num_cards; i++)
+		{
+			if (mirror->write_card_mask & (1 << i))
+			{
+				int8_t card_response;
+				sd_spi_use_card(mirror->cards[i]);
+
+				if ((card_response = sd_spi_write_continuous((uint8_t *) data +
+															 (current_block
+															  << 9),
+															 512, 0)) ||
+					(card_response = sd_spi_flush()))
+				{
+					/* The card is dropped from the write. The blocks written
+					   to it so far are still uncertain. */
+					response = card_response;
+					mirror->write_card_mask &= ~(1 << i);
+					sd_spi_write_continuous_stop();
+					sd_spi_mirror_mark_dirty(mirror, i,
+											 mirror->start_block_address,
+											 mirror->next_block_address -
+											 mirror->start_block_address + 1);
+				}
+			}
+			else
+			{
+				sd_spi_mirror_mark_dirty(mirror, i, mirror->next_block_address,
+										 1);
+			}
+		}
+
+		mirror->next_block_address++;
+	}
+
+	if (mirror->write_card_mask == 0)
+	{
+		mirror->is_write_continuous = 0;
+		return response;
+	}
+
+	return SD_ERR_OK;
+}
+
+int8_t
+sd_spi_mirror_write_continuous_stop(
+	sd_spi_mirror_t	*mirror
+)
+{
+	if (!mirror->is_write_continuous)
+	{
+		return SD_ERR_OK;
+	}
+
+	int8_t response = SD_ERR_OK;
+	uint8_t i;
+
+	for (i = 0; i < mirror->num_cards; i++)
+	{
+		if (mirror->write_card_mask & (1 << i))
+		{
+			int8_t card_response;
+			sd_spi_use_card(mirror->cards[i]);
+
+			if ((card_response = sd_spi_write_continuous_stop()))
+			{
+				response = card_response;
+				mirror->write_card_mask &= ~(1 << i);
+				sd_spi_mirror_mark_dirty(mirror, i, mirror->start_block_address,
+										 mirror->next_block_address -
+										 mirror->start_block_address);
+			}
+		}
+	}
+
+	mirror->is_write_continuous = 0;
+
+	if (mirror->write_card_mask == 0)
+	{
+		return response;
+	}
+
+	return SD_ERR_OK;
+}
+
+int8_t
+sd_spi_mirror_read_blocks(
+	sd_spi_mirror_t	*mirror,
+	uint32_t		block_address,
+	void			*data_buffer,
+	uint32_t		num_blocks
+)
+{
+	if (block_address > mirror->num_blocks ||
+		num_blocks > mirror->num_blocks - block_address)
+	{
+		return SD_ERR_ARGUMENT_OUT_OF_RANGE;
+	}
+
+	int8_t response;
+	if ((response = sd_spi_mirror_write_continuous_stop(mirror)))
+	{
+		return response;
+	}
+
+	/* Prefer a card that continues a sequential read. Otherwise, spread the
+	   reads by taking turns. */
+	uint8_t card_index = mirror->next_read_card;
+	uint8_t i;
+
+	for (i = 0; i < mirror->num_cards; i++)
+	{
+		if (mirror->next_read_address[i] == block_address &&
+			!sd_spi_mirror_is_dirty(mirror, i, block_address, num_blocks))
+		{
+			card_index = i;
+			break;
+		}
+	}
+
+	if (i == mirror->num_cards)
+	{
+		mirror->next_read_card = (mirror->next_read_card + 1) %
+								 mirror->num_cards;
+	}
+
+	response = SD_ERR_READ_FAILURE;
+
+	for (i = 0; i < mirror->num_cards; i++)
+	{
+		if (!sd_spi_mirror_is_dirty(mirror, card_index, block_address,
+									num_blocks))
+		{
+			if ((response = sd_spi_mirror_read_card(mirror, card_index,
+													block_address, data_buffer,
+													num_blocks)) == 0)
+			{
+				mirror->next_read_address[card_index] = block_address +
+														num_blocks;
+				return SD_ERR_OK;
+			}
+
+			sd_spi_mirror_mark_dirty(mirror, card_index, block_address,
+									 num_blocks);
+		}
+
+		card_index = (card_index + 1) % mirror->num_cards;
+	}
+
+	return response;
+}
+
+int8_t
+sd_spi_mirror_verify(
+	sd_spi_mirror_t	*mirror,
+	uint32_t		block_address,
+	uint32_t		num_blocks
+)
+{
+	if (block_address > mirror->num_blocks ||
+		num_blocks > mirror->num_blocks - block_address)
+	{
+		return SD_ERR_ARGUMENT_OUT_OF_RANGE;
+	}
+
+	int8_t response;
+	if ((response = sd_spi_mirror_write_continuous_stop(mirror)))
+	{
+		return response;
+	}
+
+	uint8_t block[512];
+	uint8_t chunk[SD_SPI_MIRROR_VERIFY_CHUNK];
+	uint32_t current_block;
+
+	for (current_block = block_address;
+		 current_block < block_address + num_blocks;
+		 current_block++)
+	{
+		uint8_t reference_index;
+
+		for (reference_index = 0; reference_index < mirror->num_cards;
+			 reference_index++)
+		{
+			if (!sd_spi_mirror_is_dirty(mirror, reference_index, current_block,
+										1))
+			{
+				break;
+			}
+		}
+
+		if (reference_index == mirror->num_cards)
+		{
+			continue;
+		}
+
+		if ((response = sd_spi_mirror_read_card(mirror, reference_index,
+												current_block, block, 1)))
+		{
+			return response;
+		}
+
+		uint8_t i;
+		for (i = reference_index + 1; i < mirror->num_cards; i++)
+		{
+			if (sd_spi_mirror_is_dirty(mirror, i, current_block, 1))
+			{
+				continue;
+			}
+
+			sd_spi_use_card(mirror->cards[i]);
+
+			uint16_t byte_offset;
+			for (byte_offset = 0; byte_offset < 512;
+				 byte_offset += SD_SPI_MIRROR_VERIFY_CHUNK)
+			{
+				if (sd_spi_read(current_block, chunk,
+								SD_SPI_MIRROR_VERIFY_CHUNK, byte_offset) ||
+					memcmp(chunk, block + byte_offset,
+						   SD_SPI_MIRROR_VERIFY_CHUNK) != 0)
+				{
+					sd_spi_mirror_mark_dirty(mirror, i, current_block, 1);
+					break;
+				}
+			}
+		}
+	}
+
+	return SD_ERR_OK;
+}
+
+int8_t
+sd_spi_mirror_resync(
+	sd_spi_mirror_t	*mirror,
+	uint32_t		max_blocks
+)
+{
+	int8_t response;
+	if ((response = sd_spi_mirror_write_continuous_stop(mirror)))
+	{
+		return response;
+	}
+
+	uint8_t block[512];
+	uint32_t num_copied = 0;
+	uint8_t i;
+
+	for (i = 0; i < mirror->num_cards; i++)
+	{
+		uint8_t range_index = 0;
+
+		while (range_index < mirror->num_dirty_ranges[i] &&
+			   num_copied < max_blocks)
+		{
+			sd_spi_block_range_t *range = &mirror->dirty_ranges[i][range_index];
+
+			/* Find a card that has a good copy of the block. */
+			uint8_t source_index;
+			for (source_index = 0; source_index < mirror->num_cards;
+				 source_index++)
+			{
+				if (source_index != i &&
+					!sd_spi_mirror_is_dirty(mirror, source_index,
+											range->start_block_address, 1))
+				{
+					break;
+				}
+			}
+
+			if (source_index == mirror->num_cards)
+			{
+				range_index++;
+				continue;
+			}
+
+			if ((response = sd_spi_mirror_read_card(mirror, source_index,
+													range->start_block_address,
+													block, 1)))
+			{
+				return response;
+			}
+
+			sd_spi_use_card(mirror->cards[i]);
+
+			if ((response = sd_spi_write_block(range->start_block_address,
+											   block)))
+			{
+				return response;
+			}
+
+			num_copied++;
+			range->start_block_address++;
+			range->num_blocks--;
+
+			if (range->num_blocks == 0)
+			{
+				mirror->num_dirty_ranges[i]--;
+				*range = mirror->dirty_ranges[i][mirror->num_dirty_ranges[i]];
+			}
+		}
+	}
+
+	return SD_ERR_OK;
+}
+
+uint32_t
+sd_spi_mirror_dirty_blocks(
+	sd_spi_mirror_t	*mirror,
+	uint8_t			card_index
+)
+{
+	uint32_t num_blocks = 0;
+	uint8_t i;
+
+	for (i = 0; i < mirror->num_dirty_ranges[card_index]; i++)
+	{
+		num_blocks += mirror->dirty_ranges[card_index][i].num_blocks;
+	}
+
+	return num_blocks;
+}
+
+static void
+sd_spi_mirror_mark_dirty(
+	sd_spi_mirror_t	*mirror,
+	uint8_t			card_index,
+	uint32_t		start_block_address,
+	uint32_t		num_blocks
+)
+{
+	sd_spi_block_range_t *ranges = mirror->dirty_ranges[card_index];
+	uint32_t end_block_address = start_block_address + num_blocks;
+	uint8_t i = 0;
+
+	if (num_blocks == 0)
+	{
+		return;
+	}
+
+	/* Absorb every range that overlaps or touches the new one. */
+	while (i < mirror->num_dirty_ranges[card_index])
+	{
+		uint32_t range_end = ranges[i].start_block_address +
+							 ranges[i].num_blocks;
+
+		if (ranges[i].start_block_address <= end_block_address &&
+			start_block_address <= range_end)
+		{
+			if (ranges[i].start_block_address < start_block_address)
+			{
+				start_block_address = ranges[i].start_block_address;
+			}
+
+			if (range_end > end_block_address)
+			{
+				end_block_address = range_end;
+			}
+
+			mirror->num_dirty_ranges[card_index]--;
+			ranges[i] = ranges[mirror->num_dirty_ranges[card_index]];
+		}
+		else
+		{
+			i++;
+		}
+	}
+
+	/* If there is no room, merge with the closest range. The blocks in the gap
+	   are resynced needlessly but nothing is lost. */
+	if (mirror->num_dirty_ranges[card_index] == SD_SPI_MIRROR_MAX_DIRTY_RANGES)
+	{
+		uint8_t closest = 0;
+		uint32_t closest_gap = UINT32_MAX;
+
+		for (i = 0; i < SD_SPI_MIRROR_MAX_DIRTY_RANGES; i++)
+		{
+			uint32_t gap;
+
+			if (ranges[i].start_block_address >= end_block_address)
+			{
+				gap = ranges[i].start_block_address - end_block_address;
+			}
+			else
+			{
+				gap = start_block_address - (ranges[i].start_block_address +
+											 ranges[i].num_blocks);
+			}
+
+			if (gap < closest_gap)
+			{
+				closest_gap = gap;
+				closest = i;
+			}
+		}
+
+		if (ranges[closest].start_block_address < start_block_address)
+		{
+			start_block_address = ranges[closest].start_block_address;
+		}
+
+		if (ranges[closest].start_block_address + ranges[closest].num_blocks >
+			end_block_address)
+		{
+			end_block_address = ranges[closest].start_block_address +
+								ranges[closest].num_blocks;
+		}
+
+		mirror->num_dirty_ranges[card_index]--;
+		ranges[closest] = ranges[mirror->num_dirty_ranges[card_index]];
+	}
+
+	ranges[mirror->num_dirty_ranges[card_index]].start_block_address =
+		start_block_address;
+	ranges[mirror->num_dirty_ranges[card_index]].num_blocks =
+		end_block_address - start_block_address;
+	mirror->num_dirty_ranges[card_index]++;
+}
+
+static uint8_t
+sd_spi_mirror_is_dirty(
+	sd_spi_mirror_t	*mirror,
+	uint8_t			card_index,
+	uint32_t		start_block_address,
+	uint32_t		num_blocks
+)
+{
+	uint8_t i;
+
+	for (i = 0; i < mirror->num_dirty_ranges[card_index]; i++)
+	{
+		sd_spi_block_range_t *range = &mirror->dirty_ranges[card_index][i];
+
+		if (range->start_block_address < start_block_address + num_blocks &&
+			start_block_address < range->start_block_address +
+								  range->num_blocks)
+		{
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static int8_t
+sd_spi_mirror_read_card(
+	sd_spi_mirror_t	*mirror,
+	uint8_t			card_index,
+	uint32_t		block_address,
+	void			*data_buffer,
+	uint32_t		num_blocks
+)
+{
+	int8_t response;
+	sd_spi_use_card(mirror->cards[card_index]);
+
+	if (num_blocks == 1)
+	{
+		return sd_spi_read(block_address, data_buffer, 512, 0);
+	}
+
+	if ((response = sd_spi_read_continuous_start(block_address)))
+	{
+		return response;
+	}
+
+	/* The read is stopped on an error as well, so the card can still be
+	   used for a resync or a read of another copy. */
+	uint32_t i;
+	for (i = 0; i < num_blocks; i++)
+	{
+		if ((response = sd_spi_read_continuous((uint8_t *) data_buffer +
+											   (i << 9), 512, 0)))
+		{
+			break;
+		}
+
+		if (i + 1 < num_blocks && (response = sd_spi_read_continuous_next()))
+		{
+			break;
+		}
+	}
+
+	int8_t stop_response = sd_spi_read_continuous_stop();
+
+	return response ? response : stop_response;
+}
@@ -0,0 +1,208 @@
+/******************************************************************************/
+/**
+@file		sd_spi_mirror.h
+@author     Wade Penson
+@date		June, 2015
+@brief      Mirroring (RAID-1) layer over multiple SD cards.
+@details	Every block is written to all of the cards in the set. The writes
+			go through a continuous write on each card and the cards are
+			given the same block one after the other, so the busy time of one
+			card overlaps the transfer to the next. Reads are served by a
+			single card which is picked by address locality. When a card fails
+			or does not match, the affected blocks are recorded as dirty for
+			that card and are copied over from a good card by
+			sd_spi_mirror_resync() when the application has idle time.
+
+@copyright  Copyright 2015 Wade Penson
+
+@license    Licensed under the Apache License, Version 2.0 (the "License");
+            you may not use this file except in compliance with the License.
+            You may obtain a copy of the License at
+
+              http://www.apache.org/licenses/LICENSE-2.0
+
+            Unless required by applicable law or agreed to in writing, software
+            distributed under the License is distributed on an "AS IS" BASIS,
+            WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+            implied. See the License for the specific language governing
+            permissions and limitations under the License.
+*/
+/******************************************************************************/
+
+#if !defined(SD_SPI_MIRROR_H_)
+#define SD_SPI_MIRROR_H_
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#include "sd_spi.h"
+
+/** The maximum number of cards in a mirror set. */
+#define SD_SPI_MIRROR_MAX_CARDS			4
+/** The number of dirty ranges that are kept for each card. When a card runs
+	out, the closest ranges are merged so no dirty block is ever lost. */
+#define SD_SPI_MIRROR_MAX_DIRTY_RANGES	8
+
+/** State variables used by the mirroring layer. */
+typedef struct sd_spi_mirror {
+	/** The state of each card in the set. */
+	sd_spi_card_t			*cards[SD_SPI_MIRROR_MAX_CARDS];
+	/** The number of cards in the set. */
+	uint8_t					num_cards;
+	/** The number of blocks in the set (the size of the smallest card). */
+	uint32_t				num_blocks;
+	/** The block that the continuous write started at. */
+	uint32_t				start_block_address;
+	/** The block that the next streamed write goes to. */
+	uint32_t				next_block_address;
+	/** Bit i is set if card i is taking part in the continuous write. */
+	uint8_t					write_card_mask;
+	/** True if a continuous write is in progress. */
+	uint8_t					is_write_continuous;
+	/** The card that the next read without locality goes to. */
+	uint8_t					next_read_card;
+	/** For each card, the block after the last block it read. */
+	uint32_t				next_read_address[SD_SPI_MIRROR_MAX_CARDS];
+	/** For each card, the ranges of blocks that are out of date. */
+	sd_spi_block_range_t	dirty_ranges[SD_SPI_MIRROR_MAX_CARDS]
+										[SD_SPI_MIRROR_MAX_DIRTY_RANGES];
+	/** For each card, the number of dirty ranges. */
+	uint8_t					num_dirty_ranges[SD_SPI_MIRROR_MAX_CARDS];
+} sd_spi_mirror_t;
+
+/**
+@brief		Initializes every card in the mirror set.
+@details	The functions of the layer change the card in use (see
+			sd_spi_use_card()).
+
+@param[out]	mirror				The mirror set to initialize.
+@param[out]	cards				An array of num_cards card states to use.
+@param[in]	chip_select_pins	The chip select pin of each card.
+@param		num_cards			The number of cards (2 to
+								SD_SPI_MIRROR_MAX_CARDS).
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+int8_t
+sd_spi_mirror_init(
+	sd_spi_mirror_t	*mirror,
+	sd_spi_card_t	*cards,
+	uint8_t			*chip_select_pins,
+	uint8_t			num_cards
+);
+
+/**
+@brief		Writes whole blocks to every card in the mirror set.
+@details	The blocks are written through continuous writes which are left
+			open so that consecutive calls keep streaming. Call
+			sd_spi_mirror_write_continuous_stop() when done writing. If a card
+			fails, it is dropped from the write and the blocks are marked as
+			dirty for it.
+
+@param[in]	mirror			An initialized mirror set.
+@param		block_address	The first block to write.
+@param[in]	data			num_blocks * 512 bytes of data.
+@param		num_blocks		The number of blocks to write.
+
+@return		SD_ERR_OK if at least one card holds the data. Otherwise, the error
+			code of the last card that failed.
+*/
+int8_t
+sd_spi_mirror_write_blocks(
+	sd_spi_mirror_t	*mirror,
+	uint32_t		block_address,
+	void			*data,
+	uint32_t		num_blocks
+);
+
+/**
+@brief		Stops the continuous write on every card.
+@details	If stopping fails on a card, all of the blocks of the write are
+			marked as dirty for that card.
+
+@param[in]	mirror	An initialized mirror set.
+
+@return		SD_ERR_OK if at least one card holds the data. Otherwise, the error
+			code of the last card that failed.
+*/
+int8_t
+sd_spi_mirror_write_continuous_stop(
+	sd_spi_mirror_t	*mirror
+);
+
+/**
+@brief		Reads whole blocks from the mirror set.
+@details	A card which continues its previous read is preferred; otherwise
+			the cards take turns. Cards with dirty blocks in the range are
+			skipped. If a card fails, the range is marked as dirty for it and
+			the next card is tried.
+
+@param[in]	mirror			An initialized mirror set.
+@param		block_address	The first block to read.
+@param[out]	data_buffer		A location in memory of num_blocks * 512 bytes.
+@param		num_blocks		The number of blocks to read.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+int8_t
+sd_spi_mirror_read_blocks(
+	sd_spi_mirror_t	*mirror,
+	uint32_t		block_address,
+	void			*data_buffer,
+	uint32_t		num_blocks
+);
+
+/**
+@brief		Compares the blocks on every card with the first card that is not
+			dirty for them. Blocks that do not match are marked as dirty.
+
+@param[in]	mirror			An initialized mirror set.
+@param		block_address	The first block to compare.
+@param		num_blocks		The number of blocks to compare.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+int8_t
+sd_spi_mirror_verify(
+	sd_spi_mirror_t	*mirror,
+	uint32_t		block_address,
+	uint32_t		num_blocks
+);
+
+/**
+@brief		Copies dirty blocks from a good card to the cards that need them.
+@details	This is meant to be called repeatedly when the application is idle.
+			Blocks that are dirty on every card cannot be recovered and are
+			left dirty.
+
+@param[in]	mirror		An initialized mirror set.
+@param		max_blocks	The maximum number of blocks to copy in this call.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+int8_t
+sd_spi_mirror_resync(
+	sd_spi_mirror_t	*mirror,
+	uint32_t		max_blocks
+);
+
+/**
+@brief		Gets the number of dirty blocks of a card.
+
+@param[in]	mirror		An initialized mirror set.
+@param		card_index	The index of the card in the set.
+
+@return		The number of blocks that still have to be resynced.
+*/
+uint32_t
+sd_spi_mirror_dirty_blocks(
+	sd_spi_mirror_t	*mirror,
+	uint8_t			card_index
+);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif /* SD_SPI_MIRROR_H_ */
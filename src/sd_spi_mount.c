@@ -0,0 +1,186 @@
+/******************************************************************************/
+/**
+@file		sd_spi_mount.c
+@author     Wade Penson
+@date		June, 2015
+@brief      Binary search for the ends of a log of sequence-stamped pages.
+@copyright  Copyright 2015 Wade Penson
+
+@license    Licensed under the Apache License, Version 2.0 (the "License");
+            you may not use this file except in compliance with the License.
+            You may obtain a copy of the License at
+
+              http://www.apache.org/licenses/LICENSE-2.0
+
+            Unless required by applicable law or agreed to in writing, software
+            distributed under the License is distributed on an "AS IS" BASIS,
+            WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+            implied. See the License for the specific language governing
+            permissions and limitations under the License.
+*/
+/******************************************************************************/
+
+#include "sd_spi_mount.h"
+
+/**
+@brief		Gets the sequence number of a page of the range.
+
+@param		read_sequence	Gets the sequence number of a page.
+@param[in]	context			Passed to read_sequence.
+@param[in]	mount			The search, whose read count goes up.
+@param		block_address	The page.
+@param[out]	sequence		The sequence number of the page.
+@param[out]	is_valid		1 if the page is valid and 0 otherwise.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+static int8_t
+sd_spi_mount_probe(
+	sd_spi_mount_sequence_t	read_sequence,
+	void					*context,
+	sd_spi_mount_t			*mount,
+	uint32_t				block_address,
+	uint32_t				*sequence,
+	uint8_t					*is_valid
+);
+
+int8_t
+sd_spi_mount_find(
+	uint32_t				start_block_address,
+	uint32_t				num_blocks,
+	uint32_t				max_gap,
+	sd_spi_mount_sequence_t	read_sequence,
+	void					*context,
+	sd_spi_mount_t			*mount
+)
+{
+	int8_t response;
+	uint32_t sequence;
+	uint8_t is_valid;
+	uint32_t anchor = 0;
+
+	mount->head_block_address = start_block_address;
+	mount->tail_block_address = start_block_address;
+	mount->newest_sequence = 0;
+	mount->num_reads = 0;
+
+	if (num_blocks == 0)
+	{
+		return SD_ERR_OK;
+	}
+
+	if ((response = sd_spi_mount_probe(read_sequence, context, mount,
+									   start_block_address, &sequence,
+									   &is_valid)))
+	{
+		return response;
+	}
+
+	/* The erased pages in front of the newest page may cover the start of
+	   the range, but not the page at max_gap. */
+	if (!is_valid && max_gap > 0 && max_gap < num_blocks)
+	{
+		anchor = max_gap;
+
+		if ((response = sd_spi_mount_probe(read_sequence, context, mount,
+										   start_block_address + anchor,
+										   &sequence, &is_valid)))
+		{
+			return response;
+		}
+	}
+
+	if (!is_valid)
+	{
+		return SD_ERR_OK;
+	}
+
+	/* Find the first page after the anchor that is not from the same lap. */
+	uint32_t lap_offset = sequence - anchor;
+	uint32_t low = anchor + 1;
+	uint32_t high = num_blocks;
+
+	while (low < high)
+	{
+		uint32_t middle = low + (high - low) / 2;
+
+		if ((response = sd_spi_mount_probe(read_sequence, context, mount,
+										   start_block_address + middle,
+										   &sequence, &is_valid)))
+		{
+			return response;
+		}
+
+		if (is_valid && sequence - middle == lap_offset)
+		{
+			low = middle + 1;
+		}
+		else
+		{
+			high = middle;
+		}
+	}
+
+	mount->head_block_address = start_block_address + low;
+	mount->newest_sequence = lap_offset + low - 1;
+
+	/* The oldest page is the first valid page after the erased pages in
+	   front of the head. They may go on at the start of the range. */
+	high = num_blocks;
+
+	while (1)
+	{
+		while (low < high)
+		{
+			uint32_t middle = low + (high - low) / 2;
+
+			if ((response = sd_spi_mount_probe(read_sequence, context, mount,
+											   start_block_address + middle,
+											   &sequence, &is_valid)))
+			{
+				return response;
+			}
+
+			if (is_valid)
+			{
+				high = middle;
+			}
+			else
+			{
+				low = middle + 1;
+			}
+		}
+
+		if (low < num_blocks || anchor == 0)
+		{
+			break;
+		}
+
+		low = 0;
+		high = anchor;
+		anchor = 0;
+	}
+
+	mount->tail_block_address = start_block_address +
+								(low < num_blocks ? low : 0);
+
+	return SD_ERR_OK;
+}
+
+static int8_t
+sd_spi_mount_probe(
+	sd_spi_mount_sequence_t	read_sequence,
+	void					*context,
+	sd_spi_mount_t			*mount,
+	uint32_t				block_address,
+	uint32_t				*sequence,
+	uint8_t					*is_valid
+)
+{
+	int8_t response = read_sequence(context, block_address, sequence);
+	mount->num_reads++;
+
+	*is_valid = response == SD_ERR_OK;
+
+	return response == SD_ERR_STORE_CORRUPT ? SD_ERR_OK : response;
+}
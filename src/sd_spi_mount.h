@@ -0,0 +1,116 @@
+/******************************************************************************/
+/**
+@file		sd_spi_mount.h
+@author     Wade Penson
+@date		June, 2015
+@brief      Finds the newest and oldest pages of a log of sequence-stamped
+			pages with a binary search.
+@details	The pages of the log are written one after the other in a range
+			of pages and each one holds a sequence number that goes up by one
+			from page to page. When the log is circular, the writes go back to
+			the first page of the range after the last one. The sequence
+			number of a page minus its position is then the same for every
+			page that was written since the writes last went back to the
+			first page, and smaller for the pages of the lap before. This
+			splits the range in two, so the page after the newest one is
+			found with a binary search in about log2(num_blocks) page reads
+			instead of reading the pages one by one.
+
+			A circular log may keep up to max_gap erased pages ahead of the
+			newest page (see sd_spi_queue_erase()), where max_gap is less than
+			half of the range. Erased pages are not valid
+			pages of the log whatever the erased value of the card is, and
+			reads of pages in the map of erased blocks do not go to the card
+			(see sd_spi_mark_erased()).
+
+@copyright  Copyright 2015 Wade Penson
+
+@license    Licensed under the Apache License, Version 2.0 (the "License");
+            you may not use this file except in compliance with the License.
+            You may obtain a copy of the License at
+
+              http://www.apache.org/licenses/LICENSE-2.0
+
+            Unless required by applicable law or agreed to in writing, software
+            distributed under the License is distributed on an "AS IS" BASIS,
+            WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+            implied. See the License for the specific language governing
+            permissions and limitations under the License.
+*/
+/******************************************************************************/
+
+#if !defined(SD_SPI_MOUNT_H_)
+#define SD_SPI_MOUNT_H_
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#include "sd_spi.h"
+
+/**
+@brief		Called by sd_spi_mount_find() to get the sequence number of a
+			page.
+
+@param[in]	context			The context given to sd_spi_mount_find().
+@param		block_address	The page to read.
+@param[out]	sequence		The sequence number of the page.
+
+@return		SD_ERR_OK if the page is a valid page of the log and
+			SD_ERR_STORE_CORRUPT if it is not (such as an erased page). Any
+			other code stops the search and is returned by
+			sd_spi_mount_find().
+*/
+typedef int8_t (*sd_spi_mount_sequence_t)(
+	void		*context,
+	uint32_t	block_address,
+	uint32_t	*sequence
+);
+
+/** Where a log was found to be by sd_spi_mount_find(). */
+typedef struct sd_spi_mount {
+	/** The page after the newest page. It is the page after the range when
+		the newest page is the last page of the range. */
+	uint32_t	head_block_address;
+	/** The oldest page of the log. */
+	uint32_t	tail_block_address;
+	/** The sequence number of the newest page, or 0 if the log is empty. */
+	uint32_t	newest_sequence;
+	/** The number of pages that were read. */
+	uint32_t	num_reads;
+} sd_spi_mount_t;
+
+/**
+@brief		Finds the newest and oldest pages of a log.
+@details	The first page of the range is the page that the search starts
+			from. If it is not valid and max_gap is not 0, the page at
+			max_gap is tried instead, since the erased pages in front of the
+			newest page may have wrapped around to the start of the range. If
+			neither is valid, the log is empty.
+
+@param		start_block_address		The first page of the range.
+@param		num_blocks				The number of pages in the range.
+@param		max_gap					The most erased pages that a circular log
+									keeps in front of its newest page, or 0
+									for a log that is not circular.
+@param		read_sequence			Gets the sequence number of a page.
+@param[in]	context					Passed to read_sequence.
+@param[out]	mount					Where the log is.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+int8_t
+sd_spi_mount_find(
+	uint32_t				start_block_address,
+	uint32_t				num_blocks,
+	uint32_t				max_gap,
+	sd_spi_mount_sequence_t	read_sequence,
+	void					*context,
+	sd_spi_mount_t			*mount
+);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif /* SD_SPI_MOUNT_H_ */
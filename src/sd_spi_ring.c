@@ -0,0 +1,536 @@
+/******************************************************************************/
+/**
+@file		sd_spi_ring.c
+@author     Wade Penson
+@date		June, 2015
+@brief      Circular log that writes over its oldest pages.
+@copyright  Copyright 2015 Wade Penson
+
+@license    Licensed under the Apache License, Version 2.0 (the "License");
+            you may not use this file except in compliance with the License.
+            You may obtain a copy of the License at
+
+              http://www.apache.org/licenses/LICENSE-2.0
+
+            Unless required by applicable law or agreed to in writing, software
+            distributed under the License is distributed on an "AS IS" BASIS,
+            WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+            implied. See the License for the specific language governing
+            permissions and limitations under the License.
+*/
+/******************************************************************************/
+
+#include "sd_spi_ring.h"
+#include "sd_spi_mount.h"
+
+/**
+@brief		Sets up an empty ring without reading or writing the card.
+
+@param[out]	ring					The ring.
+@param[in]	card					The state of the card that holds the ring.
+@param		start_block_address		The first page of the ring.
+@param		num_blocks				The number of pages of the ring.
+*/
+static void
+sd_spi_ring_reset(
+	sd_spi_ring_t	*ring,
+	sd_spi_card_t	*card,
+	uint32_t		start_block_address,
+	uint32_t		num_blocks
+);
+
+/**
+@brief		Gets the page that a sequence number is written to.
+
+@param[in]	ring		An open ring.
+@param		sequence	The sequence number.
+
+@return		The address of the page.
+*/
+static uint32_t
+sd_spi_ring_block_address(
+	sd_spi_ring_t	*ring,
+	uint32_t		sequence
+);
+
+/**
+@brief		Gets the sequence number of a page of a ring for
+			sd_spi_mount_find().
+
+@param[in]	context			The ring.
+@param		block_address	The page to read.
+@param[out]	sequence		The sequence number of the page.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+static int8_t
+sd_spi_ring_read_sequence(
+	void		*context,
+	uint32_t	block_address,
+	uint32_t	*sequence
+);
+
+/**
+@brief		Starts the continuous write of the segment that the next page is
+			in.
+@details	The segment ends at the end of the range. The erases that are
+			still queued are finished first, since the pages of the segment
+			may be among them.
+
+@param[in]	ring	An open ring.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+static int8_t
+sd_spi_ring_start_segment(
+	sd_spi_ring_t	*ring
+);
+
+/**
+@brief		Writes the header of the page that is being filled and moves on to
+			the next page. The continuous write is stopped at the end of the
+			segment.
+
+@param[in]	ring	An open ring.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+static int8_t
+sd_spi_ring_finish_page(
+	sd_spi_ring_t	*ring
+);
+
+/**
+@brief		Queues the pages from one sequence number up to another to be
+			erased, split in two where they go past the end of the range.
+
+@param[in]	ring	An open ring.
+@param		first	The sequence number of the first page.
+@param		end		The sequence number after the last page.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+static int8_t
+sd_spi_ring_queue_erase(
+	sd_spi_ring_t	*ring,
+	uint32_t		first,
+	uint32_t		end
+);
+
+int8_t
+sd_spi_ring_format(
+	sd_spi_ring_t	*ring,
+	sd_spi_card_t	*card,
+	uint32_t		start_block_address,
+	uint32_t		num_blocks
+)
+{
+	if (num_blocks <= 2 * (uint32_t) SD_SPI_RING_SEGMENT_BLOCKS)
+	{
+		return SD_ERR_ARGUMENT_OUT_OF_RANGE;
+	}
+
+	sd_spi_ring_reset(ring, card, start_block_address, num_blocks);
+	sd_spi_use_card(card);
+	ring->erased_sequence = num_blocks + 1;
+
+	/* The erase functions work with 512 byte blocks. */
+	uint32_t blocks_per_page = card->page_size >> 9;
+
+	return sd_spi_erase_blocks(start_block_address * blocks_per_page,
+							   (start_block_address + num_blocks) *
+							   blocks_per_page - 1);
+}
+
+int8_t
+sd_spi_ring_mount(
+	sd_spi_ring_t	*ring,
+	sd_spi_card_t	*card,
+	uint32_t		start_block_address,
+	uint32_t		num_blocks
+)
+{
+	if (num_blocks <= 2 * (uint32_t) SD_SPI_RING_SEGMENT_BLOCKS)
+	{
+		return SD_ERR_ARGUMENT_OUT_OF_RANGE;
+	}
+
+	sd_spi_ring_reset(ring, card, start_block_address, num_blocks);
+	sd_spi_use_card(card);
+
+	int8_t response;
+	sd_spi_mount_t mount;
+
+	if ((response = sd_spi_mount_find(start_block_address, num_blocks,
+									  SD_SPI_RING_SEGMENT_BLOCKS,
+									  sd_spi_ring_read_sequence, ring,
+									  &mount)))
+	{
+		return response;
+	}
+
+	if (mount.newest_sequence == 0)
+	{
+		return SD_ERR_OK;
+	}
+
+	ring->next_sequence = mount.newest_sequence + 1;
+
+	/* The first page of the ring is at the start of the range, so every page
+	   is at its sequence number minus one, modulo the size of the range. */
+	if (sd_spi_ring_block_address(ring, ring->next_sequence) !=
+		(mount.head_block_address - start_block_address) % num_blocks +
+		start_block_address)
+	{
+		return SD_ERR_STORE_CORRUPT;
+	}
+
+	if ((response = sd_spi_ring_read_sequence(ring, mount.tail_block_address,
+											  &ring->tail_sequence)))
+	{
+		return response;
+	}
+
+	/* Pages past the segment in front of the head may be erased later. */
+	if (ring->next_sequence + SD_SPI_RING_SEGMENT_BLOCKS >
+		ring->tail_sequence + num_blocks)
+	{
+		ring->tail_sequence = ring->next_sequence +
+							  SD_SPI_RING_SEGMENT_BLOCKS - num_blocks;
+	}
+
+	/* Nothing is known about the pages in front of the head. */
+	ring->erased_sequence = ring->next_sequence;
+
+	return SD_ERR_OK;
+}
+
+int8_t
+sd_spi_ring_write(
+	sd_spi_ring_t	*ring,
+	const void		*data,
+	uint32_t		number_of_bytes
+)
+{
+	int8_t response;
+	const uint8_t *bytes = (const uint8_t *) data;
+	uint16_t page_bytes = ring->card->page_size -
+						  sizeof(sd_spi_store_header_t);
+
+	sd_spi_use_card(ring->card);
+
+	while (number_of_bytes > 0)
+	{
+		if (!ring->is_writing && (response = sd_spi_ring_start_segment(ring)))
+		{
+			return response;
+		}
+
+		if (ring->page_fill == 0)
+		{
+			ring->page_crc = 0xFFFFFFFF;
+		}
+
+		uint16_t chunk = page_bytes - ring->page_fill;
+
+		if (chunk > number_of_bytes)
+		{
+			chunk = (uint16_t) number_of_bytes;
+		}
+
+		if ((response = sd_spi_write_continuous((void *) bytes, chunk,
+												sizeof(sd_spi_store_header_t) +
+												ring->page_fill)))
+		{
+			return response;
+		}
+
+		ring->page_crc = sd_spi_store_crc(ring->page_crc, bytes, chunk);
+		ring->page_fill += chunk;
+		bytes += chunk;
+		number_of_bytes -= chunk;
+
+		if (ring->page_fill == page_bytes &&
+			(response = sd_spi_ring_finish_page(ring)))
+		{
+			return response;
+		}
+	}
+
+	return SD_ERR_OK;
+}
+
+int8_t
+sd_spi_ring_flush(
+	sd_spi_ring_t	*ring
+)
+{
+	int8_t response;
+
+	sd_spi_use_card(ring->card);
+
+	if (ring->page_fill > 0 && (response = sd_spi_ring_finish_page(ring)))
+	{
+		return response;
+	}
+
+	if (ring->is_writing)
+	{
+		ring->is_writing = 0;
+
+		if ((response = sd_spi_write_continuous_stop()))
+		{
+			return response;
+		}
+	}
+
+	/* Erase the next segment ahead of the head in idle time. */
+	uint32_t end = ring->next_sequence + SD_SPI_RING_SEGMENT_BLOCKS;
+	uint32_t first = ring->erased_sequence > ring->next_sequence ?
+					 ring->erased_sequence : ring->next_sequence;
+
+	if (first < end)
+	{
+		response = sd_spi_ring_queue_erase(ring, first, end);
+
+		/* A full queue only means that the next segment pre-erases on its
+		   own. */
+		if (response == SD_ERR_ERASE_QUEUE_FULL)
+		{
+			return SD_ERR_OK;
+		}
+		else if (response)
+		{
+			return response;
+		}
+
+		ring->erased_sequence = end;
+	}
+
+	return SD_ERR_OK;
+}
+
+int8_t
+sd_spi_ring_read(
+	sd_spi_ring_t	*ring,
+	uint32_t		sequence,
+	void			*data_buffer,
+	uint16_t		*number_of_bytes
+)
+{
+	int8_t response;
+
+	if (sequence >= ring->next_sequence + (ring->page_fill > 0))
+	{
+		return SD_ERR_STORE_END;
+	}
+
+	if (sequence < ring->tail_sequence)
+	{
+		return SD_ERR_ARGUMENT_OUT_OF_RANGE;
+	}
+
+	/* The newest pages may still be in the buffers of the continuous
+	   write. */
+	if (ring->is_writing && (response = sd_spi_ring_flush(ring)))
+	{
+		return response;
+	}
+
+	sd_spi_use_card(ring->card);
+
+	uint32_t block_address = sd_spi_ring_block_address(ring, sequence);
+	sd_spi_store_header_t header;
+
+	if ((response = sd_spi_store_check_page(block_address, &header)))
+	{
+		return response;
+	}
+
+	if (header.type != SD_SPI_STORE_PAGE_RAW || header.sequence != sequence)
+	{
+		return SD_ERR_STORE_CORRUPT;
+	}
+
+	*number_of_bytes = header.num_bytes;
+
+	return sd_spi_read(block_address, data_buffer, header.num_bytes,
+					   sizeof(sd_spi_store_header_t));
+}
+
+static void
+sd_spi_ring_reset(
+	sd_spi_ring_t	*ring,
+	sd_spi_card_t	*card,
+	uint32_t		start_block_address,
+	uint32_t		num_blocks
+)
+{
+	ring->card = card;
+	ring->start_block_address = start_block_address;
+	ring->num_blocks = num_blocks;
+	ring->next_sequence = 1;
+	ring->tail_sequence = 1;
+	ring->erased_sequence = 1;
+	ring->num_wraps = 0;
+	ring->num_segment_blocks = 0;
+	ring->page_crc = 0xFFFFFFFF;
+	ring->page_fill = 0;
+	ring->is_writing = 0;
+}
+
+static uint32_t
+sd_spi_ring_block_address(
+	sd_spi_ring_t	*ring,
+	uint32_t		sequence
+)
+{
+	return ring->start_block_address + (sequence - 1) % ring->num_blocks;
+}
+
+static int8_t
+sd_spi_ring_read_sequence(
+	void		*context,
+	uint32_t	block_address,
+	uint32_t	*sequence
+)
+{
+	int8_t response;
+	sd_spi_store_header_t header;
+
+	(void) context;
+
+	if ((response = sd_spi_store_check_page(block_address, &header)))
+	{
+		return response;
+	}
+
+	if (header.type != SD_SPI_STORE_PAGE_RAW)
+	{
+		return SD_ERR_STORE_CORRUPT;
+	}
+
+	*sequence = header.sequence;
+
+	return SD_ERR_OK;
+}
+
+static int8_t
+sd_spi_ring_start_segment(
+	sd_spi_ring_t	*ring
+)
+{
+	int8_t response;
+
+	if (sd_spi_pending_erases() > 0 && (response = sd_spi_finish_erases()))
+	{
+		return response;
+	}
+
+	uint32_t position = (ring->next_sequence - 1) % ring->num_blocks;
+	uint32_t num_blocks = ring->num_blocks - position;
+
+	if (num_blocks > SD_SPI_RING_SEGMENT_BLOCKS)
+	{
+		num_blocks = SD_SPI_RING_SEGMENT_BLOCKS;
+	}
+
+	if ((response = sd_spi_write_continuous_start(ring->start_block_address +
+												  position, num_blocks)))
+	{
+		return response;
+	}
+
+	if (position == 0 && ring->next_sequence > 1)
+	{
+		ring->num_wraps++;
+	}
+
+	ring->num_segment_blocks = num_blocks;
+	ring->is_writing = 1;
+
+	return SD_ERR_OK;
+}
+
+static int8_t
+sd_spi_ring_finish_page(
+	sd_spi_ring_t	*ring
+)
+{
+	int8_t response;
+	sd_spi_store_header_t header;
+
+	header.magic = SD_SPI_STORE_MAGIC;
+	header.type = SD_SPI_STORE_PAGE_RAW;
+	header.version = SD_SPI_STORE_VERSION;
+	header.sequence = ring->next_sequence;
+	header.first_key = 0;
+	header.last_key = 0;
+	header.num_records = 0;
+	header.num_bytes = ring->page_fill;
+	header.crc = 0;
+	header.crc = ~sd_spi_store_crc(ring->page_crc, &header,
+								   sizeof(sd_spi_store_header_t));
+
+	if ((response = sd_spi_write_continuous(&header,
+											sizeof(sd_spi_store_header_t),
+											0)) ||
+		(response = sd_spi_write_continuous_next()))
+	{
+		return response;
+	}
+
+	ring->next_sequence++;
+	ring->page_fill = 0;
+
+	/* The pages of the segment in front of the head may be erased. */
+	if (ring->next_sequence + SD_SPI_RING_SEGMENT_BLOCKS > ring->num_blocks)
+	{
+		ring->tail_sequence = ring->next_sequence +
+							  SD_SPI_RING_SEGMENT_BLOCKS - ring->num_blocks;
+	}
+
+	if (--ring->num_segment_blocks == 0)
+	{
+		ring->is_writing = 0;
+
+		return sd_spi_write_continuous_stop();
+	}
+
+	return SD_ERR_OK;
+}
+
+static int8_t
+sd_spi_ring_queue_erase(
+	sd_spi_ring_t	*ring,
+	uint32_t		first,
+	uint32_t		end
+)
+{
+	int8_t response;
+	uint32_t blocks_per_page = ring->card->page_size >> 9;
+
+	while (first < end)
+	{
+		uint32_t position = (first - 1) % ring->num_blocks;
+		uint32_t num_blocks = ring->num_blocks - position;
+
+		if (num_blocks > end - first)
+		{
+			num_blocks = end - first;
+		}
+
+		uint32_t block_address = ring->start_block_address + position;
+
+		if ((response = sd_spi_queue_erase(block_address * blocks_per_page,
+										   (block_address + num_blocks) *
+										   blocks_per_page - 1)))
+		{
+			return response;
+		}
+
+		first += num_blocks;
+	}
+
+	return SD_ERR_OK;
+}
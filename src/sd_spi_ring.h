@@ -0,0 +1,208 @@
+/******************************************************************************/
+/**
+@file		sd_spi_ring.h
+@author     Wade Penson
+@date		June, 2015
+@brief      Circular log on a range of pages that writes over its oldest pages.
+@details	Bytes are written into pages in the format of a store (see
+			sd_spi_store.h) whose sequence numbers go up by one from page to
+			page. When the last page of the range is written, the writes go
+			back to the first page and write over the oldest pages, so the
+			log always holds the newest pages.
+
+			The pages are written with continuous writes of up to
+			SD_SPI_RING_SEGMENT_BLOCKS pages that never go past the end of the
+			range. Each one pre-erases its pages when it is started, so the
+			wrap is the same as going from one segment to the next: the
+			continuous write is stopped and the next one is started at the
+			first page. When the log is flushed, the pages in front of the
+			newest page are queued to be erased in idle time (see
+			sd_spi_queue_erase()), so the next segment starts on erased pages.
+			The oldest page that can still be read is kept as the tail of the
+			log.
+
+			The block addresses refer to pages (see sd_spi_set_page_size()).
+
+@copyright  Copyright 2015 Wade Penson
+
+@license    Licensed under the Apache License, Version 2.0 (the "License");
+            you may not use this file except in compliance with the License.
+            You may obtain a copy of the License at
+
+              http://www.apache.org/licenses/LICENSE-2.0
+
+            Unless required by applicable law or agreed to in writing, software
+            distributed under the License is distributed on an "AS IS" BASIS,
+            WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+            implied. See the License for the specific language governing
+            permissions and limitations under the License.
+*/
+/******************************************************************************/
+
+#if !defined(SD_SPI_RING_H_)
+#define SD_SPI_RING_H_
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#include "sd_spi.h"
+#include "sd_spi_store.h"
+
+/** The most pages that one continuous write of a ring writes, which is also
+	the most pages that are erased in front of the newest page. A ring must
+	have more than twice as many pages. */
+#if !defined(SD_SPI_RING_SEGMENT_BLOCKS)
+#define SD_SPI_RING_SEGMENT_BLOCKS 64
+#endif
+
+#if SD_SPI_RING_SEGMENT_BLOCKS < 1
+#error "SD_SPI_RING_SEGMENT_BLOCKS must be at least 1."
+#endif
+
+/** State variables used by a ring. */
+typedef struct sd_spi_ring {
+	/** The card that holds the ring. */
+	sd_spi_card_t	*card;
+	/** The first page of the ring. */
+	uint32_t		start_block_address;
+	/** The number of pages of the ring. */
+	uint32_t		num_blocks;
+	/** The sequence number of the next page. The first page of a ring has
+		the sequence number 1 and is written to the first page of the range. */
+	uint32_t		next_sequence;
+	/** The sequence number of the oldest page that can be read. */
+	uint32_t		tail_sequence;
+	/** The sequence number after the last page that was queued to be
+		erased. */
+	uint32_t		erased_sequence;
+	/** The number of times the writes went back to the first page since the
+		ring was formatted or mounted. */
+	uint32_t		num_wraps;
+	/** The number of pages left in the continuous write that is open. */
+	uint32_t		num_segment_blocks;
+	/** The CRC of the bytes of the page that is being filled so far. */
+	uint32_t		page_crc;
+	/** The number of bytes of the page that is being filled, not including
+		its header. */
+	uint16_t		page_fill;
+	/** True while a continuous write of the ring is open. */
+	uint8_t			is_writing;
+} sd_spi_ring_t;
+
+/**
+@brief		Creates an empty ring on a range of pages.
+@details	The pages are erased so that no page of an earlier ring is taken
+			for part of this one. The card must already be initialized. The
+			functions of the layer change the card in use (see
+			sd_spi_use_card()).
+
+@param[out]	ring					The ring to create.
+@param[in]	card					The state of the card that holds the ring.
+@param		start_block_address		The first page of the ring.
+@param		num_blocks				The number of pages of the ring. It must be
+									more than twice
+									SD_SPI_RING_SEGMENT_BLOCKS.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+int8_t
+sd_spi_ring_format(
+	sd_spi_ring_t	*ring,
+	sd_spi_card_t	*card,
+	uint32_t		start_block_address,
+	uint32_t		num_blocks
+);
+
+/**
+@brief		Opens a ring that is already on a card, such as after a reset.
+@details	The newest and oldest pages are found with a binary search (see
+			sd_spi_mount_find()). A page that was cut short by a reset does
+			not match its CRC and is written over. The card must already be
+			initialized.
+
+@param[out]	ring					The ring to open.
+@param[in]	card					The state of the card that holds the ring.
+@param		start_block_address		The first page of the ring.
+@param		num_blocks				The number of pages of the ring.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+int8_t
+sd_spi_ring_mount(
+	sd_spi_ring_t	*ring,
+	sd_spi_card_t	*card,
+	uint32_t		start_block_address,
+	uint32_t		num_blocks
+);
+
+/**
+@brief		Writes bytes to a ring.
+@details	The bytes are put in the page that is being filled, which is
+			written through the continuous write of the ring once it is full.
+			The continuous write is started when needed and is stopped and
+			started again at the end of each segment and at the end of the
+			range. Call sd_spi_ring_flush() to write out the bytes that are
+			still in memory.
+
+@param[in]	ring				An open ring.
+@param[in]	data				The bytes to write.
+@param		number_of_bytes		The number of bytes. The bytes may go over
+								several pages.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+int8_t
+sd_spi_ring_write(
+	sd_spi_ring_t	*ring,
+	const void		*data,
+	uint32_t		number_of_bytes
+);
+
+/**
+@brief		Writes out the page that is being filled, stops the continuous
+			write of the ring and queues the pages in front of the newest page
+			to be erased.
+@details	The next write starts a new page, so flushing often leaves pages
+			partly empty. Call sd_spi_poll() in idle time to do the erase.
+
+@param[in]	ring	An open ring.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+int8_t
+sd_spi_ring_flush(
+	sd_spi_ring_t	*ring
+);
+
+/**
+@brief		Reads a page of a ring.
+@details	The ring is flushed first if it is writing. The CRC of the page is
+			checked.
+
+@param[in]	ring				An open ring.
+@param		sequence			The sequence number of the page, from
+								tail_sequence to next_sequence - 1.
+@param[out]	data_buffer			Where to put the bytes of the page. It must
+								hold the page size minus the size of
+								sd_spi_store_header_t.
+@param[out]	number_of_bytes		The number of bytes of the page.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+			SD_ERR_STORE_END is returned if the page has not been written yet,
+			SD_ERR_ARGUMENT_OUT_OF_RANGE if it was written over and
+			SD_ERR_STORE_CORRUPT if it does not match its CRC.
+*/
+int8_t
+sd_spi_ring_read(
+	sd_spi_ring_t	*ring,
+	uint32_t		sequence,
+	void			*data_buffer,
+	uint16_t		*number_of_bytes
+);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif /* SD_SPI_RING_H_ */
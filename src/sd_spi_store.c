@@ -0,0 +1,1142 @@
+/******************************************************************************/
+/**
+@file		sd_spi_store.c
+@author     Wade Penson
+@date		June, 2015
+@brief      Log-structured record store implementation.
+@copyright  Copyright 2015 Wade Penson
+
+@license    Licensed under the Apache License, Version 2.0 (the "License");
+            you may not use this file except in compliance with the License.
+            You may obtain a copy of the License at
+
+              http://www.apache.org/licenses/LICENSE-2.0
+
+            Unless required by applicable law or agreed to in writing, software
+            distributed under the License is distributed on an "AS IS" BASIS,
+            WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+            implied. See the License for the specific language governing
+            permissions and limitations under the License.
+*/
+/******************************************************************************/
+
+#include "sd_spi_store.h"
+#include "sd_spi_mount.h"
+
+/** The number of pages in a group of data pages and its index page. */
+#define SD_SPI_STORE_GROUP_SIZE	(SD_SPI_STORE_INDEX_INTERVAL + 1)
+
+/**
+@brief		Sets up the state of an empty store.
+
+@param[out]	store					The store.
+@param[in]	card					The state of the card that holds the store.
+@param		start_block_address		The first page of the store.
+@param		num_blocks				The number of pages of the store.
+*/
+static void
+sd_spi_store_reset(
+	sd_spi_store_t	*store,
+	sd_spi_card_t	*card,
+	uint32_t		start_block_address,
+	uint32_t		num_blocks
+);
+
+/**
+@brief		Gets the sequence number of a page for sd_spi_mount_find().
+
+@param[in]	context			The store.
+@param		block_address	The page to read.
+@param[out]	sequence		The sequence number of the page.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+static int8_t
+sd_spi_store_read_sequence(
+	void		*context,
+	uint32_t	block_address,
+	uint32_t	*sequence
+);
+
+/**
+@brief		Checks if a page of a store is an index page.
+
+@param[in]	store			An open store.
+@param		block_address	The page.
+
+@return		1 if the page is at the position of an index page and 0
+			otherwise.
+*/
+static uint8_t
+sd_spi_store_is_index_page(
+	sd_spi_store_t	*store,
+	uint32_t		block_address
+);
+
+/**
+@brief		Writes a page through the continuous write of the store.
+@details	The data after the header has to be in the block buffer already.
+			The CRC of the header is added to the CRC of that data.
+
+@param[in]	store		An open store.
+@param[in]	header		The header of the page. Its CRC is filled in.
+@param		crc			The CRC of the data after the header.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+static int8_t
+sd_spi_store_write_page(
+	sd_spi_store_t			*store,
+	sd_spi_store_header_t	*header,
+	uint32_t				crc
+);
+
+/**
+@brief		Writes out the data page that is being filled, and the index page
+			of its group if the group is complete.
+
+@param[in]	store	An open store.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+static int8_t
+sd_spi_store_finish_page(
+	sd_spi_store_t	*store
+);
+
+/**
+@brief		Moves a cursor to the next record and reads the header of the
+			record without going past it.
+
+@param[in]	store		An open store.
+@param[in]	cursor		The cursor.
+@param[out]	key			The key of the record.
+@param[out]	length		The size of the data of the record.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+static int8_t
+sd_spi_store_next_record(
+	sd_spi_store_t			*store,
+	sd_spi_store_cursor_t	*cursor,
+	uint32_t				*key,
+	uint16_t				*length
+);
+
+/**
+@brief		Finds the last data page whose first key is less than key, since
+			the records from key on can start in it.
+
+@param[in]	store			An open store that is not appending.
+@param		key				The key to look for.
+@param[out]	block_address	The page, or the first page of the store if no
+							page has a first key less than key.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+static int8_t
+sd_spi_store_find_page(
+	sd_spi_store_t	*store,
+	uint32_t		key,
+	uint32_t		*block_address
+);
+
+/**
+@brief		Adds the first key of a group that got its index page to the
+			summary, dropping every other key of the summary when it is full.
+
+@param[in]	store	An open store.
+@param		group	The number of the group, counting from 0.
+@param		key		The first key of the group.
+*/
+static void
+sd_spi_store_summarize(
+	sd_spi_store_t	*store,
+	uint32_t		group,
+	uint32_t		key
+);
+
+/**
+@brief		Gives the records of the page of a continuous read whose keys are
+			in a range to a callback.
+
+@param[in]	store			An open store.
+@param		first_key		The first key of the range.
+@param		last_key		The last key of the range.
+@param[out]	data_buffer		Where to put the data of each record.
+@param		max_bytes		The size of data_buffer.
+@param		callback		Gets the records.
+@param[in]	context			Passed to callback.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+			SD_ERR_STORE_END is returned once a key past last_key is found.
+*/
+static int8_t
+sd_spi_store_query_page(
+	sd_spi_store_t			*store,
+	uint32_t				first_key,
+	uint32_t				last_key,
+	void					*data_buffer,
+	uint16_t				max_bytes,
+	sd_spi_store_record_t	callback,
+	void					*context
+);
+
+int8_t
+sd_spi_store_format(
+	sd_spi_store_t	*store,
+	sd_spi_card_t	*card,
+	uint32_t		start_block_address,
+	uint32_t		num_blocks
+)
+{
+	if (num_blocks == 0)
+	{
+		return SD_ERR_ARGUMENT_OUT_OF_RANGE;
+	}
+
+	sd_spi_store_reset(store, card, start_block_address, num_blocks);
+	sd_spi_use_card(card);
+
+	/* The erase functions work with 512 byte blocks. */
+	uint32_t blocks_per_page = card->page_size >> 9;
+
+	return sd_spi_erase_blocks(start_block_address * blocks_per_page,
+							   (start_block_address + num_blocks) *
+							   blocks_per_page - 1);
+}
+
+int8_t
+sd_spi_store_mount(
+	sd_spi_store_t	*store,
+	sd_spi_card_t	*card,
+	uint32_t		start_block_address,
+	uint32_t		num_blocks
+)
+{
+	if (num_blocks == 0)
+	{
+		return SD_ERR_ARGUMENT_OUT_OF_RANGE;
+	}
+
+	sd_spi_store_reset(store, card, start_block_address, num_blocks);
+
+	int8_t response;
+	sd_spi_mount_t mount;
+
+	if ((response = sd_spi_mount_find(start_block_address, num_blocks, 0,
+									  sd_spi_store_read_sequence, store,
+									  &mount)))
+	{
+		return response;
+	}
+
+	if (mount.newest_sequence == 0)
+	{
+		return SD_ERR_OK;
+	}
+
+	store->next_block_address = mount.head_block_address;
+	store->next_sequence = mount.newest_sequence + 1;
+
+	sd_spi_store_header_t header;
+
+	if ((response = sd_spi_store_read_header(store,
+											 store->next_block_address - 1,
+											 &header)))
+	{
+		return response;
+	}
+
+	store->last_key = header.last_key;
+
+	/* Get the summary back from the first keys of the index pages, with the
+	   smallest stride that fits. */
+	uint32_t num_groups = (store->next_block_address - start_block_address) /
+						  SD_SPI_STORE_GROUP_SIZE;
+	uint32_t group;
+
+	while (num_groups > store->summary_stride * SD_SPI_STORE_SUMMARY_SIZE)
+	{
+		store->summary_stride *= 2;
+	}
+
+	for (group = 0; group < num_groups; group += store->summary_stride)
+	{
+		if ((response = sd_spi_store_read_header(
+				store, start_block_address + group * SD_SPI_STORE_GROUP_SIZE +
+					   SD_SPI_STORE_INDEX_INTERVAL, &header)))
+		{
+			return response;
+		}
+
+		if (header.type != SD_SPI_STORE_PAGE_INDEX)
+		{
+			return SD_ERR_STORE_CORRUPT;
+		}
+
+		store->summary_keys[store->num_summary_keys++] = header.first_key;
+	}
+
+	/* Get the first keys of the data pages after the last index page back. */
+	uint32_t block_address = start_block_address +
+							 (store->next_block_address -
+							  start_block_address) /
+							 SD_SPI_STORE_GROUP_SIZE * SD_SPI_STORE_GROUP_SIZE;
+
+	for (; block_address < store->next_block_address; block_address++)
+	{
+		if ((response = sd_spi_store_read_header(store, block_address,
+												 &header)))
+		{
+			return response;
+		}
+
+		if (header.type != SD_SPI_STORE_PAGE_DATA)
+		{
+			return SD_ERR_STORE_CORRUPT;
+		}
+
+		store->index_keys[store->num_index_keys++] = header.first_key;
+	}
+
+	return SD_ERR_OK;
+}
+
+int8_t
+sd_spi_store_append(
+	sd_spi_store_t	*store,
+	uint32_t		key,
+	const void		*data,
+	uint16_t		number_of_bytes
+)
+{
+	if ((store->num_records > 0 || store->next_sequence > 1) &&
+		key < store->last_key)
+	{
+		return SD_ERR_ARGUMENT_OUT_OF_RANGE;
+	}
+
+	if (number_of_bytes > store->card->page_size -
+						  sizeof(sd_spi_store_header_t) -
+						  SD_SPI_STORE_RECORD_HEADER_SIZE)
+	{
+		return SD_ERR_WRITE_OUTSIDE_OF_BLOCK;
+	}
+
+	sd_spi_use_card(store->card);
+
+	int8_t response;
+
+	if (store->page_num_records > 0 &&
+		store->page_fill + SD_SPI_STORE_RECORD_HEADER_SIZE + number_of_bytes >
+		store->card->page_size &&
+		(response = sd_spi_store_finish_page(store)))
+	{
+		return response;
+	}
+
+	if (store->page_num_records == 0)
+	{
+		if (store->next_block_address == store->end_block_address)
+		{
+			return SD_ERR_ARGUMENT_OUT_OF_RANGE;
+		}
+
+		if (!store->is_appending)
+		{
+			if ((response = sd_spi_write_continuous_start(
+					store->next_block_address,
+					store->end_block_address - store->next_block_address)))
+			{
+				return response;
+			}
+
+			store->is_appending = 1;
+		}
+
+		store->page_first_key = key;
+		store->page_fill = sizeof(sd_spi_store_header_t);
+		store->page_crc = 0xFFFFFFFF;
+	}
+
+	uint8_t record_header[SD_SPI_STORE_RECORD_HEADER_SIZE];
+	memcpy(record_header, &key, 4);
+	memcpy(record_header + 4, &number_of_bytes, 2);
+
+	if ((response = sd_spi_write_continuous(record_header,
+											SD_SPI_STORE_RECORD_HEADER_SIZE,
+											store->page_fill)))
+	{
+		return response;
+	}
+
+	if (number_of_bytes > 0 &&
+		(response = sd_spi_write_continuous((void *) data, number_of_bytes,
+											store->page_fill +
+											SD_SPI_STORE_RECORD_HEADER_SIZE)))
+	{
+		return response;
+	}
+
+	store->page_crc = sd_spi_store_crc(store->page_crc, record_header,
+									   SD_SPI_STORE_RECORD_HEADER_SIZE);
+	store->page_crc = sd_spi_store_crc(store->page_crc, data, number_of_bytes);
+	store->page_fill += SD_SPI_STORE_RECORD_HEADER_SIZE + number_of_bytes;
+	store->page_num_records++;
+	store->num_records++;
+	store->last_key = key;
+
+	return SD_ERR_OK;
+}
+
+int8_t
+sd_spi_store_flush(
+	sd_spi_store_t	*store
+)
+{
+	if (!store->is_appending)
+	{
+		return SD_ERR_OK;
+	}
+
+	sd_spi_use_card(store->card);
+
+	int8_t response = SD_ERR_OK;
+
+	if (store->page_num_records > 0)
+	{
+		response = sd_spi_store_finish_page(store);
+	}
+
+	int8_t stop_response = sd_spi_write_continuous_stop();
+	store->is_appending = 0;
+
+	return response ? response : stop_response;
+}
+
+int8_t
+sd_spi_store_seek(
+	sd_spi_store_t			*store,
+	sd_spi_store_cursor_t	*cursor,
+	uint32_t				key
+)
+{
+	sd_spi_use_card(store->card);
+
+	int8_t response;
+
+	if ((response = sd_spi_store_flush(store)))
+	{
+		return response;
+	}
+
+	uint32_t block_address;
+
+	if ((response = sd_spi_store_find_page(store, key, &block_address)))
+	{
+		return response;
+	}
+
+	cursor->block_address = block_address;
+	cursor->offset = 0;
+	cursor->end = 0;
+
+	/* Skip the records before key. */
+	while (1)
+	{
+		uint32_t record_key;
+		uint16_t length;
+
+		if ((response = sd_spi_store_next_record(store, cursor, &record_key,
+												 &length)))
+		{
+			return response == SD_ERR_STORE_END ? SD_ERR_OK : response;
+		}
+
+		if (record_key >= key)
+		{
+			return SD_ERR_OK;
+		}
+
+		cursor->offset += SD_SPI_STORE_RECORD_HEADER_SIZE + length;
+	}
+}
+
+int8_t
+sd_spi_store_read_next(
+	sd_spi_store_t			*store,
+	sd_spi_store_cursor_t	*cursor,
+	uint32_t				*key,
+	void					*data_buffer,
+	uint16_t				max_bytes,
+	uint16_t				*number_of_bytes
+)
+{
+	/* Another card may have been used since the cursor was moved. */
+	sd_spi_use_card(store->card);
+
+	int8_t response;
+	uint16_t length;
+
+	if ((response = sd_spi_store_next_record(store, cursor, key, &length)))
+	{
+		return response;
+	}
+
+	if (length < max_bytes)
+	{
+		max_bytes = length;
+	}
+
+	if (max_bytes > 0 &&
+		(response = sd_spi_read(cursor->block_address, data_buffer, max_bytes,
+								cursor->offset +
+								SD_SPI_STORE_RECORD_HEADER_SIZE)))
+	{
+		return response;
+	}
+
+	*number_of_bytes = length;
+	cursor->offset += SD_SPI_STORE_RECORD_HEADER_SIZE + length;
+
+	return SD_ERR_OK;
+}
+
+int8_t
+sd_spi_store_query(
+	sd_spi_store_t			*store,
+	uint32_t				first_key,
+	uint32_t				last_key,
+	void					*data_buffer,
+	uint16_t				max_bytes,
+	sd_spi_store_record_t	callback,
+	void					*context
+)
+{
+	sd_spi_use_card(store->card);
+
+	int8_t response;
+	uint32_t block_address;
+
+	if ((response = sd_spi_store_flush(store)) ||
+		(response = sd_spi_store_find_page(store, first_key, &block_address)))
+	{
+		return response;
+	}
+
+	if (first_key > last_key || block_address >= store->next_block_address)
+	{
+		return SD_ERR_OK;
+	}
+
+	/* The pages of the range are read with one continuous read, and the
+	   index pages in it are passed over. */
+	if ((response = sd_spi_read_continuous_start(block_address)))
+	{
+		return response;
+	}
+
+	while (1)
+	{
+		if (!sd_spi_store_is_index_page(store, block_address) &&
+			(response = sd_spi_store_query_page(store, first_key, last_key,
+												data_buffer, max_bytes,
+												callback, context)))
+		{
+			break;
+		}
+
+		if (++block_address == store->next_block_address)
+		{
+			break;
+		}
+
+		if ((response = sd_spi_read_continuous_next()))
+		{
+			break;
+		}
+	}
+
+	int8_t stop_response = sd_spi_read_continuous_stop();
+
+	if (response == SD_ERR_STORE_END)
+	{
+		response = SD_ERR_OK;
+	}
+
+	return response ? response : stop_response;
+}
+
+int8_t
+sd_spi_store_read_header(
+	sd_spi_store_t			*store,
+	uint32_t				block_address,
+	sd_spi_store_header_t	*header
+)
+{
+	sd_spi_use_card(store->card);
+
+	return sd_spi_store_check_page(block_address, header);
+}
+
+int8_t
+sd_spi_store_check_page(
+	uint32_t				block_address,
+	sd_spi_store_header_t	*header
+)
+{
+	int8_t response;
+
+	if ((response = sd_spi_read(block_address, header,
+								sizeof(sd_spi_store_header_t), 0)))
+	{
+		return response;
+	}
+
+	if (header->magic != SD_SPI_STORE_MAGIC ||
+		header->version != SD_SPI_STORE_VERSION ||
+		header->num_bytes > sd_spi_current_card()->page_size -
+							sizeof(sd_spi_store_header_t))
+	{
+		return SD_ERR_STORE_CORRUPT;
+	}
+
+	/* The rest of the page is read from the block buffer in chunks. */
+	uint8_t chunk[SD_SPI_STREAM_CHUNK_SIZE];
+	uint32_t crc = 0xFFFFFFFF;
+	uint16_t offset = sizeof(sd_spi_store_header_t);
+	uint16_t end = offset + header->num_bytes;
+
+	while (offset < end)
+	{
+		uint16_t number_of_bytes = end - offset;
+
+		if (number_of_bytes > SD_SPI_STREAM_CHUNK_SIZE)
+		{
+			number_of_bytes = SD_SPI_STREAM_CHUNK_SIZE;
+		}
+
+		if ((response = sd_spi_read(block_address, chunk, number_of_bytes,
+									offset)))
+		{
+			return response;
+		}
+
+		crc = sd_spi_store_crc(crc, chunk, number_of_bytes);
+		offset += number_of_bytes;
+	}
+
+	uint32_t header_crc = header->crc;
+	header->crc = 0;
+	crc = ~sd_spi_store_crc(crc, header, sizeof(sd_spi_store_header_t));
+	header->crc = header_crc;
+
+	return crc == header_crc ? SD_ERR_OK : SD_ERR_STORE_CORRUPT;
+}
+
+static void
+sd_spi_store_reset(
+	sd_spi_store_t	*store,
+	sd_spi_card_t	*card,
+	uint32_t		start_block_address,
+	uint32_t		num_blocks
+)
+{
+	store->card = card;
+	store->start_block_address = start_block_address;
+	store->end_block_address = start_block_address + num_blocks;
+	store->next_block_address = start_block_address;
+	store->next_sequence = 1;
+	store->last_key = 0;
+	store->num_records = 0;
+	store->summary_stride = 1;
+	store->num_summary_keys = 0;
+	store->num_index_keys = 0;
+	store->is_appending = 0;
+	store->page_fill = 0;
+	store->page_num_records = 0;
+}
+
+static int8_t
+sd_spi_store_read_sequence(
+	void		*context,
+	uint32_t	block_address,
+	uint32_t	*sequence
+)
+{
+	int8_t response;
+	sd_spi_store_header_t header;
+
+	if ((response = sd_spi_store_read_header((sd_spi_store_t *) context,
+											 block_address, &header)))
+	{
+		return response;
+	}
+
+	*sequence = header.sequence;
+
+	return SD_ERR_OK;
+}
+
+uint32_t
+sd_spi_store_crc(
+	uint32_t	crc,
+	const void	*data,
+	uint16_t	number_of_bytes
+)
+{
+	const uint8_t *bytes = (const uint8_t *) data;
+
+	while (number_of_bytes--)
+	{
+		crc ^= *bytes++;
+
+		uint8_t i;
+		for (i = 0; i < 8; i++)
+		{
+			crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+		}
+	}
+
+	return crc;
+}
+
+static uint8_t
+sd_spi_store_is_index_page(
+	sd_spi_store_t	*store,
+	uint32_t		block_address
+)
+{
+	return (block_address - store->start_block_address) %
+		   SD_SPI_STORE_GROUP_SIZE == SD_SPI_STORE_INDEX_INTERVAL;
+}
+
+static int8_t
+sd_spi_store_write_page(
+	sd_spi_store_t			*store,
+	sd_spi_store_header_t	*header,
+	uint32_t				crc
+)
+{
+	int8_t response;
+
+	header->magic = SD_SPI_STORE_MAGIC;
+	header->version = SD_SPI_STORE_VERSION;
+	header->sequence = store->next_sequence;
+	header->last_key = store->last_key;
+	header->crc = 0;
+	header->crc = ~sd_spi_store_crc(crc, header,
+									sizeof(sd_spi_store_header_t));
+
+	if ((response = sd_spi_write_continuous(header,
+											sizeof(sd_spi_store_header_t),
+											0)) ||
+		(response = sd_spi_write_continuous_next()))
+	{
+		return response;
+	}
+
+	store->next_block_address++;
+	store->next_sequence++;
+
+	return SD_ERR_OK;
+}
+
+static int8_t
+sd_spi_store_finish_page(
+	sd_spi_store_t	*store
+)
+{
+	int8_t response;
+	sd_spi_store_header_t header;
+
+	header.type = SD_SPI_STORE_PAGE_DATA;
+	header.first_key = store->page_first_key;
+	header.num_records = store->page_num_records;
+	header.num_bytes = store->page_fill - sizeof(sd_spi_store_header_t);
+
+	if ((response = sd_spi_store_write_page(store, &header, store->page_crc)))
+	{
+		return response;
+	}
+
+	store->index_keys[store->num_index_keys++] = store->page_first_key;
+	store->page_num_records = 0;
+	store->page_fill = 0;
+
+	/* The index page is left out if the store has no room for it. Its keys
+	   stay in memory. */
+	if (store->num_index_keys < SD_SPI_STORE_INDEX_INTERVAL ||
+		store->next_block_address == store->end_block_address)
+	{
+		return SD_ERR_OK;
+	}
+
+	uint16_t num_bytes = SD_SPI_STORE_INDEX_INTERVAL * 4;
+
+	if ((response = sd_spi_write_continuous(store->index_keys, num_bytes,
+											sizeof(sd_spi_store_header_t))))
+	{
+		return response;
+	}
+
+	header.type = SD_SPI_STORE_PAGE_INDEX;
+	header.first_key = store->index_keys[0];
+	header.num_records = SD_SPI_STORE_INDEX_INTERVAL;
+	header.num_bytes = num_bytes;
+
+	if ((response = sd_spi_store_write_page(store, &header,
+											sd_spi_store_crc(0xFFFFFFFF,
+															 store->index_keys,
+															 num_bytes))))
+	{
+		return response;
+	}
+
+	sd_spi_store_summarize(store, (store->next_block_address -
+								   store->start_block_address) /
+								  SD_SPI_STORE_GROUP_SIZE - 1,
+						   store->index_keys[0]);
+	store->num_index_keys = 0;
+
+	return SD_ERR_OK;
+}
+
+static int8_t
+sd_spi_store_next_record(
+	sd_spi_store_t			*store,
+	sd_spi_store_cursor_t	*cursor,
+	uint32_t				*key,
+	uint16_t				*length
+)
+{
+	int8_t response;
+
+	if (store->is_appending && (response = sd_spi_store_flush(store)))
+	{
+		return response;
+	}
+
+	while (cursor->offset == 0 || cursor->offset >= cursor->end)
+	{
+		if (cursor->offset != 0)
+		{
+			cursor->block_address++;
+			cursor->offset = 0;
+		}
+
+		if (sd_spi_store_is_index_page(store, cursor->block_address))
+		{
+			cursor->block_address++;
+		}
+
+		if (cursor->block_address >= store->next_block_address)
+		{
+			return SD_ERR_STORE_END;
+		}
+
+		sd_spi_store_header_t header;
+
+		if ((response = sd_spi_store_read_header(store, cursor->block_address,
+												 &header)))
+		{
+			return response;
+		}
+
+		if (header.type != SD_SPI_STORE_PAGE_DATA)
+		{
+			return SD_ERR_STORE_CORRUPT;
+		}
+
+		cursor->offset = sizeof(sd_spi_store_header_t);
+		cursor->end = cursor->offset + header.num_bytes;
+	}
+
+	uint8_t record_header[SD_SPI_STORE_RECORD_HEADER_SIZE];
+
+	if ((response = sd_spi_read(cursor->block_address, record_header,
+								SD_SPI_STORE_RECORD_HEADER_SIZE,
+								cursor->offset)))
+	{
+		return response;
+	}
+
+	memcpy(key, record_header, 4);
+	memcpy(length, record_header + 4, 2);
+
+	if (cursor->offset + SD_SPI_STORE_RECORD_HEADER_SIZE + *length >
+		cursor->end)
+	{
+		return SD_ERR_STORE_CORRUPT;
+	}
+
+	return SD_ERR_OK;
+}
+
+static int8_t
+sd_spi_store_find_page(
+	sd_spi_store_t	*store,
+	uint32_t		key,
+	uint32_t		*block_address
+)
+{
+	/* The groups that have an index page are searched through their index
+	   pages and the group after them through the keys in memory. */
+	*block_address = store->start_block_address;
+
+	uint32_t num_groups = (store->next_block_address -
+						   store->start_block_address) /
+						  SD_SPI_STORE_GROUP_SIZE;
+	int8_t response;
+	sd_spi_store_header_t header;
+	uint8_t i;
+
+	if (store->num_index_keys > 0 && store->index_keys[0] < key)
+	{
+		i = store->num_index_keys - 1;
+
+		while (store->index_keys[i] >= key)
+		{
+			i--;
+		}
+
+		*block_address += num_groups * SD_SPI_STORE_GROUP_SIZE + i;
+	}
+	else if (num_groups > 0)
+	{
+		uint32_t low = 0;
+		uint32_t high = num_groups;
+		uint8_t j = 0;
+
+		/* The summary gives the range that the count below is in. */
+		while (j < store->num_summary_keys && store->summary_keys[j] < key)
+		{
+			j++;
+		}
+
+		if (j > 0)
+		{
+			low = (j - 1) * store->summary_stride + 1;
+		}
+
+		if (j < store->num_summary_keys && j * store->summary_stride < high)
+		{
+			high = j * store->summary_stride;
+		}
+
+		/* Count the groups whose first key is less than key. */
+		while (low < high)
+		{
+			uint32_t middle = low + (high - low) / 2;
+
+			if ((response = sd_spi_store_read_header(
+					store, store->start_block_address +
+						   middle * SD_SPI_STORE_GROUP_SIZE +
+						   SD_SPI_STORE_INDEX_INTERVAL, &header)))
+			{
+				return response;
+			}
+
+			if (header.type != SD_SPI_STORE_PAGE_INDEX)
+			{
+				return SD_ERR_STORE_CORRUPT;
+			}
+
+			if (header.first_key < key)
+			{
+				low = middle + 1;
+			}
+			else
+			{
+				high = middle;
+			}
+		}
+
+		if (low > 0)
+		{
+			uint32_t group_address = store->start_block_address +
+									 (low - 1) * SD_SPI_STORE_GROUP_SIZE;
+			uint32_t index_address = group_address +
+									 SD_SPI_STORE_INDEX_INTERVAL;
+			uint32_t page_key;
+
+			if ((response = sd_spi_store_read_header(store, index_address,
+													 &header)))
+			{
+				return response;
+			}
+
+			/* The page is in the block buffer now, so the keys are read from
+			   memory. */
+			for (i = SD_SPI_STORE_INDEX_INTERVAL - 1; i > 0; i--)
+			{
+				if ((response = sd_spi_read(index_address, &page_key, 4,
+											sizeof(sd_spi_store_header_t) +
+											i * 4)))
+				{
+					return response;
+				}
+
+				if (page_key < key)
+				{
+					break;
+				}
+			}
+
+			*block_address = group_address + i;
+		}
+	}
+
+
+	return SD_ERR_OK;
+}
+
+static void
+sd_spi_store_summarize(
+	sd_spi_store_t	*store,
+	uint32_t		group,
+	uint32_t		key
+)
+{
+	if (group % store->summary_stride != 0)
+	{
+		return;
+	}
+
+	if (store->num_summary_keys == SD_SPI_STORE_SUMMARY_SIZE)
+	{
+		uint8_t i;
+
+		for (i = 0; 2 * i < SD_SPI_STORE_SUMMARY_SIZE; i++)
+		{
+			store->summary_keys[i] = store->summary_keys[2 * i];
+		}
+
+		store->num_summary_keys = i;
+		store->summary_stride *= 2;
+
+		if (group % store->summary_stride != 0)
+		{
+			return;
+		}
+	}
+
+	store->summary_keys[store->num_summary_keys++] = key;
+}
+
+static int8_t
+sd_spi_store_query_page(
+	sd_spi_store_t			*store,
+	uint32_t				first_key,
+	uint32_t				last_key,
+	void					*data_buffer,
+	uint16_t				max_bytes,
+	sd_spi_store_record_t	callback,
+	void					*context
+)
+{
+	int8_t response;
+	sd_spi_store_header_t header;
+
+	if ((response = sd_spi_read_continuous(&header,
+										   sizeof(sd_spi_store_header_t), 0)))
+	{
+		return response;
+	}
+
+	if (header.magic != SD_SPI_STORE_MAGIC ||
+		header.version != SD_SPI_STORE_VERSION ||
+		header.type != SD_SPI_STORE_PAGE_DATA ||
+		header.num_bytes > store->card->page_size -
+						   sizeof(sd_spi_store_header_t))
+	{
+		return SD_ERR_STORE_CORRUPT;
+	}
+
+	if (header.first_key > last_key)
+	{
+		return SD_ERR_STORE_END;
+	}
+
+	/* The page is in the block buffer, so it is read twice from memory: once
+	   for the CRC and once for the records. */
+	uint8_t chunk[SD_SPI_STREAM_CHUNK_SIZE];
+	uint32_t crc = 0xFFFFFFFF;
+	uint16_t offset = sizeof(sd_spi_store_header_t);
+	uint16_t end = offset + header.num_bytes;
+
+	while (offset < end)
+	{
+		uint16_t number_of_bytes = end - offset;
+
+		if (number_of_bytes > SD_SPI_STREAM_CHUNK_SIZE)
+		{
+			number_of_bytes = SD_SPI_STREAM_CHUNK_SIZE;
+		}
+
+		if ((response = sd_spi_read_continuous(chunk, number_of_bytes,
+											   offset)))
+		{
+			return response;
+		}
+
+		crc = sd_spi_store_crc(crc, chunk, number_of_bytes);
+		offset += number_of_bytes;
+	}
+
+	uint32_t header_crc = header.crc;
+	header.crc = 0;
+
+	if (~sd_spi_store_crc(crc, &header, sizeof(sd_spi_store_header_t)) !=
+		header_crc)
+	{
+		return SD_ERR_STORE_CORRUPT;
+	}
+
+	offset = sizeof(sd_spi_store_header_t);
+
+	while (offset < end)
+	{
+		uint8_t record_header[SD_SPI_STORE_RECORD_HEADER_SIZE];
+		uint32_t key;
+		uint16_t length;
+
+		if ((response = sd_spi_read_continuous(record_header,
+											   SD_SPI_STORE_RECORD_HEADER_SIZE,
+											   offset)))
+		{
+			return response;
+		}
+
+		memcpy(&key, record_header, 4);
+		memcpy(&length, record_header + 4, 2);
+		offset += SD_SPI_STORE_RECORD_HEADER_SIZE;
+
+		if (offset + length > end)
+		{
+			return SD_ERR_STORE_CORRUPT;
+		}
+
+		if (key > last_key)
+		{
+			return SD_ERR_STORE_END;
+		}
+
+		if (key >= first_key)
+		{
+			if ((response = sd_spi_read_continuous(data_buffer,
+												   length < max_bytes ?
+												   length : max_bytes,
+												   offset)) ||
+				(response = callback(context, key, data_buffer, length)))
+			{
+				return response;
+			}
+		}
+
+		offset += length;
+	}
+
+	return SD_ERR_OK;
+}
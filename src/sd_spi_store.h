@@ -0,0 +1,416 @@
+/******************************************************************************/
+/**
+@file		sd_spi_store.h
+@author     Wade Penson
+@date		June, 2015
+@brief      Append-only log-structured record store on a range of pages.
+@details	Records are appended into pages that are written with a
+			continuous write, so appending only sends the data of whole pages
+			in one multiple block write. Each record has a key, such as a
+			timestamp or a sequence number, and the keys of a store never go
+			down. Every page starts with a header that holds the sequence
+			number of the page, the keys and the number of its records, and a
+			CRC of the page. After every SD_SPI_STORE_INDEX_INTERVAL data
+			pages, an index page with the first key of each of them is
+			written, so finding a key takes a binary search over the index
+			pages instead of a scan:
+
+				| data 0 | ... | data K-1 | index | data K | ... | index | ...
+
+			The first key of every few groups is kept in memory as well, so a
+			seek reads only a few index pages, and sd_spi_store_query() streams
+			the records of a range of keys with one continuous read.
+
+			The block addresses refer to pages (see sd_spi_set_page_size()).
+
+@copyright  Copyright 2015 Wade Penson
+
+@license    Licensed under the Apache License, Version 2.0 (the "License");
+            you may not use this file except in compliance with the License.
+            You may obtain a copy of the License at
+
+              http://www.apache.org/licenses/LICENSE-2.0
+
+            Unless required by applicable law or agreed to in writing, software
+            distributed under the License is distributed on an "AS IS" BASIS,
+            WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+            implied. See the License for the specific language governing
+            permissions and limitations under the License.
+*/
+/******************************************************************************/
+
+#if !defined(SD_SPI_STORE_H_)
+#define SD_SPI_STORE_H_
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#include "sd_spi.h"
+
+/** The number of data pages that each index page covers. The first key of
+	each data page in the current group is kept in memory until the index
+	page is written. */
+#if !defined(SD_SPI_STORE_INDEX_INTERVAL)
+#define SD_SPI_STORE_INDEX_INTERVAL 32
+#endif
+
+/** The value of the magic field of every page of a store. */
+#define SD_SPI_STORE_MAGIC				0x5354
+/** The version of the layout of the pages. */
+#define SD_SPI_STORE_VERSION			1
+/** The type of a page that holds records. */
+#define SD_SPI_STORE_PAGE_DATA			0
+/** The type of a page that holds the first keys of the data pages before
+	it. */
+#define SD_SPI_STORE_PAGE_INDEX			1
+/** The type of a page whose bytes after the header are not split into
+	records, such as a page of a circular log (see sd_spi_ring.h). */
+#define SD_SPI_STORE_PAGE_RAW			2
+/** The number of bytes in front of the data of each record: the key (4
+	bytes) and the length of the data (2 bytes). */
+#define SD_SPI_STORE_RECORD_HEADER_SIZE	6
+
+/** The header at the start of every page of a store. The fields are stored
+	in the byte order of the host. */
+typedef struct sd_spi_store_header {
+	/** SD_SPI_STORE_MAGIC. */
+	uint16_t	magic;
+	/** SD_SPI_STORE_PAGE_DATA, SD_SPI_STORE_PAGE_INDEX or
+		SD_SPI_STORE_PAGE_RAW. */
+	uint8_t		type;
+	/** SD_SPI_STORE_VERSION. */
+	uint8_t		version;
+	/** The number of the page in the order the pages were written, starting
+		at 1. */
+	uint32_t	sequence;
+	/** The key of the first record (or the first key of the first data page
+		for an index page). */
+	uint32_t	first_key;
+	/** The key of the last record (or the last key of the last data page
+		for an index page). */
+	uint32_t	last_key;
+	/** The number of records (or of keys for an index page). */
+	uint16_t	num_records;
+	/** The number of bytes after the header. */
+	uint16_t	num_bytes;
+	/** The CRC-32 of the bytes after the header followed by the header with
+		this field set to 0. */
+	uint32_t	crc;
+} sd_spi_store_header_t;
+
+/** The number of first keys of groups of pages that are kept in memory to
+	narrow the search over the index pages. When the summary is full, every
+	other key is dropped, so it always covers the whole store. */
+#if !defined(SD_SPI_STORE_SUMMARY_SIZE)
+#define SD_SPI_STORE_SUMMARY_SIZE 32
+#endif
+
+#if SD_SPI_STORE_SUMMARY_SIZE < 2
+#error "SD_SPI_STORE_SUMMARY_SIZE must be at least 2."
+#endif
+
+#if SD_SPI_STORE_INDEX_INTERVAL < 1 || \
+	SD_SPI_STORE_INDEX_INTERVAL * 4 + 24 > 512
+#error "The keys of SD_SPI_STORE_INDEX_INTERVAL pages must fit in an index page."
+#endif
+
+/** State variables used by a store. */
+typedef struct sd_spi_store {
+	/** The card that holds the store. */
+	sd_spi_card_t	*card;
+	/** The first page of the store. */
+	uint32_t		start_block_address;
+	/** The page after the last one of the store. */
+	uint32_t		end_block_address;
+	/** The page that the next page is written to. */
+	uint32_t		next_block_address;
+	/** The sequence number of the next page. */
+	uint32_t		next_sequence;
+	/** The key of the last record that was appended. */
+	uint32_t		last_key;
+	/** The number of records that were appended since the store was
+		formatted or mounted. */
+	uint32_t		num_records;
+	/** The first key of each data page of the group that does not have its
+		index page yet. */
+	uint32_t		index_keys[SD_SPI_STORE_INDEX_INTERVAL];
+	/** The first key of every summary_stride groups that have an index
+		page, starting with the first group. */
+	uint32_t		summary_keys[SD_SPI_STORE_SUMMARY_SIZE];
+	/** The number of groups between the keys of summary_keys. It is a power
+		of 2. */
+	uint32_t		summary_stride;
+	/** The number of keys in summary_keys. */
+	uint8_t			num_summary_keys;
+	/** The number of keys in index_keys. */
+	uint8_t			num_index_keys;
+	/** True while the continuous write of the store is open. */
+	uint8_t			is_appending;
+	/** The number of bytes of the page that is being filled, including its
+		header. */
+	uint16_t		page_fill;
+	/** The number of records in the page that is being filled. */
+	uint16_t		page_num_records;
+	/** The key of the first record of the page that is being filled. */
+	uint32_t		page_first_key;
+	/** The CRC of the bytes of the page that is being filled so far. */
+	uint32_t		page_crc;
+} sd_spi_store_t;
+
+/**
+@brief		Called by sd_spi_store_query() for each record in the range.
+
+@param[in]	context				The context given to sd_spi_store_query().
+@param		key					The key of the record.
+@param[in]	data				The data of the record, cut short to the size
+								of the buffer given to sd_spi_store_query().
+@param		number_of_bytes		The size of the data of the record.
+
+@return		SD_ERR_OK to go on. Any other code stops the query and is returned
+			by sd_spi_store_query(), except SD_ERR_STORE_END which stops it
+			without an error.
+*/
+typedef int8_t (*sd_spi_store_record_t)(
+	void		*context,
+	uint32_t	key,
+	const void	*data,
+	uint16_t	number_of_bytes
+);
+
+/** A position in a store that records are read from. */
+typedef struct sd_spi_store_cursor {
+	/** The page that the next record is read from. */
+	uint32_t	block_address;
+	/** The offset of the next record in the page, or 0 if the header of the
+		page has not been read yet. */
+	uint16_t	offset;
+	/** The offset of the end of the records of the page. */
+	uint16_t	end;
+} sd_spi_store_cursor_t;
+
+/**
+@brief		Creates an empty store on a range of pages.
+@details	The pages are erased so that no page of an earlier store is taken
+			for part of this one. The card must already be initialized. The
+			functions of the layer change the card in use (see
+			sd_spi_use_card()).
+
+@param[out]	store					The store to create.
+@param[in]	card					The state of the card that holds the store.
+@param		start_block_address		The first page of the store.
+@param		num_blocks				The number of pages of the store.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+int8_t
+sd_spi_store_format(
+	sd_spi_store_t	*store,
+	sd_spi_card_t	*card,
+	uint32_t		start_block_address,
+	uint32_t		num_blocks
+);
+
+/**
+@brief		Opens a store that is already on a card, such as after a reset.
+@details	The page after the newest page is found with a binary search over
+			the sequence numbers of the pages (see sd_spi_mount_find()), so
+			this reads about log2(num_blocks) pages, plus the data pages of
+			the group that does not have its index page yet to get their first
+			keys back. A page that was cut short by a reset does not match its
+			CRC and is written over. The card must already be initialized.
+
+@param[out]	store					The store to open.
+@param[in]	card					The state of the card that holds the store.
+@param		start_block_address		The first page of the store.
+@param		num_blocks				The number of pages of the store.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+int8_t
+sd_spi_store_mount(
+	sd_spi_store_t	*store,
+	sd_spi_card_t	*card,
+	uint32_t		start_block_address,
+	uint32_t		num_blocks
+);
+
+/**
+@brief		Appends a record to a store.
+@details	The record goes into the page that is being filled. When it does
+			not fit, the page is finished and written through the continuous
+			write of the store, which is started when needed and left open
+			for the next appends. Call sd_spi_store_flush() to write out the
+			records that are still in memory.
+
+@param[in]	store				An open store.
+@param		key					The key of the record. It must not be less
+								than the key of the last record.
+@param[in]	data				The data of the record.
+@param		number_of_bytes		The size of the data. The data and the headers
+								must fit in a page.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+			SD_ERR_ARGUMENT_OUT_OF_RANGE is returned if the key is less than
+			the last key or the store is full.
+*/
+int8_t
+sd_spi_store_append(
+	sd_spi_store_t	*store,
+	uint32_t		key,
+	const void		*data,
+	uint16_t		number_of_bytes
+);
+
+/**
+@brief		Writes out the page that is being filled and stops the continuous
+			write of the store.
+@details	The next append starts a new page, so flushing often leaves pages
+			partly empty.
+
+@param[in]	store	An open store.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+int8_t
+sd_spi_store_flush(
+	sd_spi_store_t	*store
+);
+
+/**
+@brief		Points a cursor at the first record whose key is at least key.
+@details	The store is flushed first. The summary in memory narrows the
+			groups that the key can be in, and the index pages of those are
+			binary searched, so this reads about log2(summary_stride) + 2
+			pages.
+
+@param[in]	store	An open store.
+@param[out]	cursor	The cursor to set.
+@param		key		The key to look for.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+int8_t
+sd_spi_store_seek(
+	sd_spi_store_t			*store,
+	sd_spi_store_cursor_t	*cursor,
+	uint32_t				key
+);
+
+/**
+@brief		Reads the record at a cursor and moves the cursor to the next one.
+@details	The CRC of each page is checked when the cursor gets to it. The
+			store is flushed first if it is appending, so records that were
+			appended after the seek are read as well.
+
+@param[in]	store				An open store.
+@param[in]	cursor				A cursor that was set by sd_spi_store_seek().
+@param[out]	key					The key of the record.
+@param[out]	data_buffer			Where to put the data.
+@param		max_bytes			The size of data_buffer. Longer data is cut
+								short.
+@param[out]	number_of_bytes		The size of the data of the record.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+			SD_ERR_STORE_END is returned if there are no more records and
+			SD_ERR_STORE_CORRUPT if a page does not match its CRC.
+*/
+int8_t
+sd_spi_store_read_next(
+	sd_spi_store_t			*store,
+	sd_spi_store_cursor_t	*cursor,
+	uint32_t				*key,
+	void					*data_buffer,
+	uint16_t				max_bytes,
+	uint16_t				*number_of_bytes
+);
+
+/**
+@brief		Gives each record whose key is from first_key to last_key to a
+			callback.
+@details	The store is flushed first. The first page of the range is found
+			as by sd_spi_store_seek(), and the pages from it on are read with
+			one continuous read until a key past last_key is found. The CRC of
+			each page is checked before its records are given out.
+
+@param[in]	store			An open store.
+@param		first_key		The first key of the range.
+@param		last_key		The last key of the range.
+@param[out]	data_buffer		Where to put the data of each record.
+@param		max_bytes		The size of data_buffer. Longer data is cut short.
+@param		callback		Gets the records.
+@param[in]	context			Passed to callback.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+			SD_ERR_STORE_CORRUPT is returned if a page does not match its CRC.
+*/
+int8_t
+sd_spi_store_query(
+	sd_spi_store_t			*store,
+	uint32_t				first_key,
+	uint32_t				last_key,
+	void					*data_buffer,
+	uint16_t				max_bytes,
+	sd_spi_store_record_t	callback,
+	void					*context
+);
+
+/**
+@brief		Reads the header of a page of a store and checks its CRC.
+
+@param[in]	store			An open store.
+@param		block_address	The page to read.
+@param[out]	header			The header of the page.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+			SD_ERR_STORE_CORRUPT is returned if the page is not a page of a
+			store or does not match its CRC.
+*/
+int8_t
+sd_spi_store_read_header(
+	sd_spi_store_t			*store,
+	uint32_t				block_address,
+	sd_spi_store_header_t	*header
+);
+
+/**
+@brief		Reads the header of a page in the format of a store and checks its
+			CRC.
+@details	Other layers that write pages in this format use it to check their
+			pages.
+
+@param		block_address	The page to read.
+@param[out]	header			The header of the page.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+			SD_ERR_STORE_CORRUPT is returned if the page is not in the format
+			of a store or does not match its CRC.
+*/
+int8_t
+sd_spi_store_check_page(
+	uint32_t				block_address,
+	sd_spi_store_header_t	*header
+);
+
+/**
+@brief		Adds bytes to the CRC-32 of a page.
+@details	The CRC starts at 0xFFFFFFFF and is inverted at the end.
+
+@param		crc					The CRC so far.
+@param[in]	data				The bytes to add.
+@param		number_of_bytes		The number of bytes.
+
+@return		The new CRC.
+*/
+uint32_t
+sd_spi_store_crc(
+	uint32_t	crc,
+	const void	*data,
+	uint16_t	number_of_bytes
+);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif /* SD_SPI_STORE_H_ */
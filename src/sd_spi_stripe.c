@@ -0,0 +1,376 @@
+/******************************************************************************/
+/**
+@file		sd_spi_stripe.c
+@author     Wade Penson
+@date		June, 2015
+@brief      Striping (RAID-0) layer implementation.
+@copyright  Copyright 2015 Wade Penson
+
+@license    Licensed under the Apache License, Version 2.0 (the "License");
+            you may not use this file except in compliance with the License.
+            You may obtain a copy of the License at
+
+              http://www.apache.org/licenses/LICENSE-2.0
+
+            Unless required by applicable law or agreed to in writing, software
+            distributed under the License is distributed on an "AS IS" BASIS,
+            WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+            implied. See the License for the specific language governing
+            permissions and limitations under the License.
+*/
+/******************************************************************************/
+
+#include "sd_spi_stripe.h"
+
+/**
+@brief		Maps a logical block to a card and the block on that card.
+
+@param[in]	stripe				An initialized stripe set.
+@param		block_address		The logical block.
+@param[out]	card_index			The index of the card that stores the block.
+@param[out]	physical_address	The address of the block on the card.
+*/
+static void
+sd_spi_stripe_map(
+	sd_spi_stripe_t	*stripe,
+	uint32_t		block_address,
+	uint8_t			*card_index,
+	uint32_t		*physical_address
+);
+
+/**
+@brief		Finds the first logical block at or after block_address that is
+			stored on the given card.
+
+@param[in]	stripe			An initialized stripe set.
+@param		block_address	The logical block to start searching from.
+@param		card_index		The index of the card.
+
+@return		The logical block address.
+*/
+static uint32_t
+sd_spi_stripe_first_on_card(
+	sd_spi_stripe_t	*stripe,
+	uint32_t		block_address,
+	uint8_t			card_index
+);
+
+int8_t
+sd_spi_stripe_init(
+	sd_spi_stripe_t	*stripe,
+	sd_spi_card_t	*cards,
+	uint8_t			*chip_select_pins,
+	uint8_t			num_cards,
+	uint32_t		chunk_size
+)
+{
+	if (num_cards == 0 || num_cards > SD_SPI_STRIPE_MAX_CARDS ||
+		chunk_size == 0)
+	{
+		return SD_ERR_ILLEGAL_PARAMETER;
+	}
+
+	stripe->num_cards = num_cards;
+	stripe->chunk_size = chunk_size;
+	stripe->next_block_address = 0;
+	stripe->is_write_continuous = 0;
+
+	uint32_t min_card_size = 0;
+	uint8_t i;
+
+	for (i = 0; i < num_cards; i++)
+	{
+		stripe->cards[i] = &cards[i];
+		sd_spi_use_card(stripe->cards[i]);
+
+		int8_t response;
+		if ((response = sd_spi_init(chip_select_pins[i])))
+		{
+			return response;
+		}
+
+		uint32_t card_size = sd_spi_card_size();
+
+		if (i == 0 || card_size < min_card_size)
+		{
+			min_card_size = card_size;
+		}
+	}
+
+	stripe->num_blocks = (min_card_size / chunk_size) * chunk_size * num_cards;
+
+	return SD_ERR_OK;
+}
+
+int8_t
+sd_spi_stripe_write_continuous_start(
+	sd_spi_stripe_t	*stripe,
+	uint32_t		start_block_address,
+	uint32_t		num_blocks_pre_erase
+)
+{
+	int8_t response;
+	if ((response = sd_spi_stripe_write_continuous_stop(stripe)))
+	{
+		return response;
+	}
+
+	if (start_block_address >= stripe->num_blocks)
+	{
+		return SD_ERR_ARGUMENT_OUT_OF_RANGE;
+	}
+
+	/* The blocks of each card are consecutive on that card, so every card
+	   only needs one sequential write starting at its first block. */
+	uint32_t blocks_per_card = (num_blocks_pre_erase + stripe->num_cards - 1) /
+							   stripe->num_cards;
+	uint8_t i;
+
+	for (i = 0; i < stripe->num_cards; i++)
+	{
+		uint32_t first_block = sd_spi_stripe_first_on_card(stripe,
+															start_block_address,
+															i);
+
+		/* Cards without any blocks left in the set are not started. */
+		if (first_block >= stripe->num_blocks)
+		{
+			continue;
+		}
+
+		uint8_t card_index;
+		uint32_t physical_address;
+		sd_spi_stripe_map(stripe, first_block, &card_index, &physical_address);
+
+		sd_spi_use_card(stripe->cards[i]);
+
+		if ((response = sd_spi_write_continuous_start(physical_address,
+													   blocks_per_card)))
+		{
+			return response;
+		}
+	}
+
+	stripe->next_block_address = start_block_address;
+	stripe->is_write_continuous = 1;
+
+	return SD_ERR_OK;
+}
+
+int8_t
+sd_spi_stripe_write_continuous_stop(
+	sd_spi_stripe_t	*stripe
+)
+{
+	if (!stripe->is_write_continuous)
+	{
+		return SD_ERR_OK;
+	}
+
+	int8_t first_response = SD_ERR_OK;
+	uint8_t i;
+
+	for (i = 0; i < stripe->num_cards; i++)
+	{
+		if (!stripe->cards[i]->is_read_write_continuous)
+		{
+			continue;
+		}
+
+		sd_spi_use_card(stripe->cards[i]);
+
+		int8_t response = sd_spi_write_continuous_stop();
+
+		if (first_response == SD_ERR_OK)
+		{
+			first_response = response;
+		}
+	}
+
+	stripe->is_write_continuous = 0;
+
+	return first_response;
+}
+
+int8_t
+sd_spi_stripe_write_blocks(
+	sd_spi_stripe_t	*stripe,
+	uint32_t		block_address,
+	void			*data,
+	uint32_t		num_blocks
+)
+{
+	if (block_address > stripe->num_blocks ||
+		num_blocks > stripe->num_blocks - block_address)
+	{
+		return SD_ERR_ARGUMENT_OUT_OF_RANGE;
+	}
+
+	int8_t response;
+
+	if (!stripe->is_write_continuous ||
+		stripe->next_block_address != block_address)
+	{
+		if ((response = sd_spi_stripe_write_continuous_start(stripe,
+															  block_address,
+															  num_blocks)))
+		{
+			return response;
+		}
+	}
+
+	uint32_t i;
+	for (i = 0; i < num_blocks; i++)
+	{
+		uint8_t card_index = ((block_address + i) / stripe->chunk_size) %
+							 stripe->num_cards;
+
+		/* Every card is already positioned at its next block. A card does not
+		   wait for its own write to finish, so the next card receives its
+		   block while this one is busy. */
+		sd_spi_use_card(stripe->cards[card_index]);
+
+		if ((response = sd_spi_write_continuous((uint8_t *) data + (i << 9),
+												512, 0)) ||
+			(response = sd_spi_flush()))
+		{
+			return response;
+		}
+
+		stripe->next_block_address++;
+	}
+
+	return SD_ERR_OK;
+}
+
+int8_t
+sd_spi_stripe_read_blocks(
+	sd_spi_stripe_t	*stripe,
+	uint32_t		block_address,
+	void			*data_buffer,
+	uint32_t		num_blocks
+)
+{
+	if (block_address > stripe->num_blocks ||
+		num_blocks > stripe->num_blocks - block_address)
+	{
+		return SD_ERR_ARGUMENT_OUT_OF_RANGE;
+	}
+
+	int8_t response;
+	if ((response = sd_spi_stripe_write_continuous_stop(stripe)))
+	{
+		return response;
+	}
+
+	uint32_t end_block_address = block_address + num_blocks;
+	uint8_t i;
+
+	for (i = 0; i < stripe->num_cards; i++)
+	{
+		uint32_t current_block = sd_spi_stripe_first_on_card(stripe,
+															  block_address,
+															  i);
+
+		if (current_block >= end_block_address)
+		{
+			continue;
+		}
+
+		uint8_t card_index;
+		uint32_t physical_address;
+		sd_spi_stripe_map(stripe, current_block, &card_index,
+						  &physical_address);
+
+		sd_spi_use_card(stripe->cards[i]);
+
+		if ((response = sd_spi_read_continuous_start(physical_address)))
+		{
+			return response;
+		}
+
+		/* The read is stopped on an error as well, so the card is not left
+		   in the middle of it. */
+		while (1)
+		{
+			if ((response = sd_spi_read_continuous((uint8_t *) data_buffer +
+												   ((current_block -
+													 block_address) << 9),
+												   512, 0)))
+			{
+				break;
+			}
+
+			/* Skip over the chunks stored on the other cards. */
+			current_block++;
+
+			if (current_block % stripe->chunk_size == 0)
+			{
+				current_block += (stripe->num_cards - 1) * stripe->chunk_size;
+			}
+
+			if (current_block >= end_block_address)
+			{
+				break;
+			}
+
+			if ((response = sd_spi_read_continuous_next()))
+			{
+				break;
+			}
+		}
+
+		int8_t stop_response = sd_spi_read_continuous_stop();
+
+		if (response || (response = stop_response))
+		{
+			return response;
+		}
+	}
+
+	return SD_ERR_OK;
+}
+
+uint32_t
+sd_spi_stripe_size(
+	sd_spi_stripe_t	*stripe
+)
+{
+	return stripe->num_blocks;
+}
+
+static void
+sd_spi_stripe_map(
+	sd_spi_stripe_t	*stripe,
+	uint32_t		block_address,
+	uint8_t			*card_index,
+	uint32_t		*physical_address
+)
+{
+	uint32_t chunk = block_address / stripe->chunk_size;
+
+	*card_index = chunk % stripe->num_cards;
+	*physical_address = (chunk / stripe->num_cards) * stripe->chunk_size +
+						block_address % stripe->chunk_size;
+}
+
+static uint32_t
+sd_spi_stripe_first_on_card(
+	sd_spi_stripe_t	*stripe,
+	uint32_t		block_address,
+	uint8_t			card_index
+)
+{
+	uint32_t chunk = block_address / stripe->chunk_size;
+	uint8_t chunk_card_index = chunk % stripe->num_cards;
+
+	if (chunk_card_index == card_index)
+	{
+		return block_address;
+	}
+
+	chunk += (card_index + stripe->num_cards - chunk_card_index) %
+			 stripe->num_cards;
+
+	return chunk * stripe->chunk_size;
+}
@@ -0,0 +1,177 @@
+/******************************************************************************/
+/**
+@file		sd_spi_stripe.h
+@author     Wade Penson
+@date		June, 2015
+@brief      Striping (RAID-0) layer over multiple SD cards.
+@details	Consecutive logical blocks are spread round-robin, in chunks of
+			a configurable number of blocks, across cards on the same SPI bus
+			that are selected by different chip select pins. While one card is
+			busy programming a block, the next block is clocked out to another
+			card so the busy times of the cards overlap.
+
+@copyright  Copyright 2015 Wade Penson
+
+@license    Licensed under the Apache License, Version 2.0 (the "License");
+            you may not use this file except in compliance with the License.
+            You may obtain a copy of the License at
+
+              http://www.apache.org/licenses/LICENSE-2.0
+
+            Unless required by applicable law or agreed to in writing, software
+            distributed under the License is distributed on an "AS IS" BASIS,
+            WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+            implied. See the License for the specific language governing
+            permissions and limitations under the License.
+*/
+/******************************************************************************/
+
+#if !defined(SD_SPI_STRIPE_H_)
+#define SD_SPI_STRIPE_H_
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+#include "sd_spi.h"
+
+/** The maximum number of cards in a stripe set. */
+#define SD_SPI_STRIPE_MAX_CARDS		4
+
+/** State variables used by the striping layer. */
+typedef struct sd_spi_stripe {
+	/** The state of each card in the set. */
+	sd_spi_card_t	*cards[SD_SPI_STRIPE_MAX_CARDS];
+	/** The number of cards in the set. */
+	uint8_t			num_cards;
+	/** The number of consecutive logical blocks that are stored on a card
+		before moving on to the next card. */
+	uint32_t		chunk_size;
+	/** The number of logical blocks in the set. */
+	uint32_t		num_blocks;
+	/** The logical block that the next streamed write goes to. */
+	uint32_t		next_block_address;
+	/** True if every card has a continuous write in progress. */
+	uint8_t			is_write_continuous;
+} sd_spi_stripe_t;
+
+/**
+@brief		Initializes every card in the stripe set.
+@details	The capacity of the set is the size of the smallest card, as
+			reported by sd_spi_card_size(), rounded down to a multiple of the
+			chunk size and multiplied by the number of cards. The functions
+			of the layer change the card in use (see sd_spi_use_card()).
+
+@param[out]	stripe				The stripe set to initialize.
+@param[out]	cards				An array of num_cards card states to use.
+@param[in]	chip_select_pins	The chip select pin of each card.
+@param		num_cards			The number of cards (at most
+								SD_SPI_STRIPE_MAX_CARDS).
+@param		chunk_size			The number of consecutive blocks that are
+								placed on a card (1 for round-robin blocks).
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+int8_t
+sd_spi_stripe_init(
+	sd_spi_stripe_t	*stripe,
+	sd_spi_card_t	*cards,
+	uint8_t			*chip_select_pins,
+	uint8_t			num_cards,
+	uint32_t		chunk_size
+);
+
+/**
+@brief		Starts a continuous write on every card so that the logical blocks
+			from start_block_address onwards can be streamed.
+@details	Any continuous write that is in progress is stopped first. This is
+			called implicitly by sd_spi_stripe_write_blocks() when the blocks
+			do not follow the previous write.
+
+@param[in]	stripe					An initialized stripe set.
+@param		start_block_address		The first logical block of the stream.
+@param		num_blocks_pre_erase	(Optional) The number of logical blocks
+									that will be written. It is split between
+									the cards and used as their pre-erase
+									count. Use 0 if it is unknown.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+int8_t
+sd_spi_stripe_write_continuous_start(
+	sd_spi_stripe_t	*stripe,
+	uint32_t		start_block_address,
+	uint32_t		num_blocks_pre_erase
+);
+
+/**
+@brief		Stops the continuous write on every card.
+@details	The write is stopped on all of the cards even if one of them fails.
+
+@param[in]	stripe	An initialized stripe set.
+
+@return		The first error code as defined by one of the SD_ERR_* definitions.
+*/
+int8_t
+sd_spi_stripe_write_continuous_stop(
+	sd_spi_stripe_t	*stripe
+);
+
+/**
+@brief		Writes whole logical blocks to the stripe set.
+@details	The blocks are written through the continuous writes of the cards
+			which are left open so that consecutive calls keep streaming. Call
+			sd_spi_stripe_write_continuous_stop() when done writing.
+
+@param[in]	stripe			An initialized stripe set.
+@param		block_address	The first logical block to write.
+@param[in]	data			num_blocks * 512 bytes of data.
+@param		num_blocks		The number of blocks to write.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+int8_t
+sd_spi_stripe_write_blocks(
+	sd_spi_stripe_t	*stripe,
+	uint32_t		block_address,
+	void			*data,
+	uint32_t		num_blocks
+);
+
+/**
+@brief		Reads whole logical blocks from the stripe set.
+@details	A continuous write that is in progress is stopped first. Each card
+			reads its part of the range with a single continuous read.
+
+@param[in]	stripe			An initialized stripe set.
+@param		block_address	The first logical block to read.
+@param[out]	data_buffer		A location in memory of num_blocks * 512 bytes.
+@param		num_blocks		The number of blocks to read.
+
+@return		An error code as defined by one of the SD_ERR_* definitions.
+*/
+int8_t
+sd_spi_stripe_read_blocks(
+	sd_spi_stripe_t	*stripe,
+	uint32_t		block_address,
+	void			*data_buffer,
+	uint32_t		num_blocks
+);
+
+/**
+@brief		Gets the number of logical blocks in the stripe set.
+
+@param[in]	stripe	An initialized stripe set.
+
+@return		The number of logical blocks.
+*/
+uint32_t
+sd_spi_stripe_size(
+	sd_spi_stripe_t	*stripe
+);
+
+#if defined(__cplusplus)
+}
+#endif
+
+#endif /* SD_SPI_STRIPE_H_ */
@@ -0,0 +1,642 @@
+/******************************************************************************/
+/**
+@file		sd_spi_card_simulator.c
+@author     Wade Penson
+@date		June, 2015
+@brief      Simulated SD cards behind the platform dependencies of the device
+			library, so the unit tests can run the device driver on a host.
+@details	Each chip select pin gets a card of SD_SIMULATOR_NUM_BLOCKS blocks
+			in memory. The cards answer the commands and data tokens of SPI
+			mode one byte at a time, so every byte that the driver sends and
+			receives goes through the same paths as on a board, including the
+			DMA hooks of sd_spi_platform_dma.c. A block past the end of a card
+			is rejected with a write error, which the tests use to make writes
+			fail.
+
+			This file takes the place of sd_spi_platform_dependencies.c when it
+			is linked before the device library.
+@copyright  Copyright 2015 Wade Penson
+
+@license    Licensed under the Apache License, Version 2.0 (the "License");
+            you may not use this file except in compliance with the License.
+            You may obtain a copy of the License at
+
+              http://www.apache.org/licenses/LICENSE-2.0
+
+            Unless required by applicable law or agreed to in writing, software
+            distributed under the License is distributed on an "AS IS" BASIS,
+            WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+            implied. See the License for the specific language governing
+            permissions and limitations under the License.
+*/
+/******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include "sd_spi_platform_dependencies.h"
+
+/** The most cards that can be on the bus. */
+#define SD_SIMULATOR_MAX_CARDS		8
+/** The number of 512 byte blocks of each card (32MB, so it is SDHC). */
+#define SD_SIMULATOR_NUM_BLOCKS		65536UL
+/** The number of bytes the card answers with that can be waiting to be
+	clocked out. */
+#define SD_SIMULATOR_QUEUE_SIZE		1024
+/** The number of bytes that a card stays busy after a write or an erase. */
+#define SD_SIMULATOR_BUSY_BYTES		8
+
+/**
+@defgroup sd_simulator_states	Simulator States
+@brief		What a card is waiting for on the bus.
+@{
+*/
+#define SD_SIMULATOR_STATE_COMMAND			0
+#define SD_SIMULATOR_STATE_WRITE_TOKEN		1
+#define SD_SIMULATOR_STATE_WRITE_DATA		2
+#define SD_SIMULATOR_STATE_MULTIPLE_TOKEN	3
+#define SD_SIMULATOR_STATE_MULTIPLE_DATA	4
+#define SD_SIMULATOR_STATE_READ_MULTIPLE	5
+/** @} End of group sd_simulator_states */
+
+/** State of a simulated card. */
+typedef struct sd_simulator_card {
+	/** The blocks of the card. */
+	uint8_t		*blocks;
+	/** The bytes that the card sends next. */
+	uint8_t		queue[SD_SIMULATOR_QUEUE_SIZE];
+	uint16_t	queue_head;
+	uint16_t	queue_tail;
+	/** The command that is being received. */
+	uint8_t		command[6];
+	uint8_t		command_length;
+	/** The data block that is being received, with its CRC. */
+	uint8_t		data[514];
+	uint16_t	data_length;
+	/** One of the SD_SIMULATOR_STATE_* definitions. */
+	uint8_t		state;
+	/** The block that is read or written next. */
+	uint32_t	block_address;
+	/** Blocks written without errors by the last write, which ACMD22
+		gives. */
+	uint32_t	num_written_blocks;
+	uint32_t	erase_start_block_address;
+	uint32_t	erase_end_block_address;
+	/** The number of bytes left that the card answers as busy. */
+	uint16_t	busy_bytes;
+	uint8_t		pin;
+	uint8_t		is_used;
+	uint8_t		is_selected;
+	uint8_t		is_idle;
+	/** True if the next command is an application command. */
+	uint8_t		is_app_command;
+} sd_simulator_card_t;
+
+static sd_simulator_card_t cards[SD_SIMULATOR_MAX_CARDS];
+
+/** The number of bytes on the bus, which is used as the clock. */
+static uint32_t num_bus_bytes = 0;
+
+/**
+@brief		Finds the card on a chip select pin and creates it the first time.
+
+@param		pin		The chip select pin of the card.
+
+@return		The card.
+*/
+static sd_simulator_card_t *
+sd_simulator_get_card(
+	uint8_t pin
+);
+
+/**
+@brief		Queues a byte for the card to send.
+*/
+static void
+sd_simulator_queue_byte(
+	sd_simulator_card_t	*card,
+	uint8_t				b
+);
+
+/**
+@brief		Queues a data block with its start token and CRC.
+*/
+static void
+sd_simulator_queue_block(
+	sd_simulator_card_t	*card,
+	const uint8_t		*data,
+	uint16_t			number_of_bytes
+);
+
+/**
+@brief		Carries out the command that was received.
+*/
+static void
+sd_simulator_do_command(
+	sd_simulator_card_t	*card
+);
+
+/**
+@brief		Exchanges a byte with a card that is selected.
+
+@param		card	The card.
+@param		b		The byte from the host.
+
+@return		The byte from the card.
+*/
+static uint8_t
+sd_simulator_transfer(
+	sd_simulator_card_t	*card,
+	uint8_t				b
+);
+
+/**
+@brief		Exchanges a byte on the bus with the cards that are selected.
+*/
+static uint8_t
+sd_simulator_bus(
+	uint8_t b
+);
+
+void
+sd_spi_pin_mode(
+	uint8_t pin,
+	uint8_t mode
+)
+{
+	(void) mode;
+	sd_simulator_get_card(pin);
+}
+
+void
+sd_spi_digital_write(
+	uint8_t pin,
+	uint8_t state
+)
+{
+	sd_simulator_card_t *card = sd_simulator_get_card(pin);
+
+	card->is_selected = (state == LOW);
+
+	/* A command that is cut off is dropped. */
+	if (!card->is_selected)
+	{
+		card->command_length = 0;
+
+		if (card->state != SD_SIMULATOR_STATE_READ_MULTIPLE)
+		{
+			card->queue_head = card->queue_tail;
+		}
+	}
+}
+
+uint32_t
+sd_spi_millis(
+	void
+)
+{
+	/* A byte takes about 1us at the speed of the bus. */
+	return num_bus_bytes / 1000;
+}
+
+void
+sd_spi_begin(
+	void
+)
+{
+
+}
+
+void
+sd_spi_begin_transaction(
+	uint32_t transfer_speed_hz
+)
+{
+	(void) transfer_speed_hz;
+}
+
+void
+sd_spi_end_transaction(
+	void
+)
+{
+
+}
+
+void
+sd_spi_send_byte(
+	uint8_t b
+)
+{
+	sd_simulator_bus(b);
+}
+
+uint8_t
+sd_spi_receive_byte(
+	void
+)
+{
+	return sd_simulator_bus(0xFF);
+}
+
+static sd_simulator_card_t *
+sd_simulator_get_card(
+	uint8_t pin
+)
+{
+	uint8_t i;
+
+	for (i = 0; i < SD_SIMULATOR_MAX_CARDS; i++)
+	{
+		if (cards[i].is_used && cards[i].pin == pin)
+		{
+			return &cards[i];
+		}
+	}
+
+	for (i = 0; i < SD_SIMULATOR_MAX_CARDS; i++)
+	{
+		if (!cards[i].is_used)
+		{
+			memset(&cards[i], 0, sizeof(cards[i]));
+			cards[i].blocks = (uint8_t *) calloc(SD_SIMULATOR_NUM_BLOCKS, 512);
+			cards[i].pin = pin;
+			cards[i].is_used = 1;
+			cards[i].is_idle = 1;
+
+			if (cards[i].blocks == NULL)
+			{
+				abort();
+			}
+
+			return &cards[i];
+		}
+	}
+
+	abort();
+}
+
+static void
+sd_simulator_queue_byte(
+	sd_simulator_card_t	*card,
+	uint8_t				b
+)
+{
+	card->queue[card->queue_tail] = b;
+	card->queue_tail = (card->queue_tail + 1) % SD_SIMULATOR_QUEUE_SIZE;
+}
+
+static void
+sd_simulator_queue_block(
+	sd_simulator_card_t	*card,
+	const uint8_t		*data,
+	uint16_t			number_of_bytes
+)
+{
+	uint16_t i;
+
+	/* The access time, then the start token. */
+	sd_simulator_queue_byte(card, 0xFF);
+	sd_simulator_queue_byte(card, 0xFE);
+
+	for (i = 0; i < number_of_bytes; i++)
+	{
+		sd_simulator_queue_byte(card, data[i]);
+	}
+
+	/* A CRC that is not checked. */
+	sd_simulator_queue_byte(card, 0xFF);
+	sd_simulator_queue_byte(card, 0xFF);
+}
+
+static void
+sd_simulator_do_command(
+	sd_simulator_card_t	*card
+)
+{
+	uint8_t command = card->command[0] & 0x3F;
+	uint32_t argument = (uint32_t) card->command[1] << 24 |
+						(uint32_t) card->command[2] << 16 |
+						(uint32_t) card->command[3] << 8 |
+						card->command[4];
+	uint8_t r1 = card->is_idle ? 0x01 : 0x00;
+	uint8_t is_app_command = card->is_app_command;
+	uint8_t data[64];
+
+	card->is_app_command = 0;
+	card->queue_head = card->queue_tail;
+
+	/* The card takes a byte before it answers. */
+	sd_simulator_queue_byte(card, 0xFF);
+
+	if (is_app_command)
+	{
+		switch (command)
+		{
+			case 41:
+				/* Leaves the idle state the second time it is asked. */
+				sd_simulator_queue_byte(card, r1);
+				card->is_idle = 0;
+				break;
+			case 22:
+				sd_simulator_queue_byte(card, r1);
+				data[0] = card->num_written_blocks >> 24;
+				data[1] = card->num_written_blocks >> 16;
+				data[2] = card->num_written_blocks >> 8;
+				data[3] = card->num_written_blocks;
+				sd_simulator_queue_block(card, data, 4);
+				break;
+			case 13:
+				/* SD status: speed class 10, 4MB allocation units and an
+				   erase size of 64 units. */
+				sd_simulator_queue_byte(card, r1);
+				sd_simulator_queue_byte(card, 0x00);
+				memset(data, 0, 64);
+				data[8] = 0x04;
+				data[10] = 0x90;
+				data[12] = 0x40;
+				data[13] = 0x0A;
+				data[14] = 0x10;
+				sd_simulator_queue_block(card, data, 64);
+				break;
+			case 51:
+				sd_simulator_queue_byte(card, r1);
+				memset(data, 0, 8);
+				data[0] = 0x02;
+				data[1] = 0x35;
+				data[2] = 0x80;
+				data[3] = 0x03;
+				sd_simulator_queue_block(card, data, 8);
+				break;
+			case 23:
+				sd_simulator_queue_byte(card, r1);
+				break;
+			default:
+				/* Illegal command. */
+				sd_simulator_queue_byte(card, r1 | 0x04);
+				break;
+		}
+
+		return;
+	}
+
+	/* Reads and writes past the end of the card are out of range. */
+	if ((command == 17 || command == 18 || command == 24 || command == 25) &&
+		argument >= SD_SIMULATOR_NUM_BLOCKS)
+	{
+		sd_simulator_queue_byte(card, 0x20);
+		return;
+	}
+
+	switch (command)
+	{
+		case 0:
+			card->is_idle = 1;
+			card->state = SD_SIMULATOR_STATE_COMMAND;
+			sd_simulator_queue_byte(card, 0x01);
+			break;
+		case 8:
+			/* Version 2 card that takes the voltage that was given. */
+			sd_simulator_queue_byte(card, 0x01);
+			sd_simulator_queue_byte(card, 0x00);
+			sd_simulator_queue_byte(card, 0x00);
+			sd_simulator_queue_byte(card, 0x01);
+			sd_simulator_queue_byte(card, 0xAA);
+			break;
+		case 55:
+			card->is_app_command = 1;
+			sd_simulator_queue_byte(card, r1);
+			break;
+		case 58:
+			/* Powered up and high capacity. */
+			sd_simulator_queue_byte(card, r1);
+			sd_simulator_queue_byte(card, 0xC0);
+			sd_simulator_queue_byte(card, 0xFF);
+			sd_simulator_queue_byte(card, 0x80);
+			sd_simulator_queue_byte(card, 0x00);
+			break;
+		case 9:
+		{
+			/* Version 2 CSD with the size of the card. */
+			uint32_t c_size = SD_SIMULATOR_NUM_BLOCKS / 1024 - 1;
+
+			sd_simulator_queue_byte(card, r1);
+			memset(data, 0, 16);
+			data[0] = 0x40;
+			data[1] = 0x0E;
+			data[3] = 0x32;
+			data[4] = 0x5B;
+			data[5] = 0x59;
+			data[7] = (c_size >> 16) & 0x3F;
+			data[8] = c_size >> 8;
+			data[9] = c_size;
+			data[10] = 0x7F;
+			data[11] = 0x80;
+			data[12] = 0x0A;
+			data[13] = 0x40;
+			data[15] = 0x01;
+			sd_simulator_queue_block(card, data, 16);
+			break;
+		}
+		case 10:
+			sd_simulator_queue_byte(card, r1);
+			memset(data, 0, 16);
+			data[0] = 0x03;
+			memcpy(data + 1, "SDSIM01", 7);
+			sd_simulator_queue_block(card, data, 16);
+			break;
+		case 13:
+			sd_simulator_queue_byte(card, r1);
+			sd_simulator_queue_byte(card, 0x00);
+			break;
+		case 17:
+			sd_simulator_queue_byte(card, r1);
+			sd_simulator_queue_block(card, card->blocks + (size_t) argument * 512,
+									 512);
+			break;
+		case 18:
+			sd_simulator_queue_byte(card, r1);
+			card->state = SD_SIMULATOR_STATE_READ_MULTIPLE;
+			card->block_address = argument;
+			break;
+		case 12:
+			/* The stuff byte, then R1 and busy. */
+			card->state = SD_SIMULATOR_STATE_COMMAND;
+			sd_simulator_queue_byte(card, 0xFF);
+			sd_simulator_queue_byte(card, 0x00);
+			card->busy_bytes = SD_SIMULATOR_BUSY_BYTES;
+			break;
+		case 24:
+		case 25:
+			sd_simulator_queue_byte(card, r1);
+			card->state = command == 24 ? SD_SIMULATOR_STATE_WRITE_TOKEN
+										: SD_SIMULATOR_STATE_MULTIPLE_TOKEN;
+			card->block_address = argument;
+			card->num_written_blocks = 0;
+			break;
+		case 32:
+			card->erase_start_block_address = argument;
+			sd_simulator_queue_byte(card, r1);
+			break;
+		case 33:
+			card->erase_end_block_address = argument;
+			sd_simulator_queue_byte(card, r1);
+			break;
+		case 38:
+		{
+			uint32_t block_address;
+
+			for (block_address = card->erase_start_block_address;
+				 block_address <= card->erase_end_block_address &&
+				 block_address < SD_SIMULATOR_NUM_BLOCKS;
+				 block_address++)
+			{
+				memset(card->blocks + (size_t) block_address * 512, 0, 512);
+			}
+
+			sd_simulator_queue_byte(card, r1);
+			card->busy_bytes = 4 * SD_SIMULATOR_BUSY_BYTES;
+			break;
+		}
+		case 16:
+		case 59:
+			sd_simulator_queue_byte(card, r1);
+			break;
+		default:
+			sd_simulator_queue_byte(card, r1 | 0x04);
+			break;
+	}
+}
+
+static uint8_t
+sd_simulator_transfer(
+	sd_simulator_card_t	*card,
+	uint8_t				b
+)
+{
+	uint8_t response = 0xFF;
+
+	if (card->queue_head != card->queue_tail)
+	{
+		response = card->queue[card->queue_head];
+		card->queue_head = (card->queue_head + 1) % SD_SIMULATOR_QUEUE_SIZE;
+	}
+	else if (card->busy_bytes > 0)
+	{
+		card->busy_bytes--;
+		response = 0x00;
+	}
+	else if (card->state == SD_SIMULATOR_STATE_READ_MULTIPLE)
+	{
+		/* The next block is sent until CMD12 stops the read. */
+		sd_simulator_queue_block(card, card->blocks +
+									   (size_t) card->block_address * 512,
+								 512);
+		card->block_address = (card->block_address + 1) %
+							  SD_SIMULATOR_NUM_BLOCKS;
+		response = card->queue[card->queue_head];
+		card->queue_head = (card->queue_head + 1) % SD_SIMULATOR_QUEUE_SIZE;
+	}
+
+	switch (card->state)
+	{
+		case SD_SIMULATOR_STATE_WRITE_TOKEN:
+		case SD_SIMULATOR_STATE_MULTIPLE_TOKEN:
+			if (card->busy_bytes > 0)
+			{
+				break;
+			}
+
+			if (card->state == SD_SIMULATOR_STATE_WRITE_TOKEN && b == 0xFE)
+			{
+				card->state = SD_SIMULATOR_STATE_WRITE_DATA;
+				card->data_length = 0;
+			}
+			else if (card->state == SD_SIMULATOR_STATE_MULTIPLE_TOKEN &&
+					 b == 0xFC)
+			{
+				card->state = SD_SIMULATOR_STATE_MULTIPLE_DATA;
+				card->data_length = 0;
+			}
+			else if (card->state == SD_SIMULATOR_STATE_MULTIPLE_TOKEN &&
+					 b == 0xFD)
+			{
+				/* The stop token. */
+				card->state = SD_SIMULATOR_STATE_COMMAND;
+				sd_simulator_queue_byte(card, 0xFF);
+				card->busy_bytes = SD_SIMULATOR_BUSY_BYTES;
+			}
+			else if ((b & 0xC0) == 0x40)
+			{
+				card->state = SD_SIMULATOR_STATE_COMMAND;
+				card->command[0] = b;
+				card->command_length = 1;
+			}
+			break;
+		case SD_SIMULATOR_STATE_WRITE_DATA:
+		case SD_SIMULATOR_STATE_MULTIPLE_DATA:
+			card->data[card->data_length++] = b;
+
+			if (card->data_length < sizeof(card->data))
+			{
+				break;
+			}
+
+			card->busy_bytes = SD_SIMULATOR_BUSY_BYTES;
+
+			/* A block past the end is rejected and ends the write. */
+			if (card->block_address >= SD_SIMULATOR_NUM_BLOCKS)
+			{
+				sd_simulator_queue_byte(card, 0x0D);
+				card->state = SD_SIMULATOR_STATE_COMMAND;
+				break;
+			}
+
+			memcpy(card->blocks + (size_t) card->block_address * 512,
+				   card->data, 512);
+			card->block_address++;
+			card->num_written_blocks++;
+			sd_simulator_queue_byte(card, 0x05);
+			card->state = card->state == SD_SIMULATOR_STATE_MULTIPLE_DATA
+						  ? SD_SIMULATOR_STATE_MULTIPLE_TOKEN
+						  : SD_SIMULATOR_STATE_COMMAND;
+			break;
+		default:
+			/* A command starts with 01 in its top bits. */
+			if (card->command_length == 0 && (b & 0xC0) != 0x40)
+			{
+				break;
+			}
+
+			card->command[card->command_length++] = b;
+
+			if (card->command_length == 6)
+			{
+				card->command_length = 0;
+				sd_simulator_do_command(card);
+			}
+			break;
+	}
+
+	return response;
+}
+
+static uint8_t
+sd_simulator_bus(
+	uint8_t b
+)
+{
+	uint8_t response = 0xFF;
+	uint8_t i;
+
+	num_bus_bytes++;
+
+	for (i = 0; i < SD_SIMULATOR_MAX_CARDS; i++)
+	{
+		if (cards[i].is_used && cards[i].is_selected)
+		{
+			response &= sd_simulator_transfer(&cards[i], b);
+		}
+	}
+
+	return response;
+}
@@ -21,9 +21,29 @@
 /******************************************************************************/
 
 #include "sd_spi.h"
+#include "sd_spi_erase_planner.h"
+#include "sd_spi_log.h"
+#include "sd_spi_mirror.h"
+#include "sd_spi_mount.h"
+#include "sd_spi_ring.h"
+#include "sd_spi_store.h"
+#include "sd_spi_stripe.h"
 #include "planck_unit/src/planckunit.h"
 
+#if defined(__cplusplus)
+#include "sd_spi.hpp"
+#endif
+
+#if defined(SD_SPI_THREAD_SAFE)
+#include <pthread.h>
+#endif
+
+#if defined(__cpp_impl_coroutine)
+#include "sd_spi_coro.hpp"
+#endif
+
 #define CHIP_SELECT_PIN 4
+#define SECOND_CHIP_SELECT_PIN 5
 uint8_t data[512];
 
 static void
@@ -66,6 +86,43 @@ test_sd_spi_initialization(
 	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_init(CHIP_SELECT_PIN));
 }
 
+void
+test_sd_spi_sd_status_and_scr(
+	planck_unit_test_t *tc
+)
+{
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_init(CHIP_SELECT_PIN));
+
+	sd_spi_card_t *current_card = sd_spi_current_card();
+
+	/* The registers are kept when the card is initialized. */
+	sd_spi_scr_t scr;
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read_scr_register(&scr));
+	PLANCK_UNIT_ASSERT_TRUE(tc, scr.sd_spec > 0);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, scr.sd_spec, current_card->scr.sd_spec);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, scr.cmd_support, current_card->scr.cmd_support);
+
+	sd_spi_sd_status_t sd_status;
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read_sd_status_register(&sd_status));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, sd_status.au_size, current_card->sd_status.au_size);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, sd_status.speed_class, current_card->sd_status.speed_class);
+
+	uint32_t au_blocks = sd_spi_au_blocks();
+	PLANCK_UNIT_ASSERT_TRUE(tc, au_blocks >= 32);
+
+	/* A write that pre-erases up to the end of the AU. */
+	populate_data_array_1();
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write_continuous_start(au_blocks - 2, SD_SPI_PRE_ERASE_AU));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write_continuous(data, 26, 0));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write_continuous_next());
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write_continuous(data, 26, 0));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write_continuous_stop());
+
+	uint8_t value;
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read(au_blocks - 1, &value, 1, 25));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 'z', value);
+}
+
 void
 test_sd_spi_single_write_and_read(
 	planck_unit_test_t *tc
@@ -109,6 +166,55 @@ test_sd_spi_single_block_write_and_read(
 	}
 }
 
+void
+test_sd_spi_status_check(
+	planck_unit_test_t *tc
+)
+{
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_init(CHIP_SELECT_PIN));
+
+	sd_spi_card_t *current_card = sd_spi_current_card();
+
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, SD_ERR_ILLEGAL_PARAMETER, sd_spi_set_status_check(3));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_set_status_check(SD_SPI_STATUS_CHECK_AT_SYNC));
+
+	/* A burst of writes reads the status once at the end. */
+	populate_data_array_1();
+
+	uint8_t i;
+	for (i = 0; i < 10; i++)
+	{
+		data[0] = i;
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write_block(300 + i, data));
+	}
+
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_sync());
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 10, current_card->num_status_checks_skipped);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, current_card->is_status_check_pending);
+
+	/* Only a rejected write reads the status. */
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_set_status_check(SD_SPI_STATUS_CHECK_ON_ERROR));
+	data[0] = 10;
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write_block(310, data));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_sync());
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 11, current_card->num_status_checks_skipped);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, current_card->is_status_check_pending);
+
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_set_status_check(SD_SPI_STATUS_CHECK_ALWAYS));
+	data[0] = 11;
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write_block(311, data));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_sync());
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 11, current_card->num_status_checks_skipped);
+
+	uint8_t buffer[2];
+	for (i = 0; i < 12; i++)
+	{
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read(300 + i, buffer, 2, 0));
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, i, buffer[0]);
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, data[1], buffer[1]);
+	}
+}
+
 void
 test_sd_spi_continuous_block_write(
 	planck_unit_test_t *tc
@@ -150,6 +256,94 @@ test_sd_spi_continuous_block_write(
 	PLANCK_UNIT_ASSERT_TRUE(tc, buffer[10] == 0x00);
 }
 
+void
+test_sd_spi_continuous_write_with_polling(
+	planck_unit_test_t *tc
+)
+{
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_init(CHIP_SELECT_PIN));
+	populate_data_array_1();
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write_continuous_start(200, 0));
+
+	/* Each block gets a different first byte so that blocks which are written
+	   out of order or twice are caught. */
+	uint8_t i;
+	for (i = 0; i < 10; i++)
+	{
+		data[0] = i;
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write_continuous(data, 512, 0));
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write_continuous_next());
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_poll());
+	}
+
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write_continuous_stop());
+
+	uint8_t buffer[2];
+
+	for (i = 0; i < 10; i++)
+	{
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read(200 + i, buffer, 2, 0));
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, i, buffer[0]);
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, data[1], buffer[1]);
+	}
+
+	/* Nothing is left to write once the continuous write is stopped. */
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_poll());
+}
+
+void
+test_sd_spi_continuous_write_recovery(
+	planck_unit_test_t *tc
+)
+{
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_init(CHIP_SELECT_PIN));
+
+	sd_spi_card_t *current_card = sd_spi_current_card();
+	uint32_t end_block_address = sd_spi_card_size();
+
+	/* The third block is past the end of the card, so the write fails. */
+	populate_data_array_1();
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write_continuous_start(end_block_address - 2, 0));
+
+	int8_t response = SD_ERR_OK;
+	uint8_t i;
+	for (i = 0; i < 3 && !response; i++)
+	{
+		data[0] = i;
+
+		if (!(response = sd_spi_write_continuous(data, 512, 0)))
+		{
+			response = sd_spi_write_continuous_next();
+		}
+	}
+
+	if (!response)
+	{
+		response = sd_spi_write_continuous_stop();
+	}
+
+	PLANCK_UNIT_ASSERT_TRUE(tc, response != SD_ERR_OK);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 2, current_card->num_well_written_blocks);
+
+	/* The write was already stopped. */
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, SD_ERR_READ_WRITE_CONTINUOUS, sd_spi_write_continuous_next());
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write_continuous_stop());
+
+	uint8_t buffer[2];
+	for (i = 0; i < 2; i++)
+	{
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read(end_block_address - 2 + i, buffer, 2, 0));
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, i, buffer[0]);
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, data[1], buffer[1]);
+	}
+
+	/* Resuming starts at the block that failed, which is still past the
+	   end. */
+	uint32_t block_address;
+	PLANCK_UNIT_ASSERT_TRUE(tc, sd_spi_write_continuous_resume(&block_address) != SD_ERR_OK);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, end_block_address, block_address);
+}
+
 void
 test_sd_spi_continuous_block_read(
 	planck_unit_test_t *tc
@@ -183,107 +377,1544 @@ test_sd_spi_continuous_block_read(
 	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read_continuous_stop());
 }
 
+/** Keeps track of the data seen by read_stream_callback(). */
+typedef struct read_stream_state {
+	uint32_t	num_bytes;
+	uint32_t	max_bytes;
+	uint8_t		is_in_order;
+	uint8_t		is_data_correct;
+} read_stream_state_t;
+
+uint8_t
+read_stream_callback(
+	void		*context,
+	uint32_t	block_address,
+	uint16_t	byte_offset,
+	uint8_t		*chunk,
+	uint16_t	number_of_bytes
+)
+{
+	read_stream_state_t *state = (read_stream_state_t *) context;
+
+	if ((block_address - 300) * 512 + byte_offset != state->num_bytes)
+	{
+		state->is_in_order = 0;
+	}
+
+	uint16_t i;
+	for (i = 0; i < number_of_bytes; i++)
+	{
+		if (chunk[i] != (uint8_t) (block_address + byte_offset + i))
+		{
+			state->is_data_correct = 0;
+		}
+	}
+
+	state->num_bytes += number_of_bytes;
+
+	return state->num_bytes >= state->max_bytes;
+}
+
 void
-test_sd_spi_multiple_reads_and_writes(
+test_sd_spi_read_stream(
 	planck_unit_test_t *tc
 )
 {
 	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_init(CHIP_SELECT_PIN));
 
-	populate_data_array_1();
-	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write(200, data, 512, 0));
-	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_flush());
+	uint32_t block_address;
+	uint16_t i;
 
-	populate_data_array_2();
-	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write(201, data, 512, 0));
-	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_flush());
+	for (block_address = 300; block_address < 304; block_address++)
+	{
+		for (i = 0; i < 512; i++)
+		{
+			data[i] = (uint8_t) (block_address + i);
+		}
 
-	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read_continuous_start(200));
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write_block(block_address, data));
+	}
 
-	uint8_t buffer[27];
+	read_stream_state_t state = { 0, 4 * 512, 1, 1 };
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read_stream(300, 4, read_stream_callback, &state));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 4 * 512, state.num_bytes);
+	PLANCK_UNIT_ASSERT_TRUE(tc, state.is_in_order);
+	PLANCK_UNIT_ASSERT_TRUE(tc, state.is_data_correct);
 
-	uint8_t i;
-	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read_continuous(buffer, 27, 2));
-	populate_data_array_1();
+	/* End the stream in the middle of the second block. The card must still
+	   be usable afterwards. */
+	read_stream_state_t early_state = { 0, 600, 1, 1 };
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read_stream(300, 4, read_stream_callback, &early_state));
+	PLANCK_UNIT_ASSERT_TRUE(tc, early_state.num_bytes >= 600);
+	PLANCK_UNIT_ASSERT_TRUE(tc, early_state.num_bytes < 1024);
+	PLANCK_UNIT_ASSERT_TRUE(tc, early_state.is_data_correct);
 
-	for (i = 0; i < 27; i++)
+	uint8_t buffer[1];
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read(303, buffer, 1, 5));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, (uint8_t) (303 + 5), buffer[0]);
+}
+
+/** Keeps track of the data handed out by write_stream_callback(). */
+typedef struct write_stream_state {
+	uint32_t	num_bytes;
+	uint32_t	max_bytes;
+} write_stream_state_t;
+
+uint16_t
+write_stream_callback(
+	void		*context,
+	uint32_t	block_address,
+	uint16_t	byte_offset,
+	uint8_t		*chunk,
+	uint16_t	max_bytes
+)
+{
+	write_stream_state_t *state = (write_stream_state_t *) context;
+
+	/* Hand out a few bytes at a time like a sensor would. */
+	uint16_t number_of_bytes = 7;
+
+	if (number_of_bytes > max_bytes)
 	{
-		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, data[i + 2], buffer[i]);
+		number_of_bytes = max_bytes;
 	}
 
-	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read_continuous_next());
-	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read_continuous(buffer, 27, 2));
-	populate_data_array_2();
+	if (number_of_bytes > state->max_bytes - state->num_bytes)
+	{
+		number_of_bytes = state->max_bytes - state->num_bytes;
+	}
 
-	for (i = 0; i < 27; i++)
+	uint16_t i;
+	for (i = 0; i < number_of_bytes; i++)
 	{
-		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, data[i + 2], buffer[i]);
+		chunk[i] = (uint8_t) (state->num_bytes + i);
 	}
 
-	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read_continuous_stop());
+	state->num_bytes += number_of_bytes;
 
-	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write_continuous_start(200, 100));
+	return number_of_bytes;
+}
 
-	for (i = 0; i < 10; i++)
+void
+test_sd_spi_write_stream(
+	planck_unit_test_t *tc
+)
+{
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_init(CHIP_SELECT_PIN));
+
+	uint16_t i;
+	for (i = 0; i < 512; i++)
 	{
-		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write_continuous(data, 512, 0));
-		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write_continuous_next());
+		data[i] = 0xAA;
 	}
 
-	/* Write only 10 bytes out to a block. The rest of the block should contain
-	   only 0's */
-	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write_continuous(data, 10, 0));
-	/* Don't need to call write flush since sd_spi_write_continuous_stop should
-	   handle it */
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write_block(400, data));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write_block(402, data));
+
+	/* Block 400 is in the buffer with its old bytes when the stream writes
+	   over it, so the read below has to go to the card again. */
+	uint8_t buffer[512];
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read(400, buffer, 1, 0));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0xAA, buffer[0]);
+
+	/* The producer runs out part way through the second block. */
+	write_stream_state_t state = { 0, 700 };
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write_stream(400, 4, write_stream_callback, &state));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 700, state.num_bytes);
+
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read(400, buffer, 512, 0));
+
+	for (i = 0; i < 512; i++)
+	{
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, (uint8_t) i, buffer[i]);
+	}
+
+	/* The final block is padded with 0's. */
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read(401, buffer, 512, 0));
+
+	for (i = 0; i < 512; i++)
+	{
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, i < 188 ? (uint8_t) (512 + i) : 0, buffer[i]);
+	}
+
+	/* Blocks after the end of the stream are left alone. */
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read(402, buffer, 1, 0));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0xAA, buffer[0]);
+}
+
+void
+test_sd_spi_write_stream_recovery(
+	planck_unit_test_t *tc
+)
+{
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_init(CHIP_SELECT_PIN));
+
+	sd_spi_card_t *current_card = sd_spi_current_card();
+	uint32_t end_block_address = sd_spi_card_size();
+
+	/* The third block is past the end of the card, so the stream fails. */
+	write_stream_state_t state = { 0, 4 * 512 };
+	PLANCK_UNIT_ASSERT_TRUE(tc, sd_spi_write_stream(end_block_address - 2, 4, write_stream_callback, &state) != SD_ERR_OK);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 2, current_card->num_well_written_blocks);
+
+	/* The write was stopped, so the card takes commands again. */
 	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write_continuous_stop());
 
-	for (i = 200; i < 210; i++)
+	uint8_t buffer[8];
+	uint8_t i;
+	for (i = 0; i < 2; i++)
 	{
-		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read(i, buffer, 27, 2));
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read(end_block_address - 2 + i, buffer, 8, 0));
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 7, buffer[7]);
+	}
+}
 
-		uint8_t j;
-		for (j = 0; j < 27; j++)
-		{
-			PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, data[j + 2], buffer[j]);
-		}
+void
+test_sd_spi_pread_and_pwrite(
+	planck_unit_test_t *tc
+)
+{
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_init(CHIP_SELECT_PIN));
+
+	uint16_t i;
+	for (i = 0; i < 512; i++)
+	{
+		data[i] = 0x55;
 	}
 
-	/* Test if rest of data in block is 0 */
-	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read(210, buffer, 11, 0));
-	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0x00, buffer[10]);
+	for (i = 500; i < 505; i++)
+	{
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write_block(i, data));
+	}
+
+	/* Starts part way into block 500, covers 501 to 503 and ends part way
+	   into block 504. */
+	uint8_t record[1700];
+	for (i = 0; i < sizeof(record); i++)
+	{
+		record[i] = (uint8_t) (i * 3);
+	}
+
+	uint64_t byte_address = 500 * 512 + 100;
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_pwrite(byte_address, record, sizeof(record)));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_flush());
+
+	/* The blocks in the middle can be read with the single block functions. */
+	uint8_t buffer[1702];
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read(502, buffer, 1, 0));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, record[2 * 512 - 100], buffer[0]);
+
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_pread(byte_address - 1, buffer, sizeof(buffer)));
+
+	/* The bytes around the record keep their old value. */
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0x55, buffer[0]);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0x55, buffer[sizeof(buffer) - 1]);
+
+	for (i = 0; i < sizeof(record); i++)
+	{
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, record[i], buffer[i + 1]);
+	}
 }
 
 void
-test_sd_spi_erase_blocks(
+test_sd_spi_pwrite_recovery(
 	planck_unit_test_t *tc
 )
 {
 	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_init(CHIP_SELECT_PIN));
-	populate_data_array_1();
-	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write_block(1, data));
-	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write_block(2, data));
 
-	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_erase_blocks(1, 2));
+	sd_spi_card_t *current_card = sd_spi_current_card();
+	uint32_t end_block_address = sd_spi_card_size();
 
-	uint8_t val;
-	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read(1, &val, 1, 2));
-	PLANCK_UNIT_ASSERT_TRUE(tc, val == 0x00 || val == 0xFF);
+	uint8_t blocks[4 * 512];
+	uint16_t i;
+	for (i = 0; i < sizeof(blocks); i++)
+	{
+		blocks[i] = (uint8_t) (i / 512 + 1);
+	}
+
+	/* The whole blocks are written directly, and the third one is past the
+	   end of the card, so the write fails. */
+	PLANCK_UNIT_ASSERT_TRUE(tc, sd_spi_pwrite((uint64_t) (end_block_address - 2) * 512, blocks, sizeof(blocks)) != SD_ERR_OK);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 2, current_card->num_well_written_blocks);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, end_block_address, current_card->continuous_block_address);
+
+	/* The write was stopped, so the card takes commands again. */
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write_continuous_stop());
+
+	uint8_t buffer[8];
+	for (i = 0; i < 2; i++)
+	{
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read(end_block_address - 2 + i, buffer, 8, 0));
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, i + 1, buffer[7]);
+	}
 }
 
-planck_unit_suite_t*
-tefs_getsuite(
-	void
+void
+test_sd_spi_page_size(
+	planck_unit_test_t *tc
 )
 {
-	planck_unit_suite_t *suite = planck_unit_new_suite();
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_init(CHIP_SELECT_PIN));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 512, sd_spi_page_size());
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, SD_ERR_ILLEGAL_PARAMETER, sd_spi_set_page_size(1000));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, SD_ERR_ILLEGAL_PARAMETER, sd_spi_set_page_size(SD_SPI_MAX_PAGE_SIZE + 512));
 
-	planck_unit_add_to_suite(suite, test_sd_spi_initialization);
-	planck_unit_add_to_suite(suite, test_sd_spi_single_write_and_read);
-	planck_unit_add_to_suite(suite, test_sd_spi_single_block_write_and_read);
-	planck_unit_add_to_suite(suite, test_sd_spi_continuous_block_write);
-	planck_unit_add_to_suite(suite, test_sd_spi_continuous_block_read);
-	planck_unit_add_to_suite(suite, test_sd_spi_multiple_reads_and_writes);
-	planck_unit_add_to_suite(suite, test_sd_spi_erase_blocks);
+#if SD_SPI_MAX_PAGE_SIZE >= 1024
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_set_page_size(1024));
+
+	/* Page 350 is made up of blocks 700 and 701. */
+	uint8_t page[1024];
+	uint16_t i;
+	for (i = 0; i < sizeof(page); i++)
+	{
+		page[i] = (uint8_t) (i / 4);
+	}
+
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write_block(350, page));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write(350, "page", 4, 600));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_flush());
+
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write_continuous_start(351, 2));
+	for (i = 0; i < 2; i++)
+	{
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write_continuous(page, 1024, 0));
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write_continuous_next());
+	}
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write_continuous_stop());
+
+	/* Read the pages back as 512 byte blocks. */
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_set_page_size(512));
+
+	uint8_t buffer[4];
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read(701, buffer, 4, 600 - 512));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, memcmp(buffer, "page", 4));
+
+	uint32_t block_address;
+	for (block_address = 700; block_address < 706; block_address++)
+	{
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read(block_address, buffer, 1, 4));
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, page[(block_address % 2) * 512 + 4], buffer[0]);
+	}
+
+	/* The same data is read back a page at a time. */
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_set_page_size(1024));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read_continuous_start(351));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read_continuous(buffer, 1, 1000));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, page[1000], buffer[0]);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read_continuous_stop());
+#endif
+
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_set_page_size(512));
+}
+
+void
+test_sd_spi_partial_writes(
+	planck_unit_test_t *tc
+)
+{
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_init(CHIP_SELECT_PIN));
+
+	uint16_t i;
+	for (i = 0; i < 512; i++)
+	{
+		data[i] = 0xAA;
+	}
+
+	uint32_t block_address;
+	for (block_address = 600; block_address < 604; block_address++)
+	{
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write_block(block_address, data));
+	}
+
+	uint8_t record[256];
+	for (i = 0; i < sizeof(record); i++)
+	{
+		record[i] = (uint8_t) i;
+	}
+
+	/* A fresh block starts out with 0's. */
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write_begin_fresh(600));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write(600, record, 10, 10));
+
+	/* Partial writes that cover the whole block. */
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write(601, record, 256, 256));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write(601, record, 256, 0));
+
+	/* Partial writes with a gap between them. */
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write(602, record, 10, 0));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write(602, record, 10, 20));
+
+	/* A partial write that is read back before it is flushed. */
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write(603, record, 10, 100));
+
+	uint8_t buffer[512];
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read(603, buffer, 512, 0));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0xAA, buffer[99]);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 5, buffer[105]);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0xAA, buffer[110]);
+
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read(600, buffer, 512, 0));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, buffer[0]);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 5, buffer[15]);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, buffer[511]);
+
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read(601, buffer, 512, 0));
+	for (i = 0; i < 512; i++)
+	{
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, record[i % 256], buffer[i]);
+	}
+
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read(602, buffer, 512, 0));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 9, buffer[9]);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0xAA, buffer[15]);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 5, buffer[25]);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0xAA, buffer[30]);
+}
+
+void
+test_sd_spi_flush_avoidance(
+	planck_unit_test_t *tc
+)
+{
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_init(CHIP_SELECT_PIN));
+
+	sd_spi_card_t *current_card = sd_spi_current_card();
+
+	populate_data_array_1();
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write_block(800, data));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write_block(801, data));
+
+	/* Writing the bytes that are already in the block does not change it. */
+	uint8_t buffer[512];
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read(800, buffer, 16, 0));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write(800, buffer, 16, 0));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read(801, buffer, 16, 0));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 1, current_card->num_flushes_avoided);
+
+	/* A write that changes the block is still flushed. */
+	uint8_t value = (uint8_t) (data[0] + 1);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write(801, &value, 1, 0));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_flush());
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 1, current_card->num_flushes_avoided);
+
+#if SD_SPI_MAX_PAGE_SIZE >= 1024
+	/* Only the block of the page that changed is written. */
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_set_page_size(1024));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read(400, buffer, 1, 0));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write(400, &value, 1, 600));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_flush());
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 1, current_card->num_blocks_not_written);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_set_page_size(512));
+#endif
+
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read(800, buffer, 512, 0));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, data[0], buffer[0]);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, data[511], buffer[511]);
+
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read(801, buffer, 512, 0));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, value, buffer[0]);
+#if SD_SPI_MAX_PAGE_SIZE >= 1024
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, value, buffer[88]);
+#endif
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, data[1], buffer[1]);
+}
+
+void
+test_sd_spi_multiple_reads_and_writes(
+	planck_unit_test_t *tc
+)
+{
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_init(CHIP_SELECT_PIN));
+
+	populate_data_array_1();
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write(200, data, 512, 0));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_flush());
+
+	populate_data_array_2();
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write(201, data, 512, 0));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_flush());
+
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read_continuous_start(200));
+
+	uint8_t buffer[27];
+
+	uint8_t i;
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read_continuous(buffer, 27, 2));
+	populate_data_array_1();
+
+	for (i = 0; i < 27; i++)
+	{
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, data[i + 2], buffer[i]);
+	}
+
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read_continuous_next());
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read_continuous(buffer, 27, 2));
+	populate_data_array_2();
+
+	for (i = 0; i < 27; i++)
+	{
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, data[i + 2], buffer[i]);
+	}
+
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read_continuous_stop());
+
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write_continuous_start(200, 100));
+
+	for (i = 0; i < 10; i++)
+	{
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write_continuous(data, 512, 0));
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write_continuous_next());
+	}
+
+	/* Write only 10 bytes out to a block. The rest of the block should contain
+	   only 0's */
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write_continuous(data, 10, 0));
+	/* Don't need to call write flush since sd_spi_write_continuous_stop should
+	   handle it */
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write_continuous_stop());
+
+	for (i = 200; i < 210; i++)
+	{
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read(i, buffer, 27, 2));
+
+		uint8_t j;
+		for (j = 0; j < 27; j++)
+		{
+			PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, data[j + 2], buffer[j]);
+		}
+	}
+
+	/* Test if rest of data in block is 0 */
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read(210, buffer, 11, 0));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0x00, buffer[10]);
+}
+
+void
+test_sd_spi_erase_blocks(
+	planck_unit_test_t *tc
+)
+{
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_init(CHIP_SELECT_PIN));
+	populate_data_array_1();
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write_block(1, data));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write_block(2, data));
+
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_erase_blocks(1, 2));
+
+	uint8_t val;
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read(1, &val, 1, 2));
+	PLANCK_UNIT_ASSERT_TRUE(tc, val == 0x00 || val == 0xFF);
+	PLANCK_UNIT_ASSERT_TRUE(tc, sd_spi_current_card()->is_erased_value_known);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, sd_spi_current_card()->erased_value, val);
+}
+
+void
+test_sd_spi_erased_block_map(
+	planck_unit_test_t *tc
+)
+{
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_init(CHIP_SELECT_PIN));
+
+	sd_spi_card_t *current_card = sd_spi_current_card();
+
+	populate_data_array_1();
+
+	uint32_t block_address;
+	for (block_address = 900; block_address < 904; block_address++)
+	{
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write_block(block_address, data));
+	}
+
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_erase_blocks(900, 903));
+
+	uint8_t erased_value = current_card->erased_value;
+	uint8_t buffer[512];
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read(901, buffer, 512, 0));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, erased_value, buffer[0]);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, erased_value, buffer[511]);
+
+	/* Written blocks are no longer erased. */
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write(901, data, 26, 0));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_flush());
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read(900, buffer, 512, 0));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read(901, buffer, 512, 0));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 'a', buffer[0]);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, erased_value, buffer[26]);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read(902, buffer, 512, 0));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, erased_value, buffer[0]);
+
+#if SD_SPI_MAX_ERASED_EXTENTS > 0
+	/* Every read except the one of block 901 after it was written was
+	   answered from memory. */
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 3, current_card->num_erased_blocks_read);
+#endif
+}
+
+void
+test_sd_spi_erase_planner(
+	planck_unit_test_t *tc
+)
+{
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_init(CHIP_SELECT_PIN));
+
+	sd_spi_erase_geometry_t geometry;
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read_erase_geometry(&geometry));
+	PLANCK_UNIT_ASSERT_TRUE(tc, geometry.unit_blocks > 0);
+
+	/* A range which covers one unit and 3 blocks on either side. */
+	uint32_t start_block_address = geometry.unit_blocks - 3;
+	uint32_t end_block_address = 2 * geometry.unit_blocks + 2;
+
+	sd_spi_erase_plan_t plan;
+	sd_spi_plan_erase(&geometry, start_block_address, end_block_address, &plan);
+	PLANCK_UNIT_ASSERT_TRUE(tc, plan.predicted_us <= plan.naive_predicted_us);
+
+	if (plan.aligned.num_blocks > 0)
+	{
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, geometry.unit_blocks, plan.aligned.start_block_address);
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, geometry.unit_blocks, plan.aligned.num_blocks);
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 3, plan.fragments[0].num_blocks);
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 3, plan.fragments[1].num_blocks);
+	}
+
+	populate_data_array_1();
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write_block(start_block_address - 1, data));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write_block(start_block_address, data));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write_block(geometry.unit_blocks, data));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write_block(end_block_address, data));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write_block(end_block_address + 1, data));
+
+	/* The first block of the range is in the buffer with its old bytes when
+	   its fragment is filled in. */
+	uint8_t buffer[512];
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read(start_block_address, buffer, 1, 0));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 'a', buffer[0]);
+
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_erase_planned(&geometry, start_block_address, end_block_address, NULL));
+
+	uint8_t erased_value = sd_spi_current_card()->erased_value;
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read(start_block_address, buffer, 512, 0));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, erased_value, buffer[0]);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, erased_value, buffer[511]);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read(geometry.unit_blocks, buffer, 512, 0));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, erased_value, buffer[0]);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read(end_block_address, buffer, 512, 0));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, erased_value, buffer[511]);
+
+	/* The blocks around the range are kept. */
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read(start_block_address - 1, buffer, 26, 0));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 'a', buffer[0]);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read(end_block_address + 1, buffer, 26, 0));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 'z', buffer[25]);
+}
+
+void
+test_sd_spi_erase_queue(
+	planck_unit_test_t *tc
+)
+{
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_init(CHIP_SELECT_PIN));
+
+	sd_spi_card_t *current_card = sd_spi_current_card();
+
+	populate_data_array_1();
+
+	uint32_t block_address;
+	for (block_address = 1000; block_address < 1004; block_address++)
+	{
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write_block(block_address, data));
+	}
+
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_queue_erase(1000, 1001));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_queue_erase(1002, 1003));
+
+#if SD_SPI_MAX_QUEUED_ERASES > 0
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 2, sd_spi_pending_erases());
+
+	/* The first erase is started and a read of another block waits for it
+	   to finish. */
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_poll());
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write_block(1004, data));
+	uint8_t value;
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read(1004, &value, 1, 25));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 'z', value);
+#else
+	uint8_t value;
+#endif
+
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_finish_erases());
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_pending_erases());
+
+	uint8_t erased_value = current_card->erased_value;
+	for (block_address = 1000; block_address < 1004; block_address++)
+	{
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read(block_address, &value, 1, 511));
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, erased_value, value);
+	}
+
+	/* A continuous write to the erased blocks does not pre-erase them. */
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write_continuous_start(1000, 4));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write_continuous(data, 26, 0));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write_continuous_stop());
+#if SD_SPI_MAX_ERASED_EXTENTS > 0
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 1, current_card->num_pre_erases_skipped);
+#endif
+
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read(1000, &value, 1, 0));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 'a', value);
+}
+
+void
+test_sd_spi_stripe_write_and_read(
+	planck_unit_test_t *tc
+)
+{
+	sd_spi_card_t cards[2];
+	sd_spi_stripe_t stripe;
+	uint8_t pins[2] = {CHIP_SELECT_PIN, SECOND_CHIP_SELECT_PIN};
+
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_stripe_init(&stripe, cards, pins, 2, 2));
+	populate_data_array_1();
+
+	uint8_t i;
+	for (i = 0; i < 8; i++)
+	{
+		data[0] = i;
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_stripe_write_blocks(&stripe, 300 + i, data, 1));
+	}
+
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_stripe_write_continuous_stop(&stripe));
+
+	/* Chunks of 2 blocks alternate between the cards, so logical block 302
+	   is the first block of the second chunk on the second card. */
+	uint8_t buffer[27];
+	sd_spi_use_card(&cards[1]);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read(150, buffer, 27, 0));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 2, buffer[0]);
+
+	static uint8_t blocks[6 * 512];
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_stripe_read_blocks(&stripe, 301, blocks, 6));
+
+	for (i = 0; i < 6; i++)
+	{
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, i + 1, blocks[i * 512]);
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, data[26], blocks[i * 512 + 26]);
+	}
+
+	/* A range whose end goes past 2^32 blocks is not taken as a small one. */
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, SD_ERR_ARGUMENT_OUT_OF_RANGE, sd_spi_stripe_read_blocks(&stripe, 301, blocks, 0xFFFFFFFF));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, SD_ERR_ARGUMENT_OUT_OF_RANGE, sd_spi_stripe_write_blocks(&stripe, 301, blocks, 0xFFFFFFFF));
+
+	sd_spi_use_card(NULL);
+}
+
+void
+test_sd_spi_mirror_verify_and_resync(
+	planck_unit_test_t *tc
+)
+{
+	sd_spi_card_t cards[2];
+	sd_spi_mirror_t mirror;
+	uint8_t pins[2] = {CHIP_SELECT_PIN, SECOND_CHIP_SELECT_PIN};
+
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_mirror_init(&mirror, cards, pins, 2));
+	populate_data_array_1();
+
+	uint8_t i;
+	for (i = 0; i < 4; i++)
+	{
+		data[0] = i;
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_mirror_write_blocks(&mirror, 400 + i, data, 1));
+	}
+
+	static uint8_t blocks[4 * 512];
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_mirror_read_blocks(&mirror, 400, blocks, 4));
+
+	for (i = 0; i < 4; i++)
+	{
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, i, blocks[i * 512]);
+	}
+
+	/* A count that would wrap past the end of the addresses is out of
+	   range. */
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, SD_ERR_ARGUMENT_OUT_OF_RANGE, sd_spi_mirror_write_blocks(&mirror, 400, blocks, 0xFFFFFFFF));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, SD_ERR_ARGUMENT_OUT_OF_RANGE, sd_spi_mirror_read_blocks(&mirror, 400, blocks, 0xFFFFFFFF));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, SD_ERR_ARGUMENT_OUT_OF_RANGE, sd_spi_mirror_verify(&mirror, 400, 0xFFFFFFFF));
+
+	/* Change a block behind the back of the layer on the second card. */
+	populate_data_array_2();
+	sd_spi_use_card(&cards[1]);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write_block(402, data));
+
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_mirror_verify(&mirror, 400, 4));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_mirror_dirty_blocks(&mirror, 0));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 1, sd_spi_mirror_dirty_blocks(&mirror, 1));
+
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_mirror_resync(&mirror, 10));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_mirror_dirty_blocks(&mirror, 1));
+
+	uint8_t buffer[27];
+	sd_spi_use_card(&cards[1]);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read(402, buffer, 27, 0));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 2, buffer[0]);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 'b', buffer[1]);
+
+	sd_spi_use_card(NULL);
+}
+
+void
+test_sd_spi_log(
+	planck_unit_test_t *tc
+)
+{
+	static sd_spi_card_t log_card;
+	static sd_spi_log_t log;
+	uint8_t record[37];
+	uint16_t num_fit = SD_SPI_LOG_RING_SIZE / sizeof(record);
+	uint16_t i;
+	uint16_t j;
+
+	sd_spi_use_card(&log_card);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_init(CHIP_SELECT_PIN));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_log_start(&log, &log_card, 1300, 8));
+
+	/* Without a drain, the ring takes whole records until the next one does
+	   not fit. Record num_fit is dropped. */
+	for (i = 0; i < 2 * num_fit; i++)
+	{
+		for (j = 0; j < sizeof(record); j++)
+		{
+			record[j] = (uint8_t) (i + j);
+		}
+
+		if (i == num_fit + 1)
+		{
+			PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, num_fit * sizeof(record), log.high_water);
+			PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 1, log.num_overflows);
+			PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_log_drain(&log));
+			PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_log_pending(&log));
+		}
+
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, i != num_fit, sd_spi_log_push(&log, record, sizeof(record)));
+
+		if (i > num_fit)
+		{
+			PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_log_drain(&log));
+		}
+	}
+
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_log_stop(&log));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, sizeof(record), log.num_bytes_dropped);
+
+	uint32_t num_bytes = (uint32_t) (2 * num_fit - 1) * sizeof(record);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, num_bytes, log.num_bytes_logged);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 1300 + (num_bytes + 511) / 512, log.next_block_address);
+
+	/* The records are back to back on the card and the last page is padded
+	   with zeros. */
+	uint32_t position = 0;
+	for (i = 0; i < 2 * num_fit; i++)
+	{
+		if (i == num_fit)
+		{
+			continue;
+		}
+
+		for (j = 0; j < sizeof(record); j++, position++)
+		{
+			if (position % 512 == 0)
+			{
+				PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_read(1300 + position / 512, data, 512, 0));
+			}
+
+			PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, (uint8_t) (i + j), data[position % 512]);
+		}
+	}
+
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, data[511]);
+
+	sd_spi_use_card(NULL);
+}
+
+void
+test_sd_spi_store(
+	planck_unit_test_t *tc
+)
+{
+	static sd_spi_card_t store_card;
+	static sd_spi_store_t store;
+	sd_spi_store_cursor_t cursor;
+	uint8_t record[40];
+	uint32_t key;
+	uint16_t length;
+	uint16_t i;
+	uint16_t j;
+
+	sd_spi_use_card(&store_card);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_init(CHIP_SELECT_PIN));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_store_format(&store, &store_card, 1400, 200));
+
+	/* Ten records fit in a page, so the store ends up with a few groups that
+	   have index pages and one that does not. */
+	uint16_t num_records = (2 * SD_SPI_STORE_INDEX_INTERVAL + 16) * 10;
+
+	for (i = 0; i < num_records; i++)
+	{
+		for (j = 0; j < sizeof(record); j++)
+		{
+			record[j] = (uint8_t) (i + j);
+		}
+
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_store_append(&store, i * 3, record, sizeof(record)));
+	}
+
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, SD_ERR_ARGUMENT_OUT_OF_RANGE, sd_spi_store_append(&store, 0, record, sizeof(record)));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_store_flush(&store));
+
+	uint16_t num_pages = num_records / 10;
+	num_pages += num_pages / SD_SPI_STORE_INDEX_INTERVAL;
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 1400 + num_pages, store.next_block_address);
+
+	/* Keys between records find the next record. */
+	uint32_t targets[5] = {0, 7, num_records, 3 * (uint32_t) (num_records / 2) + 2,
+						   3 * (uint32_t) (num_records - 1)};
+
+	for (i = 0; i < 5; i++)
+	{
+		uint32_t expected = (targets[i] + 2) / 3;
+
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_store_seek(&store, &cursor, targets[i]));
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_store_read_next(&store, &cursor, &key, record, sizeof(record), &length));
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, expected * 3, key);
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, sizeof(record), length);
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, (uint8_t) (expected + 39), record[39]);
+	}
+
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, SD_ERR_STORE_END, sd_spi_store_read_next(&store, &cursor, &key, record, sizeof(record), &length));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_store_seek(&store, &cursor, 3 * num_records));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, SD_ERR_STORE_END, sd_spi_store_read_next(&store, &cursor, &key, record, sizeof(record), &length));
+
+	/* A record that is cut short still moves the cursor to the next one. */
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_store_seek(&store, &cursor, 9));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_store_read_next(&store, &cursor, &key, record, 4, &length));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_store_read_next(&store, &cursor, &key, record, sizeof(record), &length));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 12, key);
+
+	/* The cursor reads the card of the store when another card is used
+	   between the calls. The last key is in the group that is searched in
+	   memory. */
+	static sd_spi_card_t other_card;
+	sd_spi_use_card(&other_card);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_init(SECOND_CHIP_SELECT_PIN));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_store_seek(&store, &cursor, 3 * (uint32_t) (num_records - 2)));
+	sd_spi_use_card(&other_card);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_store_read_next(&store, &cursor, &key, record, sizeof(record), &length));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 3 * (uint32_t) (num_records - 2), key);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, (uint8_t) (num_records - 2 + 39), record[39]);
+	sd_spi_use_card(&other_card);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_store_read_next(&store, &cursor, &key, record, sizeof(record), &length));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 3 * (uint32_t) (num_records - 1), key);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, (uint8_t) (num_records - 1 + 39), record[39]);
+	sd_spi_use_card(&store_card);
+
+	/* A changed byte in the second data page is caught by its CRC. */
+	uint8_t byte = 0x55;
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_write(1401 + (SD_SPI_STORE_INDEX_INTERVAL == 1), &byte, 1, 100));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_flush());
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_store_seek(&store, &cursor, 0));
+
+	for (i = 0; i < 10; i++)
+	{
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_store_read_next(&store, &cursor, &key, record, sizeof(record), &length));
+	}
+
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, SD_ERR_STORE_CORRUPT, sd_spi_store_read_next(&store, &cursor, &key, record, sizeof(record), &length));
+
+	sd_spi_use_card(NULL);
+}
+
+/* The sequence number of each page of a made up log, or 0 for an erased
+   page. */
+static uint32_t mount_sequences[100];
+
+static int8_t
+mount_sequence_callback(
+	void		*context,
+	uint32_t	block_address,
+	uint32_t	*sequence
+)
+{
+	(void) context;
+
+	if (mount_sequences[block_address] == 0)
+	{
+		return SD_ERR_STORE_CORRUPT;
+	}
+
+	*sequence = mount_sequences[block_address];
+
+	return SD_ERR_OK;
+}
+
+void
+test_sd_spi_mount(
+	planck_unit_test_t *tc
+)
+{
+	sd_spi_mount_t mount;
+	uint32_t i;
+
+	/* A circular log that wrapped, with erased pages in front of the head. */
+	for (i = 0; i < 100; i++)
+	{
+		mount_sequences[i] = i < 37 ? 1000 + i : (i < 45 ? 0 : 900 + i);
+	}
+
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_mount_find(0, 100, 8, mount_sequence_callback, NULL, &mount));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 37, mount.head_block_address);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 45, mount.tail_block_address);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 1036, mount.newest_sequence);
+	PLANCK_UNIT_ASSERT_TRUE(tc, mount.num_reads <= 16);
+
+	/* The erased pages go past the end of the range to the start. */
+	for (i = 0; i < 100; i++)
+	{
+		mount_sequences[i] = i < 3 || i >= 95 ? 0 : 500 + i;
+	}
+
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_mount_find(0, 100, 8, mount_sequence_callback, NULL, &mount));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 95, mount.head_block_address);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 3, mount.tail_block_address);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 594, mount.newest_sequence);
+
+	memset(mount_sequences, 0, sizeof(mount_sequences));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_mount_find(0, 100, 8, mount_sequence_callback, NULL, &mount));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, mount.newest_sequence);
+
+	/* A store picks up where it left off after it is mounted again. */
+	static sd_spi_card_t store_card;
+	static sd_spi_store_t store;
+	static sd_spi_store_t mounted;
+	sd_spi_store_cursor_t cursor;
+	uint8_t record[40] = {0};
+	uint32_t key;
+	uint16_t length;
+
+	sd_spi_use_card(&store_card);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_init(CHIP_SELECT_PIN));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_store_format(&store, &store_card, 1600, 300));
+
+	for (i = 0; i < 500; i++)
+	{
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_store_append(&store, i * 3, record, sizeof(record)));
+	}
+
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_store_flush(&store));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_store_mount(&mounted, &store_card, 1600, 300));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, store.next_block_address, mounted.next_block_address);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, store.next_sequence, mounted.next_sequence);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, store.last_key, mounted.last_key);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, store.num_index_keys, mounted.num_index_keys);
+
+	for (i = 0; i < store.num_index_keys; i++)
+	{
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, store.index_keys[i], mounted.index_keys[i]);
+	}
+
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, SD_ERR_ARGUMENT_OUT_OF_RANGE, sd_spi_store_append(&mounted, 0, record, sizeof(record)));
+
+	for (i = 500; i < 520; i++)
+	{
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_store_append(&mounted, i * 3, record, sizeof(record)));
+	}
+
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_store_seek(&mounted, &cursor, 3 * 495));
+
+	for (i = 495; i < 520; i++)
+	{
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_store_read_next(&mounted, &cursor, &key, record, sizeof(record), &length));
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, i * 3, key);
+	}
+
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, SD_ERR_STORE_END, sd_spi_store_read_next(&mounted, &cursor, &key, record, sizeof(record), &length));
+
+	sd_spi_use_card(NULL);
+}
+
+/* The pages of the ring in the test, which must be more than twice
+   SD_SPI_RING_SEGMENT_BLOCKS. */
+#define RING_NUM_BLOCKS (2 * SD_SPI_RING_SEGMENT_BLOCKS + 72)
+
+/**
+@brief		Checks that the pages of a ring from its tail to its head hold the
+			bytes of the stream that was written to it.
+*/
+static void
+check_ring_pages(
+	planck_unit_test_t	*tc,
+	sd_spi_ring_t		*ring
+)
+{
+	static uint8_t page[512];
+	uint16_t page_bytes = 512 - sizeof(sd_spi_store_header_t);
+	uint16_t length;
+	uint32_t sequence;
+	uint16_t i;
+
+	for (sequence = ring->tail_sequence; sequence < ring->next_sequence; sequence++)
+	{
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_ring_read(ring, sequence, page, &length));
+
+		for (i = 0; i < length; i++)
+		{
+			PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, ((sequence - 1) * page_bytes + i) % 251, page[i]);
+		}
+	}
+}
+
+void
+test_sd_spi_ring(
+	planck_unit_test_t *tc
+)
+{
+	static sd_spi_card_t ring_card;
+	static sd_spi_ring_t ring;
+	static sd_spi_ring_t mounted;
+	static uint8_t page[512];
+	uint8_t chunk[100];
+	uint16_t page_bytes = 512 - sizeof(sd_spi_store_header_t);
+	uint32_t total = (uint32_t) page_bytes * (RING_NUM_BLOCKS * 3 + 50) + 60;
+	uint32_t offset = 0;
+	uint16_t length;
+	uint32_t i;
+
+	sd_spi_use_card(&ring_card);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_init(CHIP_SELECT_PIN));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, SD_ERR_ARGUMENT_OUT_OF_RANGE, sd_spi_ring_format(&ring, &ring_card, 2000, 2 * SD_SPI_RING_SEGMENT_BLOCKS));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_ring_format(&ring, &ring_card, 2000, RING_NUM_BLOCKS));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, SD_ERR_STORE_END, sd_spi_ring_read(&ring, 1, page, &length));
+
+	/* The stream goes around the ring three times and ends in the middle of a
+	   page. */
+	while (offset < total)
+	{
+		uint32_t number_of_bytes = total - offset < sizeof(chunk) ? total - offset : sizeof(chunk);
+
+		for (i = 0; i < number_of_bytes; i++)
+		{
+			chunk[i] = (uint8_t) ((offset + i) % 251);
+		}
+
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_ring_write(&ring, chunk, number_of_bytes));
+		offset += number_of_bytes;
+	}
+
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 3, ring.num_wraps);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_ring_flush(&ring));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, RING_NUM_BLOCKS * 3 + 52, ring.next_sequence);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, ring.next_sequence + SD_SPI_RING_SEGMENT_BLOCKS - RING_NUM_BLOCKS, ring.tail_sequence);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, SD_ERR_ARGUMENT_OUT_OF_RANGE, sd_spi_ring_read(&ring, ring.tail_sequence - 1, page, &length));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, SD_ERR_STORE_END, sd_spi_ring_read(&ring, ring.next_sequence, page, &length));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_ring_read(&ring, ring.next_sequence - 1, page, &length));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 60, length);
+	check_ring_pages(tc, &ring);
+
+	/* The erase of the segment in front of the head goes past the end of the
+	   range, and the mount has to find the ring around it. */
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_finish_erases());
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_ring_mount(&mounted, &ring_card, 2000, RING_NUM_BLOCKS));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, ring.next_sequence, mounted.next_sequence);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, ring.tail_sequence, mounted.tail_sequence);
+
+	/* Writing on from the mounted head goes around the ring once more. */
+	offset = (mounted.next_sequence - 1) * (uint32_t) page_bytes;
+	total = offset + (uint32_t) page_bytes * RING_NUM_BLOCKS;
+
+	while (offset < total)
+	{
+		for (i = 0; i < page_bytes; i++)
+		{
+			page[i] = (uint8_t) ((offset + i) % 251);
+		}
+
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_ring_write(&mounted, page, page_bytes));
+		offset += page_bytes;
+	}
+
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 1, mounted.num_wraps);
+	check_ring_pages(tc, &mounted);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_ring_mount(&ring, &ring_card, 2000, RING_NUM_BLOCKS));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, mounted.next_sequence, ring.next_sequence);
+
+	sd_spi_use_card(NULL);
+}
+
+/** What the query callback of the test saw. */
+typedef struct query_result {
+	/** The number of records. */
+	uint32_t	num_records;
+	/** The key that the next record should have. */
+	uint32_t	next_key;
+	/** The number of records that did not hold what they should. */
+	uint32_t	num_errors;
+	/** The number of records after which the query is stopped. */
+	uint32_t	limit;
+} query_result_t;
+
+static int8_t
+query_callback(
+	void		*context,
+	uint32_t	key,
+	const void	*data,
+	uint16_t	number_of_bytes
+)
+{
+	query_result_t *result = (query_result_t *) context;
+	uint32_t value;
+
+	memcpy(&value, data, 4);
+
+	if (key != result->next_key || value != key / 2 || number_of_bytes != 40)
+	{
+		result->num_errors++;
+	}
+
+	result->next_key = key + 2;
+
+	return ++result->num_records == result->limit ? SD_ERR_STORE_END : SD_ERR_OK;
+}
+
+void
+test_sd_spi_store_query(
+	planck_unit_test_t *tc
+)
+{
+	static sd_spi_card_t store_card;
+	static sd_spi_store_t store;
+	static sd_spi_store_t mounted;
+	uint8_t record[40] = {0};
+	uint8_t buffer[40];
+	query_result_t result;
+	uint32_t i;
+
+	sd_spi_use_card(&store_card);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_init(CHIP_SELECT_PIN));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_store_format(&store, &store_card, 2400, 450));
+
+	/* Ten records fit in a page, so there are 200 data pages. */
+	for (i = 0; i < 2000; i++)
+	{
+		memcpy(record, &i, 4);
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_store_append(&store, i * 2, record, sizeof(record)));
+	}
+
+	PLANCK_UNIT_ASSERT_TRUE(tc, store.num_summary_keys > 0);
+	PLANCK_UNIT_ASSERT_TRUE(tc, store.num_summary_keys <= SD_SPI_STORE_SUMMARY_SIZE);
+
+	/* The records that are still in memory are queried as well. */
+	memset(&result, 0, sizeof(result));
+	result.next_key = 1002;
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_store_query(&store, 1001, 3998, buffer, sizeof(buffer), query_callback, &result));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 1499, result.num_records);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, result.num_errors);
+
+	memset(&result, 0, sizeof(result));
+	result.next_key = 10;
+	result.limit = 5;
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_store_query(&store, 10, 3000, buffer, sizeof(buffer), query_callback, &result));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 5, result.num_records);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, result.num_errors);
+
+	memset(&result, 0, sizeof(result));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_store_query(&store, 5000, 6000, buffer, sizeof(buffer), query_callback, &result));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, result.num_records);
+
+	/* The summary is read back from the index pages when the store is
+	   mounted. */
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_store_mount(&mounted, &store_card, 2400, 450));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, store.summary_stride, mounted.summary_stride);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, store.num_summary_keys, mounted.num_summary_keys);
+
+	for (i = 0; i < store.num_summary_keys; i++)
+	{
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, store.summary_keys[i], mounted.summary_keys[i]);
+	}
+
+	memset(&result, 0, sizeof(result));
+	result.next_key = 0;
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_store_query(&mounted, 0, 0xFFFFFFFF, buffer, sizeof(buffer), query_callback, &result));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 2000, result.num_records);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, result.num_errors);
+
+	/* The query reads the card of the store even when another card is in
+	   use. The keys are in the group that is searched in memory, so nothing
+	   else selects the card. */
+	static sd_spi_card_t other_card;
+	sd_spi_use_card(&other_card);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_init(SECOND_CHIP_SELECT_PIN));
+
+	memset(&result, 0, sizeof(result));
+	result.next_key = 3960;
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_store_query(&mounted, 3960, 3998, buffer, sizeof(buffer), query_callback, &result));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 20, result.num_records);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, result.num_errors);
+	PLANCK_UNIT_ASSERT_TRUE(tc, sd_spi_current_card() == &store_card);
+
+	sd_spi_use_card(NULL);
+}
+
+#if defined(SD_SPI_THREAD_SAFE)
+#define THIRD_CHIP_SELECT_PIN 6
+#define THREAD_NUM_BLOCKS 64
+
+/** The blocks that a thread of test_sd_spi_threads() writes and reads. */
+typedef struct thread_state {
+	sd_spi_card_t	*card;
+	uint32_t		start_block_address;
+	uint8_t			value;
+	uint32_t		num_mismatches;
+	int8_t			response;
+} thread_state_t;
+
+void *
+thread_write_and_read(
+	void *context
+)
+{
+	thread_state_t *state = (thread_state_t *) context;
+	uint8_t block[512];
+	uint32_t i;
+	uint16_t j;
+
+	/* Each thread has its own card in use. */
+	sd_spi_use_card(state->card);
+
+	for (i = 0; i < THREAD_NUM_BLOCKS && !state->response; i++)
+	{
+		memset(block, (uint8_t) (state->value + i), sizeof(block));
+		state->response = sd_spi_write_block(state->start_block_address + i,
+											 block);
+	}
+
+	for (i = 0; i < THREAD_NUM_BLOCKS && !state->response; i++)
+	{
+		state->response = sd_spi_read(state->start_block_address + i, block,
+									  sizeof(block), 0);
+
+		for (j = 0; j < sizeof(block); j++)
+		{
+			if (block[j] != (uint8_t) (state->value + i))
+			{
+				state->num_mismatches++;
+			}
+		}
+	}
+
+	return NULL;
+}
+
+void
+test_sd_spi_threads(
+	planck_unit_test_t *tc
+)
+{
+	static sd_spi_card_t cards[3];
+	uint8_t pins[3] = {CHIP_SELECT_PIN, SECOND_CHIP_SELECT_PIN,
+					   THIRD_CHIP_SELECT_PIN};
+	uint8_t i;
+
+	for (i = 0; i < 3; i++)
+	{
+		sd_spi_use_card(&cards[i]);
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, sd_spi_init(pins[i]));
+	}
+
+	/* Two threads use the same addresses on cards of their own and two
+	   share the state of the third card. */
+	thread_state_t states[4] = {
+		{&cards[0], 600, 1, 0, 0},
+		{&cards[1], 600, 101, 0, 0},
+		{&cards[2], 600, 201, 0, 0},
+		{&cards[2], 700, 51, 0, 0}
+	};
+	pthread_t threads[4];
+
+	for (i = 0; i < 4; i++)
+	{
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, pthread_create(&threads[i], NULL, thread_write_and_read, &states[i]));
+	}
+
+	for (i = 0; i < 4; i++)
+	{
+		pthread_join(threads[i], NULL);
+	}
+
+	for (i = 0; i < 4; i++)
+	{
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, states[i].response);
+		PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, states[i].num_mismatches);
+	}
+
+	sd_spi_use_card(NULL);
+}
+#endif
+
+#if defined(__cplusplus)
+void
+test_sd_spi_cpp_card(
+	planck_unit_test_t *tc
+)
+{
+	/* Each object keeps its own card, so they are used in turn without
+	   switching between them by hand. */
+	sd_spi::card<> first;
+	sd_spi::card<> second;
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, first.init(CHIP_SELECT_PIN));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, second.init(SECOND_CHIP_SELECT_PIN));
+
+	struct record {
+		uint32_t	sequence;
+		uint8_t		value;
+	};
+
+	record first_record = {7, 'x'};
+	record second_record = {8, 'y'};
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, first.write(500, first_record, 4));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, second.write(500, second_record, 4));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, first.flush());
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, second.flush());
+
+	record read_record;
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, first.read(500, read_record, 4));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 7, read_record.sequence);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 'x', read_record.value);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, second.read(500, read_record, 4));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 8, read_record.sequence);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 'y', read_record.value);
+
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 512, first.state().page_size);
+	PLANCK_UNIT_ASSERT_TRUE(tc, sd_spi_current_card() == &second.state());
+}
+#endif
+
+#if defined(__cpp_impl_coroutine)
+static sd_spi::task
+copy_pages_task(
+	sd_spi::async_card<>	&card,
+	uint8_t					*pages,
+	uint8_t					*read_pages
+)
+{
+	int8_t response;
+	if ((response = co_await card.write_blocks(1200, 4, pages)))
+	{
+		co_return response;
+	}
+
+	co_return co_await card.read_blocks(1200, 4, read_pages);
+}
+
+static sd_spi::task
+count_task(
+	sd_spi::scheduler	&tasks,
+	sd_spi::task		&other,
+	uint32_t			*count
+)
+{
+	while (!other.done())
+	{
+		(*count)++;
+		co_await tasks.yield();
+	}
+
+	co_return SD_ERR_OK;
+}
+
+void
+test_sd_spi_coroutines(
+	planck_unit_test_t *tc
+)
+{
+	sd_spi::scheduler tasks;
+	sd_spi::async_card<> card(tasks);
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, card.init(CHIP_SELECT_PIN));
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, card.set_status_check(SD_SPI_STATUS_CHECK_AT_SYNC));
+
+	static uint8_t pages[4 * 512];
+	static uint8_t read_pages[4 * 512];
+	uint32_t i;
+
+	for (i = 0; i < sizeof(pages); i++)
+	{
+		pages[i] = (uint8_t) (i * 7);
+	}
+
+	/* The other task keeps running while the pages are written and read. */
+	uint32_t count = 0;
+	sd_spi::task copy = copy_pages_task(card, pages, read_pages);
+	sd_spi::task counter = count_task(tasks, copy, &count);
+	PLANCK_UNIT_ASSERT_TRUE(tc, tasks.spawn(copy));
+	PLANCK_UNIT_ASSERT_TRUE(tc, tasks.spawn(counter));
+	tasks.run();
+
+	PLANCK_UNIT_ASSERT_TRUE(tc, copy.done());
+	PLANCK_UNIT_ASSERT_TRUE(tc, counter.done());
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, copy.result());
+	PLANCK_UNIT_ASSERT_TRUE(tc, count > 0);
+	PLANCK_UNIT_ASSERT_TRUE(tc, memcmp(pages, read_pages, sizeof(pages)) == 0);
+
+	PLANCK_UNIT_ASSERT_INT_ARE_EQUAL(tc, 0, card.set_status_check(SD_SPI_STATUS_CHECK_ALWAYS));
+}
+#endif
+
+planck_unit_suite_t*
+tefs_getsuite(
+	void
+)
+{
+	planck_unit_suite_t *suite = planck_unit_new_suite();
+
+	planck_unit_add_to_suite(suite, test_sd_spi_initialization);
+	planck_unit_add_to_suite(suite, test_sd_spi_sd_status_and_scr);
+	planck_unit_add_to_suite(suite, test_sd_spi_single_write_and_read);
+	planck_unit_add_to_suite(suite, test_sd_spi_single_block_write_and_read);
+	planck_unit_add_to_suite(suite, test_sd_spi_status_check);
+	planck_unit_add_to_suite(suite, test_sd_spi_continuous_block_write);
+	planck_unit_add_to_suite(suite, test_sd_spi_continuous_write_with_polling);
+	planck_unit_add_to_suite(suite, test_sd_spi_continuous_write_recovery);
+	planck_unit_add_to_suite(suite, test_sd_spi_continuous_block_read);
+	planck_unit_add_to_suite(suite, test_sd_spi_read_stream);
+	planck_unit_add_to_suite(suite, test_sd_spi_write_stream);
+	planck_unit_add_to_suite(suite, test_sd_spi_write_stream_recovery);
+	planck_unit_add_to_suite(suite, test_sd_spi_pread_and_pwrite);
+	planck_unit_add_to_suite(suite, test_sd_spi_pwrite_recovery);
+	planck_unit_add_to_suite(suite, test_sd_spi_page_size);
+	planck_unit_add_to_suite(suite, test_sd_spi_partial_writes);
+	planck_unit_add_to_suite(suite, test_sd_spi_flush_avoidance);
+	planck_unit_add_to_suite(suite, test_sd_spi_multiple_reads_and_writes);
+	planck_unit_add_to_suite(suite, test_sd_spi_erase_blocks);
+	planck_unit_add_to_suite(suite, test_sd_spi_erased_block_map);
+	planck_unit_add_to_suite(suite, test_sd_spi_erase_planner);
+	planck_unit_add_to_suite(suite, test_sd_spi_erase_queue);
+	planck_unit_add_to_suite(suite, test_sd_spi_stripe_write_and_read);
+	planck_unit_add_to_suite(suite, test_sd_spi_mirror_verify_and_resync);
+	planck_unit_add_to_suite(suite, test_sd_spi_log);
+	planck_unit_add_to_suite(suite, test_sd_spi_store);
+	planck_unit_add_to_suite(suite, test_sd_spi_mount);
+	planck_unit_add_to_suite(suite, test_sd_spi_ring);
+	planck_unit_add_to_suite(suite, test_sd_spi_store_query);
+#if defined(SD_SPI_THREAD_SAFE)
+	planck_unit_add_to_suite(suite, test_sd_spi_threads);
+#endif
+
+#if defined(__cplusplus)
+	planck_unit_add_to_suite(suite, test_sd_spi_cpp_card);
+#endif
+
+#if defined(__cpp_impl_coroutine)
+	planck_unit_add_to_suite(suite, test_sd_spi_coroutines);
+#endif
 
 	return suite;
 }
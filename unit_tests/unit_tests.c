@@ -0,0 +1,37 @@
+/******************************************************************************/
+/**
+@file		unit_tests.c
+@author     Wade Penson
+@date		June, 2015
+@brief      Runs the unit tests on a host, the same as unit_tests.ino does on
+			a board.
+@copyright  Copyright 2015 Wade Penson
+
+@license    Licensed under the Apache License, Version 2.0 (the "License");
+            you may not use this file except in compliance with the License.
+            You may obtain a copy of the License at
+
+              http://www.apache.org/licenses/LICENSE-2.0
+
+            Unless required by applicable law or agreed to in writing, software
+            distributed under the License is distributed on an "AS IS" BASIS,
+            WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or
+            implied. See the License for the specific language governing
+            permissions and limitations under the License.
+*/
+/******************************************************************************/
+
+void
+runalltests_sd_spi(
+	void
+);
+
+int
+main(
+	void
+)
+{
+	runalltests_sd_spi();
+
+	return 0;
+}